@@ -17,11 +17,15 @@
 #include "anope.h"
 #include "memo.h"
 #include "base.h"
+#include "sortedindex.h"
 
 typedef Anope::hash_map<NickAlias *> nickalias_map;
 typedef Anope::hash_map<NickCore *> nickcore_map;
+typedef Anope::sorted_index<NickAlias> nickalias_index;
 
 extern CoreExport Serialize::Checker<nickalias_map> NickAliasList;
+/* The nicks of NickAliasList in order, for listing them */
+extern CoreExport Serialize::Checker<nickalias_index> NickAliasIndex;
 extern CoreExport Serialize::Checker<nickcore_map> NickCoreList;
 
 /* A registered nickname.
@@ -231,11 +235,15 @@ class CoreExport IdentifyRequest
 	Anope::string account;
 	Anope::string password;
 
+	/* Unique for the life of the process, so a request can be found again
+	 * without holding a pointer to it which may have been freed */
+	unsigned long long request_id;
 	std::set<Module *> holds;
 	bool dispatched;
 	bool success;
 
-	static std::set<IdentifyRequest *> Requests;
+	static unsigned long long next_id;
+	static std::map<unsigned long long, IdentifyRequest *> Requests;
 
  protected:
 	IdentifyRequest(Module *o, const Anope::string &acc, const Anope::string &pass);
@@ -247,6 +255,7 @@ class CoreExport IdentifyRequest
 	virtual void OnFail() = 0;
 
 	Module *GetOwner() const { return owner; }
+	unsigned long long GetId() const { return request_id; }
 	const Anope::string &GetAccount() const { return account; }
 	const Anope::string &GetPassword() const { return password; }
 
@@ -276,6 +285,12 @@ class CoreExport IdentifyRequest
 	 */
 	void Dispatch();
 
+	/** Find a request by its id
+	 * @param id The id of the request
+	 * @return The request, or NULL if it has completed or been deleted
+	 */
+	static IdentifyRequest *Find(unsigned long long id);
+
 	static void ModuleUnload(Module *m);
 };
 
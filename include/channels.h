@@ -12,6 +12,8 @@
 #include "anope.h"
 #include "extensible.h"
 #include "modes.h"
+#include "pointermap.h"
+#include "stringpool.h"
 #include "serialize.h"
 
 typedef Anope::hash_map<Channel *> channel_map;
@@ -25,8 +27,11 @@ struct ChanUserContainer : public Extensible
 	Channel *chan;
 	/* Status the user has in the channel */
 	ChannelStatus status;
+	/* true if the user joined in a netburst and OnJoinChannel hasn't been called yet,
+	 * modules are not told when such a user leaves the channel either */
+	bool burst_pending;
 
-	ChanUserContainer(User *u, Channel *c) : user(u), chan(c) { }
+	ChanUserContainer(User *u, Channel *c) : user(u), chan(c), burst_pending(false) { }
 };
 
 class CoreExport Channel : public Base, public Extensible
@@ -34,7 +39,8 @@ class CoreExport Channel : public Base, public Extensible
 	static std::vector<Channel *> deleting;
 
  public:
-	typedef std::multimap<Anope::string, Anope::string> ModeList;
+	/* Modes set on the channel, as mode id (see ModeManager::GetModeID) and param, sorted by id */
+	typedef std::vector<std::pair<unsigned short, Anope::pooled_string> > ModeList;
  private:
 	/** A map of channel modes with their parameters set on this channel
 	 */
@@ -53,7 +59,7 @@ class CoreExport Channel : public Base, public Extensible
 	bool botchannel;
 
 	/* Users in the channel */
-	typedef std::map<User *, ChanUserContainer *> ChanUserList;
+	typedef Anope::pointer_map<User, ChanUserContainer *> ChanUserList;
 	ChanUserList users;
 
 	/* Current topic of the channel */
@@ -73,6 +79,11 @@ class CoreExport Channel : public Base, public Extensible
 	int16_t server_modecount;	/* Number of server MODEs this second */
 	int16_t chanserv_modecount;	/* Number of check_mode()'s this sec */
 	int16_t bouncy_modes;		/* Did we fail to set modes here? */
+	/* Mode changes pending in the mode stacker, owned by ModeManager */
+	StackerInfo *stacker;
+
+	/* Users who joined in a netburst and have not yet been checked or had OnJoinChannel called */
+	std::vector<Reference<User> > burst_joins;
 
  private:
 	/** Constructor
@@ -91,6 +102,12 @@ class CoreExport Channel : public Base, public Extensible
 	 */
 	void Reset();
 
+	/** Process joins which were deferred during a netburst. Users whose own
+	 * server has not yet synced are left for later.
+	 * @return The number of joins processed
+	 */
+	unsigned ProcessBurstJoins();
+
 	/** Restore the channel topic, set mlock (key), set stickied bans, etc
 	 */
 	void Sync();
@@ -136,6 +153,13 @@ class CoreExport Channel : public Base, public Extensible
 	 */
 	bool HasUserStatus(User *u, const Anope::string &name);
 
+	/** Check if a user has a status on a channel
+	 * @param u The user
+	 * @param id The id of the mode name, see ModeManager::GetModeID
+	 * @return true or false
+	 */
+	bool HasUserStatus(User *u, unsigned short id);
+
 	/** See if a channel has a mode
 	 * @param name The mode name
 	 * @return The number of modes set
@@ -275,6 +299,13 @@ class CoreExport Channel : public Base, public Extensible
 	 */
 	void SetCorrectModes(User *u, bool give_modes);
 
+	/** Set the correct modes, or remove the ones granted without permission,
+	 * for several users. What depends only on the channel is worked out once.
+	 * @param targets The users to give/remove modes to/from
+	 * @param give_modes if true modes may be given to the users
+	 */
+	void SetCorrectModes(const std::vector<User *> &targets, bool give_modes);
+
 	/** Unbans a user from this channel.
 	 * @param u The user to unban
 	 * @param mode The mode to unban
@@ -101,6 +101,8 @@ namespace Configuration
 		Anope::string DefLanguage;
 		/* options:timeoutcheck */
 		time_t TimeoutCheck;
+		/* options:slowloop, in milliseconds */
+		unsigned SlowLoop;
 		/* options:usestrictprivmsg */
 		bool UseStrictPrivmsg;
 		/* networkinfo:nickchars */
@@ -112,6 +114,8 @@ namespace Configuration
 		std::vector<Uplink> Uplinks;
 		/* A vector of our logfile options */
 		std::vector<LogInfo> LogInfos;
+		/* Which of LogInfos each message goes to */
+		LogRouter LogRoutes;
 		/* Array of ulined servers */
 		std::vector<Anope::string> Ulines;
 		/* List of available opertypes */
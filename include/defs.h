@@ -50,4 +50,5 @@ struct Exception;
 struct MemoInfo;
 struct ModeLock;
 struct Oper;
+struct StackerInfo;
 namespace SASL { struct Message; }
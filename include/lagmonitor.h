@@ -0,0 +1,100 @@
+/*
+ *
+ * (C) 2003-2018 Anope Team
+ * Contact us at team@anope.org
+ *
+ * Please read COPYING and README for further details.
+ */
+
+#ifndef LAGMONITOR_H
+#define LAGMONITOR_H
+
+#include "services.h"
+#include "modules.h"
+
+/** Watches how long each pass of the main loop keeps Services busy, and
+ * how long the uplink takes to answer a PING, to tell lag caused by
+ * Services apart from lag on the network.
+ *
+ * A pass is everything done between two waits for socket activity. Times
+ * are in EventProfiler ticks.
+ */
+class CoreExport LagMonitor
+{
+ public:
+	/** Things which are done during a pass, see Trace */
+	enum StepType
+	{
+		STEP_MESSAGE,
+		STEP_TIMER,
+		/* Only traced if event profiling is enabled */
+		STEP_EVENT,
+		STEP_SIZE
+	};
+
+	/** The slowest step of a type in a pass */
+	struct Step
+	{
+		Anope::string what;
+		unsigned long long ticks;
+
+		Step() : ticks(0) { }
+	};
+
+	struct Stats
+	{
+		/* How long passes keep Services busy, not counting waiting for sockets */
+		EventHistogram passes;
+		/* Number of passes over options:slowloop */
+		unsigned long slow;
+		/* The slowest pass, when it was, and the slowest steps in it */
+		unsigned long long slowest;
+		time_t slowest_time;
+		Step slowest_steps[STEP_SIZE];
+
+		/* Round trip times of PINGs to the uplink */
+		EventHistogram pings;
+		unsigned long long last_ping;
+		/* Number of PINGs sent */
+		unsigned long pings_sent;
+
+		Stats() : slow(0), slowest(0), slowest_time(0), last_ping(0), pings_sent(0) { }
+	};
+
+	/** Called by the main loop at the start of each pass */
+	static void Begin();
+
+	/** Called by the main loop at the end of each pass */
+	static void End();
+
+	/** Called by the socket engine around waiting for socket activity */
+	static inline void Sleep() { sleep_start = EventProfiler::Ticks(); }
+	static inline void Wake() { sleeping += EventProfiler::Ticks() - sleep_start; }
+
+	/** Record a step of the current pass, keeping the slowest of each type
+	 * @param type The type of step
+	 * @param start The tick the step started at, from EventProfiler::Ticks
+	 * @return The step to describe if this is the slowest of its type so far, else NULL
+	 */
+	static Step *Trace(StepType type, unsigned long long start);
+
+	/** Send a PING to the uplink to measure the round trip time. An earlier PING
+	 * which has not been answered yet is given up on
+	 */
+	static void Ping();
+
+	/** Called when a PONG is received
+	 * @param s The server it is from
+	 */
+	static void Pong(Server *s);
+
+	static const Stats &GetStats();
+
+	/** Forget everything recorded so far */
+	static void Reset();
+
+ private:
+	static unsigned long long sleep_start, sleeping;
+};
+
+#endif // LAGMONITOR_H
@@ -25,14 +25,39 @@ namespace Language
 	 * here.
 	 *
 	 * When strings are translated they are checked against all domains.
+	 * Use AddDomain and RemoveDomain to change this.
 	 */
 	extern std::vector<Anope::string> Domains;
 
-	/** Initialize the language system. Finds valid language files and
-	 * populates the Languages list.
+	/** Initialize the language system. Reads the language files of the
+	 * configured languages into memory and populates the Languages list.
+	 * Translations are looked up in memory afterwards, without going through
+	 * the C library's locale.
 	 */
 	extern void InitLanguages();
 
+	/** Load the language files of options:defaultlanguage if they aren't loaded
+	 * already, called when the configuration is reloaded.
+	 */
+	extern void LoadDefaultLanguage();
+
+	/** Load the language files of a module's domain for every loaded language,
+	 * and add it to Domains if any were found.
+	 * @param domain The domain, which is the name of the module
+	 * @return true if a language file was found
+	 */
+	extern bool AddDomain(const Anope::string &domain);
+
+	/** Unload the language files of a domain and remove it from Domains.
+	 * @param domain The domain
+	 */
+	extern void RemoveDomain(const Anope::string &domain);
+
+	/* The Translate functions look strings up in catalogs which are rebuilt when
+	 * the configuration is reloaded and when modules are loaded or unloaded, and
+	 * return pointers into them. They may only be called from the main thread.
+	 */
+
 	/** Translates a string to the default language.
 	 * @param string A string to translate
 	 * @return The translated string if found, else the original string.
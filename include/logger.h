@@ -38,7 +38,8 @@ enum LogType
 	LOG_DEBUG_4
 };
 
-struct LogFile
+/* A log file. Lines are written to it by a thread of its own, so the main loop never waits on the disk */
+struct CoreExport LogFile
 {
 	Anope::string filename;
 	std::ofstream stream;
@@ -46,8 +47,37 @@ struct LogFile
 	LogFile(const Anope::string &name);
 	~LogFile();
 	const Anope::string &GetName() const;
+
+	/** Queue a line to be written to this file
+	 * @param line The line, including the line break
+	 * @param droppable Whether the line may be thrown away if the writer has fallen too far behind
+	 */
+	void Write(const Anope::string &line, bool droppable);
+
+	/** Counters of the log writer thread */
+	struct Stats
+	{
+		/* Lines queued, written and thrown away */
+		unsigned long queued, written, dropped;
+		/* Number of times the writer took lines from the queue */
+		unsigned long batches;
+		/* Number of times a line had to wait for room in the queue */
+		unsigned long waits;
+		/* Bytes waiting to be written now, and the most there has been */
+		size_t pending, peak;
+	};
+
+	static Stats GetStats();
+
+	/** Write out all queued lines and stop the writer thread. It is started again when
+	 * something is next logged. Must be called before forking, as threads do not survive it.
+	 */
+	static void Flush();
 };
 
+/* A set of log blocks, with a bit for each block in Config->LogInfos */
+typedef unsigned long long LogMask;
+
 /* Represents a single log message */
 class CoreExport Log
 {
@@ -73,8 +103,23 @@ class CoreExport Log
 	LogType type;
 	Anope::string category;
 
-	std::stringstream buf;
 
+ private:
+	/* The message, created when something is first written to it */
+	std::stringstream *buf;
+	/* The log blocks this message goes to */
+	LogMask routes;
+	/* Whether anything wants this message at all. If not, it is not even formatted */
+	bool wanted;
+
+	Log(const Log &);
+	Log &operator=(const Log &);
+
+	void Route();
+	static bool ToTerminal(LogType type);
+	static bool Routed(LogType type);
+
+ public:
 	Log(LogType type = LOG_NORMAL, const Anope::string &category = "", BotInfo *bi = NULL);
 
 	/* LOG_COMMAND/OVERRIDE/ADMIN */
@@ -102,13 +147,42 @@ class CoreExport Log
  public:
 	Anope::string BuildPrefix() const;
 
+	/** The message as written so far, without the prefix */
+	Anope::string GetMessage() const;
+
+	/** Check whether messages of a type are logged anywhere. Raw and debug
+	 * messages go to the same places whatever their category, so for them
+	 * this tells whether a Log of the type would be thrown away.
+	 * @param type The type
+	 */
+	static inline bool Wants(LogType type)
+	{
+#ifndef DEBUG_BUILD
+		/* The most verbose debug messages are left out of release builds */
+		if (type >= LOG_DEBUG_3)
+			return false;
+#endif
+		return type < LOG_RAWIO || Routed(type);
+	}
+
 	template<typename T> Log &operator<<(T val)
 	{
-		this->buf << val;
+		if (this->wanted)
+		{
+			if (!this->buf)
+				this->buf = new std::stringstream();
+			*this->buf << val;
+		}
 		return *this;
 	}
 };
 
+/** Log a message of the given type, but only evaluate the rest of the statement
+ * if it is going to be logged, as in LOG_IF(LOG_DEBUG) << "Joined " << u->GetMask();
+ * Use it for raw and debug messages in code which runs often.
+ */
+#define LOG_IF(type) if (!Log::Wants(type)) { } else Log(type)
+
 /* Configured in the configuration file, actually does the message logging */
 class CoreExport LogInfo
 {
@@ -135,10 +209,73 @@ class CoreExport LogInfo
 
 	void OpenLogFiles();
 
+	/** Get the categories configured for a type of message
+	 * @param ltype The type
+	 * @return The categories, or NULL if the type has none
+	 */
+	const std::vector<Anope::string> *GetCategories(LogType ltype) const;
+
 	bool HasType(LogType ltype, const Anope::string &type) const;
 
 	/* Logs the message l if configured to */
 	void ProcessMessage(const Log *l);
 };
 
+/** Works out which log blocks want messages of each type and category. The
+ * routes are worked out when the configuration is loaded, so routing a message
+ * changes nothing and may be done from any thread.
+ */
+class CoreExport LogRouter
+{
+	/* A log block whose categories for a type include wildcards */
+	struct WildBlock
+	{
+		unsigned block;
+		/* The wildcard categories in the order they are checked, and whether they include or exclude */
+		std::vector<std::pair<Anope::string, bool> > patterns;
+	};
+
+	/* The routes of a type which has categories */
+	struct Table
+	{
+		/* Routes of the categories named in the configuration */
+		Anope::hash_map<LogMask> exact;
+		/* Blocks which want every other category */
+		LogMask fixed;
+		/* Blocks whose wildcards must be matched against any other category */
+		std::vector<WildBlock> wild;
+
+		Table() : fixed(0) { }
+	};
+
+	bool built;
+	Table tables[LOG_RAWIO];
+	/* The routes of raw and debug messages, which do not depend on the category,
+	 * without and with debug mode enabled
+	 */
+	LogMask raw_routes[2][LOG_DEBUG_4 - LOG_RAWIO + 1];
+
+ public:
+	/* The most log blocks there can be */
+	static const unsigned MAX_BLOCKS = sizeof(LogMask) * 8;
+
+	LogRouter() : built(false)
+	{
+		for (unsigned i = 0; i <= LOG_DEBUG_4 - LOG_RAWIO; ++i)
+			raw_routes[0][i] = raw_routes[1][i] = 0;
+	}
+
+	/** Work out the routes to a new set of log blocks, forgetting all routes
+	 * @param li The log blocks
+	 */
+	void Build(const std::vector<LogInfo> &li);
+
+	/** Find the log blocks a message goes to
+	 * @param type The type of the message
+	 * @param category The category of the message
+	 * @return The log blocks
+	 */
+	LogMask Route(LogType type, const Anope::string &category) const;
+};
+
 #endif // LOGGER_H
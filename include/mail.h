@@ -13,7 +13,6 @@
 #define MAIL_H
 
 #include "anope.h"
-#include "threadengine.h"
 #include "serialize.h"
 
 namespace Mail
@@ -22,21 +21,61 @@ namespace Mail
 	extern CoreExport bool Send(NickCore *to, const Anope::string &subject, const Anope::string &message);
 	extern CoreExport bool Validate(const Anope::string &email);
 
-	/* A email message being sent */
-	class Message : public Thread
+	/** Statistics about mail delivery */
+	struct Stats
 	{
-	 private:
-	 	Anope::string sendmail_path;
+		/* Messages queued, delivered, and given up on */
+		unsigned long queued, sent, failed;
+		/* Delivery attempts which failed and are retried later */
+		unsigned long deferred;
+		/* SMTP connections opened, and batches of messages delivered over them */
+		unsigned long connections, batches;
+		/* Messages in the spool, and how many of them are waiting to be retried */
+		unsigned spooled, waiting;
+	};
+
+	/** Load the messages left in the spool and start delivering them, called at startup
+	 */
+	extern CoreExport void Init();
+
+	/** Close the connection to the mail server, called when shutting down.
+	 * Messages which are not yet delivered are kept in the spool.
+	 */
+	extern CoreExport void Shutdown();
+
+	extern CoreExport Stats GetStats();
+
+	/* A email message waiting in the spool to be delivered */
+	class Message
+	{
+	 public:
+		/* Path of the spool file, empty if it could not be written */
+		Anope::string file;
 		Anope::string send_from;
+		/* Name of person being mailed (u->nick, nc->display, etc) */
 		Anope::string mail_to;
+		/* Destination address */
 		Anope::string addr;
-		Anope::string subject;
-		Anope::string message;
-		bool dont_quote_addresses;
+		/* The headers and the body, with lines ending in \n */
+		Anope::string text;
 
-		bool success;
-	 public:
-	 	/** Construct this message. Once constructed call Thread::Start to launch the mail sending.
+		/* Failed delivery attempts so far, and when to try again */
+		unsigned attempts;
+		time_t next_attempt;
+
+		/* The outcome of the last delivery attempt */
+		enum Result
+		{
+			PENDING,
+			SENT,
+			DEFERRED,
+			FAILED
+		} result;
+		Anope::string error;
+
+		Message() : attempts(0), next_attempt(0), result(PENDING) { }
+
+		/** Construct this message. Once constructed write it to the spool with Spool().
 		 * @param sf Config->SendFrom
 		 * @param mailto Name of person being mailed (u->nick, nc->display, etc)
 		 * @param addr Destination address to mail
@@ -45,10 +84,10 @@ namespace Mail
 		 */
 		Message(const Anope::string &sf, const Anope::string &mailto, const Anope::string &addr, const Anope::string &subject, const Anope::string &message);
 
-		~Message();
-
-		/* Called from within the thread to actually send the mail */
-		void Run() anope_override;
+		/** Write this message to the spool and queue it to be delivered.
+		 * The spool owns the message afterwards.
+		 */
+		void Spool();
 	};
 
 } // namespace Mail
@@ -47,6 +47,8 @@ class CoreExport Mode : public Base
 	char mchar;
 	/* Type of mode this is, eg MODE_LIST */
 	ModeType type;
+	/* Id of the mode name (see ModeManager::GetModeID), assigned when the mode is added to the ModeManager */
+	unsigned short id;
 
 	/** constructor
 	 * @param mname The mode name
@@ -347,12 +349,37 @@ class CoreExport ModeManager
 	 */
 	static UserMode *FindUserModeByName(const Anope::string &name);
 
+	/** Find a channel mode by the id of its name
+	 * @param id The mode id
+	 * @return The mode class
+	 */
+	static ChannelMode *FindChannelModeByID(unsigned short id);
+
+	/** Find a user mode by the id of its name
+	 * @param id The mode id
+	 * @return The mode class
+	 */
+	static UserMode *FindUserModeByID(unsigned short id);
+
 	/** Gets the channel mode char for a symbol (eg + returns v)
 	 * @param symbol The symbol
 	 * @return The char
 	 */
 	static char GetStatusChar(char symbol);
 
+	/** Get the id of a mode name. Ids are small integers used to store modes compactly
+	 * @param name The mode name
+	 * @param create true to allocate a new id if the name does not have one yet
+	 * @return The id, or 0 if the name has no id
+	 */
+	static unsigned short GetModeID(const Anope::string &name, bool create = false);
+
+	/** Get the mode name for an id
+	 * @param id The id
+	 * @return The mode name, or an empty string if the id is not in use
+	 */
+	static const Anope::string &GetModeName(unsigned short id);
+
 	static const std::vector<ChannelMode *> &GetChannelModes();
 	static const std::vector<UserMode *> &GetUserModes();
 	static const std::vector<ChannelModeStatus *> &GetStatusChannelModesByRank();
@@ -22,6 +22,7 @@
 #include "config.h"
 #include "extensible.h"
 #include "hashcomp.h"
+#include "lagmonitor.h"
 #include "language.h"
 #include "lists.h"
 #include "logger.h"
@@ -21,6 +21,10 @@
 #include "extensible.h"
 #include "version.h"
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 /** This definition is used as shorthand for the various classes
  * and functions needed to make a module loadable by the OS.
  * It defines the class factory and external AnopeInit and AnopeFini functions.
@@ -83,7 +87,12 @@ if (true) \
 	{ \
 		try \
 		{ \
-			(*_i)->ename args; \
+			/* Read before the handler runs, as it may change _modules */ \
+			Module *_m = *_i; \
+			unsigned long long _start = EventProfiler::Start(); \
+			_m->ename args; \
+			if (_start) \
+				EventProfiler::Stop(I_##ename, #ename, _m, _start); \
 		} \
 		catch (const ModuleException &modexcept) \
 		{ \
@@ -117,7 +126,12 @@ if (true) \
 	{ \
 		try \
 		{ \
-			EventReturn res = (*_i)->ename args; \
+			/* Read before the handler runs, as it may change _modules */ \
+			Module *_m = *_i; \
+			unsigned long long _start = EventProfiler::Start(); \
+			EventReturn res = _m->ename args; \
+			if (_start) \
+				EventProfiler::Stop(I_##ename, #ename, _m, _start); \
 			if (res != EVENT_CONTINUE) \
 			{ \
 				ret = res; \
@@ -227,6 +241,8 @@ class ModuleVersion
 
 class NotImplementedException : public CoreException { };
 
+struct EventHistogram;
+
 /** Every module in Anope is actually a class.
  */
 class CoreExport Module : public Extensible
@@ -262,6 +278,11 @@ class CoreExport Module : public Extensible
 	 */
 	Anope::string author;
 
+	/** How long this module's event handlers take, indexed by event.
+	 * NULL until the EventProfiler first times one of them
+	 */
+	EventHistogram **event_histograms;
+
 	/** Creates and initialises a new module.
 	 * @param modname The module name
 	 * @param loadernick The nickname of the user loading the module.
@@ -1009,7 +1030,8 @@ class CoreExport Module : public Extensible
 	 */
 	virtual void OnPrivmsg(User *u, Channel *c, Anope::string &msg) { throw NotImplementedException(); }
 
-	/** Called when a message is logged
+	/** Called when a message is logged. Raw and debug messages are only
+	 * passed on if a log block or the terminal takes them.
 	 * @param l The log message
 	 */
 	virtual void OnLog(Log *l) { throw NotImplementedException(); }
@@ -1102,6 +1124,13 @@ class CoreExport Module : public Extensible
 	 * @return EVENT_STOP to force the user off of the nick
 	 */
 	virtual EventReturn OnNickValidate(User *u, NickAlias *na) { throw NotImplementedException(); }
+
+	/** Called when a user requests statistics from operserv/stats
+	 * @param source The user requesting statistics
+	 * @param what The statistics requested, ALL if every type is wanted
+	 * @param handled Set to true if what names statistics provided by this module
+	 */
+	virtual void OnStats(CommandSource &source, const Anope::string &what, bool &handled) { throw NotImplementedException(); }
 };
 
 enum Implementation
@@ -1127,7 +1156,7 @@ enum Implementation
 	I_OnPrivmsg, I_OnLog, I_OnLogMessage, I_OnDnsRequest, I_OnCheckModes, I_OnChannelSync, I_OnSetCorrectModes,
 	I_OnSerializeCheck, I_OnSerializableConstruct, I_OnSerializableDestruct, I_OnSerializableUpdate,
 	I_OnSerializeTypeCreate, I_OnSetChannelOption, I_OnSetNickOption, I_OnMessage, I_OnCanSet, I_OnCheckDelete,
-	I_OnExpireTick, I_OnNickValidate,
+	I_OnExpireTick, I_OnNickValidate, I_OnStats,
 	I_SIZE
 };
 
@@ -1231,4 +1260,93 @@ class CoreExport ModuleManager
 	static ModuleVersion GetVersion(void *handle);
 };
 
+/** A histogram of how long an event handler takes, in EventProfiler ticks.
+ * Like an HDR histogram, each power of two is split into a few linear
+ * buckets, so every value is recorded to within 12.5% in a fixed size.
+ */
+struct CoreExport EventHistogram
+{
+	static const unsigned SUB_BITS = 3;
+	static const unsigned SUB_BUCKETS = 1 << SUB_BITS;
+	/* Values from 2^MAX_BITS ticks up are counted in the last bucket */
+	static const unsigned MAX_BITS = 40;
+	static const unsigned BUCKETS = SUB_BUCKETS * (MAX_BITS - SUB_BITS + 1);
+
+	unsigned counts[BUCKETS];
+	unsigned long count;
+	unsigned long long total, max;
+
+	EventHistogram();
+
+	void Record(unsigned long long ticks);
+
+	/** Find a percentile
+	 * @param p The percentile, eg 99
+	 * @return The highest value the bucket holding the percentile can hold, at most the maximum recorded
+	 */
+	unsigned long long Percentile(unsigned p) const;
+};
+
+/** Times event handlers when options:profileevents is enabled, see FOREACH_MOD.
+ * Ticks are the CPU's timestamp counter where there is one, which is
+ * converted to time by comparing it to the clock since the configuration
+ * was first read.
+ */
+class CoreExport EventProfiler
+{
+	/* Copied, as the name may be in a module which is unloaded later */
+	static Anope::string names[I_SIZE];
+
+	static unsigned long long Clock();
+
+ public:
+	static bool enabled;
+
+	static inline unsigned long long Ticks()
+	{
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+		return __builtin_ia32_rdtsc();
+#elif defined _MSC_VER && (defined _M_X64 || defined _M_IX86)
+		return __rdtsc();
+#else
+		return Clock();
+#endif
+	}
+
+	/** Start timing an event handler
+	 * @return The current tick, or 0 if profiling is disabled
+	 */
+	static inline unsigned long long Start()
+	{
+		return enabled ? Ticks() : 0;
+	}
+
+	/** Record how long an event handler took
+	 * @param event The event
+	 * @param name The name of the event
+	 * @param m The module which handled it
+	 * @param start The tick the handler was started at
+	 */
+	static void Stop(Implementation event, const char *name, Module *m, unsigned long long start);
+
+	static void SetEnabled(bool state);
+
+	/** Forget everything recorded so far */
+	static void Reset();
+
+	static void ModuleUnload(Module *m);
+
+	/** Get the name of an event which has been timed
+	 * @param event The event
+	 * @return The name, or an empty string if the event was never timed
+	 */
+	static const Anope::string &GetEventName(unsigned event);
+
+	/** Convert ticks to microseconds
+	 * @param ticks The number of ticks
+	 * @return The number of microseconds, or 0 if there is not enough to go on yet
+	 */
+	static double ToMicroseconds(unsigned long long ticks);
+};
+
 #endif // MODULES_H
@@ -13,8 +13,10 @@ enum HTTPError
 {
 	HTTP_ERROR_OK = 200,
 	HTTP_FOUND = 302,
+	HTTP_NOT_MODIFIED = 304,
 	HTTP_BAD_REQUEST = 400,
 	HTTP_PAGE_NOT_FOUND = 404,
+	HTTP_REQUEST_TOO_LARGE = 413,
 	HTTP_NOT_SUPPORTED = 505
 };
 
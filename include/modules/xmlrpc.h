@@ -17,8 +17,11 @@ class XMLRPCRequest
 	Anope::string id;
 	std::deque<Anope::string> data;
 	HTTPReply& r;
+	/* For calls made through JSON-RPC, the request they are part of and their position in it. 0 for XMLRPC */
+	unsigned long batch;
+	unsigned index;
 
-	XMLRPCRequest(HTTPReply &_r) : r(_r) { }
+	XMLRPCRequest(HTTPReply &_r) : r(_r), batch(0), index(0) { }
 	inline void reply(const Anope::string &dname, const Anope::string &ddata) { this->replies.insert(std::make_pair(dname, ddata)); }
 	inline const std::map<Anope::string, Anope::string> &get_replies() { return this->replies; }
 };
@@ -44,4 +47,10 @@ class XMLRPCServiceInterface : public Service
 	virtual Anope::string Sanitize(const Anope::string &string) = 0;
 
 	virtual void Reply(XMLRPCRequest &request) = 0;
+
+	/** Send the answer to a request which an event said it would answer later
+	 * @param client The client which made the request, may be NULL if it has gone away
+	 * @param request The request
+	 */
+	virtual void Finish(HTTPClient *client, XMLRPCRequest &request) = 0;
 };
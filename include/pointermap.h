@@ -0,0 +1,395 @@
+/*
+ *
+ * (C) 2003-2018 Anope Team
+ * Contact us at team@anope.org
+ *
+ * Please read COPYING and README for further details.
+ */
+
+#ifndef POINTERMAP_H
+#define POINTERMAP_H
+
+#include "services.h"
+
+namespace Anope
+{
+	/** A map keyed by object pointers, used for channel membership.
+	 *
+	 * Most maps of this kind hold only a handful of entries (the users in a
+	 * small channel, or the channels a user is in), while a few are huge. Up to
+	 * InlineSize entries are kept in a sorted array inside the map itself, up to
+	 * SortedMax in a sorted heap array, and beyond that in an open addressing
+	 * hash table with linear probing.
+	 *
+	 * Iterators remember the key they point at, so like with std::map erasing
+	 * other entries while iterating is safe. Iteration order is unspecified.
+	 */
+	template<typename K, typename V>
+	class pointer_map
+	{
+	 public:
+		typedef std::pair<K *, V> value_type;
+
+	 private:
+		static const unsigned InlineSize = 4;
+		static const unsigned SortedMax = 32;
+
+		/* Either inline_data, a heap allocated sorted array, or a heap allocated hash table */
+		value_type *data;
+		/* Number of entries */
+		unsigned entries;
+		/* Number of entries data has room for, or the number of buckets if hashed */
+		unsigned capacity;
+		/* Number of buckets which are used or tombstoned */
+		unsigned used;
+		bool hashed;
+		value_type inline_data[InlineSize];
+
+		static K *Tombstone()
+		{
+			static char tombstone;
+			return reinterpret_cast<K *>(&tombstone);
+		}
+
+		static inline bool Live(K *k)
+		{
+			return k != NULL && k != Tombstone();
+		}
+
+		static inline size_t Hash(K *k)
+		{
+			size_t h = reinterpret_cast<size_t>(k);
+			h ^= h >> 4;
+			return h * static_cast<size_t>(0x9E3779B97F4A7C15ULL);
+		}
+
+		static bool KeyLess(const value_type &a, const value_type &b)
+		{
+			return a.first < b.first;
+		}
+
+		/* Index of the first entry in the sorted array not less than k */
+		unsigned LowerBound(K *k) const
+		{
+			unsigned lo = 0, hi = entries;
+			while (lo < hi)
+			{
+				unsigned mid = (lo + hi) / 2;
+				if (data[mid].first < k)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			return lo;
+		}
+
+		/* Bucket holding k, or capacity if it is not in the table */
+		unsigned FindBucket(K *k) const
+		{
+			unsigned mask = capacity - 1;
+			for (unsigned i = Hash(k) & mask;; i = (i + 1) & mask)
+			{
+				if (data[i].first == k)
+					return i;
+				else if (data[i].first == NULL)
+					return capacity;
+			}
+		}
+
+		/* Position of k, or the end position if it is not here */
+		unsigned Locate(K *k) const
+		{
+			if (hashed)
+				return FindBucket(k);
+
+			unsigned i = LowerBound(k);
+			return i < entries && data[i].first == k ? i : entries;
+		}
+
+		unsigned End() const
+		{
+			return hashed ? capacity : entries;
+		}
+
+		/* First live position at or after i */
+		unsigned Next(unsigned i) const
+		{
+			if (hashed)
+				while (i < capacity && !Live(data[i].first))
+					++i;
+			return i;
+		}
+
+		void Release()
+		{
+			if (data != inline_data)
+				delete [] data;
+			data = inline_data;
+			capacity = InlineSize;
+			entries = used = 0;
+			hashed = false;
+		}
+
+		void Rehash(unsigned buckets)
+		{
+			value_type *old = data;
+			unsigned old_end = End();
+			bool old_hashed = hashed;
+
+			data = new value_type[buckets];
+			for (unsigned i = 0; i < buckets; ++i)
+				data[i] = value_type(static_cast<K *>(NULL), V());
+			capacity = buckets;
+			used = entries;
+			hashed = true;
+
+			unsigned mask = buckets - 1;
+			for (unsigned i = 0; i < old_end; ++i)
+			{
+				if (old_hashed && !Live(old[i].first))
+					continue;
+
+				unsigned j = Hash(old[i].first) & mask;
+				while (data[j].first != NULL)
+					j = (j + 1) & mask;
+				data[j] = old[i];
+			}
+
+			if (old != inline_data)
+				delete [] old;
+		}
+
+		void Unhash()
+		{
+			value_type *old = data;
+			unsigned old_capacity = capacity;
+
+			value_type *sorted = entries <= InlineSize ? inline_data : new value_type[SortedMax];
+			unsigned n = 0;
+			for (unsigned i = 0; i < old_capacity; ++i)
+				if (Live(old[i].first))
+					sorted[n++] = old[i];
+			std::sort(sorted, sorted + n, KeyLess);
+
+			delete [] old;
+			data = sorted;
+			capacity = sorted == inline_data ? InlineSize : SortedMax;
+			used = 0;
+			hashed = false;
+		}
+
+		/* Make room for one more entry. This is the only place the layout changes */
+		void Reserve()
+		{
+			if (hashed)
+			{
+				/* Shrink back to a sorted array once the table is mostly empty */
+				if (entries < SortedMax / 2)
+					Unhash();
+				else if ((used + 1) * 2 > capacity)
+				{
+					unsigned buckets = capacity;
+					while ((entries + 1) * 2 > buckets)
+						buckets *= 2;
+					Rehash(buckets);
+				}
+			}
+
+			if (!hashed && entries == capacity)
+			{
+				if (capacity >= SortedMax)
+					Rehash(SortedMax * 4);
+				else
+				{
+					value_type *bigger = new value_type[SortedMax];
+					std::copy(data, data + entries, bigger);
+					if (data != inline_data)
+						delete [] data;
+					data = bigger;
+					capacity = SortedMax;
+				}
+			}
+		}
+
+	 public:
+		class iterator
+		{
+			friend class pointer_map;
+
+			pointer_map *map;
+			/* Position hint, validated against key on every access */
+			mutable unsigned pos;
+			K *key;
+
+			iterator(pointer_map *m, unsigned p) : map(m), pos(p), key(NULL)
+			{
+				if (pos < map->End())
+					key = map->data[pos].first;
+			}
+
+			void Sync() const
+			{
+				if (pos < map->End() && map->data[pos].first == key)
+					return;
+
+				/* Entries before us were erased or the layout changed, find our entry again */
+				if (map->hashed)
+					pos = map->FindBucket(key);
+				else
+					pos = map->LowerBound(key);
+			}
+
+		 public:
+			iterator() : map(NULL), pos(0), key(NULL) { }
+
+			value_type &operator*() const
+			{
+				Sync();
+				return map->data[pos];
+			}
+
+			value_type *operator->() const
+			{
+				return &**this;
+			}
+
+			iterator &operator++()
+			{
+				Sync();
+				pos = map->Next(pos + 1);
+				key = pos < map->End() ? map->data[pos].first : NULL;
+				return *this;
+			}
+
+			iterator operator++(int)
+			{
+				iterator tmp = *this;
+				++*this;
+				return tmp;
+			}
+
+			bool operator==(const iterator &other) const
+			{
+				return key == other.key;
+			}
+
+			bool operator!=(const iterator &other) const
+			{
+				return key != other.key;
+			}
+		};
+
+		typedef iterator const_iterator;
+
+		pointer_map() : data(inline_data), entries(0), capacity(InlineSize), used(0), hashed(false) { }
+
+		pointer_map(const pointer_map &other) : data(inline_data), entries(0), capacity(InlineSize), used(0), hashed(false)
+		{
+			for (iterator it = other.begin(), it_end = other.end(); it != it_end; ++it)
+				(*this)[it->first] = it->second;
+		}
+
+		~pointer_map()
+		{
+			Release();
+		}
+
+		pointer_map &operator=(const pointer_map &other)
+		{
+			if (this != &other)
+			{
+				clear();
+				for (iterator it = other.begin(), it_end = other.end(); it != it_end; ++it)
+					(*this)[it->first] = it->second;
+			}
+			return *this;
+		}
+
+		iterator begin() const
+		{
+			return iterator(const_cast<pointer_map *>(this), Next(0));
+		}
+
+		iterator end() const
+		{
+			return iterator(const_cast<pointer_map *>(this), End());
+		}
+
+		iterator find(K *k) const
+		{
+			return iterator(const_cast<pointer_map *>(this), Locate(k));
+		}
+
+		size_t count(K *k) const
+		{
+			return Locate(k) != End();
+		}
+
+		size_t size() const
+		{
+			return entries;
+		}
+
+		bool empty() const
+		{
+			return entries == 0;
+		}
+
+		void clear()
+		{
+			Release();
+		}
+
+		V &operator[](K *k)
+		{
+			unsigned p = Locate(k);
+			if (p != End())
+				return data[p].second;
+
+			Reserve();
+
+			if (hashed)
+			{
+				unsigned mask = capacity - 1, i = Hash(k) & mask;
+				while (Live(data[i].first))
+					i = (i + 1) & mask;
+				if (data[i].first == NULL)
+					++used;
+				data[i] = value_type(k, V());
+				++entries;
+				return data[i].second;
+			}
+
+			unsigned i = LowerBound(k);
+			std::copy_backward(data + i, data + entries, data + entries + 1);
+			data[i] = value_type(k, V());
+			++entries;
+			return data[i].second;
+		}
+
+		size_t erase(K *k)
+		{
+			unsigned p = Locate(k);
+			if (p == End())
+				return 0;
+
+			if (hashed)
+				/* Leave a tombstone so probe sequences and iterators stay intact */
+				data[p] = value_type(Tombstone(), V());
+			else
+				std::copy(data + p + 1, data + entries, data + p);
+
+			if (--entries == 0)
+				Release();
+			return 1;
+		}
+
+		/** Approximate number of bytes used by this map, including itself */
+		size_t memory_usage() const
+		{
+			return sizeof(*this) + (data != inline_data ? capacity * sizeof(value_type) : 0);
+		}
+	};
+}
+
+#endif // POINTERMAP_H
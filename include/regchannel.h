@@ -16,10 +16,14 @@
 #include "modules.h"
 #include "serialize.h"
 #include "bots.h"
+#include "sortedindex.h"
 
 typedef Anope::hash_map<ChannelInfo *> registered_channel_map;
+typedef Anope::sorted_index<ChannelInfo> registered_channel_index;
 
 extern CoreExport Serialize::Checker<registered_channel_map> RegisteredChannelList;
+/* The channels of RegisteredChannelList in order, for listing them */
+extern CoreExport Serialize::Checker<registered_channel_index> RegisteredChannelIndex;
 
 /* AutoKick data. */
 class CoreExport AutoKick : public Serializable
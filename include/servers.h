@@ -81,6 +81,10 @@ class CoreExport Server : public Extensible
  public:
  	/* Number of users on the server */
  	unsigned users;
+	/* Users introduced by this server during its burst. Their OnUserConnect
+	 * is deferred until the server is synced, see Server::Sync
+	 */
+	std::vector<Reference<User> > burst_users;
 
 	/** Delete this server with a reason
 	 * @param reason The reason
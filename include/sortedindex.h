@@ -0,0 +1,113 @@
+/*
+ *
+ * (C) 2003-2018 Anope Team
+ * Contact us at team@anope.org
+ *
+ * Please read COPYING and README for further details.
+ */
+
+#ifndef SORTEDINDEX_H
+#define SORTEDINDEX_H
+
+#include "services.h"
+#include "anope.h"
+
+namespace Anope
+{
+	/** An index of objects by name, ordered case insensitively.
+	 *
+	 * It is kept up to date as objects are added and removed, so they can be
+	 * listed in order without being copied and sorted every time. A listing
+	 * can be limited to the names beginning with a prefix, and can be resumed
+	 * after the last name seen, which is how callers page through the index.
+	 */
+	template<typename T> class sorted_index
+	{
+		typedef std::map<string, T *, ci::less> index_map;
+		index_map index;
+
+	 public:
+		/** A position in the index. Cursors are invalidated like map iterators,
+		 * so only keep the name of the last entry seen between pages.
+		 */
+		class cursor
+		{
+			const index_map *map;
+			typename index_map::const_iterator it;
+			string prefix;
+
+		 public:
+			cursor(const index_map &m, const string &p, const string &after) : map(&m), prefix(p)
+			{
+				it = map->lower_bound(prefix);
+				/* Names beginning with the prefix sort after it, so this only moves forward */
+				if (!after.empty() && !ci::less()(after, prefix))
+					it = map->upper_bound(after);
+			}
+
+			/** Whether the cursor is at an entry, false once past the last name with the prefix */
+			bool valid() const
+			{
+				if (it == map->end())
+					return false;
+
+				const string &name = it->first;
+				if (name.length() < prefix.length())
+					return false;
+				for (string::size_type i = 0; i < prefix.length(); ++i)
+					if (Anope::tolower(name[i]) != Anope::tolower(prefix[i]))
+						return false;
+				return true;
+			}
+
+			const string &name() const { return it->first; }
+			T *operator*() const { return it->second; }
+			T *operator->() const { return it->second; }
+
+			cursor &operator++()
+			{
+				++it;
+				return *this;
+			}
+		};
+
+		void insert(const string &name, T *t)
+		{
+			index[name] = t;
+		}
+
+		void erase(const string &name)
+		{
+			index.erase(name);
+		}
+
+		size_t size() const
+		{
+			return index.size();
+		}
+
+		/** Start walking through the index.
+		 * @param prefix Only visit names beginning with this, case insensitively
+		 * @param after If not empty, start after this name instead of at the first one
+		 * @return A cursor at the first entry, check valid() before using it
+		 */
+		cursor find(const string &prefix = "", const string &after = "") const
+		{
+			return cursor(index, prefix, after);
+		}
+	};
+
+	/** Find the literal text a wildcard pattern begins with, which any string
+	 * matching it with Anope::Match must begin with too.
+	 * @param pattern The pattern
+	 * @return The text before the first wildcard, or an empty string for regex patterns
+	 */
+	inline string PatternPrefix(const string &pattern)
+	{
+		if (pattern.length() >= 2 && pattern[0] == '/' && pattern[pattern.length() - 1] == '/')
+			return "";
+		return pattern.substr(0, pattern.find_first_of("*?"));
+	}
+}
+
+#endif // SORTEDINDEX_H
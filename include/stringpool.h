@@ -0,0 +1,136 @@
+/*
+ *
+ * (C) 2003-2018 Anope Team
+ * Contact us at team@anope.org
+ *
+ * Please read COPYING and README for further details.
+ */
+
+#ifndef STRINGPOOL_H
+#define STRINGPOOL_H
+
+#include "services.h"
+#include "anope.h"
+
+namespace Anope
+{
+	/** A reference counted handle to a string shared through the string pool.
+	 *
+	 * Values such as hostnames, idents and realnames are heavily duplicated
+	 * across users, so each distinct value is stored once and every holder
+	 * keeps a handle to it. Pooling is exact (case sensitive) so that the
+	 * value is kept as it was given, comparisons through the handle use the
+	 * casemap like Anope::string does. A handle can be used wherever a const
+	 * Anope::string is expected, and is changed only by assigning to it.
+	 *
+	 * The reference counts and the pool are not locked, so handles may only be
+	 * created, copied, assigned and destroyed on the main thread. Code running
+	 * on other threads, such as ThreadPool tasks, must copy the value into an
+	 * Anope::string on the main thread first. Services abort if this is not
+	 * followed.
+	 */
+	class CoreExport pooled_string
+	{
+	 public:
+		struct Entry
+		{
+			string value;
+			unsigned refs;
+		};
+
+	 private:
+		/* NULL for the empty string */
+		Entry *entry;
+
+		static const string &Empty();
+		static Entry *Acquire(const string &value);
+		static void AddRef(Entry *e);
+		static void Release(Entry *e);
+
+	 public:
+		typedef string::size_type size_type;
+		typedef string::const_iterator const_iterator;
+		static const size_type npos = string::npos;
+
+		pooled_string() : entry(NULL) { }
+		pooled_string(const string &value) : entry(Acquire(value)) { }
+		pooled_string(const char *value) : entry(Acquire(value)) { }
+		pooled_string(const pooled_string &other) : entry(other.entry)
+		{
+			AddRef(entry);
+		}
+		~pooled_string() { Release(entry); }
+
+		pooled_string &operator=(const pooled_string &other)
+		{
+			AddRef(other.entry);
+			Release(entry);
+			entry = other.entry;
+			return *this;
+		}
+		pooled_string &operator=(const string &value) { return *this = pooled_string(value); }
+		pooled_string &operator=(const char *value) { return *this = pooled_string(value); }
+
+		inline void clear()
+		{
+			Release(entry);
+			entry = NULL;
+		}
+
+		inline const string &get() const { return entry ? entry->value : Empty(); }
+		inline operator const string &() const { return get(); }
+
+		/* Handles to the same pooled value are equal without comparing the strings */
+		inline bool operator==(const pooled_string &other) const { return entry == other.entry; }
+		inline bool operator!=(const pooled_string &other) const { return entry != other.entry; }
+		template<typename T> inline bool operator==(const T &other) const { return get() == other; }
+		template<typename T> inline bool operator!=(const T &other) const { return get() != other; }
+		template<typename T> inline bool equals_cs(const T &other) const { return get().equals_cs(other); }
+		template<typename T> inline bool equals_ci(const T &other) const { return get().equals_ci(other); }
+		template<typename T> inline const string operator+(const T &other) const { return get() + other; }
+		inline bool operator<(const pooled_string &other) const { return get() < other.get(); }
+
+		inline const char *c_str() const { return get().c_str(); }
+		inline const char *data() const { return get().data(); }
+		inline const std::string &str() const { return get().str(); }
+		inline ci::string ci_str() const { return get().ci_str(); }
+		inline bool empty() const { return entry == NULL; }
+		inline size_type length() const { return get().length(); }
+		inline const_iterator begin() const { return get().begin(); }
+		inline const_iterator end() const { return get().end(); }
+		inline const char &operator[](size_type n) const { return get()[n]; }
+
+		template<typename T> inline size_type find(const T &s, size_type pos = 0) const { return get().find(s, pos); }
+		template<typename T> inline size_type find_ci(const T &s, size_type pos = 0) const { return get().find_ci(s, pos); }
+		template<typename T> inline size_type rfind(const T &s, size_type pos = npos) const { return get().rfind(s, pos); }
+		template<typename T> inline size_type find_first_of(const T &s, size_type pos = 0) const { return get().find_first_of(s, pos); }
+		template<typename T> inline size_type find_first_not_of(const T &s, size_type pos = 0) const { return get().find_first_not_of(s, pos); }
+		inline bool is_number_only() const { return get().is_number_only(); }
+		inline string lower() const { return get().lower(); }
+		inline string upper() const { return get().upper(); }
+		inline string substr(size_type pos = 0, size_type n = npos) const { return get().substr(pos, n); }
+		inline string replace_all_cs(const string &orig, const string &repl) const { return get().replace_all_cs(orig, repl); }
+		inline string replace_all_ci(const string &orig, const string &repl) const { return get().replace_all_ci(orig, repl); }
+
+		/** Statistics about the string pool */
+		struct Stats
+		{
+			/* Number of distinct pooled values */
+			size_t values;
+			/* Number of handles referring to them */
+			size_t refs;
+			/* Bytes used by the pooled values themselves */
+			size_t pooled_bytes;
+			/* Bytes the values would use if every handle had its own copy */
+			size_t unpooled_bytes;
+		};
+
+		static Stats GetStats();
+	};
+
+	inline const string operator+(const char *s, const pooled_string &p) { return s + p.get(); }
+	inline const string operator+(const string &s, const pooled_string &p) { return s + p.get(); }
+	inline std::ostream &operator<<(std::ostream &os, const pooled_string &p) { return os << p.get(); }
+}
+
+#endif // STRINGPOOL_H
@@ -112,9 +112,91 @@ class CoreExport Condition : public Mutex
 	 */
 	void Wakeup();
 
+	/** Called to wakeup all of the waiters
+	 */
+	void WakeupAll();
+
 	/** Called to wait for a Wakeup() call
 	 */
 	void Wait();
 };
 
+/** A piece of work for the ThreadPool. Run is called on one of the pool's threads,
+ * then OnComplete is called on the main thread, and the task is deleted.
+ */
+class CoreExport Task
+{
+	friend class ThreadPool;
+
+	/* When the task was queued */
+	timeval queued;
+	/* Set when the task is cancelled, it is not completed. Protected by the pool's lock */
+	bool cancelled;
+
+ protected:
+	/* The module the task belongs to, its tasks are cancelled when it is unloaded */
+	Module *owner;
+
+ public:
+	Task(Module *o = NULL) : cancelled(false), owner(o) { }
+
+	virtual ~Task() { }
+
+	/** Whether the task has been cancelled. Tasks which run for a long time
+	 * should check this now and then, and return early.
+	 */
+	bool IsCancelled() const;
+
+	/** Called on a thread of the pool. Anything the main thread also uses
+	 * must not be touched from here without locking.
+	 */
+	virtual void Run() = 0;
+
+	/** Called on the main thread after Run has returned
+	 */
+	virtual void OnComplete() { }
+};
+
+/** Runs tasks on a small number of threads, which are started as they are needed.
+ * All completions are delivered to the main thread through one pipe.
+ */
+class CoreExport ThreadPool
+{
+	static void *Worker(void *);
+	static void CancelTasks(Module *m, Task *task, std::vector<Task *> &cancelled);
+
+ public:
+	struct Stats
+	{
+		/* Threads started, threads running a task, and tasks waiting for one */
+		unsigned workers, active, pending;
+		/* Tasks run */
+		unsigned long completed;
+		/* Microseconds tasks have spent waiting to be run and running, and the longest wait */
+		unsigned long long wait_total, run_total, wait_max;
+	};
+
+	/** Queue a task to be run. The pool owns the task afterwards.
+	 * @param t The task
+	 */
+	static void Queue(Task *t);
+
+	/** Cancel a task. If it is running this waits for it to return. The task
+	 * is deleted without being completed.
+	 * @param t The task
+	 */
+	static void Cancel(Task *t);
+
+	/** Cancel all of the tasks of a module, called when it is unloaded
+	 * @param m The module
+	 */
+	static void ModuleUnload(Module *m);
+
+	/** Run the tasks which are still queued and stop the threads, called when shutting down
+	 */
+	static void Shutdown();
+
+	static Stats GetStats();
+};
+
 #endif // THREADENGINE_H
@@ -14,6 +14,8 @@
 
 #include "anope.h"
 #include "modes.h"
+#include "pointermap.h"
+#include "stringpool.h"
 #include "extensible.h"
 #include "serialize.h"
 #include "commands.h"
@@ -33,19 +35,29 @@ class CoreExport User : public virtual Base, public Extensible, public CommandRe
 {
 	/* true if the user was quit or killed */
 	bool quit;
+	/* true if the user was introduced in a netburst and OnUserConnect hasn't been called yet */
+	bool connect_pending;
+	/* true if the user identified while connect_pending, so FinishBurst calls OnNickIdentify */
+	bool burst_identified;
 	/* Users that are in the process of quitting */
 	static std::list<User *> quitting_users;
 
  public:
 	typedef std::map<Anope::string, Anope::string> ModeList;
+	/* Mode ids (see ModeManager::GetModeID) and params, sorted by id */
+	typedef std::vector<std::pair<unsigned short, Anope::string> > ModeParamList;
+	/* Number of mode ids kept in the mode bitset */
+	static const unsigned short MODE_BITS = 128;
  protected:
-	Anope::string vident;
-	Anope::string ident;
+	Anope::pooled_string vident;
+	Anope::pooled_string ident;
 	Anope::string uid;
 	/* If the user is on the access list of the nick they're on */
 	bool on_access;
-	/* Map of user modes and the params this user has (if any) */
-	ModeList modes;
+	/* User modes this user has, by mode id */
+	std::bitset<MODE_BITS> mode_bits;
+	/* Params of the user modes this user has which have one, and any modes with an id too large for mode_bits */
+	ModeParamList mode_params;
 	/* NickCore account the user is currently loggged in as, if they are logged in */
 	Serialize::Reference<NickCore> nc;
 
@@ -60,13 +72,13 @@ class CoreExport User : public virtual Base, public Extensible, public CommandRe
 	Anope::string nick;
 
 	/* User's real hostname */
-	Anope::string host;
+	Anope::pooled_string host;
 	/* User's virtual hostname */
-	Anope::string vhost;
+	Anope::pooled_string vhost;
 	/* User's cloaked hostname */
-	Anope::string chost;
+	Anope::pooled_string chost;
 	/* Realname */
-	Anope::string realname;
+	Anope::pooled_string realname;
 	/* SSL Fingerprint */
 	Anope::string fingerprint;
 	/* User's IP */
@@ -79,9 +91,13 @@ class CoreExport User : public virtual Base, public Extensible, public CommandRe
 	time_t timestamp;
 	/* Is the user as super admin? */
 	bool super_admin;
+	/* Mode changes pending in the mode stacker, owned by ModeManager */
+	StackerInfo *stacker;
+	/* The away message the user set while connect_pending, which FinishBurst passes to OnUserAway */
+	Anope::string burst_away;
 
 	/* Channels the user is in */
-	typedef std::map<Channel *, ChanUserContainer *> ChanUserList;
+	typedef Anope::pointer_map<Channel, ChanUserContainer *> ChanUserList;
 	ChanUserList chans;
 
 	/* Last time this user sent a memo command used */
@@ -253,6 +269,12 @@ class CoreExport User : public virtual Base, public Extensible, public CommandRe
 	 */
 	bool HasMode(const Anope::string &name) const;
 
+	/** Check if the user has a mode
+	 * @param id The id of the mode name, see ModeManager::GetModeID
+	 * @return true or false
+	 */
+	bool HasMode(unsigned short id) const;
+
 	/** Set a mode internally on the user, the IRCd is not informed
 	 * @param setter who/what is setting the mode
 	 * @param um The user mode
@@ -280,6 +302,13 @@ class CoreExport User : public virtual Base, public Extensible, public CommandRe
 	 */
 	void SetMode(BotInfo *bi, const Anope::string &name, const Anope::string &param = "");
 
+	/** Set a mode on the user
+	 * @param bi The client setting the mode
+	 * @param id The id of the mode name
+	 * @param Param Optional param for the mode
+	 */
+	void SetMode(BotInfo *bi, unsigned short id, const Anope::string &param = "");
+
 	/** Remove a mode on the user
 	 * @param bi The client setting the mode
 	 * @param um The user mode
@@ -294,6 +323,13 @@ class CoreExport User : public virtual Base, public Extensible, public CommandRe
 	 */
 	void RemoveMode(BotInfo *bi, const Anope::string &name, const Anope::string &param = "");
 
+	/** Remove a mode from the user
+	 * @param bi The client setting the mode
+	 * @param id The id of the mode name
+	 * @param param Optional param for the mode
+	 */
+	void RemoveMode(BotInfo *bi, unsigned short id, const Anope::string &param = "");
+
 	/** Set a string of modes on a user
 	 * @param bi The client setting the modes
 	 * @param umodes The modes
@@ -311,7 +347,14 @@ class CoreExport User : public virtual Base, public Extensible, public CommandRe
 	 */
 	Anope::string GetModes() const;
 
-	const ModeList &GetModeList() const;
+	/** Get the modes set on this user and their params, by mode id
+	 * @param modes Filled with the modes, sorted by id
+	 */
+	void GetModes(ModeParamList &modes) const;
+
+	/** Get the modes set on this user and their params, by mode name
+	 */
+	ModeList GetModeList() const;
 
 	/** Find the channel container for Channel c that the user is on
 	 * This is preferred over using FindUser in Channel, as there are usually more users in a channel
@@ -345,6 +388,18 @@ class CoreExport User : public virtual Base, public Extensible, public CommandRe
 
 	bool Quitting() const;
 
+	/** Check if this user was introduced in a netburst and the modules haven't been told about them yet.
+	 * Events about such users are not sent to the modules, they see the user as they are when OnUserConnect is called.
+	 */
+	bool IsConnectPending() const;
+
+	/** Calls OnUserConnect for a user introduced in a netburst, once their server syncs.
+	 * The events which were held back since are then called for the user's current
+	 * modes, account and away message.
+	 * @return true if it was called, false if the user quit in the meantime
+	 */
+	bool FinishBurst();
+
 	/* Returns a mask that will most likely match any address the
 	 * user will have from that location.  For IP addresses, wildcards the
 	 * last octet (e.g. 35.1.1.1 -> 35.1.1.*). for named addresses, wildcards
@@ -12,20 +12,21 @@
 #include "serialize.h"
 #include "service.h"
 #include "sockets.h"
+#include "stringpool.h"
 
 /* An Xline, eg, anything added with operserv/akill, or any of the operserv/sxline commands */
 class CoreExport XLine : public Serializable
 {
 	void Init();
-	Anope::string nick, user, host, real;
+	Anope::pooled_string nick, user, host, real;
  public:
 	cidr *c;
 	Anope::string mask;
 	Regex *regex;
-	Anope::string by;
+	Anope::pooled_string by;
 	time_t created;
 	time_t expires;
-	Anope::string reason;
+	Anope::pooled_string reason;
 	XLineManager *manager;
 	Anope::string id;
 
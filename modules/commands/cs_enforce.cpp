@@ -192,8 +192,7 @@ class CommandCSEnforce : public Command
 		}
 
 		std::vector<User *> users;
-		/* The newer users are at the end of the list, so kick users starting from the end */
-		for (Channel::ChanUserList::reverse_iterator it = ci->c->users.rbegin(), it_end = ci->c->users.rend(); it != it_end; ++it)
+		for (Channel::ChanUserList::iterator it = ci->c->users.begin(), it_end = ci->c->users.end(); it != it_end; ++it)
 		{
 			ChanUserContainer *uc = it->second;
 			User *user = uc->user;
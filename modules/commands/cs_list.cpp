@@ -74,13 +74,10 @@ class CommandCSList : public Command
 		ListFormatter list(source.GetAccount());
 		list.AddColumn(_("Name")).AddColumn(_("Description"));
 
-		Anope::map<ChannelInfo *> ordered_map;
-		for (registered_channel_map::const_iterator it = RegisteredChannelList->begin(), it_end = RegisteredChannelList->end(); it != it_end; ++it)
-			ordered_map[it->first] = it->second;
-
-		for (Anope::map<ChannelInfo *>::const_iterator it = ordered_map.begin(), it_end = ordered_map.end(); it != it_end; ++it)
+		bool more = false;
+		for (registered_channel_index::cursor it = RegisteredChannelIndex->find(); it.valid(); ++it)
 		{
-			const ChannelInfo *ci = it->second;
+			const ChannelInfo *ci = *it;
 
 			if (!is_servadmin)
 			{
@@ -101,24 +98,33 @@ class CommandCSList : public Command
 			if (channoexpire && !ci->HasExt("CS_NO_EXPIRE"))
 				continue;
 
-			if (pattern.equals_ci(ci->name) || ci->name.equals_ci(spattern) || Anope::Match(ci->name, pattern, false, true) || Anope::Match(ci->name, spattern, false, true) || Anope::Match(ci->desc, pattern, false, true) || Anope::Match(ci->last_topic, pattern, false, true))
+			if (!pattern.equals_ci(ci->name) && !ci->name.equals_ci(spattern) && !Anope::Match(ci->name, pattern, false, true) && !Anope::Match(ci->name, spattern, false, true) && !Anope::Match(ci->desc, pattern, false, true) && !Anope::Match(ci->last_topic, pattern, false, true))
+				continue;
+
+			++count;
+			if (from && count < from)
+				continue;
+			else if ((from || to) && count > to)
+				break;
+
+			if (++nchans > listmax)
 			{
-				if (((count + 1 >= from && count + 1 <= to) || (!from && !to)) && ++nchans <= listmax)
-				{
-					bool isnoexpire = false;
-					if (is_servadmin && (ci->HasExt("CS_NO_EXPIRE")))
-						isnoexpire = true;
-
-					ListFormatter::ListEntry entry;
-					entry["Name"] = (isnoexpire ? "!" : "") + ci->name;
-					if (ci->HasExt("CS_SUSPENDED"))
-						entry["Description"] = Language::Translate(source.GetAccount(), _("[Suspended]"));
-					else
-						entry["Description"] = ci->desc;
-					list.AddEntry(entry);
-				}
-				++count;
+				/* No need to look further once the list is full */
+				more = true;
+				break;
 			}
+
+			bool isnoexpire = false;
+			if (is_servadmin && (ci->HasExt("CS_NO_EXPIRE")))
+				isnoexpire = true;
+
+			ListFormatter::ListEntry entry;
+			entry["Name"] = (isnoexpire ? "!" : "") + ci->name;
+			if (ci->HasExt("CS_SUSPENDED"))
+				entry["Description"] = Language::Translate(source.GetAccount(), _("[Suspended]"));
+			else
+				entry["Description"] = ci->desc;
+			list.AddEntry(entry);
 		}
 
 		std::vector<Anope::string> replies;
@@ -127,7 +133,10 @@ class CommandCSList : public Command
 		for (unsigned i = 0; i < replies.size(); ++i)
 			source.Reply(replies[i]);
 
-		source.Reply(_("End of list - %d/%d matches shown."), nchans > listmax ? listmax : nchans, nchans);
+		if (more)
+			source.Reply(_("End of list - only the first %d matches are shown."), listmax);
+		else
+			source.Reply(_("End of list - %d/%d matches shown."), nchans, nchans);
 	}
 
 	bool OnHelp(CommandSource &source, const Anope::string &subcommand) anope_override
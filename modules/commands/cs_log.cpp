@@ -379,7 +379,7 @@ class CSLog : public Module
 						continue;
 				}
 
-				Anope::string buffer = l->u->nick + " used " + l->source->command.upper() + " " + l->buf.str();
+				Anope::string buffer = l->u->nick + " used " + l->source->command.upper() + " " + l->GetMessage();
 
 				if (log->method.equals_ci("MEMO") && MSService && l->ci->WhoSends() != NULL)
 					MSService->Send(l->ci->WhoSends()->nick, l->ci->name, buffer, true);
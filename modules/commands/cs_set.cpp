@@ -1108,7 +1108,7 @@ class CSSet : public Module
 			{
 				if (!modes.empty())
 					modes += " ";
-				modes += it->first;
+				modes += ModeManager::GetModeName(it->first);
 				if (!it->second.empty())
 					modes += "," + it->second;
 			}
@@ -1130,9 +1130,9 @@ class CSSet : public Module
 			{
 				size_t c = modes.find(',');
 				if (c == Anope::string::npos)
-					ci->last_modes.insert(std::make_pair(modes, ""));
+					ci->last_modes.push_back(std::make_pair(ModeManager::GetModeID(modes, true), ""));
 				else
-					ci->last_modes.insert(std::make_pair(modes.substr(0, c), modes.substr(c + 1)));
+					ci->last_modes.push_back(std::make_pair(ModeManager::GetModeID(modes.substr(0, c), true), modes.substr(c + 1)));
 			}
 		}
 	} keep_modes;
@@ -1192,7 +1192,7 @@ class CSSet : public Module
 		{
 			Channel::ModeList ml = c->ci->last_modes;
 			for (Channel::ModeList::iterator it = ml.begin(); it != ml.end(); ++it)
-				c->SetMode(c->ci->WhoSends(), it->first, it->second);
+				c->SetMode(c->ci->WhoSends(), ModeManager::GetModeName(it->first), it->second);
 		}
 	}
 
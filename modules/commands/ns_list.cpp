@@ -74,13 +74,14 @@ class CommandNSList : public Command
 
 		list.AddColumn(_("Nick")).AddColumn(_("Last usermask"));
 
-		Anope::map<NickAlias *> ordered_map;
-		for (nickalias_map::const_iterator it = NickAliasList->begin(), it_end = NickAliasList->end(); it != it_end; ++it)
-			ordered_map[it->first] = it->second;
+		/* Only nicks beginning with the literal start of the pattern can match it */
+		Anope::string prefix = Anope::PatternPrefix(pattern);
+		prefix = prefix.substr(0, prefix.find('!'));
 
-		for (Anope::map<NickAlias *>::const_iterator it = ordered_map.begin(), it_end = ordered_map.end(); it != it_end; ++it)
+		bool more = false;
+		for (nickalias_index::cursor it = NickAliasIndex->find(prefix); it.valid(); ++it)
 		{
-			const NickAlias *na = it->second;
+			const NickAlias *na = *it;
 
 			/* Don't show private nicks to non-services admins. */
 			if (na->nc->HasExt("NS_PRIVATE") && !is_servadmin && na->nc != mync)
@@ -95,29 +96,37 @@ class CommandNSList : public Command
 			/* We no longer compare the pattern against the output buffer.
 			 * Instead we build a nice nick!user@host buffer to compare.
 			 * The output is then generated separately. -TheShadow */
-			Anope::string buf = Anope::printf("%s!%s", na->nick.c_str(), !na->last_usermask.empty() ? na->last_usermask.c_str() : "*@*");
-			if (na->nick.equals_ci(pattern) || Anope::Match(buf, pattern, false, true))
+			if (!na->nick.equals_ci(pattern) && !Anope::Match(na->nick + "!" + (!na->last_usermask.empty() ? na->last_usermask : "*@*"), pattern, false, true))
+				continue;
+
+			++count;
+			if (from && count < from)
+				continue;
+			else if ((from || to) && count > to)
+				break;
+
+			if (++nnicks > listmax)
 			{
-				if (((count + 1 >= from && count + 1 <= to) || (!from && !to)) && ++nnicks <= listmax)
-				{
-					bool isnoexpire = false;
-					if (is_servadmin && na->HasExt("NS_NO_EXPIRE"))
-						isnoexpire = true;
-
-					ListFormatter::ListEntry entry;
-					entry["Nick"] = (isnoexpire ? "!" : "") + na->nick;
-					if (na->nc->HasExt("HIDE_MASK") && !is_servadmin && na->nc != mync)
-						entry["Last usermask"] = Language::Translate(source.GetAccount(), _("[Hostname hidden]"));
-					else if (na->nc->HasExt("NS_SUSPENDED"))
-						entry["Last usermask"] = Language::Translate(source.GetAccount(), _("[Suspended]"));
-					else if (na->nc->HasExt("UNCONFIRMED"))
-						entry["Last usermask"] = Language::Translate(source.GetAccount(), _("[Unconfirmed]"));
-					else
-						entry["Last usermask"] = na->last_usermask;
-					list.AddEntry(entry);
-				}
-				++count;
+				/* No need to look further once the list is full */
+				more = true;
+				break;
 			}
+
+			bool isnoexpire = false;
+			if (is_servadmin && na->HasExt("NS_NO_EXPIRE"))
+				isnoexpire = true;
+
+			ListFormatter::ListEntry entry;
+			entry["Nick"] = (isnoexpire ? "!" : "") + na->nick;
+			if (na->nc->HasExt("HIDE_MASK") && !is_servadmin && na->nc != mync)
+				entry["Last usermask"] = Language::Translate(source.GetAccount(), _("[Hostname hidden]"));
+			else if (na->nc->HasExt("NS_SUSPENDED"))
+				entry["Last usermask"] = Language::Translate(source.GetAccount(), _("[Suspended]"));
+			else if (na->nc->HasExt("UNCONFIRMED"))
+				entry["Last usermask"] = Language::Translate(source.GetAccount(), _("[Unconfirmed]"));
+			else
+				entry["Last usermask"] = na->last_usermask;
+			list.AddEntry(entry);
 		}
 
 		source.Reply(_("List of entries matching \002%s\002:"), pattern.c_str());
@@ -128,8 +137,10 @@ class CommandNSList : public Command
 		for (unsigned i = 0; i < replies.size(); ++i)
 			source.Reply(replies[i]);
 
-		source.Reply(_("End of list - %d/%d matches shown."), nnicks > listmax ? listmax : nnicks, nnicks);
-		return;
+		if (more)
+			source.Reply(_("End of list - only the first %d matches are shown."), listmax);
+		else
+			source.Reply(_("End of list - %d/%d matches shown."), nnicks, nnicks);
 	}
 
 	bool OnHelp(CommandSource &source, const Anope::string &subcommand) anope_override
@@ -69,6 +69,9 @@ struct DNSZone : Serializable
 			zone->servers.insert(server_str);
 		}
 
+		if (dnsmanager)
+			dnsmanager->UpdateSerial();
+
 		return zone;
 	}
 
@@ -188,6 +191,9 @@ class DNSServer : public Serializable
 			req->zones.insert(zone_str);
 		}
 
+		if (dnsmanager)
+			dnsmanager->UpdateSerial();
+
 		return req;
 	}
 
@@ -734,7 +740,7 @@ class ModuleDNS : public Module
  public:
 	ModuleDNS(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, EXTRA | VENDOR),
 		zone_type("DNSZone", DNSZone::Unserialize), dns_type("DNSServer", DNSServer::Unserialize), commandosdns(this),
-		last_warn(0)
+		ttl(0), last_warn(0)
 	{
 
 
@@ -757,7 +763,11 @@ class ModuleDNS : public Module
 	void OnReload(Configuration::Conf *conf) anope_override
 	{
 		Configuration::Block *block = conf->GetModule(this);
+		time_t old_ttl = this->ttl;
 		this->ttl = block->Get<time_t>("ttl");
+		/* Answers already sent out carry the old ttl */
+		if (this->ttl != old_ttl && dnsmanager)
+			dnsmanager->UpdateSerial();
 		this->user_drop_mark =  block->Get<int>("user_drop_mark");
 		this->user_drop_time = block->Get<time_t>("user_drop_time");
 		this->user_drop_readd_time = block->Get<time_t>("user_drop_readd_time");
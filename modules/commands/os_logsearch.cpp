@@ -13,6 +13,195 @@
 
 static unsigned int HARDMAX = 65536;
 
+class LogSearch;
+
+/* Searches which are still running */
+static std::list<LogSearch *> searches;
+
+/* Searches the log files on the thread pool, so services are not blocked while
+ * they are read. The matches are sent to the oper once the search is done.
+ */
+class LogSearch : public Task
+{
+	/* Bytes read from a file at a time */
+	static const size_t CHUNK = 1024 * 1024;
+
+	std::vector<Anope::string> files;
+	Anope::string search_string;
+	/* Whether the search string has wildcards */
+	bool wildcard;
+	/* Compiled on the main thread, as providers and the regex cache are not thread safe */
+	Regex *regex;
+	/* Lower cased text every matching line must contain, to find candidate lines quickly */
+	Anope::string needle;
+	unsigned limit;
+
+	/* The last limit matching lines, and how many matched in total */
+	std::deque<Anope::string> matches;
+	unsigned found;
+
+	bool Matches(const Anope::string &line) const
+	{
+		if (regex)
+			return regex->Matches(line);
+		else if (wildcard)
+			return Anope::Match(line, "*" + search_string + "*");
+		/* Finding the needle was enough */
+		return true;
+	}
+
+	void AddMatch(const char *begin, const char *end)
+	{
+		Anope::string line(begin, end);
+		if (!Matches(line))
+			return;
+
+		matches.push_back(line);
+		if (matches.size() > limit)
+			matches.pop_front();
+		++found;
+	}
+
+	/* Search the complete lines in data */
+	void SearchLines(const char *data, size_t len)
+	{
+		if (needle.empty())
+		{
+			for (size_t pos = 0; pos < len && found < HARDMAX;)
+			{
+				const char *nl = static_cast<const char *>(memchr(data + pos, '\n', len - pos));
+				size_t end = nl ? nl - data : len;
+				AddMatch(data + pos, data + end);
+				pos = end + 1;
+			}
+			return;
+		}
+
+		/* Search the whole block for the needle and only look at the lines it is on */
+		std::string lower(data, len);
+		for (size_t i = 0; i < len; ++i)
+			lower[i] = Anope::tolower(lower[i]);
+
+		for (size_t pos = 0; found < HARDMAX && (pos = lower.find(needle.str(), pos)) != std::string::npos;)
+		{
+			size_t begin = lower.rfind('\n', pos), end = lower.find('\n', pos);
+			begin = begin == std::string::npos ? 0 : begin + 1;
+			if (end == std::string::npos)
+				end = len;
+
+			AddMatch(data + begin, data + end);
+			pos = end + 1;
+		}
+	}
+
+	void SearchFile(const Anope::string &name)
+	{
+		FILE *f = fopen(name.c_str(), "rb");
+		if (f == NULL)
+			return;
+
+		std::vector<char> buffer(CHUNK);
+		/* The start of a line which did not fit in the last chunk */
+		std::string partial;
+
+		for (size_t len; !this->IsCancelled() && found < HARDMAX && (len = fread(&buffer[0], 1, buffer.size(), f)) > 0;)
+		{
+			const char *data = &buffer[0];
+			const char *last = data + len;
+			while (last > data && last[-1] != '\n')
+				--last;
+
+			if (!partial.empty())
+			{
+				if (last == data)
+				{
+					partial.append(data, len);
+					continue;
+				}
+
+				/* Finish the line which was cut off */
+				const char *nl = static_cast<const char *>(memchr(data, '\n', len));
+				partial.append(data, nl - data);
+				SearchLines(partial.data(), partial.length());
+				partial.clear();
+				data = nl + 1;
+			}
+
+			if (last > data)
+				SearchLines(data, last - data - 1);
+			partial.append(last, &buffer[0] + len - last);
+		}
+
+		if (!partial.empty() && !this->IsCancelled())
+			SearchLines(partial.data(), partial.length());
+
+		fclose(f);
+	}
+
+ public:
+	/* Who to send the results to */
+	CommandSource source;
+	/* The module providing the regex engine, if a regex is used */
+	Module *regex_owner;
+
+	LogSearch(Module *o, CommandSource &src, const std::vector<Anope::string> &f, const Anope::string &search, Regex *r, Module *ro, unsigned lim) : Task(o),
+		files(f), search_string(search), wildcard(search.find_first_of("?*") != Anope::string::npos), regex(r), limit(lim), found(0), source(src), regex_owner(ro)
+	{
+		if (regex)
+			return;
+		else if (!wildcard)
+			needle = search_string.lower();
+		else
+		{
+			/* Use the longest piece of the pattern without wildcards */
+			sepstream sep(search_string.replace_all_cs("?", "*"), '*');
+			for (Anope::string token; sep.GetToken(token);)
+				if (token.length() > needle.length())
+					needle = token.lower();
+		}
+	}
+
+	~LogSearch()
+	{
+		searches.remove(this);
+		delete regex;
+	}
+
+	void Run() anope_override
+	{
+		for (unsigned i = 0; i < files.size() && found < HARDMAX && !this->IsCancelled(); ++i)
+			SearchFile(files[i]);
+	}
+
+	void OnComplete() anope_override
+	{
+		/* Unless the oper has gone away */
+		if (source.GetUser())
+			this->SendResults();
+	}
+
+	void SendResults()
+	{
+		if (!found)
+		{
+			source.Reply(_("No matches for \002%s\002 found."), search_string.c_str());
+			return;
+		}
+
+		if (found >= HARDMAX)
+		{
+			source.Reply(_("Too many results for \002%s\002."), search_string.c_str());
+			return;
+		}
+
+		source.Reply(_("Matches for \002%s\002:"), search_string.c_str());
+		unsigned int count = 0;
+		for (std::deque<Anope::string>::iterator it = matches.begin(), it_end = matches.end(); it != it_end; ++it)
+			source.Reply("#%d: %s", ++count, it->c_str());
+		source.Reply(_("Showed %d/%d matches for \002%s\002."), matches.size(), found, search_string.c_str());
+	}
+};
+
 class CommandOSLogSearch : public Command
 {
 	static inline Anope::string CreateLogName(const Anope::string &file, time_t t = Anope::CurTime)
@@ -91,65 +280,55 @@ class CommandOSLogSearch : public Command
 
 		Log(LOG_ADMIN, source, this) << "for " << search_string;
 
-		bool wildcard = search_string.find_first_of("?*") != Anope::string::npos;
-		bool regex = search_string.empty() == false && search_string[0] == '/' && search_string[search_string.length() - 1] == '/';
-
-		const Anope::string &logfile_name = Config->GetModule(this->owner)->Get<const Anope::string>("logname");
-		std::vector<Anope::string> matches;
-		for (int d = days - 1; d >= 0; --d)
+		Regex *regex = NULL;
+		Module *regex_owner = NULL;
+		if (search_string.length() > 2 && search_string[0] == '/' && search_string[search_string.length() - 1] == '/')
 		{
-			Anope::string lf_name = CreateLogName(logfile_name, Anope::CurTime - (d * 86400));
-			Log(LOG_DEBUG) << "Searching " << lf_name;
-			std::fstream fd(lf_name.c_str(), std::ios_base::in);
-			if (!fd.is_open())
-				continue;
+			const Anope::string &regexengine = Config->GetBlock("options")->Get<const Anope::string>("regexengine");
 
-			for (Anope::string buf, token; std::getline(fd, buf.str());)
+			if (regexengine.empty())
 			{
-				bool match = false;
-
-				if (regex)
-					match = Anope::Match(buf, search_string, false, true);
-				else if (wildcard)
-					match = Anope::Match(buf, "*" + search_string + "*");
-				else
-					match = buf.find_ci(search_string) != Anope::string::npos;
-
-				if (match)
-				{
-					matches.push_back(buf);
+				source.Reply(_("Regex is disabled."));
+				return;
+			}
 
-					if (matches.size() >= HARDMAX)
-						break;
-				}
+			ServiceReference<RegexProvider> provider("Regex", regexengine);
+			if (!provider)
+			{
+				source.Reply(_("Unable to find regex engine %s."), regexengine.c_str());
+				return;
 			}
 
-			fd.close();
+			try
+			{
+				regex = provider->Compile(search_string.substr(1, search_string.length() - 2));
+				regex_owner = provider->owner;
+			}
+			catch (const RegexException &ex)
+			{
+				source.Reply("%s", ex.GetReason().c_str());
+				return;
+			}
 		}
 
-		unsigned int found = matches.size();
-		if (!found)
-		{
-			source.Reply(_("No matches for \002%s\002 found."), search_string.c_str());
-			return;
-		}
+		const Anope::string &logfile_name = Config->GetModule(this->owner)->Get<const Anope::string>("logname");
+		std::vector<Anope::string> files;
+		for (int d = days - 1; d >= 0; --d)
+			files.push_back(CreateLogName(logfile_name, Anope::CurTime - (d * 86400)));
 
-		if (matches.size() >= HARDMAX)
-		{
-			source.Reply(_("Too many results for \002%s\002."), search_string.c_str());
-			return;
-		}
+		LogSearch *search = new LogSearch(this->owner, source, files, search_string, regex, regex_owner, replies);
 
-		if (matches.size() > static_cast<unsigned int>(replies))
+		/* Replies can only be sent later to users, search anything else right away */
+		if (source.GetUser())
 		{
-			matches.erase(matches.begin(), matches.begin() + (matches.size() - static_cast<unsigned int>(replies)));
+			searches.push_back(search);
+			ThreadPool::Queue(search);
+			return;
 		}
 
-		source.Reply(_("Matches for \002%s\002:"), search_string.c_str());
-		unsigned int count = 0;
-		for (std::vector<Anope::string>::iterator it = matches.begin(), it_end = matches.end(); it != it_end; ++it)
-			source.Reply("#%d: %s", ++count, it->c_str());
-		source.Reply(_("Showed %d/%d matches for \002%s\002."), matches.size(), found, search_string.c_str());
+		search->Run();
+		search->SendResults();
+		delete search;
 	}
 
 	bool OnHelp(CommandSource &source, const Anope::string &subcommand) anope_override
@@ -180,6 +359,17 @@ class OSLogSearch : public Module
 		commandoslogsearch(this)
 	{
 	}
+
+	void OnModuleUnload(User *, Module *m) anope_override
+	{
+		/* Searches can not go on without their regex engine */
+		for (std::list<LogSearch *>::iterator it = searches.begin(); it != searches.end();)
+		{
+			LogSearch *search = *it++;
+			if (search->regex_owner == m)
+				ThreadPool::Cancel(search);
+		}
+	}
 };
 
 MODULE_INIT(OSLogSearch)
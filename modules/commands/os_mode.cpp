@@ -37,7 +37,7 @@ class CommandOSMode : public Command
 
 			const Channel::ModeList chmodes = c->GetModes();
 			for (Channel::ModeList::const_iterator it = chmodes.begin(), it_end = chmodes.end(); it != it_end && c; ++it)
-				c->RemoveMode(c->ci->WhoSends(), it->first, it->second, false);
+				c->RemoveMode(c->ci->WhoSends(), ModeManager::GetModeName(it->first), it->second, false);
 
 			if (!c)
 			{
@@ -56,6 +56,19 @@ static int stats_count_servers(Server *s)
 	return count;
 }
 
+struct EventTime
+{
+	Module *module;
+	unsigned event;
+	const EventHistogram *histogram;
+
+	bool operator<(const EventTime &other) const
+	{
+		/* Most time spent first */
+		return histogram->total > other.histogram->total;
+	}
+};
+
 class CommandOSStats : public Command
 {
 	ServiceReference<XLineManager> akills, snlines, sqlines;
@@ -128,6 +141,8 @@ class CommandOSStats : public Command
 	void DoStatsReset(CommandSource &source)
 	{
 		MaxUserCount = UserListByNick.size();
+		EventProfiler::Reset();
+		LagMonitor::Reset();
 		source.Reply(_("Statistics reset."));
 		return;
 	}
@@ -196,12 +211,119 @@ class CommandOSStats : public Command
 		}
 	}
 
+	void DoStatsLog(CommandSource &source)
+	{
+		LogFile::Stats stats = LogFile::GetStats();
+
+		source.Reply(_("Log lines: %lu queued, %lu written in %lu batches, %lu dropped"), stats.queued, stats.written, stats.batches, stats.dropped);
+		source.Reply(_("Log queue: %lu kB pending, %lu kB at most, waited for room %lu times"), static_cast<unsigned long>(stats.pending / 1024), static_cast<unsigned long>(stats.peak / 1024), stats.waits);
+	}
+
+	void DoStatsThreads(CommandSource &source)
+	{
+		ThreadPool::Stats stats = ThreadPool::GetStats();
+
+		source.Reply(_("Thread pool: %u threads, %u busy, %u tasks waiting, %lu tasks run"), stats.workers, stats.active, stats.pending, stats.completed);
+		if (stats.completed)
+			source.Reply(_("Task latency: %llu ms average wait, %llu ms longest wait, %llu ms average run time"), stats.wait_total / stats.completed / 1000, stats.wait_max / 1000, stats.run_total / stats.completed / 1000);
+	}
+
+	void DoStatsMail(CommandSource &source)
+	{
+		Mail::Stats stats = Mail::GetStats();
+
+		source.Reply(_("Mail: %lu queued, %lu delivered, %lu given up on, %lu attempts deferred"), stats.queued, stats.sent, stats.failed, stats.deferred);
+		source.Reply(_("Mail spool: %u messages, %u waiting to be retried"), stats.spooled, stats.waiting);
+		if (stats.batches)
+			source.Reply(_("SMTP: %lu connections, %lu batches delivered"), stats.connections, stats.batches);
+	}
+
+	void DoStatsEvents(CommandSource &source)
+	{
+		std::vector<EventTime> times;
+		for (std::list<Module *>::iterator it = ModuleManager::Modules.begin(), it_end = ModuleManager::Modules.end(); it != it_end; ++it)
+		{
+			Module *m = *it;
+			if (m->event_histograms == NULL)
+				continue;
+
+			for (unsigned i = 0; i < I_SIZE; ++i)
+				if (m->event_histograms[i] != NULL)
+				{
+					EventTime t = { m, i, m->event_histograms[i] };
+					times.push_back(t);
+				}
+		}
+
+		if (!EventProfiler::enabled && times.empty())
+		{
+			source.Reply(_("Event profiling is disabled."));
+			return;
+		}
+
+		std::sort(times.begin(), times.end());
+		unsigned shown = std::min(times.size(), static_cast<size_t>(20));
+		source.Reply(_("Event handlers which took the most time (%u of %u):"), shown, static_cast<unsigned>(times.size()));
+		for (unsigned i = 0; i < shown; ++i)
+		{
+			const EventHistogram *h = times[i].histogram;
+			source.Reply(_("%s in %s: %lu calls, %.0f us total, %.1f us average, %.1f us at the 99th percentile, %.1f us at most"),
+				EventProfiler::GetEventName(times[i].event).c_str(), times[i].module->name.c_str(), h->count,
+				EventProfiler::ToMicroseconds(h->total), EventProfiler::ToMicroseconds(h->total) / h->count,
+				EventProfiler::ToMicroseconds(h->Percentile(99)), EventProfiler::ToMicroseconds(h->max));
+		}
+	}
+
+	void DoStatsLag(CommandSource &source)
+	{
+		const LagMonitor::Stats &stats = LagMonitor::GetStats();
+
+		if (stats.passes.count)
+		{
+			source.Reply(_("Main loop: %lu passes, busy for %.1f ms at the median, %.1f ms at the 99th percentile, %.1f ms at most"), stats.passes.count,
+				EventProfiler::ToMicroseconds(stats.passes.Percentile(50)) / 1000, EventProfiler::ToMicroseconds(stats.passes.Percentile(99)) / 1000, EventProfiler::ToMicroseconds(stats.passes.max) / 1000);
+			if (Config->SlowLoop)
+				source.Reply(_("Passes busy for at least %u ms: %lu"), Config->SlowLoop, stats.slow);
+		}
+
+		if (stats.slowest)
+		{
+			static const char *const step_names[] = { "message", "timer", "event handler" };
+
+			source.Reply(_("Slowest pass: %.1f ms (%s)"), EventProfiler::ToMicroseconds(stats.slowest) / 1000, Anope::strftime(stats.slowest_time, source.GetAccount()).c_str());
+			for (unsigned i = 0; i < LagMonitor::STEP_SIZE; ++i)
+			{
+				const LagMonitor::Step &step = stats.slowest_steps[i];
+				if (step.ticks)
+					source.Reply(_("  Slowest %s: %s, %.1f ms"), step_names[i], step.what.c_str(), EventProfiler::ToMicroseconds(step.ticks) / 1000);
+			}
+		}
+
+		if (stats.pings.count)
+			source.Reply(_("Uplink round trip: %.1f ms last, %.1f ms at the median, %.1f ms at most, %lu of %lu PINGs answered"),
+				EventProfiler::ToMicroseconds(stats.last_ping) / 1000, EventProfiler::ToMicroseconds(stats.pings.Percentile(50)) / 1000,
+				EventProfiler::ToMicroseconds(stats.pings.max) / 1000, stats.pings.count, stats.pings_sent);
+		else if (stats.pings_sent)
+			source.Reply(_("Uplink round trip: none of %lu PINGs answered"), stats.pings_sent);
+	}
+
+	void DoStatsMemory(CommandSource &source)
+	{
+		Anope::pooled_string::Stats stats = Anope::pooled_string::GetStats();
+
+		source.Reply(_("String pool: %lu distinct values shared by %lu references"), static_cast<unsigned long>(stats.values), static_cast<unsigned long>(stats.refs));
+		source.Reply(_("String pool memory: %lu kB, %lu kB without pooling"), static_cast<unsigned long>(stats.pooled_bytes / 1024), static_cast<unsigned long>(stats.unpooled_bytes / 1024));
+		if (stats.unpooled_bytes > stats.pooled_bytes)
+			source.Reply(_("String pool savings: %lu kB (%lu%%)"), static_cast<unsigned long>((stats.unpooled_bytes - stats.pooled_bytes) / 1024),
+				static_cast<unsigned long>((stats.unpooled_bytes - stats.pooled_bytes) * 100 / stats.unpooled_bytes));
+	}
+
  public:
 	CommandOSStats(Module *creator) : Command(creator, "operserv/stats", 0, 1),
 		akills("XLineManager", "xlinemanager/sgline"), snlines("XLineManager", "xlinemanager/snline"), sqlines("XLineManager", "xlinemanager/sqline")
 	{
 		this->SetDesc(_("Show status of Services and network"));
-		this->SetSyntax("[AKILL | HASH | UPLINK | UPTIME | ALL | RESET]");
+		this->SetSyntax("[AKILL | EVENTS | HASH | LAG | LOG | MAIL | MEMORY | THREADS | UPLINK | UPTIME | ALL | RESET]");
 	}
 
 	void Execute(CommandSource &source, const std::vector<Anope::string> &params) anope_override
@@ -216,16 +338,40 @@ class CommandOSStats : public Command
 		if (extra.equals_ci("ALL") || extra.equals_ci("AKILL"))
 			this->DoStatsAkill(source);
 
+		if (extra.equals_ci("ALL") || extra.equals_ci("EVENTS"))
+			this->DoStatsEvents(source);
+
 		if (extra.equals_ci("ALL") || extra.equals_ci("HASH"))
 			this->DoStatsHash(source);
 
+		if (extra.equals_ci("ALL") || extra.equals_ci("LAG"))
+			this->DoStatsLag(source);
+
+		if (extra.equals_ci("ALL") || extra.equals_ci("LOG"))
+			this->DoStatsLog(source);
+
+		if (extra.equals_ci("ALL") || extra.equals_ci("MAIL"))
+			this->DoStatsMail(source);
+
+		if (extra.equals_ci("ALL") || extra.equals_ci("MEMORY"))
+			this->DoStatsMemory(source);
+
+		if (extra.equals_ci("ALL") || extra.equals_ci("THREADS"))
+			this->DoStatsThreads(source);
+
 		if (extra.equals_ci("ALL") || extra.equals_ci("UPLINK"))
 			this->DoStatsUplink(source);
 
 		if (extra.empty() || extra.equals_ci("ALL") || extra.equals_ci("UPTIME"))
 			this->DoStatsUptime(source);
 
-		if (!extra.empty() && !extra.equals_ci("ALL") && !extra.equals_ci("AKILL") && !extra.equals_ci("HASH") && !extra.equals_ci("UPLINK") && !extra.equals_ci("UPTIME"))
+		bool handled = false;
+		if (!extra.empty())
+		{
+			FOREACH_MOD(OnStats, (source, extra, handled));
+		}
+
+		if (!handled && !extra.empty() && !extra.equals_ci("ALL") && !extra.equals_ci("AKILL") && !extra.equals_ci("EVENTS") && !extra.equals_ci("HASH") && !extra.equals_ci("LAG") && !extra.equals_ci("LOG") && !extra.equals_ci("MAIL") && !extra.equals_ci("MEMORY") && !extra.equals_ci("THREADS") && !extra.equals_ci("UPLINK") && !extra.equals_ci("UPTIME"))
 			source.Reply(_("Unknown STATS option: \002%s\002"), extra.c_str());
 	}
 
@@ -241,13 +387,37 @@ class CommandOSStats : public Command
 				"AKILL list and the current default expiry time.\n"
 				" \n"
 				"The \002RESET\002 option currently resets the maximum user count\n"
-				"to the number of users currently present on the network.\n"
+				"to the number of users currently present on the network, and\n"
+				"forgets the event handler times shown by \002EVENTS\002 and\n"
+				"the main loop and uplink times shown by \002LAG\002.\n"
 				" \n"
 				"The \002UPLINK\002 option displays information about the current\n"
 				"server Anope uses as an uplink to the network.\n"
 				" \n"
+				"The \002EVENTS\002 option displays which modules' event handlers\n"
+				"have taken the most time, if event profiling is enabled.\n"
+				" \n"
 				"The \002HASH\002 option displays information about the hash maps.\n"
 				" \n"
+				"The \002LAG\002 option displays how long each pass of the main\n"
+				"loop keeps Services busy, what was running during the slowest\n"
+				"one, and how long the uplink takes to answer a PING.\n"
+				" \n"
+				"The \002LOG\002 option displays how many lines have been written\n"
+				"to the log files, and how far behind the log writer is.\n"
+				" \n"
+				"The \002MAIL\002 option displays how much e-mail has been sent,\n"
+				"and how much is waiting in the spool to be delivered.\n"
+				" \n"
+				"The \002MEMORY\002 option displays how much memory is saved by\n"
+				"sharing repeated hostnames, idents and other strings.\n"
+				" \n"
+				"The \002THREADS\002 option displays how busy the thread pool is,\n"
+				"and how long its tasks wait and take to run.\n"
+				" \n"
+				"Other options may be provided by modules, such as \002DNSBL\002\n"
+				"for the blacklist cache of m_dnsbl.\n"
+				" \n"
 				"The \002ALL\002 option displays all of the above statistics."));
 		return true;
 	}
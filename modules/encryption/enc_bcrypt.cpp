@@ -840,8 +840,26 @@ char *_crypt_gensalt_blowfish_rn(const char *prefix, unsigned long count,
 #include "module.h"
 #include "modules/encryption.h"
 
+/* Checks a password against a bcrypt hash on the thread pool */
+class BCryptCheck : public Task
+{
+	/* The request may be deleted while it is being checked if the module
+	 * which made it is unloaded, so it is looked up again by id when done */
+	unsigned long long req_id;
+	Anope::string password, pass;
+	bool matched;
+
+ public:
+	BCryptCheck(Module *o, IdentifyRequest *r, const Anope::string &p) : Task(o), req_id(r->GetId()), password(r->GetPassword()), pass(p), matched(false) { }
+
+	void Run() anope_override;
+	void OnComplete() anope_override;
+};
+
 class EBCRYPT : public Module
 {
+	friend class BCryptCheck;
+
 	unsigned int rounds;
 
 	Anope::string Salt()
@@ -856,14 +874,14 @@ class EBCRYPT : public Module
 		return salt;
 	}
 
-	Anope::string Generate(const Anope::string& data, const Anope::string& salt)
+	static Anope::string Generate(const Anope::string& data, const Anope::string& salt)
 	{
 		char hash[64];
 		_crypt_blowfish_rn(data.c_str(), salt.c_str(), hash, sizeof(hash));
 		return hash;
 	}
 
-	bool Compare(const Anope::string& string, const Anope::string& hash)
+	static bool Compare(const Anope::string& string, const Anope::string& hash)
 	{
 		Anope::string ret = Generate(string, hash);
 		if (ret.empty())
@@ -907,30 +925,40 @@ class EBCRYPT : public Module
 		if (hash_method != "bcrypt")
 			return;
 
-		if (Compare(req->GetPassword(), nc->pass.substr(7)))
+		/* Hashing is slow on purpose, so do it on the thread pool */
+		req->Hold(this);
+		ThreadPool::Queue(new BCryptCheck(this, req, nc->pass));
+	}
+
+	void OnCheckDone(IdentifyRequest *req, const Anope::string &pass)
+	{
+		/* The password may have been changed while it was being checked */
+		const NickAlias *na = NickAlias::Find(req->GetAccount());
+		if (na == NULL || na->nc->pass != pass)
+			return;
+		NickCore *nc = na->nc;
+
+		/* if we are NOT the first module in the list,
+		 * we want to re-encrypt the pass with the new encryption
+		 */
+
+		unsigned int hashrounds = 0;
+		try
 		{
-			/* if we are NOT the first module in the list,
-			 * we want to re-encrypt the pass with the new encryption
-			 */
-
-			unsigned int hashrounds = 0;
-			try
-			{
-				size_t roundspos = nc->pass.find('$', 11);
-				if (roundspos == Anope::string::npos)
-					throw ConvertException("Could not find hashrounds");
-
-				hashrounds = convertTo<unsigned int>(nc->pass.substr(11, roundspos - 11));
-			}
-			catch (const ConvertException &)
-			{
-				Log(this) << "Could not get the round size of a hash. This is probably a bug. Hash: " << nc->pass;
-			}
+			size_t roundspos = nc->pass.find('$', 11);
+			if (roundspos == Anope::string::npos)
+				throw ConvertException("Could not find hashrounds");
 
-			if (ModuleManager::FindFirstOf(ENCRYPTION) != this || (hashrounds && hashrounds != rounds))
-				Anope::Encrypt(req->GetPassword(), nc->pass);
-			req->Success(this);
+			hashrounds = convertTo<unsigned int>(nc->pass.substr(11, roundspos - 11));
 		}
+		catch (const ConvertException &)
+		{
+			Log(this) << "Could not get the round size of a hash. This is probably a bug. Hash: " << nc->pass;
+		}
+
+		if (ModuleManager::FindFirstOf(ENCRYPTION) != this || (hashrounds && hashrounds != rounds))
+			Anope::Encrypt(req->GetPassword(), nc->pass);
+		req->Success(this);
 	}
 
 	void OnReload(Configuration::Conf *conf) anope_override
@@ -959,4 +987,20 @@ class EBCRYPT : public Module
 	}
 };
 
+void BCryptCheck::Run()
+{
+	matched = EBCRYPT::Compare(password, pass.substr(7));
+}
+
+void BCryptCheck::OnComplete()
+{
+	IdentifyRequest *req = IdentifyRequest::Find(this->req_id);
+	if (req == NULL)
+		return;
+
+	if (matched)
+		static_cast<EBCRYPT *>(owner)->OnCheckDone(req, pass);
+	req->Release(owner);
+}
+
 MODULE_INIT(EBCRYPT)
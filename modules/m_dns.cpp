@@ -12,6 +12,10 @@
 #include "module.h"
 #include "modules/dns.h"
 
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
 using namespace DNS;
 
 namespace
@@ -141,8 +145,9 @@ class Packet : public Query
 		record.ttl = (input[pos] << 24) | (input[pos + 1] << 16) | (input[pos + 2] << 8) | input[pos + 3];
 		pos += 4;
 
-		//record.rdlength = input[pos] << 8 | input[pos + 1];
+		unsigned short rdlength = input[pos] << 8 | input[pos + 1];
 		pos += 2;
+		unsigned short rdata_end = pos + rdlength;
 
 		switch (record.type)
 		{
@@ -191,7 +196,28 @@ class Packet : public Query
 
 				break;
 			}
+			case QUERY_SOA:
+			{
+				/* Kept in zone file order, the minimum field is needed for negative caching */
+				Anope::string mname = this->UnpackName(input, input_size, pos);
+				Anope::string rname = this->UnpackName(input, input_size, pos);
+
+				if (pos + 20 > input_size)
+					throw SocketException("Unable to unpack SOA record");
+
+				record.rdata = mname + " " + rname;
+				for (int j = 0; j < 5; ++j, pos += 4)
+				{
+					uint32_t field = (static_cast<uint32_t>(input[pos]) << 24) | (input[pos + 1] << 16) | (input[pos + 2] << 8) | input[pos + 3];
+					record.rdata += " " + stringify(field);
+				}
+				break;
+			}
 			default:
+				/* Skip over data we do not understand, so the records after it can still be read */
+				if (rdata_end > input_size)
+					throw SocketException("Unable to unpack resource record");
+				pos = rdata_end;
 				break;
 		}
 
@@ -212,6 +238,8 @@ class Packet : public Query
 	unsigned short id;
 	/* Flags on the packet */
 	unsigned short flags;
+	/* If set, these bytes are sent instead of packing the packet */
+	std::vector<unsigned char> wire;
 
 	Packet(Manager *m, sockaddrs *a) : manager(m), id(0), flags(0)
 	{
@@ -266,8 +294,24 @@ class Packet : public Query
 		}
 	}
 
-	unsigned short Pack(unsigned char *output, unsigned short output_size)
+	/** Pack the packet into wire format
+	 * @param output The buffer to pack into
+	 * @param output_size The size of output
+	 * @param answer_offsets If not NULL, the offset of each answer record is stored
+	 *  here, followed by the offset of the end of the answer section
+	 * @return The number of bytes used
+	 */
+	unsigned short Pack(unsigned char *output, unsigned short output_size, std::vector<unsigned short> *answer_offsets = NULL)
 	{
+		if (!this->wire.empty())
+		{
+			if (this->wire.size() > output_size)
+				throw SocketException("Unable to pack packet");
+
+			memcpy(output, &this->wire[0], this->wire.size());
+			return this->wire.size();
+		}
+
 		if (output_size < HEADER_LENGTH)
 			throw SocketException("Unable to pack packet");
 
@@ -323,11 +367,18 @@ class Packet : public Query
 			pos += 2;
 		}
 
-		std::vector<ResourceRecord> types[] = { this->answers, this->authorities, this->additional };
+		const std::vector<ResourceRecord> *types[] = { &this->answers, &this->authorities, &this->additional };
 		for (int i = 0; i < 3; ++i)
-			for (unsigned j = 0; j < types[i].size(); ++j)
+		{
+			if (i == 1 && answer_offsets)
+				answer_offsets->push_back(pos);
+
+			for (unsigned j = 0; j < types[i]->size(); ++j)
 			{
-				ResourceRecord &rr = types[i][j];
+				const ResourceRecord &rr = (*types[i])[j];
+
+				if (i == 0 && answer_offsets)
+					answer_offsets->push_back(pos);
 
 				this->PackName(output, output_size, pos, rr.name);
 
@@ -443,6 +494,7 @@ class Packet : public Query
 						break;
 				}
 			}
+		}
 
 		return pos;
 	}
@@ -645,61 +697,337 @@ class NotifySocket : public Socket
 	}
 };
 
+/* Sends queries to the upstream nameservers from a random local port, and reads their answers */
+class QuerySocket : public UDPSocket
+{
+ public:
+	/* Position in the manager's socket pool, which forms the high bits of the keys of queries sent from here */
+	unsigned index;
+
+	QuerySocket(Manager *m, bool v6, unsigned i) : Socket(-1, v6, SOCK_DGRAM), UDPSocket(m, v6 ? "::" : "", 0), index(i) { }
+};
+
+class MyManager;
+
+/* Repeats a query over TCP when its answer did not fit in a UDP packet */
+class TCPQuerySocket : public ConnectionSocket
+{
+	MyManager *manager;
+	Packet *packet;
+	std::vector<unsigned char> buffer;
+
+ public:
+	/* Key of the query this belongs to, 0 once it is no longer wanted */
+	unsigned long key;
+
+	TCPQuerySocket(MyManager *m, unsigned long k, Packet *p) : Socket(-1, p->addr.ipv6()), ConnectionSocket(), manager(m), packet(p), key(k)
+	{
+		Log(LOG_DEBUG_2) << "Resolver: Retrying query over TCP to " << p->addr.addr();
+
+		this->Connect(p->addr.addr(), p->addr.port());
+		if (!this->flags[SF_CONNECTING] && !this->flags[SF_CONNECTED])
+		{
+			delete this->packet;
+			throw SocketException("Unable to connect to " + p->addr.addr());
+		}
+	}
+
+	~TCPQuerySocket();
+
+	void OnConnect() anope_override
+	{
+		unsigned char buf[524];
+		try
+		{
+			unsigned short len = this->packet->Pack(buf + 2, sizeof(buf) - 2);
+			buf[0] = len >> 8;
+			buf[1] = len & 0xFF;
+			send(this->GetFD(), reinterpret_cast<char *>(buf), len + 2, 0);
+		}
+		catch (const SocketException &ex)
+		{
+			Log(LOG_DEBUG_2) << "Resolver: " << ex.GetReason();
+		}
+
+		SocketEngine::Change(this, false, SF_WRITABLE);
+	}
+
+	void OnError(const Anope::string &error) anope_override
+	{
+		Log(LOG_DEBUG_2) << "Resolver: TCP query to " << this->packet->addr.addr() << " failed: " << error;
+	}
+
+	bool ProcessRead() anope_override;
+};
+
+/* Asks another upstream when the ones asked so far are taking too long */
+class HedgeTimer : public Timer
+{
+	MyManager *manager;
+	Request *request;
+
+ public:
+	HedgeTimer(Module *creator, MyManager *m, Request *r, long delay) : Timer(creator, delay), manager(m), request(r) { }
+
+	void Tick(time_t) anope_override;
+};
+
+/** Refreshes a popular cache entry shortly before it expires. Nothing
+ * is done with the answer here, it is cached when it arrives.
+ */
+class PrefetchRequest : public Request
+{
+ public:
+	PrefetchRequest(Manager *mgr, Module *c, const Question &q) : Request(mgr, c, q.name, q.type) { }
+
+	void OnLookupComplete(const Query *r) anope_override { }
+};
+
 class MyManager : public Manager, public Timer
 {
+ public:
+	/* An upstream nameserver queries are sent to */
+	struct Upstream
+	{
+		sockaddrs addr;
+		/* Smoothed round trip time in microseconds, 0 until the first answer */
+		long srtt;
+		/* Queries waiting for an answer */
+		unsigned inflight;
+		unsigned long sent, answered, failed;
+
+		Upstream() : srtt(0), inflight(0), sent(0), answered(0), failed(0) { }
+	};
+ private:
 	uint32_t serial;
 
-	typedef TR1NS::unordered_map<Question, Query, Question::hash> cache_map;
+	/* Negative answers are not cached for longer than this, as RFC 2308 suggests */
+	static const time_t MAX_NEGATIVE_TTL = 10800;
+	/* Entries used at least this many times are refreshed before they expire */
+	static const unsigned PREFETCH_HITS = 3;
+
+	/* A cached answer, or a cached negative answer if query.error is set */
+	struct CacheEntry
+	{
+		Query query;
+		time_t created, expires;
+		/* Position in lru */
+		std::list<Question>::iterator lru;
+		/* Matched against the expiry heap to find stale heap entries */
+		unsigned long seq;
+		/* Approximate number of bytes used by this entry */
+		size_t size;
+		/* Number of times this entry has been used */
+		unsigned hits;
+		bool prefetching;
+
+		CacheEntry() : created(0), expires(0), seq(0), size(0), hits(0), prefetching(false) { }
+	};
+
+	struct Expiry
+	{
+		time_t expires;
+		unsigned long seq;
+		Question question;
+
+		/* Orders the heap so the entry expiring first is at the top */
+		bool operator<(const Expiry &other) const { return this->expires > other.expires; }
+	};
+
+	typedef TR1NS::unordered_map<Question, CacheEntry, Question::hash> cache_map;
 	cache_map cache;
+	/* Cached questions, most recently used first */
+	std::list<Question> lru;
+	/* Min-heap of expiry times. Entries replaced or evicted early are left behind and skipped */
+	std::vector<Expiry> expiry;
+	unsigned long cache_seq;
+	size_t cache_bytes;
 
 	TCPSocket *tcpsock;
 	UDPSocket *udpsock;
 
 	bool listen;
-	sockaddrs addrs;
+
+	std::vector<Upstream> upstreams;
+
+	/* Sockets queries are sent from */
+	std::vector<QuerySocket *> query_sockets;
+
+	/* A query sent to an upstream */
+	struct Attempt
+	{
+		Request *request;
+		unsigned upstream;
+		struct timeval sent;
+		/* Set while the query is being repeated over TCP */
+		TCPQuerySocket *tcp;
+
+		Attempt() : request(NULL), upstream(0), tcp(NULL) { }
+	};
+	/* Queries keyed by the index of the socket they were sent from and their id */
+	typedef TR1NS::unordered_map<unsigned long, Attempt> attempt_map;
+	attempt_map attempts;
+
+	/* A request being looked up */
+	struct Pending
+	{
+		/* Keys of the queries sent for this request */
+		std::vector<unsigned long> attempts;
+		/* Upstreams asked so far */
+		std::vector<unsigned> tried;
+		HedgeTimer *hedge;
+
+		Pending() : hedge(NULL) { }
+	};
+	typedef TR1NS::unordered_map<Request *, Pending> pending_map;
+	pending_map requests;
+
+	/* An answer to a question asked of us, packed once and sent many times */
+	struct CompiledAnswer
+	{
+		std::vector<unsigned char> wire;
+		/* Offset of each answer record in wire, followed by the end of the answer section */
+		std::vector<unsigned short> offsets;
+		/* Rotates the order of the answers for round robin */
+		unsigned rotation;
+		/* Position in answers_lru */
+		std::list<Question>::iterator lru;
+
+		CompiledAnswer() : rotation(0) { }
+	};
+	/* Keyed by the question with its name lower cased, so askers which randomise
+	 * the case of names share one answer
+	 */
+	typedef TR1NS::unordered_map<Question, CompiledAnswer, Question::hash> answer_map;
+	answer_map answers;
+	/* Questions with compiled answers, most recently used first */
+	std::list<Question> answers_lru;
+	/* Most distinct questions to keep compiled answers for */
+	static const unsigned MAX_COMPILED_ANSWERS = 4096;
+
+	/* The most recent round trip times in microseconds, for the latency percentiles */
+	static const unsigned LATENCY_SAMPLES = 1024;
+	std::vector<long> latency;
+	unsigned latency_pos;
 
 	std::vector<std::pair<Anope::string, short> > notify;
  public:
-	std::map<unsigned short, Request *> requests;
+	/* Number of upstreams each request is sent to at once */
+	unsigned race;
+	/* Seconds to wait for an answer before also asking the next upstream, 0 to not do this */
+	time_t hedge_delay;
+
+	/* Maximum number of bytes the cache may use */
+	size_t cache_max;
+
+	/* Questions asked of us which were answered from a compiled answer, and which had to be answered by the modules */
+	unsigned long compiled_hits, compiled_misses;
+
+	struct CacheStats
+	{
+		unsigned long hits, negative_hits, misses, evictions, expirations, prefetches;
+
+		CacheStats() : hits(0), negative_hits(0), misses(0), evictions(0), expirations(0), prefetches(0) { }
+	} cache_stats;
 
-	MyManager(Module *creator) : Manager(creator), Timer(300, Anope::CurTime, true), serial(Anope::CurTime), tcpsock(NULL), udpsock(NULL),
-		listen(false), cur_id(rand())
+	MyManager(Module *creator) : Manager(creator), Timer(30, Anope::CurTime, true), serial(Anope::CurTime), cache_seq(0), cache_bytes(0),
+		tcpsock(NULL), udpsock(NULL), listen(false), latency_pos(0), race(1), hedge_delay(0), cache_max(0), compiled_hits(0), compiled_misses(0)
 	{
 	}
 
 	~MyManager()
 	{
+		this->CancelRequests(NULL, ERROR_UNKNOWN);
+
 		delete udpsock;
 		delete tcpsock;
 
-		for (std::map<unsigned short, Request *>::iterator it = this->requests.begin(), it_end = this->requests.end(); it != it_end;)
+		for (unsigned i = 0; i < this->query_sockets.size(); ++i)
+			delete this->query_sockets[i];
+
+		this->ClearCache();
+	}
+
+	/** Fail requests
+	 * @param m The module whose requests should be failed, or NULL for all requests
+	 * @param error The error to give them
+	 */
+	void CancelRequests(Module *m, Error error)
+	{
+		std::vector<Request *> cancel;
+		for (pending_map::iterator it = this->requests.begin(), it_end = this->requests.end(); it != it_end; ++it)
+			if (m == NULL || it->first->creator == m)
+				cancel.push_back(it->first);
+
+		for (unsigned i = 0; i < cancel.size(); ++i)
 		{
-			Request *request = it->second;
-			++it;
+			Request *request = cancel[i];
 
 			Query rr(*request);
-			rr.error = ERROR_UNKNOWN;
+			rr.error = error;
 			request->OnError(&rr);
 
 			delete request;
 		}
-		this->requests.clear();
+	}
 
-		this->cache.clear();
+	/** Set the upstream nameservers
+	 * @param servers The addresses of the nameservers
+	 * @param sockets How many sockets to send queries from for each address family
+	 */
+	void SetUpstreams(const std::vector<sockaddrs> &servers, unsigned sockets)
+	{
+		/* Queries in flight refer to the old upstreams and sockets */
+		this->CancelRequests(NULL, ERROR_UNKNOWN);
+
+		for (unsigned i = 0; i < this->query_sockets.size(); ++i)
+			delete this->query_sockets[i];
+		this->query_sockets.clear();
+		this->upstreams.clear();
+
+		bool v4 = false, v6 = false;
+		for (unsigned i = 0; i < servers.size(); ++i)
+		{
+			Upstream u;
+			u.addr = servers[i];
+			this->upstreams.push_back(u);
+
+			if (u.addr.ipv6())
+				v6 = true;
+			else
+				v4 = true;
+		}
+
+		for (unsigned i = 0; i < sockets * 2; ++i)
+		{
+			bool v6sock = i >= sockets;
+			if (v6sock ? !v6 : !v4)
+				continue;
+
+			try
+			{
+				this->query_sockets.push_back(new QuerySocket(this, v6sock, this->query_sockets.size()));
+			}
+			catch (const SocketException &ex)
+			{
+				Log() << "Resolver: Unable to create query socket: " << ex.GetReason();
+			}
+		}
 	}
 
-	void SetIPPort(const Anope::string &nameserver, const Anope::string &ip, unsigned short port, std::vector<std::pair<Anope::string, short> > n)
+	void SetIPPort(const Anope::string &ip, unsigned short port, std::vector<std::pair<Anope::string, short> > n)
 	{
 		delete udpsock;
 		delete tcpsock;
 
 		udpsock = NULL;
 		tcpsock = NULL;
+		listen = false;
+		/* The configuration the answers were built with may have changed */
+		this->ClearAnswers();
 
 		try
 		{
-			this->addrs.pton(nameserver.find(':') != Anope::string::npos ? AF_INET6 : AF_INET, nameserver, 53);
-
 			udpsock = new UDPSocket(this, ip, port);
 
 			if (!ip.empty())
@@ -718,18 +1046,226 @@ class MyManager : public Manager, public Timer
 	}
 
  private:
-	unsigned short cur_id;
+	static long Elapsed(const struct timeval &since)
+	{
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		return (now.tv_sec - since.tv_sec) * 1000000 + (now.tv_usec - since.tv_usec);
+	}
+
+	/* The upstream to ask next for a request, or -1 if all of them were asked */
+	int ChooseUpstream(const Pending &pending) const
+	{
+		int best = -1;
+		long best_score = 0;
+
+		for (unsigned i = 0; i < this->upstreams.size(); ++i)
+		{
+			if (std::find(pending.tried.begin(), pending.tried.end(), i) != pending.tried.end())
+				continue;
+
+			/* Prefer fast upstreams, but spread the load over those which are equally fast.
+			 * Upstreams with no answers yet score best, so every one of them gets measured.
+			 */
+			const Upstream &u = this->upstreams[i];
+			long score = (u.srtt ? u.srtt : 1) * (1 + u.inflight);
+			if (best == -1 || score < best_score)
+			{
+				best = i;
+				best_score = score;
+			}
+		}
 
-	unsigned short GetID()
+		return best;
+	}
+
+	/** Send a request to the next upstream
+	 * @return false if there is no upstream left to ask
+	 */
+	bool Send(Request *req, Pending &pending)
 	{
-		if (this->udpsock->GetPackets().size() == 65535)
+		int u = this->ChooseUpstream(pending);
+		if (u == -1)
+			return false;
+		Upstream &upstream = this->upstreams[u];
+
+		std::vector<QuerySocket *> candidates;
+		for (unsigned i = 0; i < this->query_sockets.size(); ++i)
+			if (this->query_sockets[i]->IsIPv6() == upstream.addr.ipv6())
+				candidates.push_back(this->query_sockets[i]);
+		if (candidates.empty())
+			return false;
+
+		if (this->attempts.size() >= this->query_sockets.size() * 32768)
 			throw SocketException("DNS queue full");
 
+		/* A random socket and id, so answers are hard to forge */
+		QuerySocket *sock = candidates[rand() % candidates.size()];
+		unsigned short id;
+		unsigned long key;
 		do
-			cur_id = (cur_id + 1) & 0xFFFF;
-		while (!cur_id || this->requests.count(cur_id));
+		{
+			id = rand() & 0xFFFF;
+			key = static_cast<unsigned long>(sock->index) << 16 | id;
+		}
+		while (!id || this->attempts.count(key));
+
+		Attempt &a = this->attempts[key];
+		a.request = req;
+		a.upstream = u;
+		gettimeofday(&a.sent, NULL);
+
+		pending.attempts.push_back(key);
+		pending.tried.push_back(u);
+		++upstream.inflight;
+		++upstream.sent;
+		req->id = id;
+
+		Packet *p = new Packet(this, &upstream.addr);
+		p->flags = QUERYFLAGS_RD;
+		p->id = id;
+		p->questions.push_back(*req);
+
+		sock->Reply(p);
+		return true;
+	}
+
+	/* Forget about a query, penalizing its upstream if it never answered */
+	void DropAttempt(unsigned long key, bool timedout)
+	{
+		attempt_map::iterator it = this->attempts.find(key);
+		if (it == this->attempts.end())
+			return;
+
+		Attempt &a = it->second;
+		Upstream &upstream = this->upstreams[a.upstream];
+		--upstream.inflight;
+
+		if (timedout)
+		{
+			long limit = timeout * 1000000;
+			++upstream.failed;
+			upstream.srtt = upstream.srtt && upstream.srtt * 2 < limit ? upstream.srtt * 2 : limit;
+		}
+
+		if (a.tcp)
+		{
+			a.tcp->key = 0;
+			delete a.tcp;
+		}
 
-		return cur_id;
+		this->attempts.erase(it);
+	}
+
+	/** Keep the packed form of an answer so the same question can be answered without asking the modules
+	 * @param question The packet the question was asked in
+	 * @param packet The answer
+	 */
+	void Compile(const Packet &question, Packet *packet)
+	{
+		CompiledAnswer compiled;
+		unsigned char buffer[512];
+
+		try
+		{
+			compiled.wire.assign(buffer, buffer + packet->Pack(buffer, sizeof(buffer), &compiled.offsets));
+		}
+		catch (const SocketException &)
+		{
+			/* Too big for UDP, keep answering it the slow way */
+			return;
+		}
+
+		Question key = question.questions[0];
+		key.name = key.name.lower();
+
+		answer_map::iterator it = this->answers.find(key);
+		if (it != this->answers.end())
+		{
+			this->answers_lru.erase(it->second.lru);
+			this->answers.erase(it);
+		}
+		else if (this->answers.size() >= MAX_COMPILED_ANSWERS)
+		{
+			this->answers.erase(this->answers_lru.back());
+			this->answers_lru.pop_back();
+		}
+
+		this->answers_lru.push_front(key);
+		compiled.lru = this->answers_lru.begin();
+		CompiledAnswer &c = this->answers[key];
+		c = compiled;
+
+		/* Answer this one from the compiled answer too, so the rotation starts here */
+		this->Instantiate(c, question, packet->wire);
+	}
+
+	void ClearAnswers()
+	{
+		this->answers.clear();
+		this->answers_lru.clear();
+	}
+
+	/** Build the answer to a question from a compiled answer
+	 * @param c The compiled answer
+	 * @param question The packet the question was asked in
+	 * @param out Where to build the answer
+	 */
+	void Instantiate(CompiledAnswer &c, const Packet &question, std::vector<unsigned char> &out)
+	{
+		out = c.wire;
+
+		unsigned short flags = (question.flags & ~QUERYFLAGS_RCODE) | QUERYFLAGS_QR | QUERYFLAGS_AA | (c.wire[3] & QUERYFLAGS_RCODE);
+		out[0] = question.id >> 8;
+		out[1] = question.id & 0xFF;
+		out[2] = flags >> 8;
+		out[3] = flags & 0xFF;
+
+		/* Give the question back in the case it was asked in. The name is not compressed,
+		 * and only differs from the compiled one in case, so it fits in the same labels
+		 */
+		const Anope::string &asked = question.questions[0].name;
+		Anope::string::size_type j = 0;
+		for (unsigned short pos = 12; pos < out.size() && out[pos]; ++j)
+		{
+			unsigned char len = out[pos++];
+			for (unsigned char k = 0; k < len && pos < out.size() && j < asked.length(); ++k)
+				out[pos++] = asked[j++];
+		}
+
+		/* Round robin the answer records. Names are not compressed, so records can be moved freely */
+		unsigned count = c.offsets.size() - 1;
+		if (count > 1)
+		{
+			unsigned first = c.rotation++ % count;
+			unsigned short pos = c.offsets[0];
+			for (unsigned i = 0; i < count; ++i)
+			{
+				unsigned r = (first + i) % count;
+				std::copy(c.wire.begin() + c.offsets[r], c.wire.begin() + c.offsets[r + 1], out.begin() + pos);
+				pos += c.offsets[r + 1] - c.offsets[r];
+			}
+		}
+	}
+
+	void AddLatency(Upstream &upstream, long rtt)
+	{
+		upstream.srtt = upstream.srtt ? (upstream.srtt * 7 + rtt) / 8 : rtt;
+		++upstream.answered;
+
+		if (this->latency.size() < LATENCY_SAMPLES)
+			this->latency.push_back(rtt);
+		else
+			this->latency[this->latency_pos++ % LATENCY_SAMPLES] = rtt;
+	}
+
+	unsigned short RandomID()
+	{
+		unsigned short id;
+		do
+			id = rand() & 0xFFFF;
+		while (!id);
+		return id;
 	}
 
  public:
@@ -744,25 +1280,99 @@ class MyManager : public Manager, public Timer
 			return;
 		}
 
-		if (!this->udpsock)
+		if (this->query_sockets.empty())
 			throw SocketException("No dns socket");
 
-		req->id = GetID();
-		this->requests[req->id] = req;
+		Pending &pending = this->requests[req];
+		for (unsigned i = 0; i < std::max(this->race, 1U); ++i)
+			if (!this->Send(req, pending))
+				break;
+
+		if (pending.attempts.empty())
+		{
+			this->requests.erase(req);
+			throw SocketException("No nameserver to send the query to");
+		}
 
 		req->SetSecs(timeout);
 
-		Packet *p = new Packet(this, &this->addrs);
-		p->flags = QUERYFLAGS_RD;
-		p->id = req->id;
-		p->questions.push_back(*req);
+		if (this->hedge_delay > 0 && this->hedge_delay < timeout && pending.tried.size() < this->upstreams.size())
+			pending.hedge = new HedgeTimer(this->Service::owner, this, req, this->hedge_delay);
+	}
+
+	/** Called when a request has waited hedge_delay for an answer */
+	void Hedge(Request *req)
+	{
+		pending_map::iterator it = this->requests.find(req);
+		if (it == this->requests.end())
+			return;
+
+		/* The timer deletes itself */
+		Pending &pending = it->second;
+		pending.hedge = NULL;
 
-		this->udpsock->Reply(p);
+		try
+		{
+			if (this->Send(req, pending))
+				Log(LOG_DEBUG_2) << "Resolver: No answer for " << req->name << " yet, also asking " << this->upstreams[pending.tried.back()].addr.addr();
+		}
+		catch (const SocketException &ex)
+		{
+			Log(LOG_DEBUG_2) << "Resolver: " << ex.GetReason();
+		}
 	}
 
 	void RemoveRequest(Request *req) anope_override
 	{
-		this->requests.erase(req->id);
+		pending_map::iterator it = this->requests.find(req);
+		if (it == this->requests.end())
+			return;
+
+		Pending &pending = it->second;
+		/* Requests are only removed with queries left when they time out or are cancelled */
+		for (unsigned i = 0; i < pending.attempts.size(); ++i)
+		{
+			attempt_map::iterator ait = this->attempts.find(pending.attempts[i]);
+			if (ait != this->attempts.end())
+				this->DropAttempt(pending.attempts[i], Elapsed(ait->second.sent) >= (timeout - 1) * 1000000);
+		}
+
+		delete pending.hedge;
+		this->requests.erase(it);
+	}
+
+	/** Called by TCPQuerySocket when its answer has arrived */
+	void HandleTCPAnswer(TCPQuerySocket *sock, const unsigned char *data, int length)
+	{
+		attempt_map::iterator it = this->attempts.find(sock->key);
+		if (it == this->attempts.end())
+			return;
+
+		/* The socket goes away by itself once it returns */
+		it->second.tcp = NULL;
+		sock->key = 0;
+
+		Packet recv_packet(this, NULL);
+		try
+		{
+			recv_packet.Fill(data, length);
+		}
+		catch (const SocketException &ex)
+		{
+			Log(LOG_DEBUG_2) << ex.GetReason();
+			return;
+		}
+
+		if (recv_packet.flags & QUERYFLAGS_QR)
+			this->HandleAnswer(recv_packet, it->first, this->upstreams[it->second.upstream].addr, true);
+	}
+
+	/** Called by TCPQuerySocket when it is closed before its answer arrived */
+	void TCPClosed(unsigned long key)
+	{
+		attempt_map::iterator it = this->attempts.find(key);
+		if (it != this->attempts.end())
+			it->second.tcp = NULL;
 	}
 
 	bool HandlePacket(ReplySocket *s, const unsigned char *const packet_buffer, int length, sockaddrs *from) anope_override
@@ -784,7 +1394,7 @@ class MyManager : public Manager, public Timer
 
 		if (!(recv_packet.flags & QUERYFLAGS_QR))
 		{
-			if (!listen)
+			if (!listen || dynamic_cast<QuerySocket *>(s))
 				return true;
 			else if (recv_packet.questions.empty())
 			{
@@ -792,6 +1402,25 @@ class MyManager : public Manager, public Timer
 				return true;
 			}
 
+			/* Answers to single questions depend only on the question, so they are packed once and reused */
+			bool compile = recv_packet.questions.size() == 1 && recv_packet.questions[0].type != QUERY_AXFR && !(recv_packet.flags & QUERYFLAGS_OPCODE);
+			if (compile)
+			{
+				Question key = recv_packet.questions[0];
+				key.name = key.name.lower();
+
+				answer_map::iterator it = this->answers.find(key);
+				if (it != this->answers.end())
+				{
+					this->answers_lru.splice(this->answers_lru.begin(), this->answers_lru, it->second.lru);
+					Packet *packet = new Packet(this, from);
+					this->Instantiate(it->second, recv_packet, packet->wire);
+					++this->compiled_hits;
+					s->Reply(packet);
+					return true;
+				}
+			}
+
 			Packet *packet = new Packet(recv_packet);
 			packet->flags |= QUERYFLAGS_QR; /* This is a response */
 			packet->flags |= QUERYFLAGS_AA; /* And we are authoritative */
@@ -841,28 +1470,89 @@ class MyManager : public Manager, public Timer
 			if (packet->answers.empty() && packet->authorities.empty() && packet->additional.empty() && packet->error == ERROR_NONE)
 				packet->error = ERROR_REFUSED; // usually safe, won't cause an NXDOMAIN to get cached
 
+			++this->compiled_misses;
+			if (compile && !packet->answers.empty())
+				this->Compile(recv_packet, packet);
+
 			s->Reply(packet);
 			return true;
 		}
 
-		if (from == NULL)
+		QuerySocket *qs = dynamic_cast<QuerySocket *>(s);
+		if (qs == NULL || from == NULL)
 		{
-			Log(LOG_DEBUG_2) << "Resolver: Received an answer over TCP. This is not supported.";
+			Log(LOG_DEBUG_2) << "Resolver: Received an answer on a socket no queries are sent from";
 			return true;
 		}
-		else if (this->addrs != *from)
+
+		this->HandleAnswer(recv_packet, static_cast<unsigned long>(qs->index) << 16 | recv_packet.id, *from, false);
+		return true;
+	}
+
+ private:
+	void HandleAnswer(Packet &recv_packet, unsigned long key, const sockaddrs &from, bool tcp)
+	{
+		attempt_map::iterator it = this->attempts.find(key);
+		if (it == this->attempts.end())
 		{
-			Log(LOG_DEBUG_2) << "Resolver: Received an answer from the wrong nameserver, Bad NAT or DNS forging attempt? '" << this->addrs.addr() << "' != '" << from->addr() << "'";
-			return true;
+			Log(LOG_DEBUG_2) << "Resolver: Received an answer for something we didn't request";
+			return;
 		}
 
-		std::map<unsigned short, Request *>::iterator it = this->requests.find(recv_packet.id);
-		if (it == this->requests.end())
+		Attempt &attempt = it->second;
+		Upstream &upstream = this->upstreams[attempt.upstream];
+		if (upstream.addr != from)
 		{
-			Log(LOG_DEBUG_2) << "Resolver: Received an answer for something we didn't request";
-			return true;
+			Log(LOG_DEBUG_2) << "Resolver: Received an answer from the wrong nameserver, Bad NAT or DNS forging attempt? '" << upstream.addr.addr() << "' != '" << from.addr() << "'";
+			return;
+		}
+
+		Request *request = attempt.request;
+		Pending &pending = this->requests[request];
+
+		if ((recv_packet.flags & QUERYFLAGS_TC) && !tcp)
+		{
+			/* The answer did not fit, ask the same upstream again over TCP */
+			Packet *p = new Packet(this, &upstream.addr);
+			p->flags = QUERYFLAGS_RD;
+			p->id = recv_packet.id;
+			p->questions.push_back(*request);
+
+			try
+			{
+				attempt.tcp = new TCPQuerySocket(this, key, p);
+				return;
+			}
+			catch (const SocketException &ex)
+			{
+				Log(LOG_DEBUG_2) << "Resolver: " << ex.GetReason() << ", using the truncated answer";
+			}
+		}
+
+		unsigned short rcode = recv_packet.flags & QUERYFLAGS_RCODE;
+		if (rcode == 1 || rcode == 2 || rcode == 4 || rcode == 5)
+		{
+			/* This upstream can not answer, let another one try if there is one */
+			++upstream.failed;
+			pending.attempts.erase(std::find(pending.attempts.begin(), pending.attempts.end(), key));
+			this->DropAttempt(key, false);
+
+			try
+			{
+				if (!pending.attempts.empty() || this->Send(request, pending))
+				{
+					Log(LOG_DEBUG_2) << "Resolver: Upstream " << from.addr() << " failed to answer " << request->name << ", rcode " << rcode;
+					return;
+				}
+			}
+			catch (const SocketException &) { }
+		}
+		else
+		{
+			this->AddLatency(upstream, Elapsed(attempt.sent));
+			pending.attempts.erase(std::find(pending.attempts.begin(), pending.attempts.end(), key));
+			this->DropAttempt(key, false);
 		}
-		Request *request = it->second;
 
 		if (recv_packet.flags & QUERYFLAGS_OPCODE)
 		{
@@ -913,16 +1603,21 @@ class MyManager : public Manager, public Timer
 		{
 			Log(LOG_DEBUG_2) << "Resolver: Lookup complete for " << request->name;
 			request->OnLookupComplete(&recv_packet);
-			this->AddCache(recv_packet);
 		}
 
+		this->AddCache(*request, recv_packet);
+
 		delete request;
-		return true;
 	}
 
+ public:
+
 	void UpdateSerial() anope_override
 	{
 		serial = Anope::CurTime;
+
+		/* Whatever changed may change the answers too */
+		this->ClearAnswers();
 	}
 
 	void Notify(const Anope::string &zone) anope_override
@@ -940,15 +1635,7 @@ class MyManager : public Manager, public Timer
 
 			Packet *packet = new Packet(this, &addr);
 			packet->flags = QUERYFLAGS_AA | QUERYFLAGS_OPCODE_NOTIFY;
-			try
-			{
-				packet->id = GetID();
-			}
-			catch (const SocketException &)
-			{
-				delete packet;
-				continue;
-			}
+			packet->id = RandomID();
 
 			packet->questions.push_back(Question(zone, QUERY_SOA));
 
@@ -963,29 +1650,177 @@ class MyManager : public Manager, public Timer
 
 	void Tick(time_t now) anope_override
 	{
-		Log(LOG_DEBUG_2) << "Resolver: Purging DNS cache";
+		this->Expire(now);
+	}
+
+	const std::vector<Upstream> &GetUpstreams() const
+	{
+		return this->upstreams;
+	}
+
+	/** Get a percentile of the recent round trip times
+	 * @param pct The percentile, from 0 to 100
+	 * @return The round trip time in microseconds, or -1 if there have not been any answers
+	 */
+	long GetLatency(unsigned pct) const
+	{
+		if (this->latency.empty())
+			return -1;
+
+		std::vector<long> sorted = this->latency;
+		size_t n = std::min(sorted.size() * pct / 100, sorted.size() - 1);
+		std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+		return sorted[n];
+	}
+
+	size_t CacheSize() const
+	{
+		return this->cache.size();
+	}
+
+	size_t CacheBytes() const
+	{
+		return this->cache_bytes;
+	}
+
+	void ClearCache()
+	{
+		this->cache.clear();
+		this->lru.clear();
+		this->expiry.clear();
+		this->cache_bytes = 0;
+	}
+
+ private:
+	void EraseCache(cache_map::iterator it)
+	{
+		this->cache_bytes -= it->second.size;
+		this->lru.erase(it->second.lru);
+		this->cache.erase(it);
+	}
 
-		for (cache_map::iterator it = this->cache.begin(), it_next; it != this->cache.end(); it = it_next)
+	/** Remove expired entries from the cache
+	 * @param now The current time
+	 */
+	void Expire(time_t now)
+	{
+		while (!this->expiry.empty() && this->expiry.front().expires <= now)
 		{
-			const Query &q = it->second;
-			const ResourceRecord &req = q.answers[0];
-			it_next = it;
-			++it_next;
+			std::pop_heap(this->expiry.begin(), this->expiry.end());
+			const Expiry &e = this->expiry.back();
+
+			cache_map::iterator it = this->cache.find(e.question);
+			if (it != this->cache.end() && it->second.seq == e.seq)
+			{
+				LOG_IF(LOG_DEBUG_3) << "Resolver cache: expired " << e.question.name;
+				this->EraseCache(it);
+				++this->cache_stats.expirations;
+			}
+
+			this->expiry.pop_back();
+		}
 
-			if (req.created + static_cast<time_t>(req.ttl) < now)
-				this->cache.erase(it);
+		/* Rebuild the heap if it is mostly stale entries */
+		if (this->expiry.size() > this->cache.size() * 2 + 64)
+		{
+			this->expiry.clear();
+			for (cache_map::const_iterator it = this->cache.begin(), it_end = this->cache.end(); it != it_end; ++it)
+			{
+				Expiry e;
+				e.expires = it->second.expires;
+				e.seq = it->second.seq;
+				e.question = it->first;
+				this->expiry.push_back(e);
+			}
+			std::make_heap(this->expiry.begin(), this->expiry.end());
 		}
 	}
 
- private:
-	/** Add a record to the dns cache
-	 * @param r The record
+	/** How long an answer may be cached for
+	 * @return The time in seconds, 0 if it should not be cached
 	 */
-	void AddCache(Query &r)
+	static time_t CacheTTL(const Query &r)
 	{
-		const ResourceRecord &rr = r.answers[0];
-		Log(LOG_DEBUG_3) << "Resolver cache: added cache for " << rr.name << " -> " << rr.rdata << ", ttl: " << rr.ttl;
-		this->cache[r.questions[0]] = r;
+		if (r.error == ERROR_NONE)
+		{
+			time_t ttl = 0;
+			for (unsigned i = 0; i < r.answers.size(); ++i)
+				if (i == 0 || static_cast<time_t>(r.answers[i].ttl) < ttl)
+					ttl = r.answers[i].ttl;
+			return ttl;
+		}
+
+		if (r.error != ERROR_DOMAIN_NOT_FOUND && r.error != ERROR_NO_RECORDS)
+			return 0;
+
+		/* RFC 2308: negative answers are cached for the lesser of the SOA's TTL and its minimum field */
+		for (unsigned i = 0; i < r.authorities.size(); ++i)
+		{
+			const ResourceRecord &rr = r.authorities[i];
+			if (rr.type != QUERY_SOA)
+				continue;
+
+			size_t sp = rr.rdata.rfind(' ');
+			if (sp == Anope::string::npos)
+				return 0;
+
+			time_t minimum = convertTo<time_t>(rr.rdata.substr(sp + 1), false);
+			time_t ttl = std::min(minimum, static_cast<time_t>(rr.ttl));
+			return ttl < MAX_NEGATIVE_TTL ? ttl : MAX_NEGATIVE_TTL;
+		}
+
+		return 0;
+	}
+
+	/** Add an answer to the dns cache
+	 * @param q The question asked
+	 * @param r The answer
+	 */
+	void AddCache(const Question &q, const Query &r)
+	{
+		time_t ttl = CacheTTL(r);
+		if (ttl <= 0)
+			return;
+
+		cache_map::iterator it = this->cache.find(q);
+		if (it != this->cache.end())
+			this->EraseCache(it);
+
+		size_t size = sizeof(CacheEntry) + sizeof(Question) + 4 * sizeof(void *) + 2 * q.name.length();
+		const std::vector<ResourceRecord> *records[] = { &r.answers, &r.authorities, &r.additional };
+		for (int i = 0; i < 3; ++i)
+			for (unsigned j = 0; j < records[i]->size(); ++j)
+				size += sizeof(ResourceRecord) + (*records[i])[j].name.length() + (*records[i])[j].rdata.length();
+
+		if (size > this->cache_max)
+			return;
+
+		/* Make room by dropping the least recently used entries */
+		while (this->cache_bytes + size > this->cache_max && !this->lru.empty())
+		{
+			LOG_IF(LOG_DEBUG_3) << "Resolver cache: evicting " << this->lru.back().name;
+			this->EraseCache(this->cache.find(this->lru.back()));
+			++this->cache_stats.evictions;
+		}
+
+		CacheEntry &entry = this->cache[q];
+		entry.query = r;
+		entry.created = Anope::CurTime;
+		entry.expires = Anope::CurTime + ttl;
+		entry.seq = ++this->cache_seq;
+		entry.size = size;
+		this->lru.push_front(q);
+		entry.lru = this->lru.begin();
+		this->cache_bytes += size;
+
+		Expiry e;
+		e.expires = entry.expires;
+		e.seq = entry.seq;
+		e.question = q;
+		this->expiry.push_back(e);
+		std::push_heap(this->expiry.begin(), this->expiry.end());
+
+		LOG_IF(LOG_DEBUG_3) << "Resolver cache: added " << (r.error == ERROR_NONE ? "" : "negative ") << "cache for " << q.name << ", ttl: " << ttl;
 	}
 
 	/** Check the DNS cache to see if request can be handled by a cached result
@@ -994,19 +1829,88 @@ class MyManager : public Manager, public Timer
 	bool CheckCache(Request *request)
 	{
 		cache_map::iterator it = this->cache.find(*request);
-		if (it != this->cache.end())
+		if (it == this->cache.end() || it->second.expires <= Anope::CurTime)
 		{
-			Query &record = it->second;
-			Log(LOG_DEBUG_3) << "Resolver: Using cached result for " << request->name;
-			request->OnLookupComplete(&record);
-			return true;
+			++this->cache_stats.misses;
+			return false;
 		}
 
-		return false;
+		CacheEntry &entry = it->second;
+		this->lru.splice(this->lru.begin(), this->lru, entry.lru);
+		++entry.hits;
+
+		/* Popular entries are refreshed during the last tenth of their lifetime, so they never go missing */
+		if (!entry.prefetching && entry.hits >= PREFETCH_HITS && (entry.expires - Anope::CurTime) * 10 <= entry.expires - entry.created)
+		{
+			entry.prefetching = true;
+			this->Prefetch(it->first);
+		}
+
+		LOG_IF(LOG_DEBUG_3) << "Resolver: Using cached result for " << request->name;
+		if (entry.query.error == ERROR_NONE)
+		{
+			++this->cache_stats.hits;
+			request->OnLookupComplete(&entry.query);
+		}
+		else
+		{
+			++this->cache_stats.negative_hits;
+			request->OnError(&entry.query);
+		}
+
+		return true;
 	}
 
+	void Prefetch(const Question &q)
+	{
+		PrefetchRequest *req = NULL;
+		try
+		{
+			req = new PrefetchRequest(this, this->Service::owner, q);
+			this->Process(req);
+			++this->cache_stats.prefetches;
+			LOG_IF(LOG_DEBUG_3) << "Resolver cache: prefetching " << q.name;
+		}
+		catch (const SocketException &ex)
+		{
+			delete req;
+			Log(LOG_DEBUG_2) << "Resolver cache: unable to prefetch " << q.name << ": " << ex.GetReason();
+		}
+	}
 };
 
+TCPQuerySocket::~TCPQuerySocket()
+{
+	delete this->packet;
+	if (this->key)
+		this->manager->TCPClosed(this->key);
+}
+
+bool TCPQuerySocket::ProcessRead()
+{
+	unsigned char buf[4096];
+	int i = recv(this->GetFD(), reinterpret_cast<char *>(buf), sizeof(buf), 0);
+	if (i <= 0)
+		return false;
+
+	this->buffer.insert(this->buffer.end(), buf, buf + i);
+	if (this->buffer.size() < 2)
+		return true;
+
+	size_t want_len = this->buffer[0] << 8 | this->buffer[1];
+	if (this->buffer.size() < want_len + 2)
+		return true;
+
+	if (this->key)
+		this->manager->HandleTCPAnswer(this, &this->buffer[2], want_len);
+	return false;
+}
+
+void HedgeTimer::Tick(time_t)
+{
+	this->manager->Hedge(this->request);
+}
+
 class ModuleDNS : public Module
 {
 	MyManager manager;
@@ -1030,7 +1934,7 @@ class ModuleDNS : public Module
 			Socket *s = it->second;
 			++it;
 
-			if (dynamic_cast<NotifySocket *>(s) || dynamic_cast<TCPSocket::Client *>(s))
+			if (dynamic_cast<NotifySocket *>(s) || dynamic_cast<TCPSocket::Client *>(s) || dynamic_cast<TCPQuerySocket *>(s))
 				delete s;
 		}
 	}
@@ -1046,6 +1950,7 @@ class ModuleDNS : public Module
 		admin = block->Get<const Anope::string>("admin", "admin@example.com");
 		nameservers = block->Get<const Anope::string>("nameservers", "ns1.example.com");
 		refresh = block->Get<int>("refresh", "3600");
+		this->manager.cache_max = block->Get<size_t>("cache_size", "1024") * 1024;
 
 		for (int i = 0; i < block->CountBlock("notify"); ++i)
 		{
@@ -1056,44 +1961,53 @@ class ModuleDNS : public Module
 			notify.push_back(std::make_pair(nip, nport));
 		}
 
+		/* Either a list of nameservers, or a resolver configuration file to read them from */
+		std::vector<Anope::string> names;
 		if (Anope::IsFile(nameserver))
 		{
 			std::ifstream f(nameserver.c_str());
-			bool success = false;
 
-			if (f.is_open())
+			for (Anope::string server; std::getline(f, server.str());)
 			{
-				for (Anope::string server; std::getline(f, server.str());)
-				{
-					if (server.find("nameserver") == 0)
-					{
-						size_t i = server.find_first_of("123456789");
-						if (i != Anope::string::npos)
-						{
-							if (server.substr(i).is_pos_number_only())
-							{
-								nameserver = server.substr(i);
-								Log(LOG_DEBUG) << "Nameserver set to " << nameserver;
-								success = true;
-								break;
-							}
-						}
-					}
-				}
-
-				f.close();
+				spacesepstream sep(server);
+				Anope::string keyword, addr;
+				if (sep.GetToken(keyword) && keyword == "nameserver" && sep.GetToken(addr))
+					names.push_back(addr);
 			}
+		}
+		else
+			spacesepstream(nameserver).GetTokens(names);
 
-			if (!success)
+		std::vector<sockaddrs> servers;
+		for (unsigned i = 0; i < names.size(); ++i)
+		{
+			sockaddrs addr;
+			addr.pton(names[i].find(':') != Anope::string::npos ? AF_INET6 : AF_INET, names[i], 53);
+			if (!addr.valid())
 			{
-				Log() << "Unable to find nameserver, defaulting to 127.0.0.1";
-				nameserver = "127.0.0.1";
+				Log(this) << "Ignoring invalid nameserver " << names[i];
+				continue;
 			}
+
+			Log(LOG_DEBUG) << "Nameserver " << addr.addr() << " added";
+			servers.push_back(addr);
 		}
 
+		if (servers.empty())
+		{
+			Log() << "Unable to find nameserver, defaulting to 127.0.0.1";
+			sockaddrs addr;
+			addr.pton(AF_INET, "127.0.0.1", 53);
+			servers.push_back(addr);
+		}
+
+		this->manager.race = block->Get<unsigned>("race", "1");
+		this->manager.hedge_delay = block->Get<time_t>("hedge", "1");
+		this->manager.SetUpstreams(servers, std::max(block->Get<unsigned>("sockets", "4"), 1U));
+
 		try
 		{
-			this->manager.SetIPPort(nameserver, ip, port, notify);
+			this->manager.SetIPPort(ip, port, notify);
 		}
 		catch (const SocketException &ex)
 		{
@@ -1101,24 +2015,35 @@ class ModuleDNS : public Module
 		}
 	}
 
-	void OnModuleUnload(User *u, Module *m) anope_override
+	void OnStats(CommandSource &source, const Anope::string &what, bool &handled) anope_override
 	{
-		for (std::map<unsigned short, Request *>::iterator it = this->manager.requests.begin(), it_end = this->manager.requests.end(); it != it_end;)
-		{
-			unsigned short id = it->first;
-			Request *req = it->second;
-			++it;
+		if (!what.equals_ci("ALL") && !what.equals_ci("DNS"))
+			return;
+		handled = true;
 
-			if (req->creator == m)
-			{
-				Query rr(*req);
-				rr.error = ERROR_UNLOADED;
-				req->OnError(&rr);
+		const MyManager::CacheStats &stats = this->manager.cache_stats;
+		unsigned long lookups = stats.hits + stats.negative_hits + stats.misses;
+		source.Reply(_("DNS cache: %lu entries, %lu of %lu kB used"), static_cast<unsigned long>(this->manager.CacheSize()), static_cast<unsigned long>(this->manager.CacheBytes() / 1024), static_cast<unsigned long>(this->manager.cache_max / 1024));
+		source.Reply(_("DNS cache hits: %lu (%lu negative), misses: %lu, hit rate: %lu%%"), stats.hits + stats.negative_hits, stats.negative_hits, stats.misses, lookups ? (stats.hits + stats.negative_hits) * 100 / lookups : 0);
+		source.Reply(_("DNS cache evictions: %lu, expirations: %lu, prefetches: %lu"), stats.evictions, stats.expirations, stats.prefetches);
 
-				delete req;
-				this->manager.requests.erase(id);
-			}
+		const std::vector<MyManager::Upstream> &upstreams = this->manager.GetUpstreams();
+		for (unsigned i = 0; i < upstreams.size(); ++i)
+		{
+			const MyManager::Upstream &u = upstreams[i];
+			source.Reply(_("Nameserver %s: %lu queries, %lu answered, %lu failed, average response time %ld ms"), u.addr.addr().c_str(), u.sent, u.answered, u.failed, u.srtt / 1000);
 		}
+
+		if (this->manager.compiled_hits + this->manager.compiled_misses)
+			source.Reply(_("DNS questions answered: %lu, %lu of them from precompiled answers"), this->manager.compiled_hits + this->manager.compiled_misses, this->manager.compiled_hits);
+
+		if (this->manager.GetLatency(50) >= 0)
+			source.Reply(_("DNS response times: 50%% within %ld ms, 90%% within %ld ms, 99%% within %ld ms"), this->manager.GetLatency(50) / 1000, this->manager.GetLatency(90) / 1000, this->manager.GetLatency(99) / 1000);
+	}
+
+	void OnModuleUnload(User *u, Module *m) anope_override
+	{
+		this->manager.CancelRequests(m, ERROR_UNLOADED);
 	}
 };
 
@@ -32,7 +32,7 @@ struct Blacklist
 
 	Blacklist() : bantime(0) { }
 
-	Reply *Find(int code)
+	const Reply *Find(int code) const
 	{
 		for (unsigned int i = 0; i < replies.size(); ++i)
 			if (replies[i].code == code)
@@ -41,37 +41,108 @@ struct Blacklist
 	}
 };
 
+/* Result of looking an address up in one blacklist */
+enum
+{
+	/* The lookup is still in flight */
+	RESULT_PENDING = -2,
+	/* The lookup failed, so nothing is known */
+	RESULT_UNKNOWN = -1,
+	/* The address is not listed */
+	RESULT_CLEAN = 0
+	/* Anything else is the last octet of the reply */
+};
+
+/* The verdicts of every blacklist for one address */
+struct DNSBLEntry
+{
+	/* Result for each configured blacklist, in config order */
+	std::vector<int> results;
+	/* Number of lookups still in flight */
+	unsigned pending;
+	/* When this verdict expires, 0 while lookups are in flight */
+	time_t expires;
+	/* Position of this entry in the eviction order */
+	unsigned long seq;
+	/* Users from this address who connected while the lookups were in flight */
+	std::vector<Reference<User> > waiting;
+
+	DNSBLEntry() : pending(0), expires(0), seq(0) { }
+};
+
 class DNSBLResolver : public Request
 {
-	Reference<User> user;
-	Blacklist blacklist;
-	bool add_to_akill;
+	Anope::string ip;
+	unsigned generation;
+	unsigned index;
+
+	void Result(int result, unsigned ttl);
 
  public:
-	DNSBLResolver(Module *c, User *u, const Blacklist &b, const Anope::string &host, bool add_akill) : Request(dnsmanager, c, host, QUERY_A, true), user(u), blacklist(b), add_to_akill(add_akill) { }
+	DNSBLResolver(Module *c, const Anope::string &i, unsigned gen, unsigned idx, const Anope::string &host) : Request(dnsmanager, c, host, QUERY_A, true), ip(i), generation(gen), index(idx) { }
 
 	void OnLookupComplete(const Query *record) anope_override
 	{
-		if (!user || user->Quitting())
-			return;
-
 		const ResourceRecord &ans_record = record->answers[0];
 		// Replies should be in 127.0.0.0/8
 		if (ans_record.rdata.find("127.") != 0)
+		{
+			this->Result(RESULT_CLEAN, ans_record.ttl);
 			return;
+		}
 
 		sockaddrs sresult;
 		sresult.pton(AF_INET, ans_record.rdata);
 		int result = sresult.sa4.sin_addr.s_addr >> 24;
 
-		Blacklist::Reply *reply = blacklist.Find(result);
+		this->Result(result > 0 ? result : RESULT_CLEAN, ans_record.ttl);
+	}
+
+	void OnError(const Query *record) anope_override
+	{
+		/* Not being in the zone is an answer too, anything else tells us nothing */
+		if (record->error == ERROR_DOMAIN_NOT_FOUND || record->error == ERROR_NO_RECORDS)
+			this->Result(RESULT_CLEAN, 0);
+		else
+			this->Result(RESULT_UNKNOWN, 0);
+	}
+};
+
+class ModuleDNSBL : public Module
+{
+	typedef TR1NS::unordered_map<Anope::string, DNSBLEntry, Anope::hash_cs> cache_map;
+
+	std::vector<Blacklist> blacklists;
+	std::set<cidr> exempts;
+	bool check_on_connect;
+	bool check_on_netburst;
+	bool add_to_akill;
+	time_t cache_time;
+	unsigned cache_size;
+
+	/* Verdicts keyed by address, including the ones still being looked up */
+	cache_map cache;
+	/* Addresses in the order they were added to the cache, oldest first */
+	std::deque<std::pair<unsigned long, Anope::string> > cache_order;
+	unsigned long cache_seq;
+	/* Bumped whenever the blacklists change, so results for old lookups are ignored */
+	unsigned generation;
+
+	/* Users checked, and how many of them were answered from the cache or by lookups already in flight */
+	unsigned long checks, hits, coalesced;
+	/* Queries sent, and queries that would have been sent without the cache */
+	unsigned long queries, queries_saved;
+
+	void Apply(User *user, const Blacklist &blacklist, int result)
+	{
+		const Blacklist::Reply *reply = blacklist.Find(result);
 		if (!blacklist.replies.empty() && !reply)
 			return;
 
 		if (reply && reply->allow_account && user->Account())
 			return;
 
-		Anope::string reason = this->blacklist.reason, addr = user->ip.addr();
+		Anope::string reason = blacklist.reason, addr = user->ip.addr();
 		reason = reason.replace_all_cs("%n", user->nick);
 		reason = reason.replace_all_cs("%u", user->GetIdent());
 		reason = reason.replace_all_cs("%g", user->realname);
@@ -81,8 +152,13 @@ class DNSBLResolver : public Request
 		reason = reason.replace_all_cs("%N", Config->GetBlock("networkinfo")->Get<const Anope::string>("networkname"));
 
 		BotInfo *OperServ = Config->GetClient("OperServ");
-		Log(creator, "dnsbl", OperServ) << user->GetMask() << " (" << addr << ") appears in " << this->blacklist.name;
-		XLine *x = new XLine("*@" + addr, OperServ ? OperServ->nick : "m_dnsbl", Anope::CurTime + this->blacklist.bantime, reason, XLineManager::GenerateUID());
+		Log(this, "dnsbl", OperServ) << user->GetMask() << " (" << addr << ") appears in " << blacklist.name;
+
+		/* Clones from an address that is already akilled need no akill of their own */
+		if (this->add_to_akill && akills && akills->HasEntry("*@" + addr))
+			return;
+
+		XLine *x = new XLine("*@" + addr, OperServ ? OperServ->nick : "m_dnsbl", Anope::CurTime + blacklist.bantime, reason, XLineManager::GenerateUID());
 		if (this->add_to_akill && akills)
 		{
 			akills->AddXLine(x);
@@ -94,28 +170,132 @@ class DNSBLResolver : public Request
 			delete x;
 		}
 	}
-};
 
-class ModuleDNSBL : public Module
-{
-	std::vector<Blacklist> blacklists;
-	std::set<cidr> exempts;
-	bool check_on_connect;
-	bool check_on_netburst;
-	bool add_to_akill;
+	void Apply(User *u, const DNSBLEntry &entry)
+	{
+		Reference<User> user(u);
+		for (unsigned i = 0; i < entry.results.size() && i < this->blacklists.size(); ++i)
+		{
+			if (!user || user->Quitting())
+				return;
+
+			if (entry.results[i] > 0)
+				this->Apply(user, this->blacklists[i], entry.results[i]);
+		}
+	}
+
+	/* Drop expired verdicts, and the oldest ones while the cache is over its size limit */
+	void Purge()
+	{
+		while (!this->cache_order.empty())
+		{
+			const std::pair<unsigned long, Anope::string> &front = this->cache_order.front();
+			cache_map::iterator it = this->cache.find(front.second);
+
+			if (it != this->cache.end() && it->second.seq == front.first)
+			{
+				const DNSBLEntry &entry = it->second;
+				if (entry.pending || (entry.expires > Anope::CurTime && this->cache.size() <= this->cache_size))
+					break;
+				this->cache.erase(it);
+			}
+
+			this->cache_order.pop_front();
+		}
+	}
+
+	void Lookup(User *user, const Anope::string &addr, DNSBLEntry &entry)
+	{
+		Anope::string reverse = user->ip.reverse();
+
+		entry.results.assign(this->blacklists.size(), RESULT_PENDING);
+		entry.pending = this->blacklists.size();
+		entry.expires = 0;
+		entry.seq = ++this->cache_seq;
+		entry.waiting.push_back(user);
+		this->cache_order.push_back(std::make_pair(entry.seq, addr));
+
+		unsigned gen = this->generation;
+		for (unsigned i = 0; i < this->blacklists.size() && gen == this->generation; ++i)
+		{
+			const Blacklist &b = this->blacklists[i];
+
+			Anope::string dnsbl_host = reverse + "." + b.name;
+			DNSBLResolver *res = NULL;
+			++this->queries;
+			try
+			{
+				res = new DNSBLResolver(this, addr, gen, i, dnsbl_host);
+				dnsmanager->Process(res);
+			}
+			catch (const SocketException &ex)
+			{
+				delete res;
+				Log(this) << ex.GetReason();
+				this->OnResult(addr, gen, i, RESULT_UNKNOWN, 0);
+			}
+		}
+	}
 
  public:
-	ModuleDNSBL(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, VENDOR | EXTRA)
+	ModuleDNSBL(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, VENDOR | EXTRA),
+		cache_size(0), cache_seq(0), generation(0), checks(0), hits(0), coalesced(0), queries(0), queries_saved(0)
 	{
 
 	}
 
+	/** Called as each blacklist lookup for an address finishes
+	 * @param addr The address looked up
+	 * @param gen The generation of the blacklists the lookup was started with
+	 * @param index Which blacklist was looked up
+	 * @param result The result of the lookup
+	 * @param ttl How long the nameserver allows the result to be cached for, 0 if unknown
+	 */
+	void OnResult(const Anope::string &addr, unsigned gen, unsigned index, int result, unsigned ttl)
+	{
+		if (gen != this->generation)
+			return;
+
+		cache_map::iterator it = this->cache.find(addr);
+		if (it == this->cache.end() || it->second.pending == 0 || index >= it->second.results.size() || it->second.results[index] != RESULT_PENDING)
+			return;
+
+		DNSBLEntry &entry = it->second;
+		entry.results[index] = result;
+
+		/* A listing can not be cached for longer than the blacklist allows */
+		time_t expires = Anope::CurTime + this->cache_time;
+		if (result > 0 && ttl > 0 && Anope::CurTime + static_cast<time_t>(ttl) < expires)
+			expires = Anope::CurTime + ttl;
+		if (!entry.expires || expires < entry.expires)
+			entry.expires = expires;
+
+		if (--entry.pending)
+			return;
+
+		std::vector<Reference<User> > waiting;
+		waiting.swap(entry.waiting);
+
+		bool known = std::find(entry.results.begin(), entry.results.end(), static_cast<int>(RESULT_UNKNOWN)) == entry.results.end();
+		DNSBLEntry verdict = entry;
+		if (!known || !this->cache_time)
+			this->cache.erase(it);
+
+		Log(LOG_DEBUG) << "dnsbl: finished checking " << addr << " for " << waiting.size() << " user(s)" << (known ? "" : ", not caching the incomplete result");
+
+		for (unsigned i = 0; i < waiting.size(); ++i)
+			if (waiting[i])
+				this->Apply(waiting[i], verdict);
+	}
+
 	void OnReload(Configuration::Conf *conf) anope_override
 	{
 		Configuration::Block *block = conf->GetModule(this);
 		this->check_on_connect = block->Get<bool>("check_on_connect");
 		this->check_on_netburst = block->Get<bool>("check_on_netburst");
 		this->add_to_akill = block->Get<bool>("add_to_akill", "yes");
+		this->cache_time = block->Get<time_t>("cache_time", "10m");
+		this->cache_size = block->Get<unsigned>("cache_size", "10000");
 
 		this->blacklists.clear();
 		for (int i = 0; i < block->CountBlock("blacklist"); ++i)
@@ -150,6 +330,11 @@ class ModuleDNSBL : public Module
 			Configuration::Block *bl = block->GetBlock("exempt", i);
 			this->exempts.insert(bl->Get<Anope::string>("ip"));
 		}
+
+		/* Verdicts are per blacklist, so they can not survive the blacklists changing */
+		++this->generation;
+		this->cache.clear();
+		this->cache_order.clear();
 	}
 
 	void OnUserConnect(User *user, bool &exempt) anope_override
@@ -167,32 +352,58 @@ class ModuleDNSBL : public Module
 		if (this->blacklists.empty())
 			return;
 
-		if (this->exempts.count(user->ip.addr()))
+		Anope::string addr = user->ip.addr();
+		if (this->exempts.count(addr))
 		{
-			Log(LOG_DEBUG) << "User " << user->nick << " is exempt from dnsbl check - ip: " << user->ip.addr();
+			Log(LOG_DEBUG) << "User " << user->nick << " is exempt from dnsbl check - ip: " << addr;
 			return;
 		}
 
-		Anope::string reverse = user->ip.reverse();
+		++this->checks;
 
-		for (unsigned i = 0; i < this->blacklists.size(); ++i)
+		cache_map::iterator it = this->cache.find(addr);
+		if (it != this->cache.end())
 		{
-			const Blacklist &b = this->blacklists[i];
-
-			Anope::string dnsbl_host = reverse + "." + b.name;
-			DNSBLResolver *res = NULL;
-			try
+			DNSBLEntry &entry = it->second;
+			if (entry.pending)
 			{
-				res = new DNSBLResolver(this, user, b, dnsbl_host, this->add_to_akill);
-				dnsmanager->Process(res);
+				/* Lookups for this address are already in flight, wait for them */
+				++this->coalesced;
+				this->queries_saved += entry.results.size();
+				entry.waiting.push_back(user);
+				return;
 			}
-			catch (const SocketException &ex)
+			else if (entry.expires > Anope::CurTime)
 			{
-				delete res;
-				Log(this) << ex.GetReason();
+				++this->hits;
+				this->queries_saved += entry.results.size();
+				DNSBLEntry verdict = entry;
+				this->Apply(user, verdict);
+				return;
 			}
 		}
+
+		this->Purge();
+		this->Lookup(user, addr, this->cache[addr]);
+	}
+
+	void OnStats(CommandSource &source, const Anope::string &what, bool &handled) anope_override
+	{
+		if (!what.equals_ci("ALL") && !what.equals_ci("DNSBL"))
+			return;
+		handled = true;
+
+		unsigned long answered = this->hits + this->coalesced;
+		source.Reply(_("DNSBL checks: %lu, answered from the cache: %lu (%lu%%), joined a lookup in flight: %lu"), this->checks, this->hits, this->checks ? this->hits * 100 / this->checks : 0, this->coalesced);
+		source.Reply(_("DNSBL queries sent: %lu, saved: %lu (%lu%%)"), this->queries, this->queries_saved, this->queries + this->queries_saved ? this->queries_saved * 100 / (this->queries + this->queries_saved) : 0);
+		source.Reply(_("DNSBL cache: %lu addresses, %lu users answered without a lookup"), static_cast<unsigned long>(this->cache.size()), answered);
 	}
 };
 
+void DNSBLResolver::Result(int result, unsigned ttl)
+{
+	if (this->creator)
+		static_cast<ModuleDNSBL *>(this->creator)->OnResult(this->ip, this->generation, this->index, result, ttl);
+}
+
 MODULE_INIT(ModuleDNSBL)
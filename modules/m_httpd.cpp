@@ -26,10 +26,14 @@ static Anope::string GetStatusFromCode(HTTPError err)
 			return "200 OK";
 		case HTTP_FOUND:
 			return "302 Found";
+		case HTTP_NOT_MODIFIED:
+			return "304 Not Modified";
 		case HTTP_BAD_REQUEST:
 			return "400 Bad Request";
 		case HTTP_PAGE_NOT_FOUND:
 			return "404 Not Found";
+		case HTTP_REQUEST_TOO_LARGE:
+			return "413 Request Entity Too Large";
 		case HTTP_NOT_SUPPORTED:
 			return "505 HTTP Version Not Supported";
 	}
@@ -46,7 +50,30 @@ class MyHTTPClient : public HTTPClient
 	Reference<HTTPPage> page;
 	Anope::string ip;
 
+	/* Data received from the client which has not been parsed yet, possibly several pipelined requests */
+	Anope::string input;
 	unsigned content_length;
+	/* The request body is sent with chunked transfer coding */
+	bool chunked;
+	/* Where the chunked body is up to, and how much of the current chunk's data is still to come */
+	enum
+	{
+		CHUNK_SIZE,
+		CHUNK_DATA,
+		CHUNK_DATA_END,
+		CHUNK_TRAILER
+	} chunk_state;
+	size_t chunk_left;
+	/* Largest request body accepted */
+	size_t max_body;
+	/* Whether the connection may be kept open after the reply to the current request */
+	bool keepalive;
+	/* Number of requests answered on this connection, and how many may be */
+	unsigned requests, max_requests;
+	/* Set once the last reply has been sent, the connection closes once it is written */
+	bool closing;
+	/* Set while parsing requests, so replies sent from within a page do not parse the next request */
+	bool processing;
 
 	enum
 	{
@@ -55,6 +82,22 @@ class MyHTTPClient : public HTTPClient
 		ACTION_POST
 	} action;
 
+	/* Forget the current request, ready for the next one on this connection */
+	void Reset()
+	{
+		this->message = HTTPMessage();
+		this->header_done = this->served = this->chunked = false;
+		this->chunk_state = CHUNK_SIZE;
+		this->chunk_left = 0;
+		this->page_name.clear();
+		this->page = NULL;
+		this->ip = this->clientaddr.addr();
+		this->content_length = 0;
+		this->keepalive = false;
+		this->action = ACTION_NONE;
+		this->created = Anope::CurTime;
+	}
+
 	void Serve()
 	{
 		if (this->served)
@@ -87,54 +130,138 @@ class MyHTTPClient : public HTTPClient
 		HTTPReply reply;
 		reply.content_type = this->page->GetContentType();
 
-		if (this->page->OnRequest(this->provider, this->page_name, this, this->message, reply))
+		/* Some pages send an error themselves and still ask for the reply to be sent */
+		unsigned answered = this->requests;
+		if (this->page->OnRequest(this->provider, this->page_name, this, this->message, reply) && this->requests == answered)
 			this->SendReply(&reply);
 	}
 
- public:
-	time_t created;
-
-	MyHTTPClient(HTTPProvider *l, int f, const sockaddrs &a) : Socket(f, l->IsIPv6()), HTTPClient(l, f, a), provider(l), header_done(false), served(false), ip(a.addr()), content_length(0), action(ACTION_NONE), created(Anope::CurTime)
+	/** Move what has been received of a chunked request body from the buffer
+	 * into the message. Only data received since the last call is parsed.
+	 * @return true if the whole body has been received
+	 */
+	bool ReadChunked()
 	{
-		Log(LOG_DEBUG, "httpd") << "Accepted connection " << f << " from " << a.addr();
-	}
+		size_t pos = 0;
+		bool done = false;
 
-	~MyHTTPClient()
-	{
-		Log(LOG_DEBUG, "httpd") << "Closing connection " << this->GetFD() << " from " << this->ip;
-	}
+		while (!done)
+		{
+			if (this->chunk_state == CHUNK_DATA)
+			{
+				size_t avail = std::min(this->chunk_left, this->input.length() - pos);
+				this->message.content.append(this->input.c_str() + pos, avail);
+				pos += avail;
+				this->chunk_left -= avail;
 
-	/* Close connection once all data is written */
-	bool ProcessWrite() anope_override
-	{
-		return !BinarySocket::ProcessWrite() || this->write_buffer.empty() ? false : true;
-	}
+				if (this->chunk_left)
+					break;
 
-	const Anope::string GetIP() anope_override
-	{
-		return this->ip;
-	}
+				this->chunk_state = CHUNK_DATA_END;
+				continue;
+			}
 
-	bool Read(const char *buffer, size_t l) anope_override
-	{
-		message.content.append(buffer, l);
+			size_t nl = this->input.find('\n', pos);
+			if (nl == Anope::string::npos)
+				break;
 
-		for (size_t nl; !this->header_done && (nl = message.content.find('\n')) != Anope::string::npos;)
-		{
-			Anope::string token = message.content.substr(0, nl).trim();
-			message.content = message.content.substr(nl + 1);
+			Anope::string line = this->input.substr(pos, nl - pos);
+			pos = nl + 1;
 
-			if (token.empty())
-				this->header_done = true;
+			if (this->chunk_state == CHUNK_DATA_END)
+			{
+				/* The chunk data is followed by a line break */
+				this->chunk_state = CHUNK_SIZE;
+				continue;
+			}
+			else if (this->chunk_state == CHUNK_TRAILER)
+			{
+				/* The trailer ends with an empty line */
+				if (line.trim().empty())
+					done = true;
+				continue;
+			}
+
+			size_t ext = line.find(';');
+			if (ext != Anope::string::npos)
+				line = line.substr(0, ext);
+			line.trim();
+
+			/* Check the size against what may still be received before using it,
+			 * so a huge size can not wrap around
+			 */
+			char *end;
+			errno = 0;
+			unsigned long long size = strtoull(line.c_str(), &end, 16);
+			if (line.empty() || *end || errno == ERANGE)
+			{
+				this->input.clear();
+				this->SendError(HTTP_BAD_REQUEST, "Invalid chunk size");
+				return false;
+			}
+			else if (size > this->max_body - this->message.content.length())
+			{
+				this->input.clear();
+				this->SendError(HTTP_REQUEST_TOO_LARGE, "Request body too large");
+				return false;
+			}
+
+			if (size == 0)
+				this->chunk_state = CHUNK_TRAILER;
 			else
-				this->Read(token);
+			{
+				this->chunk_state = CHUNK_DATA;
+				this->chunk_left = size;
+			}
 		}
 
-		if (!this->header_done)
-			return true;
+		this->input.erase(0, pos);
+		return done;
+	}
+
+	/* Parse and serve the requests received so far. Requests are answered in order, so this stops at one which is being answered later */
+	void ProcessRequests()
+	{
+		if (this->processing)
+			return;
+		this->processing = true;
 
-		if (this->message.content.length() >= this->content_length)
+		while (!this->served && !this->closing)
 		{
+			for (size_t nl; !this->header_done && !this->closing && (nl = this->input.find('\n')) != Anope::string::npos;)
+			{
+				Anope::string token = this->input.substr(0, nl).trim();
+				this->input.erase(0, nl + 1);
+
+				if (!token.empty())
+					this->Read(token);
+				/* Blank lines before a request line are allowed and ignored */
+				else if (this->action != ACTION_NONE)
+					this->header_done = true;
+			}
+
+			if (!this->header_done || this->closing)
+				break;
+
+			if (this->chunked)
+			{
+				if (!this->ReadChunked())
+					break;
+			}
+			else if (this->content_length > this->max_body)
+			{
+				this->input.clear();
+				this->SendError(HTTP_REQUEST_TOO_LARGE, "Request body too large");
+				break;
+			}
+			else if (this->input.length() >= this->content_length)
+			{
+				this->message.content = this->input.substr(0, this->content_length);
+				this->input.erase(0, this->content_length);
+			}
+			else
+				break;
+
 			sepstream sep(this->message.content, '&');
 			Anope::string token;
 
@@ -150,6 +277,51 @@ class MyHTTPClient : public HTTPClient
 			this->Serve();
 		}
 
+		this->processing = false;
+	}
+
+ public:
+	/* When the current request started, or when the connection became idle */
+	time_t created;
+
+	MyHTTPClient(HTTPProvider *l, int f, const sockaddrs &a, unsigned maxreq, size_t maxbody) : Socket(f, l->IsIPv6()), HTTPClient(l, f, a), provider(l), header_done(false), served(false), ip(a.addr()), content_length(0), chunked(false),
+		chunk_state(CHUNK_SIZE), chunk_left(0), max_body(maxbody), keepalive(false), requests(0), max_requests(maxreq), closing(false), processing(false), action(ACTION_NONE), created(Anope::CurTime)
+	{
+		Log(LOG_DEBUG, "httpd") << "Accepted connection " << f << " from " << a.addr();
+	}
+
+	~MyHTTPClient()
+	{
+		Log(LOG_DEBUG, "httpd") << "Closing connection " << this->GetFD() << " from " << this->ip;
+	}
+
+	/* Close connection once all data is written, if it is not being kept alive */
+	bool ProcessWrite() anope_override
+	{
+		return BinarySocket::ProcessWrite() && (!this->closing || !this->write_buffer.empty());
+	}
+
+	const Anope::string GetIP() anope_override
+	{
+		return this->ip;
+	}
+
+	/* Whether the connection is waiting for the client to send another request */
+	bool IsIdle() const
+	{
+		return this->requests && this->action == ACTION_NONE && this->input.empty() && this->write_buffer.empty();
+	}
+
+	bool Read(const char *buffer, size_t l) anope_override
+	{
+		if (this->closing)
+			return true;
+
+		if (this->IsIdle())
+			this->created = Anope::CurTime;
+
+		this->input.append(buffer, l);
+		this->ProcessRequests();
 		return true;
 	}
 
@@ -179,6 +351,9 @@ class MyHTTPClient : public HTTPClient
 			else if (params[0] == "POST")
 				this->action = ACTION_POST;
 
+			/* HTTP/1.1 connections are persistent unless the client says otherwise, older ones only if it asks */
+			this->keepalive = params[2] == "HTTP/1.1";
+
 			Anope::string targ = params[1];
 			size_t q = targ.find('?');
 			if (q != Anope::string::npos)
@@ -223,10 +398,25 @@ class MyHTTPClient : public HTTPClient
 			}
 			catch (const ConvertException &ex) { }
 		}
-		else if (buf.find(':') != Anope::string::npos)
+		else if (buf.find_ci("Transfer-Encoding: ") == 0)
 		{
+			if (buf.substr(19).find_ci("chunked") != Anope::string::npos)
+				this->chunked = true;
+		}
+		else
+		{
+			if (buf.find_ci("Connection: ") == 0)
+			{
+				if (buf.substr(12).find_ci("close") != Anope::string::npos)
+					this->keepalive = false;
+				else if (buf.substr(12).find_ci("keep-alive") != Anope::string::npos)
+					this->keepalive = true;
+			}
+			else if (buf.find_ci("Expect: ") == 0 && buf.substr(8).equals_ci("100-continue"))
+				this->Write("HTTP/1.1 100 Continue\r\n\r\n");
+
 			size_t sz = buf.find(':');
-			if (sz + 2 < buf.length())
+			if (sz != Anope::string::npos && sz + 2 < buf.length())
 				this->message.headers[buf.substr(0, sz)] = buf.substr(sz + 2);
 		}
 
@@ -239,6 +429,10 @@ class MyHTTPClient : public HTTPClient
 
 		h.error = err;
 
+		/* Whatever follows a request we could not parse can not be trusted to be a request */
+		if (err == HTTP_BAD_REQUEST || err == HTTP_REQUEST_TOO_LARGE)
+			this->keepalive = false;
+
 		h.Write(msg);
 
 		this->SendReply(&h);
@@ -246,14 +440,23 @@ class MyHTTPClient : public HTTPClient
 
 	void SendReply(HTTPReply *msg) anope_override
 	{
-		this->WriteClient("HTTP/1.1 " + GetStatusFromCode(msg->error));
-		this->WriteClient("Date: " + BuildDate());
-		this->WriteClient("Server: Anope-" + Anope::VersionShort());
+		if (this->closing)
+			return;
+
+		++this->requests;
+		if (this->max_requests && this->requests >= this->max_requests)
+			this->keepalive = false;
+
+		/* Send all of the headers at once */
+		Anope::string headers = "HTTP/1.1 " + GetStatusFromCode(msg->error) + "\r\n";
+		headers += "Date: " + BuildDate() + "\r\n";
+		headers += "Server: Anope-" + Anope::VersionShort() + "\r\n";
 		if (msg->content_type.empty())
-			this->WriteClient("Content-Type: text/html");
+			headers += "Content-Type: text/html\r\n";
 		else
-			this->WriteClient("Content-Type: " + msg->content_type);
-		this->WriteClient("Content-Length: " + stringify(msg->length));
+			headers += "Content-Type: " + msg->content_type + "\r\n";
+		if (msg->error != HTTP_NOT_MODIFIED)
+			headers += "Content-Length: " + stringify(msg->length) + "\r\n";
 
 		for (unsigned i = 0; i < msg->cookies.size(); ++i)
 		{
@@ -264,15 +467,17 @@ class MyHTTPClient : public HTTPClient
 
 			buf.erase(buf.length() - 1);
 
-			this->WriteClient(buf);
+			headers += buf + "\r\n";
 		}
 
 		typedef std::map<Anope::string, Anope::string> map;
 		for (map::iterator it = msg->headers.begin(), it_end = msg->headers.end(); it != it_end; ++it)
-			this->WriteClient(it->first + ": " + it->second);
+			headers += it->first + ": " + it->second + "\r\n";
 
-		this->WriteClient("Connection: Close");
-		this->WriteClient("");
+		headers += this->keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+		headers += "\r\n";
+
+		this->Write(headers);
 
 		for (unsigned i = 0; i < msg->out.size(); ++i)
 		{
@@ -284,6 +489,16 @@ class MyHTTPClient : public HTTPClient
 		}
 
 		msg->out.clear();
+
+		if (!this->keepalive)
+		{
+			this->closing = true;
+			return;
+		}
+
+		/* Go on to the next request, which may already have been received */
+		this->Reset();
+		this->ProcessRequests();
 	}
 };
 
@@ -294,24 +509,37 @@ class MyHTTPProvider : public HTTPProvider, public Timer
 	std::list<Reference<MyHTTPClient> > clients;
 
  public:
-	MyHTTPProvider(Module *c, const Anope::string &n, const Anope::string &i, const unsigned short p, const int t, bool s) : Socket(-1, i.find(':') != Anope::string::npos), HTTPProvider(c, n, i, p, s), Timer(c, 10, Anope::CurTime, true), timeout(t) { }
+	/* How long idle connections are kept open for, 0 to close connections after each request */
+	int keepalive_timeout;
+	/* How many requests may be made over one connection, 0 for no limit */
+	unsigned max_requests;
+	/* Largest request body accepted, in bytes */
+	size_t max_body;
+
+	MyHTTPProvider(Module *c, const Anope::string &n, const Anope::string &i, const unsigned short p, const int t, bool s) : Socket(-1, i.find(':') != Anope::string::npos), HTTPProvider(c, n, i, p, s), Timer(c, 5, Anope::CurTime, true), timeout(t),
+		keepalive_timeout(0), max_requests(0), max_body(0) { }
 
 	void Tick(time_t) anope_override
 	{
-		while (!this->clients.empty())
+		/* Connections which are kept alive leave the list out of order, so check all of them */
+		for (std::list<Reference<MyHTTPClient> >::iterator it = this->clients.begin(), it_end = this->clients.end(); it != it_end;)
 		{
-			Reference<MyHTTPClient>& c = this->clients.front();
-			if (c && c->created + this->timeout >= Anope::CurTime)
-				break;
+			Reference<MyHTTPClient> &c = *it;
+
+			if (c && c->created + (c->IsIdle() ? this->keepalive_timeout : this->timeout) >= Anope::CurTime)
+			{
+				++it;
+				continue;
+			}
 
 			delete c;
-			this->clients.pop_front();
+			it = this->clients.erase(it);
 		}
 	}
 
 	ClientSocket* OnAccept(int fd, const sockaddrs &addr) anope_override
 	{
-		MyHTTPClient *c = new MyHTTPClient(this, fd, addr);
+		MyHTTPClient *c = new MyHTTPClient(this, fd, addr, this->keepalive_timeout > 0 ? this->max_requests : 1, this->max_body);
 		this->clients.push_back(c);
 		return c;
 	}
@@ -374,6 +602,9 @@ class HTTPD : public Module
 			Anope::string ip = block->Get<const Anope::string>("ip");
 			int port = block->Get<int>("port", "8080");
 			int timeout = block->Get<int>("timeout", "30");
+			int keepalive_timeout = block->Get<int>("keepalive_timeout", "15");
+			unsigned max_requests = block->Get<unsigned>("max_requests", "100");
+			unsigned max_body = block->Get<unsigned>("max_body", "1048576");
 			bool ssl = block->Get<bool>("ssl", "no");
 			Anope::string ext_ip = block->Get<const Anope::string>("extforward_ip");
 			Anope::string ext_header = block->Get<const Anope::string>("extforward_header");
@@ -435,6 +666,9 @@ class HTTPD : public Module
 			}
 
 
+			p->keepalive_timeout = keepalive_timeout;
+			p->max_requests = max_requests;
+			p->max_body = max_body;
 			p->ext_ip = ext_ip;
 			spacesepstream(ext_header).GetTokens(p->ext_headers);
 		}
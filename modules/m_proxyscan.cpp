@@ -52,43 +52,189 @@ class ProxyCallbackListener : public ListenSocket
 	}
 };
 
+/* A scan of one port of an address for one type of proxy */
+struct ProxyScan
+{
+	Anope::string ip;
+	/* The /24 the address is in */
+	Anope::string net;
+	/* Index of the proxyscan block, valid for generation */
+	unsigned check;
+	unsigned generation;
+	Anope::string type;
+	unsigned short port;
+};
+
+class ProxyConnect;
+
+/** Decides when scans are started, and remembers their results per address.
+ */
+class ProxyScheduler
+{
+	/* What is known about an address */
+	struct Host
+	{
+		/* Scans queued or running */
+		unsigned pending;
+		/* When the result expires, 0 while scanning */
+		time_t expires;
+		/* Position of this host in the eviction order */
+		unsigned long seq;
+		/* Set if an open proxy was found, which is then kept to ban the address again if it reconnects */
+		bool dirty;
+		ProxyCheck proxy;
+		Anope::string type;
+		unsigned short port;
+
+		Host() : pending(0), expires(0), seq(0), dirty(false), port(0) { }
+	};
+
+	/* Scans of a /24 */
+	struct Net
+	{
+		/* Scans waiting for a free slot, in the order they were added */
+		std::deque<ProxyScan> queue;
+		/* Scans running */
+		unsigned running;
+		/* Set while the net is in the ready list */
+		bool ready;
+
+		Net() : running(0), ready(false) { }
+	};
+
+	typedef TR1NS::unordered_map<Anope::string, Host, Anope::hash_cs> host_map;
+	typedef TR1NS::unordered_map<Anope::string, Net, Anope::hash_cs> net_map;
+
+	/* /24s which have scans queued and are below max_scans_per_net. They take turns
+	 * starting a scan, so one busy network can not starve the rest
+	 */
+	std::deque<Anope::string> ready;
+	net_map nets;
+	size_t queued;
+	unsigned total_running;
+	unsigned long host_seq;
+	host_map hosts;
+	/* Addresses in the order they were added to hosts, oldest first */
+	std::deque<std::pair<unsigned long, Anope::string> > host_order;
+	bool dispatching;
+
+	/** Put a net in the ready list if it can start a scan, or forget it if it has nothing left to do */
+	void Update(net_map::iterator it);
+
+	void Purge();
+	void Start(const ProxyScan &scan);
+	void Done(const ProxyScan &scan, const ProxyConnect *con);
+
+ public:
+	std::vector<ProxyCheck> proxyscans;
+	unsigned generation;
+	unsigned max_scans, max_scans_per_net;
+	time_t timeout, cache_time;
+	unsigned cache_size;
+
+	/* Addresses checked, addresses answered from the cache, and scans started */
+	unsigned long checks, hits, scans;
+
+	ProxyScheduler() : queued(0), total_running(0), host_seq(0), dispatching(false), generation(0), max_scans(0), max_scans_per_net(0),
+		timeout(0), cache_time(0), cache_size(0), checks(0), hits(0), scans(0) { }
+
+	/** Scan an address, unless it was scanned recently or is being scanned
+	 * @return false if the address was not scanned
+	 */
+	bool Add(const Anope::string &ip);
+
+	/** Start queued scans while there are free slots */
+	void Run();
+
+	/** Drop all queued scans and results, for when the proxyscan blocks change */
+	void Reset();
+
+	void Started(const ProxyConnect *con);
+	void Finished(const ProxyConnect *con);
+
+	unsigned Running() const { return this->total_running; }
+	size_t Queued() const { return this->queued; }
+	size_t Cached() const { return this->hosts.size(); }
+};
+
+static ProxyScheduler *scheduler;
+
 class ProxyConnect : public ConnectionSocket
 {
 	static ServiceReference<XLineManager> akills;
 
+	/* Deletes the connection once it has taken too long */
+	class Deadline : public Timer
+	{
+	 public:
+		ProxyConnect *con;
+
+		Deadline(Module *creator, ProxyConnect *c, time_t timeout) : Timer(creator, timeout), con(c) { }
+
+		~Deadline()
+		{
+			if (this->con)
+				this->con->deadline = NULL;
+		}
+
+		void Tick(time_t) anope_override
+		{
+			ProxyConnect *c = this->con;
+			this->con = NULL;
+			c->deadline = NULL;
+			delete c;
+		}
+	};
+
+	Deadline *deadline;
+
  public:
  	static std::set<ProxyConnect *> proxies;
 
  	ProxyCheck proxy;
-	unsigned short port;
- 	time_t created;
+	ProxyScan scan;
+	/* Set once an open proxy was found */
+	bool found;
 
-	ProxyConnect(ProxyCheck &p, unsigned short po) : Socket(-1), ConnectionSocket(), proxy(p),
-		port(po), created(Anope::CurTime)
+	ProxyConnect(Module *creator, const ProxyCheck &p, const ProxyScan &s) : Socket(-1), ConnectionSocket(), proxy(p),
+		scan(s), found(false)
 	{
+		this->deadline = new Deadline(creator, this, scheduler->timeout);
 		proxies.insert(this);
+		scheduler->Started(this);
 	}
 
 	~ProxyConnect()
 	{
+		if (this->deadline)
+		{
+			this->deadline->con = NULL;
+			delete this->deadline;
+		}
 		proxies.erase(this);
+		if (scheduler)
+			scheduler->Finished(this);
 	}
 
 	virtual void OnConnect() anope_override = 0;
 	virtual const Anope::string GetType() const = 0;
 
- protected:
-	void Ban()
+	/** Ban an address found to be running an open proxy */
+	static void Ban(const ProxyCheck &proxy, const Anope::string &type, const Anope::string &ip, unsigned short port)
 	{
-		Anope::string reason = this->proxy.reason;
+		Anope::string reason = proxy.reason;
 
-		reason = reason.replace_all_cs("%t", this->GetType());
-		reason = reason.replace_all_cs("%i", this->conaddr.addr());
-		reason = reason.replace_all_cs("%p", stringify(this->conaddr.port()));
+		reason = reason.replace_all_cs("%t", type);
+		reason = reason.replace_all_cs("%i", ip);
+		reason = reason.replace_all_cs("%p", stringify(port));
 
 		BotInfo *OperServ = Config->GetClient("OperServ");
-		Log(OperServ) << "PROXYSCAN: Open " << this->GetType() << " proxy found on " << this->conaddr.addr() << ":" << this->conaddr.port() << " (" << reason << ")";
-		XLine *x = new XLine("*@" + this->conaddr.addr(), OperServ ? OperServ->nick : "", Anope::CurTime + this->proxy.duration, reason, XLineManager::GenerateUID());
+		Log(OperServ) << "PROXYSCAN: Open " << type << " proxy found on " << ip << ":" << port << " (" << reason << ")";
+
+		if (add_to_akill && akills && akills->HasEntry("*@" + ip))
+			return;
+
+		XLine *x = new XLine("*@" + ip, OperServ ? OperServ->nick : "", Anope::CurTime + proxy.duration, reason, XLineManager::GenerateUID());
 		if (add_to_akill && akills)
 		{
 			akills->AddXLine(x);
@@ -103,6 +249,13 @@ class ProxyConnect : public ConnectionSocket
 			delete x;
 		}
 	}
+
+ protected:
+	void Ban()
+	{
+		this->found = true;
+		Ban(this->proxy, this->GetType(), this->conaddr.addr(), this->conaddr.port());
+	}
 };
 ServiceReference<XLineManager> ProxyConnect::akills("XLineManager", "xlinemanager/sgline");
 std::set<ProxyConnect *> ProxyConnect::proxies;
@@ -110,7 +263,7 @@ std::set<ProxyConnect *> ProxyConnect::proxies;
 class HTTPProxyConnect : public ProxyConnect, public BufferedSocket
 {
  public:
-	HTTPProxyConnect(ProxyCheck &p, unsigned short po) : Socket(-1), ProxyConnect(p, po), BufferedSocket()
+	HTTPProxyConnect(Module *creator, const ProxyCheck &p, const ProxyScan &s) : Socket(-1), ProxyConnect(creator, p, s), BufferedSocket()
 	{
 	}
 
@@ -142,7 +295,7 @@ class HTTPProxyConnect : public ProxyConnect, public BufferedSocket
 class SOCKS5ProxyConnect : public ProxyConnect, public BinarySocket
 {
  public:
-	SOCKS5ProxyConnect(ProxyCheck &p, unsigned short po) : Socket(-1), ProxyConnect(p, po), BinarySocket()
+	SOCKS5ProxyConnect(Module *creator, const ProxyCheck &p, const ProxyScan &s) : Socket(-1), ProxyConnect(creator, p, s), BinarySocket()
 	{
 	}
 
@@ -189,46 +342,275 @@ class SOCKS5ProxyConnect : public ProxyConnect, public BinarySocket
 	}
 };
 
-class ModuleProxyScan : public Module
-{
-	Anope::string listen_ip;
-	unsigned short listen_port;
-	Anope::string con_notice, con_source;
-	std::vector<ProxyCheck> proxyscans;
+static Module *me;
 
-	ProxyCallbackListener *listener;
+bool ProxyScheduler::Add(const Anope::string &ip)
+{
+	++this->checks;
 
-	class ConnectionTimeout : public Timer
+	host_map::iterator it = this->hosts.find(ip);
+	if (it != this->hosts.end())
 	{
-	 public:
-		ConnectionTimeout(Module *c, long timeout) : Timer(c, timeout, Anope::CurTime, true)
+		Host &host = it->second;
+		if (host.pending)
+			return false;
+		else if (host.expires > Anope::CurTime)
 		{
+			++this->hits;
+			if (host.dirty)
+				ProxyConnect::Ban(host.proxy, host.type, ip, host.port);
+			return false;
 		}
+	}
 
-		void Tick(time_t) anope_override
+	this->Purge();
+
+	Host &host = this->hosts[ip];
+	host = Host();
+	host.seq = ++this->host_seq;
+	this->host_order.push_back(std::make_pair(host.seq, ip));
+
+	ProxyScan scan;
+	scan.ip = ip;
+	scan.net = ip.substr(0, ip.rfind('.'));
+	scan.generation = this->generation;
+
+	net_map::iterator net = this->nets.insert(std::make_pair(scan.net, Net())).first;
+
+	for (unsigned i = this->proxyscans.size(); i > 0; --i)
+	{
+		const ProxyCheck &p = this->proxyscans[i - 1];
+		scan.check = i - 1;
+
+		for (std::set<Anope::string, ci::less>::const_iterator it2 = p.types.begin(), it2_end = p.types.end(); it2 != it2_end; ++it2)
 		{
-			for (std::set<ProxyConnect *>::iterator it = ProxyConnect::proxies.begin(), it_end = ProxyConnect::proxies.end(); it != it_end;)
+			scan.type = *it2;
+
+			for (unsigned k = 0; k < p.ports.size(); ++k)
 			{
-				ProxyConnect *p = *it;
-				++it;
+				scan.port = p.ports[k];
 
-				if (p->created + this->GetSecs() < Anope::CurTime)
-					delete p;
+				net->second.queue.push_back(scan);
+				++this->queued;
+				++host.pending;
 			}
 		}
-	} connectionTimeout;
+	}
 
- public:
-	ModuleProxyScan(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, EXTRA | VENDOR),
-		connectionTimeout(this, 5)
+	this->Update(net);
+
+	if (!host.pending)
+	{
+		this->hosts.erase(ip);
+		return false;
+	}
+
+	this->Run();
+	return true;
+}
+
+void ProxyScheduler::Update(net_map::iterator it)
+{
+	Net &net = it->second;
+
+	if (net.queue.empty())
+	{
+		if (!net.running && !net.ready)
+			this->nets.erase(it);
+	}
+	else if (!net.ready && net.running < this->max_scans_per_net)
 	{
+		net.ready = true;
+		this->ready.push_back(it->first);
+	}
+}
+
+void ProxyScheduler::Run()
+{
+	/* Starting a scan may finish another, which calls back in here */
+	if (this->dispatching)
+		return;
+	this->dispatching = true;
+
+	while (!this->ready.empty() && this->total_running < this->max_scans)
+	{
+		Anope::string name = this->ready.front();
+		this->ready.pop_front();
+
+		net_map::iterator it = this->nets.find(name);
+		if (it == this->nets.end())
+			continue;
+
+		Net &net = it->second;
+		net.ready = false;
+		if (net.queue.empty() || net.running >= this->max_scans_per_net)
+		{
+			this->Update(it);
+			continue;
+		}
+
+		ProxyScan scan = net.queue.front();
+		net.queue.pop_front();
+		--this->queued;
+
+		/* Hold the net's place while the scan starts, then send it to the back of the ready list */
+		net.ready = true;
+		this->Start(scan);
+
+		it = this->nets.find(name);
+		if (it != this->nets.end())
+		{
+			it->second.ready = false;
+			this->Update(it);
+		}
+	}
+
+	this->dispatching = false;
+}
+
+void ProxyScheduler::Start(const ProxyScan &scan)
+{
+	if (scan.generation != this->generation || scan.check >= this->proxyscans.size())
+	{
+		this->Done(scan, NULL);
+		return;
+	}
+
+	const ProxyCheck &p = this->proxyscans[scan.check];
+	ProxyConnect *con = NULL;
+	try
+	{
+		if (scan.type.equals_ci("HTTP"))
+			con = new HTTPProxyConnect(me, p, scan);
+		else
+			con = new SOCKS5ProxyConnect(me, p, scan);
+		++this->scans;
+		con->Connect(scan.ip, scan.port);
+	}
+	catch (const SocketException &ex)
+	{
+		Log(LOG_DEBUG) << "m_proxyscan: " << ex.GetReason();
+		if (con)
+			delete con;
+		else
+			this->Done(scan, NULL);
+	}
+}
+
+void ProxyScheduler::Started(const ProxyConnect *con)
+{
+	++this->total_running;
+	++this->nets[con->scan.net].running;
+}
+
+void ProxyScheduler::Finished(const ProxyConnect *con)
+{
+	--this->total_running;
+
+	net_map::iterator it = this->nets.find(con->scan.net);
+	if (it != this->nets.end())
+	{
+		--it->second.running;
+		this->Update(it);
+	}
+
+	this->Done(con->scan, con);
+	this->Run();
+}
+
+void ProxyScheduler::Done(const ProxyScan &scan, const ProxyConnect *con)
+{
+	if (scan.generation != this->generation)
+		return;
+
+	host_map::iterator it = this->hosts.find(scan.ip);
+	if (it == this->hosts.end() || !it->second.pending)
+		return;
+
+	Host &host = it->second;
+	if (con && con->found && !host.dirty)
+	{
+		host.dirty = true;
+		host.proxy = con->proxy;
+		host.type = scan.type.upper();
+		host.port = scan.port;
+	}
+
+	if (--host.pending)
+		return;
 
+	Log(LOG_DEBUG) << "m_proxyscan: finished scanning " << scan.ip << ", " << (host.dirty ? "found an open proxy" : "clean");
+	if (this->cache_time)
+		host.expires = Anope::CurTime + this->cache_time;
+	else
+		this->hosts.erase(it);
+}
+
+void ProxyScheduler::Purge()
+{
+	while (!this->host_order.empty())
+	{
+		const std::pair<unsigned long, Anope::string> &front = this->host_order.front();
+		host_map::iterator it = this->hosts.find(front.second);
+
+		if (it != this->hosts.end() && it->second.seq == front.first)
+		{
+			const Host &host = it->second;
+			if (host.pending || (host.expires > Anope::CurTime && this->hosts.size() <= this->cache_size))
+				break;
+			this->hosts.erase(it);
+		}
+
+		this->host_order.pop_front();
+	}
+}
+
+void ProxyScheduler::Reset()
+{
+	++this->generation;
+
+	/* Scans which are running are still counted against their net */
+	for (net_map::iterator it = this->nets.begin(), it_end = this->nets.end(); it != it_end;)
+	{
+		Net &net = it->second;
+		net.queue.clear();
+		net.ready = false;
+
+		if (!net.running)
+			this->nets.erase(it++);
+		else
+			++it;
+	}
+	this->ready.clear();
+	this->queued = 0;
+
+	this->hosts.clear();
+	this->host_order.clear();
+}
+
+class ModuleProxyScan : public Module
+{
+	Anope::string listen_ip;
+	unsigned short listen_port;
+	Anope::string con_notice, con_source;
+	ProxyScheduler proxyscheduler;
+
+	ProxyCallbackListener *listener;
+
+ public:
+	ModuleProxyScan(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, EXTRA | VENDOR)
+	{
+		me = this;
+		scheduler = &this->proxyscheduler;
 
 		this->listener = NULL;
 	}
 
 	~ModuleProxyScan()
 	{
+		/* Nothing is scheduled anymore, the scans are simply dropped */
+		scheduler = NULL;
+
 		for (std::set<ProxyConnect *>::iterator it = ProxyConnect::proxies.begin(), it_end = ProxyConnect::proxies.end(); it != it_end;)
 		{
 			ProxyConnect *p = *it;
@@ -276,7 +658,15 @@ class ModuleProxyScan : public Module
 		this->con_notice = config->Get<const Anope::string>("connect_notice");
 		this->con_source = config->Get<const Anope::string>("connect_source");
 		add_to_akill = config->Get<bool>("add_to_akill", "true");
-		this->connectionTimeout.SetSecs(config->Get<time_t>("timeout", "5s"));
+		this->proxyscheduler.timeout = config->Get<time_t>("timeout", "5s");
+		this->proxyscheduler.max_scans = config->Get<unsigned>("max_scans", "100");
+		this->proxyscheduler.max_scans_per_net = config->Get<unsigned>("max_scans_per_net", "10");
+		this->proxyscheduler.cache_time = config->Get<time_t>("cache_time", "1h");
+		this->proxyscheduler.cache_size = config->Get<unsigned>("cache_size", "10000");
+		if (!this->proxyscheduler.max_scans)
+			this->proxyscheduler.max_scans = 1;
+		if (!this->proxyscheduler.max_scans_per_net)
+			this->proxyscheduler.max_scans_per_net = 1;
 
 		ProxyCheckString = Config->GetBlock("networkinfo")->Get<const Anope::string>("networkname") + " proxy check";
 		delete this->listener;
@@ -290,7 +680,7 @@ class ModuleProxyScan : public Module
 			throw ConfigException("m_proxyscan: " + ex.GetReason());
 		}
 
-		this->proxyscans.clear();
+		std::vector<ProxyCheck> proxyscans;
 		for (int i = 0; i < config->CountBlock("proxyscan"); ++i)
 		{
 			Configuration::Block *block = config->GetBlock("proxyscan", i);
@@ -325,8 +715,13 @@ class ModuleProxyScan : public Module
 			if (p.reason.empty())
 				continue;
 
-			this->proxyscans.push_back(p);
+			proxyscans.push_back(p);
 		}
+
+		/* Queued scans and results refer to the old proxyscan blocks */
+		this->proxyscheduler.proxyscans.swap(proxyscans);
+		this->proxyscheduler.Reset();
+		this->proxyscheduler.Run();
 	}
 
 	void OnUserConnect(User *user, bool &exempt) anope_override
@@ -339,39 +734,26 @@ class ModuleProxyScan : public Module
 			/* User doesn't have a valid IPv4 IP (ipv6/spoof/etc) */
 			return;
 
+		if (!this->proxyscheduler.Add(user->ip.addr()))
+			return;
+
 		if (!this->con_notice.empty() && !this->con_source.empty())
 		{
 			BotInfo *bi = BotInfo::Find(this->con_source, true);
 			if (bi)
 				user->SendMessage(bi, this->con_notice);
 		}
+	}
 
-		for (unsigned i = this->proxyscans.size(); i > 0; --i)
-		{
-			ProxyCheck &p = this->proxyscans[i - 1];
+	void OnStats(CommandSource &source, const Anope::string &what, bool &handled) anope_override
+	{
+		if (!what.equals_ci("ALL") && !what.equals_ci("PROXYSCAN"))
+			return;
+		handled = true;
 
-			for (std::set<Anope::string, ci::less>::iterator it = p.types.begin(), it_end = p.types.end(); it != it_end; ++it)
-			{
-				for (unsigned k = 0; k < p.ports.size(); ++k)
-				{
-					try
-					{
-						ProxyConnect *con = NULL;
-						if (it->equals_ci("HTTP"))
-							con = new HTTPProxyConnect(p, p.ports[k]);
-						else if (it->equals_ci("SOCKS5"))
-							con = new SOCKS5ProxyConnect(p, p.ports[k]);
-						else
-							continue;
-						con->Connect(user->ip.addr(), p.ports[k]);
-					}
-					catch (const SocketException &ex)
-					{
-						Log(LOG_DEBUG) << "m_proxyscan: " << ex.GetReason();
-					}
-				}
-			}
-		}
+		const ProxyScheduler &ps = this->proxyscheduler;
+		source.Reply(_("Proxy scans: %u running, %lu queued, %lu started"), ps.Running(), static_cast<unsigned long>(ps.Queued()), ps.scans);
+		source.Reply(_("Proxy scan cache: %lu addresses, %lu of %lu checks answered from the cache"), static_cast<unsigned long>(ps.Cached()), ps.hits, ps.checks);
 	}
 };
 
@@ -8,6 +8,7 @@
 
 #include "module.h"
 #include "modules/redis.h"
+#include <climits>
 
 using namespace Redis;
 
@@ -15,13 +16,76 @@ class MyRedisService;
 
 class RedisSocket : public BinarySocket, public ConnectionSocket
 {
-	size_t ParseReply(Reply &r, const char *buf, size_t l);
+	enum ParseResult
+	{
+		PARSE_OK,
+		PARSE_ATTRIBUTE,
+		PARSE_NEED_DATA,
+		PARSE_ERROR
+	};
+
+	/* An aggregate reply which is still waiting on some of its elements */
+	struct Frame
+	{
+		Reply *reply;
+		int64_t remaining;
+		/* Set for attributes and anything nested in them, which are parsed but thrown away */
+		bool discard;
+		bool attribute;
+
+		Frame(Reply *r, int64_t rem, bool d, bool a) : reply(r), remaining(rem), discard(d), attribute(a) { }
+	};
+
+	/* Received data not yet consumed by the parser starts at rpos */
+	std::vector<char> rbuf;
+	size_t rpos;
+	/* Offset up to which rbuf has already been searched for the end of the current line */
+	size_t scanned;
+	std::vector<Frame> stack;
+
+	/* Largest bulk string and aggregate accepted, anything larger means the stream is corrupt */
+	static const int64_t MAX_BULK = 512 * 1024 * 1024;
+	static const int64_t MAX_ELEMENTS = INT_MAX / 2;
+
+	/** Parse a signed decimal integer
+	 * @return false if it is not one, or does not fit in an int64_t
+	 */
+	static bool ParseInt(const char *p, size_t len, int64_t &i)
+	{
+		bool neg = len && *p == '-';
+		size_t j = neg ? 1 : 0;
+		if (j == len)
+			return false;
+
+		uint64_t u = 0;
+		for (; j < len; ++j)
+		{
+			if (p[j] < '0' || p[j] > '9')
+				return false;
+
+			unsigned digit = p[j] - '0';
+			if (u > (static_cast<uint64_t>(INT64_MAX) + neg - digit) / 10)
+				return false;
+			u = u * 10 + digit;
+		}
+
+		/* Negate via u - 1 so INT64_MIN does not overflow */
+		i = neg && u ? -static_cast<int64_t>(u - 1) - 1 : static_cast<int64_t>(u);
+		return true;
+	}
+
+	const char *FindLine(size_t &len);
+	ParseResult ParseOne(Reply *&out, int64_t &children);
+	void Complete(Reply *r, bool linked);
+	void Dispatch(const Reply &r);
+	void Reset();
+
  public:
 	MyRedisService *provider;
 	std::deque<Interface *> interfaces;
 	std::map<Anope::string, Interface *> subinterfaces;
 
-	RedisSocket(MyRedisService *pro, bool v6) : Socket(-1, v6), provider(pro) { }
+	RedisSocket(MyRedisService *pro, bool v6) : Socket(-1, v6), rpos(0), scanned(0), provider(pro) { }
 
 	~RedisSocket();
 
@@ -259,6 +323,8 @@ class MyRedisService : public Provider
 
 RedisSocket::~RedisSocket()
 {
+	this->Reset();
+
 	if (provider)
 	{
 		if (provider->sock == this)
@@ -296,230 +362,329 @@ void RedisSocket::OnError(const Anope::string &error)
 	Log() << "redis: Error on " << provider->name << (this == this->provider->sub ? " (sub)" : "") << ": " << error;
 }
 
-size_t RedisSocket::ParseReply(Reply &r, const char *buffer, size_t l)
+const char *RedisSocket::FindLine(size_t &len)
 {
-	size_t used = 0;
+	const char *begin = &this->rbuf[this->rpos], *end = &this->rbuf[0] + this->rbuf.size();
+
+	/* Resume scanning where the last incomplete attempt left off */
+	const char *p = begin + (this->scanned > this->rpos ? this->scanned - this->rpos : 0);
+	for (; p + 1 < end; ++p)
+		if (p[0] == '\r' && p[1] == '\n')
+		{
+			len = p - begin;
+			this->scanned = 0;
+			return begin;
+		}
 
-	if (!l)
-		return used;
+	this->scanned = p - &this->rbuf[0];
+	return NULL;
+}
 
-	if (r.type == Reply::MULTI_BULK)
-		goto multi_bulk_cont;
+RedisSocket::ParseResult RedisSocket::ParseOne(Reply *&out, int64_t &children)
+{
+	out = NULL;
+	children = -1;
 
-	switch (*buffer)
+	if (this->rpos >= this->rbuf.size())
+		return PARSE_NEED_DATA;
+
+	size_t len;
+	const char *line = this->FindLine(len);
+	if (line == NULL)
+		return PARSE_NEED_DATA;
+
+	char type = *line;
+	const char *data = line + 1;
+	size_t dlen = len ? len - 1 : 0;
+	/* Bytes taken by the header line, including the type byte and trailing CRLF */
+	size_t header = len + 2;
+
+	switch (type)
 	{
 		case '+':
+		case '-':
+		case ':':
+		case '_':
+		case '#':
+		case ',':
+		case '(':
 		{
-			Anope::string reason(buffer, 1, l - 1);
-			size_t nl = reason.find("\r\n");
-			Log(LOG_DEBUG_2) << "redis: status ok: " << reason.substr(0, nl);
-			if (nl != Anope::string::npos)
+			Reply *r = new Reply();
+			switch (type)
 			{
-				r.type = Reply::OK;
-				used = 1 + nl + 2;
+				case '+':
+					r->type = Reply::OK;
+					r->bulk.str().assign(data, dlen);
+					Log(LOG_DEBUG_2) << "redis: status ok: " << r->bulk;
+					break;
+				case '-':
+					r->type = Reply::NOT_OK;
+					r->bulk.str().assign(data, dlen);
+					Log(LOG_DEBUG) << "redis: status error: " << r->bulk;
+					break;
+				case ':':
+					r->type = Reply::INT;
+					if (!ParseInt(data, dlen, r->i))
+					{
+						Log(LOG_DEBUG) << "redis: invalid integer reply";
+						delete r;
+						return PARSE_ERROR;
+					}
+					break;
+				case '_':
+					/* RESP3 null, treated like a RESP2 null bulk */
+					r->type = Reply::BULK;
+					break;
+				case '#':
+					r->type = Reply::INT;
+					r->i = dlen && *data == 't';
+					break;
+				default:
+					/* Doubles and big numbers are handed to the caller as strings */
+					r->type = Reply::BULK;
+					r->bulk.str().assign(data, dlen);
 			}
-			break;
+			this->rpos += header;
+			out = r;
+			return PARSE_OK;
 		}
-		case '-':
+		case '$':
+		case '=':
+		case '!':
 		{
-			Anope::string reason(buffer, 1, l - 1);
-			size_t nl = reason.find("\r\n");
-			Log(LOG_DEBUG) << "redis: status error: " << reason.substr(0, nl);
-			if (nl != Anope::string::npos)
+			int64_t blen;
+			if (!ParseInt(data, dlen, blen) || blen > MAX_BULK)
 			{
-				r.type = Reply::NOT_OK;
-				used = 1 + nl + 2;
+				Log(LOG_DEBUG) << "redis: invalid bulk length";
+				return PARSE_ERROR;
 			}
-			break;
-		}
-		case ':':
-		{
-			Anope::string ibuf(buffer, 1, l - 1);
-			size_t nl = ibuf.find("\r\n");
-			if (nl != Anope::string::npos)
+			else if (blen < 0)
 			{
-				try
-				{
-					r.i = convertTo<int64_t>(ibuf.substr(0, nl));
-				}
-				catch (const ConvertException &) { }
+				Reply *r = new Reply();
+				r->type = Reply::BULK;
+				this->rpos += header;
+				out = r;
+				return PARSE_OK;
+			}
 
-				r.type = Reply::INT;
-				used = 1 + nl + 2;
+			/* Wait until the whole bulk is buffered, without consuming the header */
+			size_t need = header + static_cast<size_t>(blen) + 2;
+			if (this->rbuf.size() - this->rpos < need)
+			{
+				if (this->rbuf.capacity() < this->rpos + need)
+					this->rbuf.reserve(this->rpos + need);
+				/* The header is already known to be complete, so don't rescan it */
+				this->scanned = this->rpos + header - 2;
+				return PARSE_NEED_DATA;
 			}
-			break;
-		}
-		case '$':
-		{
-			Anope::string reply(buffer + 1, l - 1);
-			/* This assumes one bulk can always fit in our recv buffer */
-			size_t nl = reply.find("\r\n");
-			if (nl != Anope::string::npos)
+
+			const char *payload = line + header;
+			size_t plen = blen;
+			/* Verbatim strings carry a three byte format and a colon before the payload */
+			if (type == '=' && plen >= 4)
 			{
-				int len;
-				try
-				{
-					len = convertTo<int>(reply.substr(0, nl));
-					if (len >= 0)
-					{
-						if (1 + nl + 2 + len + 2 <= l)
-						{
-							used = 1 + nl + 2 + len + 2;
-							r.bulk = reply.substr(nl + 2, len);
-							r.type = Reply::BULK;
-						}
-					}
-					else
-					{
-						used = 1 + nl + 2 + 2;
-						r.type = Reply::BULK;
-					}
-				}
-				catch (const ConvertException &) { }
+				payload += 4;
+				plen -= 4;
 			}
-			break;
+
+			Reply *r = new Reply();
+			r->type = type == '!' ? Reply::NOT_OK : Reply::BULK;
+			/* The only copy made of the payload, straight out of the receive buffer */
+			r->bulk.str().assign(payload, plen);
+			this->rpos += need;
+			out = r;
+			return PARSE_OK;
 		}
-		multi_bulk_cont:
 		case '*':
+		case '%':
+		case '~':
+		case '>':
+		case '|':
 		{
-			if (r.type != Reply::MULTI_BULK)
-			{
-				Anope::string reply(buffer + 1, l - 1);
-				size_t nl = reply.find("\r\n");
-				if (nl != Anope::string::npos)
-				{
-					r.type = Reply::MULTI_BULK;
-					try
-					{
-						r.multi_bulk_size = convertTo<int>(reply.substr(0, nl));
-					}
-					catch (const ConvertException &) { }
-
-					used = 1 + nl + 2;
-				}
-				else
-					break;
-			}
-			else if (r.multi_bulk_size >= 0 && r.multi_bulk.size() == static_cast<unsigned>(r.multi_bulk_size))
+			int64_t count;
+			if (!ParseInt(data, dlen, count) || count > MAX_ELEMENTS)
 			{
-				/* This multi bulk is already complete, so check the sub bulks */
-				for (unsigned i = 0; i < r.multi_bulk.size(); ++i)
-					if (r.multi_bulk[i]->type == Reply::MULTI_BULK)
-						ParseReply(*r.multi_bulk[i], buffer + used, l - used);
-				break;
+				Log(LOG_DEBUG) << "redis: invalid aggregate length";
+				return PARSE_ERROR;
 			}
+			this->rpos += header;
 
-			for (int i = r.multi_bulk.size(); i < r.multi_bulk_size; ++i)
+			Reply *r = new Reply();
+			r->type = Reply::MULTI_BULK;
+			if (count < 0)
 			{
-				Reply *reply = new Reply();
-				size_t u = ParseReply(*reply, buffer + used, l - used);
-				if (!u)
-				{
-					Log(LOG_DEBUG) << "redis: ran out of data to parse";
-					delete reply;
-					break;
-				}
-				r.multi_bulk.push_back(reply);
-				used += u;
+				out = r;
+				return PARSE_OK;
 			}
-			break;
+
+			/* Maps and attributes are flattened into key, value, key, value, ... */
+			if (type == '%' || type == '|')
+				count *= 2;
+
+			r->multi_bulk_size = static_cast<int>(count);
+			out = r;
+			children = count;
+			return type == '|' ? PARSE_ATTRIBUTE : PARSE_OK;
 		}
 		default:
-			Log(LOG_DEBUG) << "redis: unknown reply " << *buffer;
+			Log(LOG_DEBUG) << "redis: unknown reply " << type;
+			return PARSE_ERROR;
 	}
-
-	return used;
 }
 
-bool RedisSocket::Read(const char *buffer, size_t l)
+void RedisSocket::Dispatch(const Reply &r)
 {
-	static std::vector<char> save;
-	std::vector<char> copy;
-
-	if (!save.empty())
+	if (this == provider->sub)
 	{
-		std::copy(buffer, buffer + l, std::back_inserter(save));
-
-		copy = save;
-
-		buffer = &copy[0];
-		l = copy.size();
+		if (r.multi_bulk.size() == 4)
+		{
+			/* pmessage
+			 * pattern subscribed to
+			 * __keyevent@0__:set
+			 * key
+			 */
+			std::map<Anope::string, Interface *>::iterator it = this->subinterfaces.find(r.multi_bulk[1]->bulk);
+			if (it != this->subinterfaces.end())
+				it->second->OnResult(r);
+		}
 	}
-
-	while (l)
+	else
 	{
-		static Reply r;
-
-		size_t used = this->ParseReply(r, buffer, l);
-		if (!used)
+		if (this->interfaces.empty())
 		{
-			Log(LOG_DEBUG) << "redis: used == 0 ?";
-			r.Clear();
-			break;
+			Log(LOG_DEBUG) << "redis: no interfaces?";
 		}
-		else if (used > l)
+		else
 		{
-			Log(LOG_DEBUG) << "redis: used > l ?";
-			r.Clear();
-			break;
+			Interface *i = this->interfaces.front();
+			this->interfaces.pop_front();
+
+			if (i)
+			{
+				if (r.type != Reply::NOT_OK)
+					i->OnResult(r);
+				else
+					i->OnError(r.bulk);
+			}
 		}
+	}
+}
 
-		/* Full result is not here yet */
-		if (r.type == Reply::MULTI_BULK && static_cast<unsigned>(r.multi_bulk_size) != r.multi_bulk.size())
+void RedisSocket::Complete(Reply *r, bool linked)
+{
+	for (;;)
+	{
+		if (this->stack.empty())
 		{
-			buffer += used;
-			l -= used;
-			break;
+			this->Dispatch(*r);
+			delete r;
+			return;
 		}
 
-		if (this == provider->sub)
+		Frame &parent = this->stack.back();
+		if (parent.discard)
+			delete r;
+		else if (!linked)
+			parent.reply->multi_bulk.push_back(r);
+
+		if (--parent.remaining > 0)
+			return;
+
+		/* The parent is now complete, which completes an element of its own parent */
+		Frame f = parent;
+		this->stack.pop_back();
+
+		if (f.attribute)
 		{
-			if (r.multi_bulk.size() == 4)
-			{
-				/* pmessage
-				 * pattern subscribed to
-				 * __keyevent@0__:set
-				 * key
-				 */
-				std::map<Anope::string, Interface *>::iterator it = this->subinterfaces.find(r.multi_bulk[1]->bulk);
-				if (it != this->subinterfaces.end())
-					it->second->OnResult(r);
-			}
+			/* Attributes describe the reply that follows them and are not an element themselves */
+			delete f.reply;
+			return;
 		}
-		else
+
+		r = f.reply;
+		linked = !f.discard;
+	}
+}
+
+void RedisSocket::Reset()
+{
+	for (unsigned i = 0; i < this->stack.size(); ++i)
+		if (i == 0 || this->stack[i].discard)
+			delete this->stack[i].reply;
+	this->stack.clear();
+	this->rbuf.clear();
+	this->rpos = this->scanned = 0;
+}
+
+bool RedisSocket::Read(const char *buffer, size_t l)
+{
+	/* Replies are parsed in place from rbuf. Parsing state for partially received
+	 * aggregates is kept on the stack so that a reply is never reparsed from the
+	 * beginning, no matter how many reads it is spread across.
+	 */
+	this->rbuf.insert(this->rbuf.end(), buffer, buffer + l);
+
+	for (;;)
+	{
+		Reply *r;
+		int64_t children;
+
+		ParseResult res = this->ParseOne(r, children);
+		if (res == PARSE_NEED_DATA)
+			break;
+		else if (res == PARSE_ERROR)
 		{
-			if (this->interfaces.empty())
-			{
-				Log(LOG_DEBUG) << "redis: no interfaces?";
-			}
-			else
-			{
-				Interface *i = this->interfaces.front();
-				this->interfaces.pop_front();
+			/* There is no telling where the next reply starts, so replies can no longer be
+			 * matched to the interfaces waiting on them. Fail those and drop the connection,
+			 * which is made again for the next command.
+			 */
+			Log() << "redis: Unable to parse a reply from " << provider->name << (this == this->provider->sub ? " (sub)" : "") << ", reconnecting";
+
+			std::deque<Interface *> pending;
+			pending.swap(this->interfaces);
+			for (unsigned i = 0; i < pending.size(); ++i)
+				if (pending[i])
+					pending[i]->OnError("Unable to parse reply");
+
+			this->Reset();
+			return false;
+		}
 
-				if (i)
-				{
-					if (r.type != Reply::NOT_OK)
-						i->OnResult(r);
-					else
-						i->OnError(r.bulk);
-				}
-			}
+		bool attribute = res == PARSE_ATTRIBUTE,
+			discard = attribute || (!this->stack.empty() && this->stack.back().discard);
+
+		if (children > 0)
+		{
+			/* Aggregates are linked into their parent as soon as they start,
+			 * and filled in as their elements arrive
+			 */
+			if (!discard && !this->stack.empty())
+				this->stack.back().reply->multi_bulk.push_back(r);
+			this->stack.push_back(Frame(r, children, discard, attribute));
+			continue;
 		}
 
-		buffer += used;
-		l -= used;
+		if (attribute)
+		{
+			delete r;
+			continue;
+		}
 
-		r.Clear();
+		this->Complete(r, false);
 	}
 
-	if (l)
+	/* Compact the consumed part of the buffer once it dominates */
+	if (this->rpos == this->rbuf.size())
 	{
-		save.resize(l);
-		std::copy(buffer, buffer + l, save.begin());
+		this->rbuf.clear();
+		this->rpos = this->scanned = 0;
+	}
+	else if (this->rpos > this->rbuf.size() / 2)
+	{
+		this->rbuf.erase(this->rbuf.begin(), this->rbuf.begin() + this->rpos);
+		this->scanned = this->scanned > this->rpos ? this->scanned - this->rpos : 0;
+		this->rpos = 0;
 	}
-	else
-		std::vector<char>().swap(save);
 
 	return true;
 }
@@ -10,34 +10,402 @@
 #include "modules/xmlrpc.h"
 #include "modules/httpd.h"
 
-static struct special_chars
+/* A value in a JSON-RPC request */
+struct JSONValue
 {
-	Anope::string character;
-	Anope::string replace;
+	enum Type
+	{
+		JSON_NULL,
+		JSON_BOOL,
+		JSON_NUMBER,
+		JSON_STRING,
+		JSON_ARRAY,
+		JSON_OBJECT
+	} type;
+
+	/* The contents of strings, and the text of other values as it was sent */
+	Anope::string str;
+	/* The elements of arrays, and the values of objects */
+	std::vector<JSONValue> items;
+	/* The names of the values of objects */
+	std::vector<Anope::string> keys;
+
+	JSONValue() : type(JSON_NULL) { }
+
+	const JSONValue *Get(const Anope::string &key) const
+	{
+		for (unsigned i = 0; i < this->keys.size(); ++i)
+			if (this->keys[i] == key)
+				return &this->items[i];
+		return NULL;
+	}
+};
+
+/* Parses a JSON document in one pass */
+class JSONParser
+{
+	const Anope::string &text;
+	size_t pos;
+
+	/* Deepest nesting allowed, as values are parsed recursively */
+	static const unsigned MAX_DEPTH = 32;
+
+	void SkipSpace()
+	{
+		while (pos < text.length() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r' || text[pos] == '\n'))
+			++pos;
+	}
+
+	/* Skip one or more digits, returns false if there are none */
+	bool SkipDigits()
+	{
+		size_t start = pos;
+		while (pos < text.length() && text[pos] >= '0' && text[pos] <= '9')
+			++pos;
+		return pos != start;
+	}
+
+	static void AppendUTF8(Anope::string &out, unsigned long c)
+	{
+		if (c < 0x80)
+			out += static_cast<char>(c);
+		else if (c < 0x800)
+		{
+			out += static_cast<char>(0xC0 | (c >> 6));
+			out += static_cast<char>(0x80 | (c & 0x3F));
+		}
+		else if (c < 0x10000)
+		{
+			out += static_cast<char>(0xE0 | (c >> 12));
+			out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (c & 0x3F));
+		}
+		else
+		{
+			out += static_cast<char>(0xF0 | (c >> 18));
+			out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+			out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (c & 0x3F));
+		}
+	}
+
+	bool ParseHex(unsigned long &c)
+	{
+		if (pos + 4 > text.length())
+			return false;
+
+		c = 0;
+		for (unsigned i = 0; i < 4; ++i)
+		{
+			char h = text[pos++];
+			c <<= 4;
+			if (h >= '0' && h <= '9')
+				c |= h - '0';
+			else if (h >= 'a' && h <= 'f')
+				c |= h - 'a' + 10;
+			else if (h >= 'A' && h <= 'F')
+				c |= h - 'A' + 10;
+			else
+				return false;
+		}
+		return true;
+	}
+
+	bool ParseString(Anope::string &out)
+	{
+		/* Skip the opening quote */
+		++pos;
+
+		while (pos < text.length())
+		{
+			char c = text[pos++];
+
+			if (c == '"')
+				return true;
+			else if (static_cast<unsigned char>(c) < 0x20)
+				return false;
+			else if (c != '\\')
+			{
+				out += c;
+				continue;
+			}
+
+			if (pos >= text.length())
+				return false;
+
+			switch (text[pos++])
+			{
+				case '"':
+					out += '"';
+					break;
+				case '\\':
+					out += '\\';
+					break;
+				case '/':
+					out += '/';
+					break;
+				case 'b':
+					out += '\b';
+					break;
+				case 'f':
+					out += '\f';
+					break;
+				case 'n':
+					out += '\n';
+					break;
+				case 'r':
+					out += '\r';
+					break;
+				case 't':
+					out += '\t';
+					break;
+				case 'u':
+				{
+					unsigned long u;
+					if (!this->ParseHex(u))
+						return false;
+
+					/* Characters outside of the BMP are sent as a surrogate pair */
+					if (u >= 0xD800 && u <= 0xDBFF && pos + 1 < text.length() && text[pos] == '\\' && text[pos + 1] == 'u')
+					{
+						pos += 2;
+						unsigned long low;
+						if (!this->ParseHex(low) || low < 0xDC00 || low > 0xDFFF)
+							return false;
+						u = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+					}
+
+					AppendUTF8(out, u);
+					break;
+				}
+				default:
+					return false;
+			}
+		}
+
+		return false;
+	}
+
+	bool ParseValue(JSONValue &v, unsigned depth)
+	{
+		if (depth > MAX_DEPTH || pos >= text.length())
+			return false;
+
+		size_t start = pos;
+		char c = text[pos];
+
+		if (c == '"')
+		{
+			v.type = JSONValue::JSON_STRING;
+			return this->ParseString(v.str);
+		}
+		else if (c == '[' || c == '{')
+		{
+			bool object = c == '{';
+			v.type = object ? JSONValue::JSON_OBJECT : JSONValue::JSON_ARRAY;
 
-	special_chars(const Anope::string &c, const Anope::string &r) : character(c), replace(r) { }
+			++pos;
+			this->SkipSpace();
+			if (pos < text.length() && text[pos] == (object ? '}' : ']'))
+			{
+				++pos;
+				return true;
+			}
+
+			for (;;)
+			{
+				if (object)
+				{
+					if (pos >= text.length() || text[pos] != '"')
+						return false;
+
+					v.keys.push_back("");
+					if (!this->ParseString(v.keys.back()))
+						return false;
+
+					this->SkipSpace();
+					if (pos >= text.length() || text[pos] != ':')
+						return false;
+					++pos;
+					this->SkipSpace();
+				}
+
+				v.items.push_back(JSONValue());
+				if (!this->ParseValue(v.items.back(), depth + 1))
+					return false;
+
+				this->SkipSpace();
+				if (pos >= text.length())
+					return false;
+
+				c = text[pos++];
+				if (c == (object ? '}' : ']'))
+					return true;
+				else if (c != ',')
+					return false;
+				this->SkipSpace();
+			}
+		}
+		else if (c == '-' || (c >= '0' && c <= '9'))
+		{
+			/* Numbers are kept as they were sent and may be echoed back as ids, so they must be valid JSON */
+			if (c == '-')
+				++pos;
+			if (pos < text.length() && text[pos] == '0')
+				++pos;
+			else if (!this->SkipDigits())
+				return false;
+			if (pos < text.length() && text[pos] == '.')
+			{
+				++pos;
+				if (!this->SkipDigits())
+					return false;
+			}
+			if (pos < text.length() && (text[pos] == 'e' || text[pos] == 'E'))
+			{
+				++pos;
+				if (pos < text.length() && (text[pos] == '+' || text[pos] == '-'))
+					++pos;
+				if (!this->SkipDigits())
+					return false;
+			}
+
+			v.type = JSONValue::JSON_NUMBER;
+			v.str = text.substr(start, pos - start);
+			return true;
+		}
+
+		static const char *literals[] = { "true", "false", "null" };
+		for (unsigned i = 0; i < 3; ++i)
+		{
+			size_t len = strlen(literals[i]);
+			if (text.str().compare(pos, len, literals[i]) == 0)
+			{
+				pos += len;
+				v.type = i < 2 ? JSONValue::JSON_BOOL : JSONValue::JSON_NULL;
+				v.str = literals[i];
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+ public:
+	JSONParser(const Anope::string &t) : text(t), pos(0) { }
+
+	bool Parse(JSONValue &v)
+	{
+		this->SkipSpace();
+		if (!this->ParseValue(v, 0))
+			return false;
+		this->SkipSpace();
+		return pos == text.length();
+	}
+};
+
+static void JSONEscape(Anope::string &out, const Anope::string &str)
+{
+	out += '"';
+	for (unsigned i = 0; i < str.length(); ++i)
+	{
+		char c = str[i];
+
+		switch (c)
+		{
+			case '"':
+				out += "\\\"";
+				break;
+			case '\\':
+				out += "\\\\";
+				break;
+			case '\n':
+				out += "\\n";
+				break;
+			case '\r':
+				out += "\\r";
+				break;
+			case '\t':
+				out += "\\t";
+				break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20)
+				{
+					char buf[8];
+					snprintf(buf, sizeof(buf), "\\u%04x", c);
+					out += buf;
+				}
+				else
+					out += c;
+		}
+	}
+	out += '"';
+}
+
+static Anope::string JSONError(const Anope::string &id, int code, const Anope::string &message)
+{
+	Anope::string out = "{\"jsonrpc\":\"2.0\",\"error\":{\"code\":" + stringify(code) + ",\"message\":";
+	JSONEscape(out, message);
+	out += "},\"id\":" + (id.empty() ? "null" : id) + "}";
+	return out;
 }
-special[] = {
-	special_chars("&", "&amp;"),
-	special_chars("\"", "&quot;"),
-	special_chars("<", "&lt;"),
-	special_chars(">", "&qt;"),
-	special_chars("'", "&#39;"),
-	special_chars("\n", "&#xA;"),
-	special_chars("\002", ""), // bold
-	special_chars("\003", ""), // color
-	special_chars("\035", ""), // italics
-	special_chars("\037", ""), // underline
-	special_chars("\026", ""), // reverses
-	special_chars("", "")
+
+/* The calls in one JSON-RPC request, waiting for the ones which are answered later */
+struct JSONRPCBatch
+{
+	Reference<HTTPClient> client;
+	/* Given to the events as the reply of each call, and used to send the answer if it is sent later */
+	HTTPReply reply;
+	/* Whether the calls were sent in an array */
+	bool array;
+	/* The id of each call, as it was sent. Empty for notifications, which are not answered */
+	std::vector<Anope::string> ids;
+	/* The answer to each call */
+	std::vector<Anope::string> responses;
+	/* Number of calls not answered yet */
+	unsigned pending;
+
+	JSONRPCBatch(HTTPClient *c) : client(c), array(false), pending(0) { }
+
+	Anope::string Serialize() const
+	{
+		Anope::string out;
+
+		for (unsigned i = 0; i < this->responses.size(); ++i)
+		{
+			if (this->responses[i].empty())
+				continue;
+			if (!out.empty())
+				out += ',';
+			out += this->responses[i];
+		}
+
+		/* A batch of only notifications gets no answer at all */
+		if (this->array && !out.empty())
+			out = "[" + out + "]";
+		return out;
+	}
 };
 
 class MyXMLRPCServiceInterface : public XMLRPCServiceInterface, public HTTPPage
 {
 	std::deque<XMLRPCEvent *> events;
 
+	/* JSON-RPC requests with calls which are answered later */
+	std::map<unsigned long, JSONRPCBatch *> batches;
+	unsigned long batch_id;
+
+	/* Most calls allowed in one JSON-RPC request */
+	static const unsigned MAX_BATCH = 1000;
+
  public:
-	MyXMLRPCServiceInterface(Module *creator, const Anope::string &sname) : XMLRPCServiceInterface(creator, sname), HTTPPage("/xmlrpc", "text/xml") { }
+	MyXMLRPCServiceInterface(Module *creator, const Anope::string &sname) : XMLRPCServiceInterface(creator, sname), HTTPPage("/xmlrpc", "text/xml"), batch_id(0) { }
+
+	~MyXMLRPCServiceInterface()
+	{
+		for (std::map<unsigned long, JSONRPCBatch *>::iterator it = this->batches.begin(), it_end = this->batches.end(); it != it_end; ++it)
+			delete it->second;
+	}
 
 	void Register(XMLRPCEvent *event)
 	{
@@ -54,135 +422,308 @@ class MyXMLRPCServiceInterface : public XMLRPCServiceInterface, public HTTPPage
 
 	Anope::string Sanitize(const Anope::string &string) anope_override
 	{
-		Anope::string ret = string;
-		for (int i = 0; special[i].character.empty() == false; ++i)
-			ret = ret.replace_all_cs(special[i].character, special[i].replace);
+		Anope::string ret;
+		for (unsigned i = 0; i < string.length(); ++i)
+		{
+			switch (string[i])
+			{
+				case '&':
+					ret += "&amp;";
+					break;
+				case '"':
+					ret += "&quot;";
+					break;
+				case '<':
+					ret += "&lt;";
+					break;
+				case '>':
+					ret += "&gt;";
+					break;
+				case '\'':
+					ret += "&#39;";
+					break;
+				case '\n':
+					ret += "&#xA;";
+					break;
+				case '\002': // bold
+				case '\003': // color
+				case '\035': // italics
+				case '\037': // underline
+				case '\026': // reverses
+					break;
+				default:
+					ret += string[i];
+			}
+		}
 		return ret;
 	}
 
-	static Anope::string Unescape(const Anope::string &string)
+	/* Decode the entities in text between start and end */
+	static Anope::string Unescape(const Anope::string &string, size_t start, size_t end)
 	{
-		Anope::string ret = string;
-		for (int i = 0; special[i].character.empty() == false; ++i)
-			if (!special[i].replace.empty())
-				ret = ret.replace_all_cs(special[i].replace, special[i].character);
+		Anope::string ret;
 
-		for (size_t i, last = 0; (i = string.find("&#", last)) != Anope::string::npos;)
+		for (size_t i = start; i < end; ++i)
 		{
-			last = i + 1;
-
-			size_t end = string.find(';', i);
-			if (end == Anope::string::npos)
-				break;
-
-			Anope::string ch = string.substr(i + 2, end - (i + 2));
-
-			if (ch.empty())
+			size_t semi;
+			if (string[i] != '&' || (semi = string.find(';', i)) == Anope::string::npos || semi >= end)
+			{
+				ret += string[i];
 				continue;
+			}
 
-			long l;
-			if (!ch.empty() && ch[0] == 'x')
-				l = strtol(ch.substr(1).c_str(), NULL, 16);
+			const Anope::string entity = string.substr(i + 1, semi - i - 1);
+			if (entity == "amp")
+				ret += '&';
+			else if (entity == "quot")
+				ret += '"';
+			else if (entity == "lt")
+				ret += '<';
+			else if (entity == "gt" || entity == "qt")
+				ret += '>';
+			else if (entity == "apos")
+				ret += '\'';
+			else if (entity.length() > 1 && entity[0] == '#')
+			{
+				long l;
+				if (entity[1] == 'x')
+					l = strtol(entity.c_str() + 2, NULL, 16);
+				else
+					l = strtol(entity.c_str() + 1, NULL, 10);
+
+				if (l > 0 && l < 256)
+					ret += static_cast<char>(l);
+				else
+					ret += string.substr(i, semi - i + 1);
+			}
 			else
-				l = strtol(ch.c_str(), NULL, 10);
+				ret += string.substr(i, semi - i + 1);
 
-			if (l > 0 && l < 256)
-				ret = ret.replace_all_cs("&#" + ch + ";", Anope::string(l));
+			i = semi;
 		}
 
 		return ret;
 	}
 
  private:
-	static bool GetData(Anope::string &content, Anope::string &tag, Anope::string &data)
+	/** Find the next text in an XML document
+	 * @param content The document
+	 * @param pos Where to start looking, moved past the text found
+	 * @param tag Set to the tag the text follows
+	 * @param data Set to the text
+	 * @return true if text was found
+	 */
+	static bool GetData(const Anope::string &content, size_t &pos, Anope::string &tag, Anope::string &data)
 	{
-		if (content.empty())
-			return false;
-
-		Anope::string prev, cur;
-		bool istag;
+		size_t tag_start = 0, tag_end = 0;
 
-		do
+		while (pos < content.length())
 		{
-			prev = cur;
-			cur.clear();
-
-			size_t len = 0;
-			istag = false;
-
-			if (content[0] == '<')
+			if (content[pos] == '<')
 			{
-				len = content.find_first_of('>');
-				istag = true;
-			}
-			else if (content[0] != '>')
-			{
-				len = content.find_first_of('<');
+				size_t end = content.find('>', pos);
+				if (end == Anope::string::npos)
+					break;
+
+				tag_start = pos + 1;
+				tag_end = end;
+				pos = end + 1;
+				continue;
 			}
 
-			// len must advance
-			if (len == Anope::string::npos || len == 0)
+			size_t end = content.find('<', pos);
+			if (end == Anope::string::npos)
+				end = content.length();
+
+			/* Whitespace between tags is not data */
+			size_t first = content.find_first_not_of(" \t\r\n", pos);
+			size_t start = pos;
+			pos = end;
+			if (first == Anope::string::npos || first >= end)
+				continue;
+
+			while (content[start] == ' ')
+				++start;
+
+			tag = content.substr(tag_start, tag_end - tag_start);
+			data = Unescape(content, start, end);
+			return true;
+		}
+
+		pos = content.length();
+		return false;
+	}
+
+	/** Run the events for a request
+	 * @return false if an event will answer the request later
+	 */
+	bool RunEvents(HTTPClient *client, XMLRPCRequest &request)
+	{
+		for (unsigned i = 0; i < this->events.size(); ++i)
+		{
+			XMLRPCEvent *e = this->events[i];
+
+			if (!e->Run(this, client, request))
+				return false;
+			else if (!request.get_replies().empty())
 				break;
+		}
 
-			if (istag)
-			{
-				cur = content.substr(1, len - 1);
-				content.erase(0, len + 1);
-				while (!content.empty() && content[0] == ' ')
-					content.erase(content.begin());
-			}
-			else
-			{
-				cur = content.substr(0, len);
-				content.erase(0, len);
-			}
+		return true;
+	}
+
+	/* Record the answer to a call of a JSON-RPC request */
+	void Complete(JSONRPCBatch *batch, XMLRPCRequest &request)
+	{
+		const Anope::string &id = batch->ids[request.index];
+		--batch->pending;
+
+		if (id.empty())
+			return;
+
+		const std::map<Anope::string, Anope::string> &replies = request.get_replies();
+		if (replies.empty())
+		{
+			batch->responses[request.index] = JSONError(id, -32601, "Method not found");
+			return;
 		}
-		while (istag && !content.empty());
 
-		tag = Unescape(prev);
-		data = Unescape(cur);
-		return !istag && !data.empty();
+		Anope::string &out = batch->responses[request.index];
+		out = "{\"jsonrpc\":\"2.0\",\"result\":{";
+		for (std::map<Anope::string, Anope::string>::const_iterator it = replies.begin(); it != replies.end(); ++it)
+		{
+			if (it != replies.begin())
+				out += ',';
+			JSONEscape(out, it->first);
+			out += ':';
+			/* Values are sanitized for XML by the callers, so undo that */
+			JSONEscape(out, Unescape(it->second, 0, it->second.length()));
+		}
+		out += "},\"id\":" + id + "}";
 	}
 
  public:
 	bool OnRequest(HTTPProvider *provider, const Anope::string &page_name, HTTPClient *client, HTTPMessage &message, HTTPReply &reply) anope_override
 	{
-		Anope::string content = message.content, tname, data;
+		const Anope::string &content = message.content;
+		Anope::string tname, data;
+		size_t pos = 0;
 		XMLRPCRequest request(reply);
 
-		while (GetData(content, tname, data))
+		while (GetData(content, pos, tname, data))
 		{
 			Log(LOG_DEBUG) << "m_xmlrpc: Tag name: " << tname << ", data: " << data;
 			if (tname == "methodName")
 				request.name = data;
 			else if (tname == "name" && data == "id")
 			{
-				GetData(content, tname, data);
+				GetData(content, pos, tname, data);
 				request.id = data;
 			}
 			else if (tname == "string")
 				request.data.push_back(data);
 		}
 
-		for (unsigned i = 0; i < this->events.size(); ++i)
+		if (!this->RunEvents(client, request))
+			return false;
+		else if (!request.get_replies().empty())
 		{
-			XMLRPCEvent *e = this->events[i];
+			this->Reply(request);
+			return true;
+		}
 
-			if (!e->Run(this, client, request))
-				return false;
-			else if (!request.get_replies().empty())
+		reply.error = HTTP_PAGE_NOT_FOUND;
+		reply.Write("Unrecognized query");
+		return true;
+	}
+
+	/* Handles a JSON-RPC 2.0 request, which may be a batch of calls */
+	bool OnJSONRequest(HTTPClient *client, HTTPMessage &message, HTTPReply &reply)
+	{
+		JSONValue root;
+		if (!JSONParser(message.content).Parse(root))
+		{
+			reply.Write(JSONError("", -32700, "Parse error"));
+			return true;
+		}
+
+		std::vector<const JSONValue *> calls;
+		if (root.type == JSONValue::JSON_ARRAY)
+			for (unsigned i = 0; i < root.items.size(); ++i)
+				calls.push_back(&root.items[i]);
+		else
+			calls.push_back(&root);
+
+		if (calls.empty() || calls.size() > MAX_BATCH)
+		{
+			reply.Write(JSONError("", -32600, calls.empty() ? "Invalid Request" : "Too many calls"));
+			return true;
+		}
+
+		unsigned long id = ++this->batch_id;
+		JSONRPCBatch *batch = new JSONRPCBatch(client);
+		batch->array = root.type == JSONValue::JSON_ARRAY;
+		/* The batch's reply is sent as is if a call is answered later */
+		batch->reply.content_type = reply.content_type;
+		batch->ids.resize(calls.size());
+		batch->responses.resize(calls.size());
+		/* One more than the number of calls, so the batch can not be finished by a call answered while the others are still being run */
+		batch->pending = calls.size() + 1;
+		this->batches[id] = batch;
+
+		for (unsigned i = 0; i < calls.size(); ++i)
+		{
+			const JSONValue &call = *calls[i];
+			const JSONValue *method = call.Get("method"), *params = call.Get("params"), *call_id = call.Get("id");
+
+			if (call_id)
+				batch->ids[i] = call_id->type == JSONValue::JSON_STRING ? "" : call_id->str;
+			if (call_id && call_id->type == JSONValue::JSON_STRING)
+				JSONEscape(batch->ids[i], call_id->str);
+
+			if (call.type != JSONValue::JSON_OBJECT || !method || method->type != JSONValue::JSON_STRING || (params && params->type != JSONValue::JSON_ARRAY))
 			{
-				this->Reply(request);
-				return true;
+				batch->responses[i] = JSONError(batch->ids[i], -32600, "Invalid Request");
+				--batch->pending;
+				continue;
 			}
+
+			XMLRPCRequest request(batch->reply);
+			request.name = method->str;
+			request.batch = id;
+			request.index = i;
+
+			bool valid = true;
+			for (unsigned j = 0; params && j < params->items.size(); ++j)
+			{
+				const JSONValue &param = params->items[j];
+				if (param.type == JSONValue::JSON_ARRAY || param.type == JSONValue::JSON_OBJECT)
+					valid = false;
+				else
+					request.data.push_back(param.type == JSONValue::JSON_NULL ? "" : param.str);
+			}
+
+			if (!valid)
+			{
+				batch->responses[i] = JSONError(batch->ids[i], -32602, "Invalid params");
+				--batch->pending;
+				continue;
+			}
+
+			if (this->RunEvents(client, request))
+				this->Complete(batch, request);
 		}
 
-		reply.error = HTTP_PAGE_NOT_FOUND;
-		reply.Write("Unrecognized query");
+		if (--batch->pending)
+			return false;
+
+		reply.Write(batch->Serialize());
+		this->batches.erase(id);
+		delete batch;
 		return true;
 	}
 
-	void Reply(XMLRPCRequest &request)
+	void Reply(XMLRPCRequest &request) anope_override
 	{
 		if (!request.id.empty())
 			request.reply("id", request.id);
@@ -194,6 +735,47 @@ class MyXMLRPCServiceInterface : public XMLRPCServiceInterface, public HTTPPage
 
 		request.r.Write(r);
 	}
+
+	void Finish(HTTPClient *client, XMLRPCRequest &request) anope_override
+	{
+		if (!request.batch)
+		{
+			this->Reply(request);
+			if (client)
+				client->SendReply(&request.r);
+			return;
+		}
+
+		std::map<unsigned long, JSONRPCBatch *>::iterator it = this->batches.find(request.batch);
+		if (it == this->batches.end())
+			return;
+
+		JSONRPCBatch *batch = it->second;
+		this->Complete(batch, request);
+		if (batch->pending)
+			return;
+
+		batch->reply.Write(batch->Serialize());
+		if (batch->client)
+			batch->client->SendReply(&batch->reply);
+
+		this->batches.erase(it);
+		delete batch;
+	}
+};
+
+/* The JSON-RPC endpoint, which runs the same events as XMLRPC */
+class JSONRPCPage : public HTTPPage
+{
+	MyXMLRPCServiceInterface &xmlrpc;
+
+ public:
+	JSONRPCPage(MyXMLRPCServiceInterface &x) : HTTPPage("/jsonrpc", "application/json"), xmlrpc(x) { }
+
+	bool OnRequest(HTTPProvider *provider, const Anope::string &page_name, HTTPClient *client, HTTPMessage &message, HTTPReply &reply) anope_override
+	{
+		return this->xmlrpc.OnJSONRequest(client, message, reply);
+	}
 };
 
 class ModuleXMLRPC : public Module
@@ -201,9 +783,10 @@ class ModuleXMLRPC : public Module
 	ServiceReference<HTTPProvider> httpref;
  public:
 	MyXMLRPCServiceInterface xmlrpcinterface;
+	JSONRPCPage jsonrpcpage;
 
 	ModuleXMLRPC(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, EXTRA | VENDOR),
-		xmlrpcinterface(this, "xmlrpc")
+		xmlrpcinterface(this, "xmlrpc"), jsonrpcpage(xmlrpcinterface)
 	{
 
 	}
@@ -211,17 +794,24 @@ class ModuleXMLRPC : public Module
 	~ModuleXMLRPC()
 	{
 		if (httpref)
+		{
 			httpref->UnregisterPage(&xmlrpcinterface);
+			httpref->UnregisterPage(&jsonrpcpage);
+		}
 	}
 
 	void OnReload(Configuration::Conf *conf) anope_override
 	{
 		if (httpref)
+		{
 			httpref->UnregisterPage(&xmlrpcinterface);
+			httpref->UnregisterPage(&jsonrpcpage);
+		}
 		this->httpref = ServiceReference<HTTPProvider>("HTTPProvider", conf->GetModule(this)->Get<const Anope::string>("server", "httpd/main"));
 		if (!httpref)
 			throw ConfigException("Unable to find http reference, is m_httpd loaded?");
 		httpref->RegisterPage(&xmlrpcinterface);
+		httpref->RegisterPage(&jsonrpcpage);
 	}
 };
 
@@ -13,40 +13,40 @@ static Module *me;
 
 class XMLRPCIdentifyRequest : public IdentifyRequest
 {
+	HTTPReply repl; /* The request's HTTPReply may be gone by the time we are answered, so keep our own */
 	XMLRPCRequest request;
-	HTTPReply repl; /* Request holds a reference to the HTTPReply, because we might exist long enough to invalidate it
-	                   we'll copy it here then reset the reference before we use it */
 	Reference<HTTPClient> client;
 	Reference<XMLRPCServiceInterface> xinterface;
 
  public:
-	XMLRPCIdentifyRequest(Module *m, XMLRPCRequest& req, HTTPClient *c, XMLRPCServiceInterface* iface, const Anope::string &acc, const Anope::string &pass) : IdentifyRequest(m, acc, pass), request(req), repl(request.r), client(c), xinterface(iface) { }
+	XMLRPCIdentifyRequest(Module *m, XMLRPCRequest& req, HTTPClient *c, XMLRPCServiceInterface* iface, const Anope::string &acc, const Anope::string &pass) : IdentifyRequest(m, acc, pass), repl(req.r), request(repl), client(c), xinterface(iface)
+	{
+		request.name = req.name;
+		request.id = req.id;
+		request.data = req.data;
+		request.batch = req.batch;
+		request.index = req.index;
+	}
 
 	void OnSuccess() anope_override
 	{
-		if (!xinterface || !client)
+		if (!xinterface)
 			return;
 
-		request.r = this->repl;
-
 		request.reply("result", "Success");
 		request.reply("account", GetAccount());
 
-		xinterface->Reply(request);
-		client->SendReply(&request.r);
+		xinterface->Finish(client, request);
 	}
 
 	void OnFail() anope_override
 	{
-		if (!xinterface || !client)
+		if (!xinterface)
 			return;
 
-		request.r = this->repl;
-
 		request.reply("error", "Invalid password");
 
-		xinterface->Reply(request);
-		client->SendReply(&request.r);
+		xinterface->Finish(client, request);
 	}
 };
 
@@ -61,6 +61,8 @@ class MyXMLRPCEvent : public XMLRPCEvent
 			return this->DoCheckAuthentication(iface, client, request);
 		else if (request.name == "stats")
 			this->DoStats(iface, client, request);
+		else if (request.name == "events")
+			this->DoEvents(iface, client, request);
 		else if (request.name == "channel")
 			this->DoChannel(iface, client, request);
 		else if (request.name == "user")
@@ -69,6 +71,8 @@ class MyXMLRPCEvent : public XMLRPCEvent
 			this->DoOperType(iface, client, request);
 		else if (request.name == "notice")
 			this->DoNotice(iface, client, request);
+		else if (request.name == "list")
+			this->DoList(iface, client, request);
 
 		return true;
 	}
@@ -151,6 +155,40 @@ class MyXMLRPCEvent : public XMLRPCEvent
 		request.reply("usercount", stringify(UserListByNick.size()));
 		request.reply("maxusercount", stringify(MaxUserCount));
 		request.reply("channelcount", stringify(ChannelList.size()));
+
+		/* Times are in microseconds */
+		const LagMonitor::Stats &lag = LagMonitor::GetStats();
+		request.reply("loopcount", stringify(lag.passes.count));
+		request.reply("loopp50", stringify(static_cast<unsigned long long>(EventProfiler::ToMicroseconds(lag.passes.Percentile(50)))));
+		request.reply("loopp99", stringify(static_cast<unsigned long long>(EventProfiler::ToMicroseconds(lag.passes.Percentile(99)))));
+		request.reply("loopmax", stringify(static_cast<unsigned long long>(EventProfiler::ToMicroseconds(lag.passes.max))));
+		request.reply("slowloops", stringify(lag.slow));
+		request.reply("uplinklag", stringify(static_cast<unsigned long long>(EventProfiler::ToMicroseconds(lag.last_ping))));
+		request.reply("uplinkpings", stringify(lag.pings_sent));
+		request.reply("uplinkpongs", stringify(lag.pings.count));
+	}
+
+	void DoEvents(XMLRPCServiceInterface *iface, HTTPClient *client, XMLRPCRequest &request)
+	{
+		request.reply("enabled", EventProfiler::enabled ? "1" : "0");
+		for (std::list<Module *>::iterator it = ModuleManager::Modules.begin(), it_end = ModuleManager::Modules.end(); it != it_end; ++it)
+		{
+			Module *m = *it;
+			if (m->event_histograms == NULL)
+				continue;
+
+			for (unsigned i = 0; i < I_SIZE; ++i)
+			{
+				const EventHistogram *h = m->event_histograms[i];
+				if (h == NULL)
+					continue;
+
+				/* Times are in microseconds */
+				request.reply(EventProfiler::GetEventName(i) + "." + m->name, "count=" + stringify(h->count) + " total=" + stringify(EventProfiler::ToMicroseconds(h->total))
+					+ " p50=" + stringify(EventProfiler::ToMicroseconds(h->Percentile(50))) + " p90=" + stringify(EventProfiler::ToMicroseconds(h->Percentile(90)))
+					+ " p99=" + stringify(EventProfiler::ToMicroseconds(h->Percentile(99))) + " max=" + stringify(EventProfiler::ToMicroseconds(h->max)));
+			}
+		}
 	}
 
 	void DoChannel(XMLRPCServiceInterface *iface, HTTPClient *client, XMLRPCRequest &request)
@@ -205,6 +243,47 @@ class MyXMLRPCEvent : public XMLRPCEvent
 		}
 	}
 
+	template<typename T> static void ListPage(XMLRPCServiceInterface *iface, XMLRPCRequest &request, const Anope::sorted_index<T> &index, const Anope::string &prefix, const Anope::string &after, unsigned max)
+	{
+		unsigned count = 0;
+		Anope::string last;
+		typename Anope::sorted_index<T>::cursor it = index.find(prefix, after);
+		for (; it.valid() && count < max; ++it)
+		{
+			last = it.name();
+			request.reply("name" + stringify(++count), iface->Sanitize(last));
+		}
+
+		request.reply("count", stringify(count));
+		/* Passed back to get the next page */
+		if (it.valid() && count)
+			request.reply("next", iface->Sanitize(last));
+	}
+
+	void DoList(XMLRPCServiceInterface *iface, HTTPClient *client, XMLRPCRequest &request)
+	{
+		const Anope::string &type = request.data.size() > 0 ? request.data[0] : "";
+		const Anope::string &after = request.data.size() > 1 ? request.data[1] : "";
+		const Anope::string &prefix = request.data.size() > 3 ? request.data[3] : "";
+
+		unsigned max = 100;
+		if (request.data.size() > 2 && !request.data[2].empty())
+		{
+			try
+			{
+				max = std::min(convertTo<unsigned>(request.data[2]), 1000U);
+			}
+			catch (const ConvertException &) { }
+		}
+
+		if (type == "nicks")
+			ListPage(iface, request, *NickAliasIndex, prefix, after, max);
+		else if (type == "channels")
+			ListPage(iface, request, *RegisteredChannelIndex, prefix, after, max);
+		else
+			request.reply("error", "Invalid type");
+	}
+
 	void DoUser(XMLRPCServiceInterface *iface, HTTPClient *client, XMLRPCRequest &request)
 	{
 		if (request.data.empty())
@@ -253,9 +332,10 @@ class MyXMLRPCEvent : public XMLRPCEvent
 		{
 			OperType *ot = Config->MyOperTypes[i];
 			Anope::string perms;
-			for (std::list<Anope::string>::const_iterator it2 = ot->GetPrivs().begin(), it2_end = ot->GetPrivs().end(); it2 != it2_end; ++it2)
+			const std::list<Anope::string> privs = ot->GetPrivs(), commands = ot->GetCommands();
+			for (std::list<Anope::string>::const_iterator it2 = privs.begin(), it2_end = privs.end(); it2 != it2_end; ++it2)
 				perms += " " + *it2;
-			for (std::list<Anope::string>::const_iterator it2 = ot->GetCommands().begin(), it2_end = ot->GetCommands().end(); it2 != it2_end; ++it2)
+			for (std::list<Anope::string>::const_iterator it2 = commands.begin(), it2_end = commands.end(); it2 != it2_end; ++it2)
 				perms += " " + *it2;
 			request.reply(ot->GetName(), perms);
 		}
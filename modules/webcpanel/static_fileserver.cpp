@@ -13,29 +13,150 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-StaticFileServer::StaticFileServer(const Anope::string &f_n, const Anope::string &u, const Anope::string &c_t) : HTTPPage(u, c_t), file_name(f_n)
+static const Anope::string *FindHeader(const HTTPMessage &message, const Anope::string &name)
 {
+	for (std::map<Anope::string, Anope::string>::const_iterator it = message.headers.begin(), it_end = message.headers.end(); it != it_end; ++it)
+		if (it->first.equals_ci(name))
+			return &it->second;
+	return NULL;
 }
 
-bool StaticFileServer::OnRequest(HTTPProvider *server, const Anope::string &page_name, HTTPClient *client, HTTPMessage &message, HTTPReply &reply)
+/** Parse a date in any of the formats HTTP allows: "Sun, 06 Nov 1994 08:49:37 GMT",
+ * "Sunday, 06-Nov-94 08:49:37 GMT" or "Sun Nov  6 08:49:37 1994"
+ * @param date The date
+ * @param t Set to the time, if the date is valid
+ * @return true if the date is valid
+ */
+static bool ParseHTTPDate(const Anope::string &date, time_t &t)
 {
-	int fd = open((template_base + "/" + this->file_name).c_str(), O_RDONLY);
-	if (fd < 0)
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char month[4];
+	int day, year, hour, min, sec;
+
+	size_t comma = date.find(',');
+	if (comma != Anope::string::npos)
 	{
-		Log(LOG_NORMAL, "httpd") << "Error serving file " << page_name << " (" << (template_base + "/" + this->file_name) << "): " << strerror(errno);
+		const char *rest = date.c_str() + comma + 1;
+		if (sscanf(rest, " %d %3s %d %d:%d:%d", &day, month, &year, &hour, &min, &sec) != 6 && sscanf(rest, " %d-%3[^-]-%d %d:%d:%d", &day, month, &year, &hour, &min, &sec) != 6)
+			return false;
+	}
+	else if (sscanf(date.c_str(), "%*s %3s %d %d:%d:%d %d", month, &day, &hour, &min, &sec, &year) != 6)
+		return false;
 
-		client->SendError(HTTP_PAGE_NOT_FOUND, "Page not found");
+	int mon = 0;
+	for (int i = 0; i < 12 && !mon; ++i)
+		if (Anope::string(months + i * 3, 3).equals_ci(month))
+			mon = i + 1;
+	if (!mon)
+		return false;
+
+	/* Two digit years are from the RFC 850 format */
+	if (year < 70)
+		year += 2000;
+	else if (year < 100)
+		year += 1900;
+
+	if (day < 1 || day > 31 || hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+		return false;
+
+	/* Days since the epoch of a date in the proleptic Gregorian calendar, so no time zone is involved */
+	int y = year - (mon <= 2);
+	int era = (y >= 0 ? y : y - 399) / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	long days = static_cast<long>(era) * 146097 + doe - 719468;
+
+	t = static_cast<time_t>(days) * 86400 + hour * 3600 + min * 60 + sec;
+	return true;
+}
+
+bool StaticFileServer::CachedFile::Load(const Anope::string &p)
+{
+	struct stat st;
+	if (stat(p.c_str(), &st) < 0)
+	{
+		this->size = -1;
+		return false;
+	}
+
+	if (p == this->path && st.st_mtime == this->mtime && st.st_size == this->size)
 		return true;
+
+	int fd = open(p.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		this->size = -1;
+		return false;
 	}
 
-	reply.content_type = this->GetContentType();
-	reply.headers["Cache-Control"] = "public";
+	Anope::string buf;
 
 	int i;
 	char buffer[BUFSIZE];
 	while ((i = read(fd, buffer, sizeof(buffer))) > 0)
-		reply.Write(buffer, i);
+		buf.append(buffer, i);
 
 	close(fd);
+
+	this->path = p;
+	this->mtime = st.st_mtime;
+	this->size = st.st_size;
+	this->content = buf;
+
+	/* The same validator the common web servers use, so it only changes along with the file */
+	char tbuf[64];
+	snprintf(tbuf, sizeof(tbuf), "\"%lx-%lx\"", static_cast<unsigned long>(st.st_mtime), static_cast<unsigned long>(st.st_size));
+	this->etag = tbuf;
+
+	strftime(tbuf, sizeof(tbuf), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&st.st_mtime));
+	this->last_modified = tbuf;
+
+	Log(LOG_DEBUG, "httpd") << "Cached static file " << p << " (" << buf.length() << " bytes)";
+
+	return true;
+}
+
+StaticFileServer::StaticFileServer(const Anope::string &f_n, const Anope::string &u, const Anope::string &c_t) : HTTPPage(u, c_t), file_name(f_n)
+{
+}
+
+bool StaticFileServer::OnRequest(HTTPProvider *server, const Anope::string &page_name, HTTPClient *client, HTTPMessage &message, HTTPReply &reply)
+{
+	const Anope::string path = template_base + "/" + this->file_name;
+
+	if (!this->file.Load(path))
+	{
+		Log(LOG_NORMAL, "httpd") << "Error serving file " << page_name << " (" << path << "): " << strerror(errno);
+
+		client->SendError(HTTP_PAGE_NOT_FOUND, "Page not found");
+		return false;
+	}
+
+	/* Use a precompressed copy of the file if there is one and it is up to date */
+	const CachedFile *f = &this->file;
+	const Anope::string *accept = FindHeader(message, "Accept-Encoding");
+	if (accept && accept->find_ci("gzip") != Anope::string::npos && this->gzipped.Load(path + ".gz") && this->gzipped.mtime >= this->file.mtime)
+	{
+		f = &this->gzipped;
+		reply.headers["Content-Encoding"] = "gzip";
+	}
+
+	reply.content_type = this->GetContentType();
+	reply.headers["Cache-Control"] = "public";
+	reply.headers["ETag"] = f->etag;
+	reply.headers["Last-Modified"] = this->file.last_modified;
+	reply.headers["Vary"] = "Accept-Encoding";
+
+	/* If-None-Match takes precedence over If-Modified-Since */
+	const Anope::string *inm = FindHeader(message, "If-None-Match"), *ims = FindHeader(message, "If-Modified-Since");
+	time_t since;
+	if (inm ? (*inm == "*" || inm->find(f->etag) != Anope::string::npos) : (ims && ParseHTTPDate(*ims, since) && this->file.mtime <= since))
+	{
+		reply.error = HTTP_NOT_MODIFIED;
+		return true;
+	}
+
+	reply.Write(f->content);
 	return true;
 }
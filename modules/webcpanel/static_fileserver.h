@@ -11,6 +11,29 @@
 class StaticFileServer : public HTTPPage
 {
 	Anope::string file_name;
+
+	/* A copy of a file kept in memory, along with what is needed to validate the client's copy of it */
+	struct CachedFile
+	{
+		Anope::string path;
+		time_t mtime;
+		off_t size;
+		Anope::string content;
+		Anope::string etag;
+		Anope::string last_modified;
+
+		CachedFile() : mtime(0), size(-1) { }
+
+		/** Make sure this holds the current contents of path
+		 * @return false if the file can not be read
+		 */
+		bool Load(const Anope::string &p);
+	};
+
+	CachedFile file;
+	/* A gzip compressed copy of the file, if one is kept next to it on disk */
+	CachedFile gzipped;
+
  public:
 	StaticFileServer(const Anope::string &f_n, const Anope::string &u, const Anope::string &c_t);
 
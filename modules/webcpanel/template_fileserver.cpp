@@ -86,75 +86,212 @@ static Anope::string FindReplacement(const TemplateFileServer::Replacements &r,
 	return "";
 }
 
-TemplateFileServer::TemplateFileServer(const Anope::string &f_n) : file_name(f_n)
+/* A template compiled into the instructions needed to render it */
+struct CompiledTemplate
 {
-}
+	struct Instruction
+	{
+		enum Type
+		{
+			TEXT,
+			REPLACE,
+			IF_EQ,
+			IF_EXISTS,
+			ELSE,
+			END_IF,
+			FOR,
+			END_FOR,
+			INCLUDE
+		} type;
+
+		/* The text of TEXT, the key of REPLACE and IF_EXISTS, and the file of INCLUDE */
+		Anope::string text;
+		/* The two operands of IF_EQ, and the variables of FOR followed by the replacements they loop over */
+		std::vector<Anope::string> args;
+
+		Instruction(Type t, const Anope::string &s = "") : type(t), text(s) { }
+	};
+
+	std::vector<Instruction> instructions;
+	/* The file this was compiled from, to know when it must be compiled again */
+	time_t mtime;
+	off_t size;
+
+	void Compile(const Anope::string &file_name, const Anope::string &buf)
+	{
+		Anope::string text;
 
-void TemplateFileServer::Serve(HTTPProvider *server, const Anope::string &page_name, HTTPClient *client, HTTPMessage &message, HTTPReply &reply, Replacements &r)
+		bool escaped = false;
+		for (size_t j = 0; j < buf.length(); ++j)
+		{
+			if (buf[j] == '\\' && j + 1 < buf.length() && (buf[j + 1] == '{' || buf[j + 1] == '}'))
+				escaped = true;
+			else if (buf[j] == '{' && !escaped)
+			{
+				size_t f = buf.find('}', j);
+				if (f == Anope::string::npos)
+					break;
+				const Anope::string &content = buf.substr(j + 1, f - j - 1);
+				j = f; // Skip over this whole block
+
+				if (!text.empty())
+				{
+					this->instructions.push_back(Instruction(Instruction::TEXT, text));
+					text.clear();
+				}
+
+				if (content.find("IF ") == 0)
+				{
+					std::vector<Anope::string> tokens;
+					spacesepstream(content).GetTokens(tokens);
+
+					if (tokens.size() == 4 && tokens[1] == "EQ")
+					{
+						Instruction i(Instruction::IF_EQ);
+						i.args.push_back(tokens[2]);
+						i.args.push_back(tokens[3]);
+						this->instructions.push_back(i);
+					}
+					else if (tokens.size() == 3 && tokens[1] == "EXISTS")
+						this->instructions.push_back(Instruction(Instruction::IF_EXISTS, tokens[2]));
+					else
+						Log() << "Invalid IF in web template " << file_name;
+				}
+				else if (content == "ELSE")
+					this->instructions.push_back(Instruction(Instruction::ELSE));
+				else if (content == "END IF")
+					this->instructions.push_back(Instruction(Instruction::END_IF));
+				else if (content.find("FOR ") == 0)
+				{
+					std::vector<Anope::string> tokens;
+					spacesepstream(content).GetTokens(tokens);
+
+					if (tokens.size() != 4 || tokens[2] != "IN")
+						Log() << "Invalid FOR in web template " << file_name;
+					else
+					{
+						std::vector<Anope::string> temp_variables, real_variables;
+						commasepstream(tokens[1]).GetTokens(temp_variables);
+						commasepstream(tokens[3]).GetTokens(real_variables);
+
+						if (temp_variables.size() != real_variables.size())
+							Log() << "Invalid FOR in web template " << file_name << " variable mismatch";
+						else
+						{
+							Instruction i(Instruction::FOR);
+							i.args = temp_variables;
+							i.args.insert(i.args.end(), real_variables.begin(), real_variables.end());
+							this->instructions.push_back(i);
+						}
+					}
+				}
+				else if (content == "END FOR")
+					this->instructions.push_back(Instruction(Instruction::END_FOR));
+				else if (content.find("INCLUDE ") == 0)
+				{
+					std::vector<Anope::string> tokens;
+					spacesepstream(content).GetTokens(tokens);
+
+					if (tokens.size() != 2)
+						Log() << "Invalid INCLUDE in web template " << file_name;
+					else
+						this->instructions.push_back(Instruction(Instruction::INCLUDE, tokens[1]));
+				}
+				else
+					this->instructions.push_back(Instruction(Instruction::REPLACE, content));
+			}
+			else
+			{
+				escaped = false;
+				text += buf[j];
+			}
+		}
+
+		if (!text.empty())
+			this->instructions.push_back(Instruction(Instruction::TEXT, text));
+	}
+};
+
+/* Compiled templates, by path */
+static std::map<Anope::string, CompiledTemplate> Templates;
+
+/** Find the compiled form of a template, compiling it if it is new or has changed on disk
+ * @param file_name The template, relative to the template directory
+ * @return The compiled template, or NULL if it can not be read
+ */
+static const CompiledTemplate *FindTemplate(const Anope::string &file_name)
 {
-	int fd = open((template_base + "/" + this->file_name).c_str(), O_RDONLY);
-	if (fd < 0)
+	const Anope::string path = template_base + "/" + file_name;
+
+	struct stat st;
+	if (stat(path.c_str(), &st) < 0)
 	{
-		Log(LOG_NORMAL, "httpd") << "Error serving file " << page_name << " (" << (template_base + "/" + this->file_name) << "): " << strerror(errno);
+		Log(LOG_NORMAL, "httpd") << "Error serving template " << path << ": " << strerror(errno);
+		Templates.erase(path);
+		return NULL;
+	}
 
-		client->SendError(HTTP_PAGE_NOT_FOUND, "Page not found");
-		return;
+	std::map<Anope::string, CompiledTemplate>::iterator it = Templates.find(path);
+	if (it != Templates.end() && it->second.mtime == st.st_mtime && it->second.size == st.st_size)
+		return &it->second;
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		Log(LOG_NORMAL, "httpd") << "Error serving template " << path << ": " << strerror(errno);
+		Templates.erase(path);
+		return NULL;
 	}
 
 	Anope::string buf;
 
 	int i;
 	char buffer[BUFSIZE];
-	while ((i = read(fd, buffer, sizeof(buffer) - 1)) > 0)
-	{
-		buffer[i] = 0;
-		buf += buffer;
-	}
+	while ((i = read(fd, buffer, sizeof(buffer))) > 0)
+		buf.append(buffer, i);
 
 	close(fd);
 
-	Anope::string finished;
+	CompiledTemplate &t = Templates[path];
+	t = CompiledTemplate();
+	t.mtime = st.st_mtime;
+	t.size = st.st_size;
+	t.Compile(file_name, buf);
 
-	bool escaped = false;
-	for (unsigned j = 0; j < buf.length(); ++j)
-	{
-		if (buf[j] == '\\' && j + 1 < buf.length() && (buf[j + 1] == '{' || buf[j + 1] == '}'))
-			escaped = true;
-		else if (buf[j] == '{' && !escaped)
-		{
-			size_t f = buf.substr(j).find('}');
-			if (f == Anope::string::npos)
-				break;
-			const Anope::string &content = buf.substr(j + 1, f - 1);
+	Log(LOG_DEBUG, "httpd") << "Compiled web template " << path << " into " << t.instructions.size() << " instructions";
 
-			if (content.find("IF ") == 0)
-			{
-				std::vector<Anope::string> tokens;
-				spacesepstream(content).GetTokens(tokens);
+	return &t;
+}
 
-				if (tokens.size() == 4 && tokens[1] == "EQ")
-				{
-					Anope::string first = FindReplacement(r, tokens[2]), second = FindReplacement(r, tokens[3]);
-					if (first.empty())
-						first = tokens[2];
-					if (second.empty())
-						second = tokens[3];
+static void Render(const CompiledTemplate &t, TemplateFileServer::Replacements &r, Anope::string &out)
+{
+	for (size_t pc = 0; pc < t.instructions.size(); ++pc)
+	{
+		const CompiledTemplate::Instruction &i = t.instructions[pc];
 
-					bool stackok = IfStack.empty() || IfStack.top();
-					IfStack.push(stackok && first == second);
-				}
-				else if (tokens.size() == 3 && tokens[1] == "EXISTS")
-				{
-					bool stackok = IfStack.empty() || IfStack.top();
-					IfStack.push(stackok && r.count(tokens[2]) > 0);
-				}
-				else
-					Log() << "Invalid IF in web template " << this->file_name;
+		switch (i.type)
+		{
+			case CompiledTemplate::Instruction::IF_EQ:
+			{
+				Anope::string first = FindReplacement(r, i.args[0]), second = FindReplacement(r, i.args[1]);
+				if (first.empty())
+					first = i.args[0];
+				if (second.empty())
+					second = i.args[1];
+
+				bool stackok = IfStack.empty() || IfStack.top();
+				IfStack.push(stackok && first == second);
+				break;
 			}
-			else if (content == "ELSE")
+			case CompiledTemplate::Instruction::IF_EXISTS:
 			{
+				bool stackok = IfStack.empty() || IfStack.top();
+				IfStack.push(stackok && r.count(i.text) > 0);
+				break;
+			}
+			case CompiledTemplate::Instruction::ELSE:
 				if (IfStack.empty())
-					Log() << "Invalid ELSE with no stack in web template" << this->file_name;
+					Log() << "Invalid ELSE with no stack in web template";
 				else
 				{
 					bool old = IfStack.top();
@@ -162,35 +299,21 @@ void TemplateFileServer::Serve(HTTPProvider *server, const Anope::string &page_n
 					bool stackok = IfStack.empty() || IfStack.top();
 					IfStack.push(stackok && !old); // Push back the opposite of what was popped
 				}
-			}
-			else if (content == "END IF")
-			{
+				break;
+			case CompiledTemplate::Instruction::END_IF:
 				if (IfStack.empty())
 					Log() << "END IF with empty stack?";
 				else
 					IfStack.pop();
-			}
-			else if (content.find("FOR ") == 0)
+				break;
+			case CompiledTemplate::Instruction::FOR:
 			{
-				std::vector<Anope::string> tokens;
-				spacesepstream(content).GetTokens(tokens);
-
-				if (tokens.size() != 4 || tokens[2] != "IN")
-					Log() << "Invalid FOR in web template " << this->file_name;
-				else
-				{
-					std::vector<Anope::string> temp_variables, real_variables;
-					commasepstream(tokens[1]).GetTokens(temp_variables);
-					commasepstream(tokens[3]).GetTokens(real_variables);
-
-					if (temp_variables.size() != real_variables.size())
-						Log() << "Invalid FOR in web template " << this->file_name << " variable mismatch";
-					else
-						ForLoop::Stack.push_back(ForLoop(j + f, r, temp_variables, real_variables));
-				}
+				size_t vars = i.args.size() / 2;
+				std::vector<Anope::string> temp_variables(i.args.begin(), i.args.begin() + vars), real_variables(i.args.begin() + vars, i.args.end());
+				ForLoop::Stack.push_back(ForLoop(pc, r, temp_variables, real_variables));
+				break;
 			}
-			else if (content == "END FOR")
-			{
+			case CompiledTemplate::Instruction::END_FOR:
 				if (ForLoop::Stack.empty())
 					Log() << "END FOR with empty stack?";
 				else
@@ -204,64 +327,55 @@ void TemplateFileServer::Serve(HTTPProvider *server, const Anope::string &page_n
 						if (fl.finished(r))
 							ForLoop::Stack.pop_back();
 						else
-						{
-							j = fl.start; // Move pointer back to start of the loop
-							continue; // To prevent skipping over this block which doesn't exist anymore
-						}
+							pc = fl.start; // Move back to the start of the loop
 					}
 				}
-			}
-			else if (content.find("INCLUDE ") == 0)
+				break;
+			case CompiledTemplate::Instruction::INCLUDE:
 			{
-				std::vector<Anope::string> tokens;
-				spacesepstream(content).GetTokens(tokens);
-
-				if (tokens.size() != 2)
-					Log() << "Invalid INCLUDE in web template " << this->file_name;
-				else
-				{
-					if (!finished.empty())
-					{
-						reply.Write(finished); // Write out what we have currently so we insert this files contents here
-						finished.clear();
-					}
-
-					TemplateFileServer tfs(tokens[1]);
-					tfs.Serve(server, page_name, client, message, reply, r);
-				}
+				const CompiledTemplate *inc = FindTemplate(i.text);
+				if (inc)
+					Render(*inc, r, out);
+				break;
 			}
-			else
+			case CompiledTemplate::Instruction::TEXT:
+			case CompiledTemplate::Instruction::REPLACE:
 			{
 				// If the if stack is empty or we are in a true statement
 				bool ifok = IfStack.empty() || IfStack.top();
 				bool forok = ForLoop::Stack.empty() || !ForLoop::Stack.back().finished(r);
 
-				if (ifok && forok)
-				{
-					Anope::string replacement = FindReplacement(r, content.substr(0, f - 1));
+				if (!ifok || !forok)
+					break;
 
+				if (i.type == CompiledTemplate::Instruction::TEXT)
+					out += i.text;
+				else
 					// htmlescape all text replaced onto the page
-					replacement = HTTPUtils::Escape(replacement);
-
-					finished += replacement;
-				}
+					out += HTTPUtils::Escape(FindReplacement(r, i.text));
+				break;
 			}
-
-			j += f; // Skip over this whole block
 		}
-		else
-		{
-			escaped = false;
+	}
+}
 
-			// If the if stack is empty or we are in a true statement
-			bool ifok = IfStack.empty() || IfStack.top();
-			bool forok = ForLoop::Stack.empty() || !ForLoop::Stack.back().finished(r);
+TemplateFileServer::TemplateFileServer(const Anope::string &f_n) : file_name(f_n)
+{
+}
 
-			if (ifok && forok)
-				finished += buf[j];
-		}
+void TemplateFileServer::Serve(HTTPProvider *server, const Anope::string &page_name, HTTPClient *client, HTTPMessage &message, HTTPReply &reply, Replacements &r)
+{
+	const CompiledTemplate *t = FindTemplate(this->file_name);
+	if (!t)
+	{
+		client->SendError(HTTP_PAGE_NOT_FOUND, "Page not found");
+		return;
 	}
 
+	/* Render the whole page, including any included templates, into one buffer */
+	Anope::string finished;
+	Render(*t, r, finished);
+
 	if (!finished.empty())
 		reply.Write(finished);
 }
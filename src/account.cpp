@@ -16,16 +16,17 @@
 #include "protocol.h"
 #include "regchannel.h"
 
-std::set<IdentifyRequest *> IdentifyRequest::Requests;
+unsigned long long IdentifyRequest::next_id = 0;
+std::map<unsigned long long, IdentifyRequest *> IdentifyRequest::Requests;
 
-IdentifyRequest::IdentifyRequest(Module *o, const Anope::string &acc, const Anope::string &pass) : owner(o), account(acc), password(pass), dispatched(false), success(false)
+IdentifyRequest::IdentifyRequest(Module *o, const Anope::string &acc, const Anope::string &pass) : owner(o), account(acc), password(pass), request_id(++next_id), dispatched(false), success(false)
 {
-	Requests.insert(this);
+	Requests[request_id] = this;
 }
 
 IdentifyRequest::~IdentifyRequest()
 {
-	Requests.erase(this);
+	Requests.erase(request_id);
 }
 
 void IdentifyRequest::Hold(Module *m)
@@ -65,11 +66,19 @@ void IdentifyRequest::Dispatch()
 		dispatched = true;
 }
 
+IdentifyRequest *IdentifyRequest::Find(unsigned long long id)
+{
+	std::map<unsigned long long, IdentifyRequest *>::iterator it = Requests.find(id);
+	if (it != Requests.end())
+		return it->second;
+	return NULL;
+}
+
 void IdentifyRequest::ModuleUnload(Module *m)
 {
-	for (std::set<IdentifyRequest *>::iterator it = Requests.begin(), it_end = Requests.end(); it != it_end;)
+	for (std::map<unsigned long long, IdentifyRequest *>::iterator it = Requests.begin(), it_end = Requests.end(); it != it_end;)
 	{
-		IdentifyRequest *ir = *it;
+		IdentifyRequest *ir = it->second;
 		++it;
 
 		ir->holds.erase(m);
@@ -28,6 +28,30 @@
 channel_map ChannelList;
 std::vector<Channel *> Channel::deleting;
 
+static bool ModeIDLess(const Channel::ModeList::value_type &a, const Channel::ModeList::value_type &b)
+{
+	return a.first < b.first;
+}
+
+/** Find the range of a mode in a mode list
+ * @param modes The mode list
+ * @param name The mode name
+ * @return The range, which is empty if the mode is not set
+ */
+static std::pair<Channel::ModeList::iterator, Channel::ModeList::iterator> FindModes(Channel::ModeList &modes, const Anope::string &name)
+{
+	unsigned short id = ModeManager::GetModeID(name);
+	if (!id)
+		return std::make_pair(modes.end(), modes.end());
+	return std::equal_range(modes.begin(), modes.end(), std::make_pair(id, Anope::string()), ModeIDLess);
+}
+
+static void EraseModes(Channel::ModeList &modes, const Anope::string &name)
+{
+	std::pair<Channel::ModeList::iterator, Channel::ModeList::iterator> range = FindModes(modes, name);
+	modes.erase(range.first, range.second);
+}
+
 Channel::Channel(const Anope::string &nname, time_t ts)
 {
 	if (nname.empty())
@@ -39,6 +63,7 @@ Channel::Channel(const Anope::string &nname, time_t ts)
 	this->syncing = this->botchannel = false;
 	this->server_modetime = this->chanserv_modetime = 0;
 	this->server_modecount = this->chanserv_modecount = this->bouncy_modes = this->topic_ts = this->topic_time = 0;
+	this->stacker = NULL;
 
 	this->ci = ChannelInfo::Find(this->name);
 	if (this->ci)
@@ -97,6 +122,57 @@ void Channel::Reset()
 		this->Sync();
 }
 
+unsigned Channel::ProcessBurstJoins()
+{
+	std::vector<Reference<User> > joins;
+	joins.swap(this->burst_joins);
+
+	/* Users are only deleted after the current pass of the main loop, so the pointers
+	 * stay valid throughout, but any of them may be kicked or quit along the way
+	 */
+	std::vector<User *> joined;
+	for (unsigned i = 0; i < joins.size(); ++i)
+	{
+		User *u = joins[i];
+		if (!u || u->Quitting())
+			continue;
+
+		/* Users may have parted, or parted and joined again, since */
+		ChanUserContainer *cc = this->FindUser(u);
+		if (!cc || !cc->burst_pending)
+			continue;
+
+		/* OnUserConnect hasn't been called for this user yet */
+		if (u->IsConnectPending())
+		{
+			this->burst_joins.push_back(u);
+			continue;
+		}
+
+		cc->burst_pending = false;
+		joined.push_back(u);
+	}
+
+	/* Kick whoever may not be here, then set the modes of everyone else in one go */
+	std::vector<User *> allowed;
+	for (unsigned i = 0; i < joined.size(); ++i)
+		if (!joined[i]->Quitting() && this->FindUser(joined[i]) && !this->CheckKick(joined[i]))
+			allowed.push_back(joined[i]);
+
+	this->SetCorrectModes(allowed, true);
+
+	for (unsigned i = 0; i < allowed.size(); ++i)
+	{
+		User *u = allowed[i];
+		if (u->Quitting() || !this->FindUser(u))
+			continue;
+
+		FOREACH_MOD(OnJoinChannel, (u, this));
+	}
+
+	return joined.size();
+}
+
 void Channel::Sync()
 {
 	syncing = false;
@@ -158,9 +234,12 @@ void Channel::DeleteUser(User *user)
 	if (user->server && user->server->IsSynced() && !user->Quitting())
 		Log(user, this, "leave");
 
-	FOREACH_MOD(OnLeaveChannel, (user, this));
-
 	ChanUserContainer *cu = user->FindChannel(this);
+	if (!cu || !cu->burst_pending)
+	{
+		FOREACH_MOD(OnLeaveChannel, (user, this));
+	}
+
 	if (!this->users.erase(user))
 		Log(LOG_DEBUG) << "Channel::DeleteUser() tried to delete nonexistent user " << user->nick << " from channel " << this->name;
 
@@ -199,10 +278,18 @@ bool Channel::HasUserStatus(User *u, const Anope::string &mname)
 	return HasUserStatus(u, anope_dynamic_static_cast<ChannelModeStatus *>(ModeManager::FindChannelModeByName(mname)));
 }
 
+bool Channel::HasUserStatus(User *u, unsigned short id)
+{
+	return HasUserStatus(u, anope_dynamic_static_cast<ChannelModeStatus *>(ModeManager::FindChannelModeByID(id)));
+}
+
 size_t Channel::HasMode(const Anope::string &mname, const Anope::string &param)
 {
 	if (param.empty())
-		return modes.count(mname);
+	{
+		std::pair<ModeList::iterator, ModeList::iterator> range = FindModes(this->modes, mname);
+		return range.second - range.first;
+	}
 	std::vector<Anope::string> v = this->GetModeList(mname);
 	for (unsigned int i = 0; i < v.size(); ++i)
 		if (v[i].equals_ci(param))
@@ -214,9 +301,9 @@ Anope::string Channel::GetModes(bool complete, bool plus)
 {
 	Anope::string res, params;
 
-	for (std::multimap<Anope::string, Anope::string>::const_iterator it = this->modes.begin(), it_end = this->modes.end(); it != it_end; ++it)
+	for (ModeList::const_iterator it = this->modes.begin(), it_end = this->modes.end(); it != it_end; ++it)
 	{
-		ChannelMode *cm = ModeManager::FindChannelModeByName(it->first);
+		ChannelMode *cm = ModeManager::FindChannelModeByID(it->first);
 		if (!cm || cm->type == MODE_LIST)
 			continue;
 
@@ -241,19 +328,12 @@ const Channel::ModeList &Channel::GetModes() const
 	return this->modes;
 }
 
-template<typename F, typename S>
-struct second
-{
-	S operator()(const std::pair<F, S> &p)
-	{
-		return p.second;
-	}
-};
-
 std::vector<Anope::string> Channel::GetModeList(const Anope::string &mname)
 {
 	std::vector<Anope::string> r;
-	std::transform(modes.lower_bound(mname), modes.upper_bound(mname), std::back_inserter(r), second<Anope::string, Anope::string>());
+	std::pair<ModeList::iterator, ModeList::iterator> range = FindModes(this->modes, mname);
+	for (ModeList::iterator it = range.first; it != range.second; ++it)
+		r.push_back(it->second);
 	return r;
 }
 
@@ -284,7 +364,7 @@ void Channel::SetModeInternal(MessageSource &setter, ChannelMode *ocm, const Ano
 			return;
 		}
 
-		Log(LOG_DEBUG) << "Setting +" << cm->mchar << " on " << this->name << " for " << u->nick;
+		LOG_IF(LOG_DEBUG) << "Setting +" << cm->mchar << " on " << this->name << " for " << u->nick;
 
 		/* Set the status on the user */
 		ChanUserContainer *cc = u->FindChannel(this);
@@ -300,11 +380,12 @@ void Channel::SetModeInternal(MessageSource &setter, ChannelMode *ocm, const Ano
 	}
 
 	if (cm->type != MODE_LIST)
-		this->modes.erase(cm->name);
+		EraseModes(this->modes, cm->name);
 	else if (this->HasMode(cm->name, param))
 		return;
 
-	this->modes.insert(std::make_pair(cm->name, param));
+	Channel::ModeList::value_type entry(ModeManager::GetModeID(cm->name, true), param);
+	this->modes.insert(std::upper_bound(this->modes.begin(), this->modes.end(), entry, ModeIDLess), entry);
 
 	if (param.empty() && cm->type != MODE_REGULAR)
 	{
@@ -355,7 +436,7 @@ void Channel::RemoveModeInternal(MessageSource &setter, ChannelMode *ocm, const
 			return;
 		}
 
-		Log(LOG_DEBUG) << "Setting -" << cm->mchar << " on " << this->name << " for " << u->nick;
+		LOG_IF(LOG_DEBUG) << "Setting -" << cm->mchar << " on " << this->name << " for " << u->nick;
 
 		/* Remove the status on the user */
 		ChanUserContainer *cc = u->FindChannel(this);
@@ -372,7 +453,8 @@ void Channel::RemoveModeInternal(MessageSource &setter, ChannelMode *ocm, const
 
 	if (cm->type == MODE_LIST)
 	{
-		for (Channel::ModeList::iterator it = modes.lower_bound(cm->name), it_end = modes.upper_bound(cm->name); it != it_end; ++it)
+		std::pair<ModeList::iterator, ModeList::iterator> range = FindModes(this->modes, cm->name);
+		for (ModeList::iterator it = range.first; it != range.second; ++it)
 			if (param.equals_ci(it->second))
 			{
 				this->modes.erase(it);
@@ -380,7 +462,7 @@ void Channel::RemoveModeInternal(MessageSource &setter, ChannelMode *ocm, const
 			}
 	}
 	else
-		this->modes.erase(cm->name);
+		EraseModes(this->modes, cm->name);
 
 	if (cm->type == MODE_LIST)
 	{
@@ -525,13 +607,12 @@ void Channel::RemoveMode(BotInfo *bi, const Anope::string &mname, const Anope::s
 
 bool Channel::GetParam(const Anope::string &mname, Anope::string &target) const
 {
-	std::multimap<Anope::string, Anope::string>::const_iterator it = this->modes.find(mname);
-
 	target.clear();
 
-	if (it != this->modes.end())
+	std::pair<ModeList::iterator, ModeList::iterator> range = FindModes(const_cast<ModeList &>(this->modes), mname);
+	if (range.first != range.second)
 	{
-		target = it->second;
+		target = range.first->second;
 		return true;
 	}
 
@@ -717,7 +798,7 @@ void Channel::SetModesInternal(MessageSource &source, const Anope::string &mode,
 	if (setter)
 		Log(setter, this, "mode") << modestring << paramstring;
 	else
-		Log(LOG_DEBUG) << source.GetName() << " is setting " << this->name << " to " << modestring << paramstring;
+		LOG_IF(LOG_DEBUG) << source.GetName() << " is setting " << this->name << " to " << modestring << paramstring;
 
 	if (enforce_mlock)
 		this->CheckModes();
@@ -763,6 +844,13 @@ void Channel::KickInternal(const MessageSource &source, const Anope::string &nic
 		return;
 	}
 
+	/* The modules haven't seen this join yet */
+	if (cu->burst_pending)
+	{
+		this->DeleteUser(target);
+		return;
+	}
+
 	ChannelStatus status = cu->status;
 
 	FOREACH_MOD(OnPreUserKicked, (source, cu, reason));
@@ -801,7 +889,7 @@ void Channel::ChangeTopicInternal(User *u, const Anope::string &user, const Anop
 	this->topic_ts = ts;
 	this->topic_time = Anope::CurTime;
 
-	Log(LOG_DEBUG) << "Topic of " << this->name << " changed by " << this->topic_setter << " to " << newtopic;
+	LOG_IF(LOG_DEBUG) << "Topic of " << this->name << " changed by " << this->topic_setter << " to " << newtopic;
 
 	FOREACH_MOD(OnTopicUpdated, (u, this, user, this->topic));
 }
@@ -825,50 +913,71 @@ void Channel::SetCorrectModes(User *user, bool give_modes)
 	if (user == NULL)
 		return;
 
+	this->SetCorrectModes(std::vector<User *>(1, user), give_modes);
+}
+
+void Channel::SetCorrectModes(const std::vector<User *> &targets, bool give_modes)
+{
 	if (!this->ci)
 		return;
 
-	Log(LOG_DEBUG) << "Setting correct user modes for " << user->nick << " on " << this->name << " (" << (give_modes ? "" : "not ") << "giving modes)";
+	/* Whether each status mode has a level for keeping it, modes without one (like operprefix, ojoin) are never removed */
+	const std::vector<ChannelModeStatus *> &status_modes = ModeManager::GetStatusChannelModesByRank();
+	std::vector<bool> removable(status_modes.size());
+	for (unsigned i = 0; i < status_modes.size(); ++i)
+		removable[i] = ci->GetLevel(status_modes[i]->name + "ME") != ACCESS_INVALID;
 
-	AccessGroup u_access = ci->AccessFor(user);
+	for (unsigned j = 0; j < targets.size(); ++j)
+	{
+		User *user = targets[j];
 
-	/* Initially only take modes if the channel is being created by a non netmerge */
-	bool take_modes = this->syncing && user->server->IsSynced();
+		/* Modules called for the previous user may have dropped the channel */
+		if (!this->ci)
+			return;
+		if (user == NULL || user->Quitting())
+			continue;
 
-	FOREACH_MOD(OnSetCorrectModes, (user, this, u_access, give_modes, take_modes));
+		LOG_IF(LOG_DEBUG) << "Setting correct user modes for " << user->nick << " on " << this->name << " (" << (give_modes ? "" : "not ") << "giving modes)";
 
-	/* Never take modes from ulines */
-	if (user->server->IsULined())
-		take_modes = false;
+		AccessGroup u_access = ci->AccessFor(user);
 
-	/* whether or not we are giving modes */
-	bool giving = give_modes;
-	/* whether or not we have given a mode */
-	bool given = false;
-	for (unsigned i = 0; i < ModeManager::GetStatusChannelModesByRank().size(); ++i)
-	{
-		ChannelModeStatus *cm = ModeManager::GetStatusChannelModesByRank()[i];
-		bool has_priv = u_access.HasPriv("AUTO" + cm->name);
+		/* Initially only take modes if the channel is being created by a non netmerge */
+		bool take_modes = this->syncing && user->server->IsSynced();
+
+		FOREACH_MOD(OnSetCorrectModes, (user, this, u_access, give_modes, take_modes));
+
+		/* Never take modes from ulines */
+		if (user->server->IsULined())
+			take_modes = false;
 
-		if (give_modes && has_priv)
+		/* whether or not we are giving modes */
+		bool giving = give_modes;
+		/* whether or not we have given a mode */
+		bool given = false;
+		for (unsigned i = 0; i < status_modes.size(); ++i)
 		{
-			/* Always give op. If we have already given one mode, don't give more until it has a symbol */
-			if (cm->name == "OP" || !given || (giving && cm->symbol))
+			ChannelModeStatus *cm = status_modes[i];
+			bool has_priv = u_access.HasPriv("AUTO" + cm->name);
+
+			if (give_modes && has_priv)
 			{
-				this->SetMode(NULL, cm, user->GetUID(), false);
-				/* Now if this contains a symbol don't give any more modes, to prevent setting +qaohv etc on users */
-				giving = !cm->symbol;
-				given = true;
+				/* Always give op. If we have already given one mode, don't give more until it has a symbol */
+				if (cm->name == "OP" || !given || (giving && cm->symbol))
+				{
+					this->SetMode(NULL, cm, user->GetUID(), false);
+					/* Now if this contains a symbol don't give any more modes, to prevent setting +qaohv etc on users */
+					giving = !cm->symbol;
+					given = true;
+				}
+			}
+			else if (take_modes && !has_priv && removable[i] && !u_access.HasPriv(cm->name + "ME"))
+			{
+				/* Only remove modes if they are > voice */
+				if (cm->name == "VOICE")
+					take_modes = false;
+				else
+					this->RemoveMode(NULL, cm, user->GetUID(), false);
 			}
-		}
-		/* modes that have no privileges assigned shouldn't be removed (like operprefix, ojoin) */
-		else if (take_modes && !has_priv && ci->GetLevel(cm->name + "ME") != ACCESS_INVALID && !u_access.HasPriv(cm->name + "ME"))
-		{
-			/* Only remove modes if they are > voice */
-			if (cm->name == "VOICE")
-				take_modes = false;
-			else
-				this->RemoveMode(NULL, cm, user->GetUID(), false);
 		}
 	}
 }
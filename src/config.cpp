@@ -16,6 +16,7 @@
 #include "opertype.h"
 #include "channels.h"
 #include "hashcomp.h"
+#include "language.h"
 
 using namespace Configuration;
 
@@ -196,6 +197,8 @@ Conf::Conf() : Block("")
 	}
 	this->DefLanguage = options->Get<const Anope::string>("defaultlanguage");
 	this->TimeoutCheck = options->Get<time_t>("timeoutcheck");
+	EventProfiler::SetEnabled(options->Get<bool>("profileevents"));
+	this->SlowLoop = options->Get<unsigned>("slowloop", "500");
 	this->NickChars = networkinfo->Get<Anope::string>("nick_chars");
 
 	for (int i = 0; i < this->CountBlock("uplink"); ++i)
@@ -393,6 +396,9 @@ Conf::Conf() : Block("")
 		}
 	}
 
+	if (static_cast<unsigned>(this->CountBlock("log")) > LogRouter::MAX_BLOCKS)
+		throw ConfigException("There can be at most " + stringify(LogRouter::MAX_BLOCKS) + " log blocks");
+
 	for (int i = 0; i < this->CountBlock("log"); ++i)
 	{
 		Block *log = this->GetBlock("log", i);
@@ -416,6 +422,7 @@ Conf::Conf() : Block("")
 
 		this->LogInfos.push_back(l);
 	}
+	this->LogRoutes.Build(this->LogInfos);
 
 	for (botinfo_map::const_iterator it = BotListByNick->begin(), it_end = BotListByNick->end(); it != it_end; ++it)
 		it->second->commands.clear();
@@ -561,6 +568,10 @@ void Conf::Post(Conf *old)
 		if (std::find(old->ModulesAutoLoad.begin(), old->ModulesAutoLoad.end(), this->ModulesAutoLoad[i]) == old->ModulesAutoLoad.end())
 			ModuleManager::LoadModule(this->ModulesAutoLoad[i], NULL);
 
+	/* The default language may have changed to one which isn't loaded yet */
+	if (this->DefLanguage != old->DefLanguage)
+		Language::LoadDefaultLanguage();
+
 	/* Apply opertype changes, as non-conf opers still point to the old oper types */
 	for (unsigned i = Oper::opers.size(); i > 0; --i)
 	{
@@ -18,6 +18,7 @@
 #include "socketengine.h"
 #include "servers.h"
 #include "language.h"
+#include "mail.h"
 
 #ifndef _WIN32
 #include <sys/wait.h>
@@ -454,6 +455,9 @@ void Anope::Init(int ac, char **av)
 		sigaction(SIGUSR2, &sa, &old_sigusr2);
 		sigaction(SIGCHLD, &sa, &old_sigchld);
 
+		/* The log writer thread would not exist in the child */
+		LogFile::Flush();
+
 		int i = fork();
 		if (i > 0)
 		{
@@ -555,6 +559,9 @@ void Anope::Init(int ac, char **av)
 
 	FOREACH_MOD(OnPostInit, ());
 
+	/* Pick up mail which was not delivered before the last shutdown */
+	Mail::Init();
+
 	for (channel_map::const_iterator it = ChannelList.begin(), it_end = ChannelList.end(); it != it_end; ++it)
 		it->second->Sync();
 
@@ -0,0 +1,108 @@
+/*
+ *
+ * (C) 2003-2018 Anope Team
+ * Contact us at team@anope.org
+ *
+ * Please read COPYING and README for further details.
+ */
+
+#include "services.h"
+#include "lagmonitor.h"
+#include "config.h"
+#include "protocol.h"
+#include "servers.h"
+#include "uplink.h"
+
+unsigned long long LagMonitor::sleep_start = 0, LagMonitor::sleeping = 0;
+
+static LagMonitor::Stats stats;
+/* When the current pass started */
+static unsigned long long pass_start = 0;
+/* The slowest steps of the current pass */
+static LagMonitor::Step steps[LagMonitor::STEP_SIZE];
+/* When the PING to the uplink being waited on was sent, or 0 */
+static unsigned long long ping_start = 0;
+
+static unsigned long ToMilliseconds(unsigned long long ticks)
+{
+	return static_cast<unsigned long>(EventProfiler::ToMicroseconds(ticks) / 1000);
+}
+
+void LagMonitor::Begin()
+{
+	pass_start = EventProfiler::Ticks();
+	sleeping = 0;
+	for (unsigned i = 0; i < STEP_SIZE; ++i)
+		steps[i].ticks = 0;
+}
+
+void LagMonitor::End()
+{
+	unsigned long long busy = EventProfiler::Ticks() - pass_start - sleeping;
+	stats.passes.Record(busy);
+
+	if (busy > stats.slowest)
+	{
+		stats.slowest = busy;
+		stats.slowest_time = Anope::CurTime;
+		for (unsigned i = 0; i < STEP_SIZE; ++i)
+			stats.slowest_steps[i] = steps[i];
+	}
+
+	if (!Config->SlowLoop || EventProfiler::ToMicroseconds(busy) < Config->SlowLoop * 1000.0)
+		return;
+
+	++stats.slow;
+
+	static const char *const step_names[] = { "message", "timer", "event handler" };
+	Anope::string trace;
+	for (unsigned i = 0; i < STEP_SIZE; ++i)
+		if (steps[i].ticks)
+			trace += ", slowest " + Anope::string(step_names[i]) + " " + steps[i].what + " took " + stringify(ToMilliseconds(steps[i].ticks)) + " ms";
+
+	Log() << "Main loop was busy for " << ToMilliseconds(busy) << " ms" << trace;
+}
+
+LagMonitor::Step *LagMonitor::Trace(StepType type, unsigned long long start)
+{
+	unsigned long long ticks = EventProfiler::Ticks() - start;
+
+	Step &step = steps[type];
+	if (ticks <= step.ticks)
+		return NULL;
+
+	step.ticks = ticks;
+	return &step;
+}
+
+void LagMonitor::Ping()
+{
+	ping_start = 0;
+
+	if (!UplinkSock || !Me->IsSynced() || Me->GetLinks().empty())
+		return;
+
+	ping_start = EventProfiler::Ticks();
+	++stats.pings_sent;
+	IRCD->SendPing(Me->GetSID(), Me->GetLinks().front()->GetSID());
+}
+
+void LagMonitor::Pong(Server *s)
+{
+	if (!ping_start || !s || Me->GetLinks().empty() || s != Me->GetLinks().front())
+		return;
+
+	stats.last_ping = EventProfiler::Ticks() - ping_start;
+	stats.pings.Record(stats.last_ping);
+	ping_start = 0;
+}
+
+const LagMonitor::Stats &LagMonitor::GetStats()
+{
+	return stats;
+}
+
+void LagMonitor::Reset()
+{
+	stats = Stats();
+}
@@ -15,33 +15,234 @@
 #include "config.h"
 #include "language.h"
 
-#if GETTEXT_FOUND
-# include <libintl.h>
-#endif
+#include <fstream>
 
 std::vector<Anope::string> Language::Languages;
 std::vector<Anope::string> Language::Domains;
 
+namespace
+{
+	/* Hashes and compares the strings of a catalog in place, so looking up a message allocates nothing */
+	struct CStringHash
+	{
+		size_t operator()(const char *s) const
+		{
+			size_t h = 2166136261U;
+			for (; *s; ++s)
+				h = (h ^ static_cast<unsigned char>(*s)) * 16777619U;
+			return h;
+		}
+	};
+
+	struct CStringEqual
+	{
+		bool operator()(const char *a, const char *b) const
+		{
+			return !strcmp(a, b);
+		}
+	};
+
+	typedef TR1NS::unordered_map<const char *, const char *, CStringHash, CStringEqual> string_table;
+
+	/* A .mo file of one domain, read into memory */
+	struct Catalog
+	{
+		Anope::string domain;
+		/* The contents of the file, which the entries point into */
+		std::vector<char> data;
+		std::vector<std::pair<const char *, const char *> > entries;
+
+		static uint32_t Read(const char *p, bool swap)
+		{
+			uint32_t i;
+			memcpy(&i, p, sizeof(i));
+			if (swap)
+				i = (i >> 24) | ((i >> 8) & 0xFF00) | ((i << 8) & 0xFF0000) | (i << 24);
+			return i;
+		}
+
+		/* Whether the string of the given length at the given offset lies within the file and is terminated */
+		bool Valid(uint32_t len, uint32_t off) const
+		{
+			return off < data.size() && len < data.size() - off && data[off + len] == 0;
+		}
+
+		bool Load(const Anope::string &file)
+		{
+			std::ifstream stream(file.c_str(), std::ios_base::in | std::ios_base::binary);
+			if (!stream.is_open())
+				return false;
+
+			data.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+			if (data.size() < 20)
+				return false;
+
+			const char *base = &data[0];
+			bool swap;
+			if (Read(base, false) == 0x950412de)
+				swap = false;
+			else if (Read(base, true) == 0x950412de)
+				swap = true;
+			else
+				return false;
+
+			uint32_t count = Read(base + 8, swap), originals = Read(base + 12, swap), translations = Read(base + 16, swap);
+			if (originals > data.size() || translations > data.size() || count > (data.size() - std::max(originals, translations)) / 8)
+				return false;
+
+			entries.reserve(count);
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				uint32_t olen = Read(base + originals + i * 8, swap), ooff = Read(base + originals + i * 8 + 4, swap),
+					tlen = Read(base + translations + i * 8, swap), toff = Read(base + translations + i * 8 + 4, swap);
+				if (!Valid(olen, ooff) || !Valid(tlen, toff))
+					return false;
+
+				/* Skip the header, which has an empty msgid, and untranslated messages. Plural forms
+				 * are stored after the first string and are never looked up.
+				 */
+				if (olen && tlen)
+					entries.push_back(std::make_pair(base + ooff, base + toff));
+			}
+
+			return true;
+		}
+	};
+
+	/* All of the catalogs of one language, and the merged table which messages are looked up in */
+	struct LanguageCatalog
+	{
+		Anope::string name;
+		/* The core catalog first, then those of modules in the order of Language::Domains */
+		std::vector<Catalog *> catalogs;
+		string_table strings;
+
+		~LanguageCatalog()
+		{
+			for (unsigned i = 0; i < catalogs.size(); ++i)
+				delete catalogs[i];
+		}
+
+		/* Find the file of a domain for this language. Like gettext, try the name as given, then without
+		 * the codeset (de_DE.UTF-8 -> de_DE), then without the territory (de_DE -> de).
+		 */
+		Anope::string FindFile(const Anope::string &domain) const
+		{
+			Anope::string lang = name;
+			for (;;)
+			{
+				Anope::string file = Anope::LocaleDir + "/" + lang + "/LC_MESSAGES/" + domain + ".mo";
+				if (Anope::IsFile(file))
+					return file;
+
+				size_t sz = lang.find('.');
+				if (sz == Anope::string::npos)
+					sz = lang.find('_');
+				if (sz == Anope::string::npos)
+					return "";
+				lang = lang.substr(0, sz);
+			}
+		}
+
+		bool Load(const Anope::string &domain)
+		{
+			Anope::string file = FindFile(domain);
+			if (file.empty())
+				return false;
+
+			Catalog *c = new Catalog();
+			c->domain = domain;
+			if (!c->Load(file))
+			{
+				Log() << "Unable to load language file " << file;
+				delete c;
+				return false;
+			}
+
+			catalogs.push_back(c);
+			Rebuild();
+			return true;
+		}
+
+		void Unload(const Anope::string &domain)
+		{
+			for (unsigned i = catalogs.size(); i > 0; --i)
+				if (catalogs[i - 1]->domain == domain)
+				{
+					delete catalogs[i - 1];
+					catalogs.erase(catalogs.begin() + i - 1);
+					Rebuild();
+				}
+		}
+
+		void Rebuild()
+		{
+			strings.clear();
+			/* Earlier catalogs win, as the core domain used to be searched first */
+			for (unsigned i = 0; i < catalogs.size(); ++i)
+				for (unsigned j = 0; j < catalogs[i]->entries.size(); ++j)
+					strings.insert(catalogs[i]->entries[j]);
+		}
+
+		const char *Translate(const char *string) const
+		{
+			string_table::const_iterator it = strings.find(string);
+			return it != strings.end() ? it->second : string;
+		}
+	};
+
+	/* Loaded languages, there are only ever a few. Neither these nor their
+	 * catalogs are locked, they are only used from the main thread.
+	 */
+	std::vector<LanguageCatalog *> LanguageCatalogs;
+
+	LanguageCatalog *FindCatalog(const char *lang)
+	{
+		for (unsigned i = 0; i < LanguageCatalogs.size(); ++i)
+			if (!strcmp(LanguageCatalogs[i]->name.c_str(), lang))
+				return LanguageCatalogs[i];
+		return NULL;
+	}
+
+	/* Loads the core catalog of a language, or returns NULL if there isn't one */
+	LanguageCatalog *LoadLanguage(const Anope::string &language)
+	{
+		LanguageCatalog *lc = FindCatalog(language.c_str());
+		if (lc)
+			return lc;
+
+		lc = new LanguageCatalog();
+		lc->name = language;
+		if (!lc->Load("anope"))
+		{
+			delete lc;
+			return NULL;
+		}
+
+		/* Modules loaded before this language have their catalogs too */
+		for (unsigned i = 0; i < Language::Domains.size(); ++i)
+			lc->Load(Language::Domains[i]);
+
+		LanguageCatalogs.push_back(lc);
+		return lc;
+	}
+}
+
 void Language::InitLanguages()
 {
-#if GETTEXT_FOUND
 	Log(LOG_DEBUG) << "Initializing Languages...";
 
 	Languages.clear();
-
-	if (!bindtextdomain("anope", Anope::LocaleDir.c_str()))
-		Log() << "Error calling bindtextdomain, " << Anope::LastError();
-	else
-		Log(LOG_DEBUG) << "Successfully bound anope to " << Anope::LocaleDir;
-
-	setlocale(LC_ALL, "");
+	for (unsigned i = 0; i < LanguageCatalogs.size(); ++i)
+		delete LanguageCatalogs[i];
+	LanguageCatalogs.clear();
 
 	spacesepstream sep(Config->GetBlock("options")->Get<const Anope::string>("languages"));
 	Anope::string language;
 	while (sep.GetToken(language))
 	{
-		const Anope::string &lang_name = Translate(language.c_str(), _("English"));
-		if (lang_name == "English")
+		LanguageCatalog *lc = LoadLanguage(language);
+		if (lc == NULL || !strcmp(lc->Translate(_("English")), "English"))
 		{
 			Log() << "Unable to use language " << language;
 			continue;
@@ -50,9 +251,41 @@ void Language::InitLanguages()
 		Log(LOG_DEBUG) << "Found language " << language;
 		Languages.push_back(language);
 	}
-#else
-	Log() << "Unable to initialize languages, gettext is not installed";
-#endif
+
+	LoadDefaultLanguage();
+}
+
+void Language::LoadDefaultLanguage()
+{
+	/* The default language is used even if it is not one users may choose */
+	if (!Config->DefLanguage.empty() && !LoadLanguage(Config->DefLanguage))
+		Log() << "Unable to use default language " << Config->DefLanguage << ", replies will be in English";
+}
+
+bool Language::AddDomain(const Anope::string &domain)
+{
+	bool found = false;
+	for (unsigned i = 0; i < LanguageCatalogs.size(); ++i)
+		if (LanguageCatalogs[i]->Load(domain))
+		{
+			Log() << "Found language file " << LanguageCatalogs[i]->name << " for " << domain;
+			found = true;
+		}
+
+	if (found)
+		Domains.push_back(domain);
+	return found;
+}
+
+void Language::RemoveDomain(const Anope::string &domain)
+{
+	std::vector<Anope::string>::iterator it = std::find(Domains.begin(), Domains.end(), domain);
+	if (it == Domains.end())
+		return;
+
+	Domains.erase(it);
+	for (unsigned i = 0; i < LanguageCatalogs.size(); ++i)
+		LanguageCatalogs[i]->Unload(domain);
 }
 
 const char *Language::Translate(const char *string)
@@ -73,12 +306,6 @@ const char *Language::Translate(const NickCore *nc, const char *string)
 	return Translate(nc ? nc->language.c_str() : "", string);
 }
 
-#if GETTEXT_FOUND
-
-#ifdef __USE_GNU_GETTEXT
-extern "C" int _nl_msg_cat_cntr;
-#endif
-
 const char *Language::Translate(const char *lang, const char *string)
 {
 	if (!string || !*string)
@@ -87,41 +314,6 @@ const char *Language::Translate(const char *lang, const char *string)
 	if (!lang || !*lang)
 		lang = Config->DefLanguage.c_str();
 
-#ifdef __USE_GNU_GETTEXT
-	++_nl_msg_cat_cntr;
-#endif
-
-#ifdef _WIN32
-	SetThreadLocale(MAKELCID(MAKELANGID(WindowsGetLanguage(lang), SUBLANG_DEFAULT), SORT_DEFAULT));
-#else
-	/* First, set LANG and LANGUAGE env variables.
-	 * Some systems (Debian) don't care about this, so we must setlocale LC_ALL as well.
-	 * BUT if this call fails because the LANGUAGE env variable is set, setlocale resets
-	 * the locale to "C", which short circuits gettext and causes it to fail on systems that
-	 * use the LANGUAGE env variable. We must reset the locale to en_US (or, anything not
-	 * C or POSIX) then.
-	 */
-	setenv("LANG", lang, 1);
-	setenv("LANGUAGE", lang, 1);
-	if (setlocale(LC_ALL, lang) == NULL)
-		setlocale(LC_ALL, "en_US");
-#endif
-	const char *translated_string = dgettext("anope", string);
-	for (unsigned i = 0; translated_string == string && i < Domains.size(); ++i)
-		translated_string = dgettext(Domains[i].c_str(), string);
-#ifdef _WIN32
-	SetThreadLocale(MAKELCID(MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), SORT_DEFAULT));
-#else
-	unsetenv("LANGUAGE");
-	unsetenv("LANG");
-	setlocale(LC_ALL, "");
-#endif
-
-	return translated_string;
-}
-#else
-const char *Language::Translate(const char *lang, const char *string)
-{
-	return string != NULL ? string : "";
+	const LanguageCatalog *lc = FindCatalog(lang);
+	return lc ? lc->Translate(string) : string;
 }
-#endif
@@ -20,6 +20,7 @@
 #include "servers.h"
 #include "uplink.h"
 #include "protocol.h"
+#include "threadengine.h"
 
 #ifndef _WIN32
 #include <sys/time.h>
@@ -60,25 +61,246 @@ static inline Anope::string CreateLogName(const Anope::string &file, time_t t =
 	return Anope::LogDir + "/" + file + "." + timestamp;
 }
 
+namespace
+{
+	/* A line waiting to be written to a log file */
+	struct PendingLine
+	{
+		LogFile *file;
+		Anope::string line;
+
+		PendingLine(LogFile *f, const Anope::string &l) : file(f), line(l) { }
+	};
+
+	/* Writes queued lines to the log files. The main thread only ever holds the lock long
+	 * enough to append to the queue, and the writer takes the whole queue at once and writes
+	 * the lines of each file with a single write.
+	 */
+	class LogWriter
+	{
+		/* Most bytes which may be waiting to be written. Past this debug and raw IO lines are
+		 * thrown away, and other lines wait for the writer to catch up.
+		 */
+		static const size_t MAX_PENDING = 4 * 1024 * 1024;
+
+		Condition cond;
+		std::vector<PendingLine> queue;
+		pthread_t handle;
+		/* Whether the thread is running, has been asked to stop, and is writing lines it has taken from the queue */
+		bool running, stopping, busy;
+		LogFile::Stats stats;
+
+		static void *Entry(void *parameter)
+		{
+			static_cast<LogWriter *>(parameter)->Run();
+			return NULL;
+		}
+
+		static void WriteBatch(const std::vector<PendingLine> &batch)
+		{
+			/* Gather the lines of each file, keeping their order */
+			std::vector<std::pair<LogFile *, std::string> > files;
+
+			for (unsigned i = 0; i < batch.size(); ++i)
+			{
+				unsigned j = 0;
+				while (j < files.size() && files[j].first != batch[i].file)
+					++j;
+				if (j == files.size())
+					files.push_back(std::make_pair(batch[i].file, std::string()));
+				files[j].second += batch[i].line.str();
+			}
+
+			for (unsigned i = 0; i < files.size(); ++i)
+			{
+				std::ofstream &stream = files[i].first->stream;
+				stream.write(files[i].second.data(), files[i].second.length());
+				stream.flush();
+			}
+		}
+
+		void Run()
+		{
+			std::vector<PendingLine> batch;
+
+			cond.Lock();
+			for (;;)
+			{
+				while (queue.empty() && !stopping)
+					cond.Wait();
+				if (queue.empty())
+					break;
+
+				batch.swap(queue);
+				stats.pending = 0;
+				busy = true;
+				cond.Unlock();
+
+				WriteBatch(batch);
+
+				cond.Lock();
+				busy = false;
+				stats.written += batch.size();
+				++stats.batches;
+				batch.clear();
+				/* The main thread may be waiting for room in the queue or for it to be written */
+				cond.Wakeup();
+			}
+			cond.Unlock();
+		}
+
+		bool Start()
+		{
+			if (pthread_create(&handle, NULL, Entry, this))
+				return false;
+
+			static bool registered = false;
+			if (!registered)
+			{
+				/* Do not lose what has not been written yet when exiting */
+				atexit(LogFile::Flush);
+				registered = true;
+			}
+
+			running = true;
+			return true;
+		}
+
+	 public:
+		LogWriter() : running(false), stopping(false), busy(false)
+		{
+			memset(&stats, 0, sizeof(stats));
+		}
+
+		void Write(LogFile *lf, const Anope::string &line, bool droppable)
+		{
+			if (!running && !Start())
+			{
+				/* No thread, write it ourselves */
+				lf->stream << line;
+				lf->stream.flush();
+				return;
+			}
+
+			cond.Lock();
+
+			if (stats.pending + line.length() > MAX_PENDING)
+			{
+				if (droppable)
+				{
+					++stats.dropped;
+					cond.Unlock();
+					return;
+				}
+
+				++stats.waits;
+				while (stats.pending + line.length() > MAX_PENDING && !queue.empty())
+				{
+					cond.Wakeup();
+					cond.Wait();
+				}
+			}
+
+			queue.push_back(PendingLine(lf, line));
+			stats.pending += line.length();
+			if (stats.pending > stats.peak)
+				stats.peak = stats.pending;
+			++stats.queued;
+
+			cond.Wakeup();
+			cond.Unlock();
+		}
+
+		/* Wait until everything queued has been written */
+		void Drain()
+		{
+			if (!running)
+				return;
+
+			cond.Lock();
+			while (!queue.empty() || busy)
+			{
+				cond.Wakeup();
+				cond.Wait();
+			}
+			cond.Unlock();
+		}
+
+		void Stop()
+		{
+			if (!running)
+				return;
+
+			cond.Lock();
+			stopping = true;
+			cond.Wakeup();
+			cond.Unlock();
+
+			pthread_join(handle, NULL);
+			running = stopping = false;
+		}
+
+		LogFile::Stats GetStats()
+		{
+			cond.Lock();
+			LogFile::Stats s = stats;
+			cond.Unlock();
+			return s;
+		}
+	};
+
+	/* Never destroyed, log files may be closed as late as static destruction */
+	LogWriter *writer = NULL;
+}
+
 LogFile::LogFile(const Anope::string &name) : filename(name), stream(name.c_str(), std::ios_base::out | std::ios_base::app)
 {
 }
 
 LogFile::~LogFile()
 {
+	/* The writer may still have lines for us */
+	if (writer)
+		writer->Drain();
 	this->stream.close();
 }
 
+void LogFile::Write(const Anope::string &line, bool droppable)
+{
+	if (!writer)
+		writer = new LogWriter();
+	writer->Write(this, line, droppable);
+}
+
+LogFile::Stats LogFile::GetStats()
+{
+	if (!writer)
+	{
+		Stats stats;
+		memset(&stats, 0, sizeof(stats));
+		return stats;
+	}
+
+	return writer->GetStats();
+}
+
+void LogFile::Flush()
+{
+	if (writer)
+		writer->Stop();
+}
+
 const Anope::string &LogFile::GetName() const
 {
 	return this->filename;
 }
 
-Log::Log(LogType t, const Anope::string &cat, BotInfo *b) : bi(b), u(NULL), nc(NULL), c(NULL), source(NULL), chan(NULL), ci(NULL), s(NULL), m(NULL), type(t), category(cat)
+Log::Log(LogType t, const Anope::string &cat, BotInfo *b) : bi(b), u(NULL), nc(NULL), c(NULL), source(NULL), chan(NULL), ci(NULL), s(NULL), m(NULL), type(t), category(cat), buf(NULL)
 {
+	this->Route();
 }
 
-Log::Log(LogType t, CommandSource &src, Command *_c, ChannelInfo *_ci) : u(src.GetUser()), nc(src.nc), c(_c), source(&src), chan(NULL), ci(_ci), s(NULL), m(NULL), type(t)
+Log::Log(LogType t, CommandSource &src, Command *_c, ChannelInfo *_ci) : u(src.GetUser()), nc(src.nc), c(_c), source(&src), chan(NULL), ci(_ci), s(NULL), m(NULL), type(t), buf(NULL)
 {
 	if (!c)
 		throw CoreException("Invalid pointers passed to Log::Log");
@@ -91,49 +313,90 @@ Log::Log(LogType t, CommandSource &src, Command *_c, ChannelInfo *_ci) : u(src.G
 	if (sl != Anope::string::npos)
 		this->bi = BotInfo::Find(c->name.substr(0, sl), true);
 	this->category = c->name;
+	this->Route();
 }
 
-Log::Log(User *_u, Channel *ch, const Anope::string &cat) : bi(NULL), u(_u), nc(NULL), c(NULL), source(NULL), chan(ch), ci(chan ? *chan->ci : NULL), s(NULL), m(NULL), type(LOG_CHANNEL), category(cat)
+Log::Log(User *_u, Channel *ch, const Anope::string &cat) : bi(NULL), u(_u), nc(NULL), c(NULL), source(NULL), chan(ch), ci(chan ? *chan->ci : NULL), s(NULL), m(NULL), type(LOG_CHANNEL), category(cat), buf(NULL)
 {
 	if (!chan)
 		throw CoreException("Invalid pointers passed to Log::Log");
+	this->Route();
 }
 
-Log::Log(User *_u, const Anope::string &cat, BotInfo *_bi) : bi(_bi), u(_u), nc(NULL), c(NULL), source(NULL), chan(NULL), ci(NULL), s(NULL), m(NULL), type(LOG_USER), category(cat)
+Log::Log(User *_u, const Anope::string &cat, BotInfo *_bi) : bi(_bi), u(_u), nc(NULL), c(NULL), source(NULL), chan(NULL), ci(NULL), s(NULL), m(NULL), type(LOG_USER), category(cat), buf(NULL)
 {
 	if (!u)
 		throw CoreException("Invalid pointers passed to Log::Log");
+	this->Route();
 }
 
-Log::Log(Server *serv, const Anope::string &cat, BotInfo *_bi) : bi(_bi), u(NULL), nc(NULL), c(NULL), source(NULL), chan(NULL), ci(NULL), s(serv), m(NULL), type(LOG_SERVER), category(cat)
+Log::Log(Server *serv, const Anope::string &cat, BotInfo *_bi) : bi(_bi), u(NULL), nc(NULL), c(NULL), source(NULL), chan(NULL), ci(NULL), s(serv), m(NULL), type(LOG_SERVER), category(cat), buf(NULL)
 {
 	if (!s)
 		throw CoreException("Invalid pointer passed to Log::Log");
+	this->Route();
 }
 
-Log::Log(BotInfo *b, const Anope::string &cat) : bi(b), u(NULL), nc(NULL), c(NULL), source(NULL), chan(NULL), ci(NULL), s(NULL), m(NULL), type(LOG_NORMAL), category(cat)
+Log::Log(BotInfo *b, const Anope::string &cat) : bi(b), u(NULL), nc(NULL), c(NULL), source(NULL), chan(NULL), ci(NULL), s(NULL), m(NULL), type(LOG_NORMAL), category(cat), buf(NULL)
 {
+	this->Route();
 }
 
-Log::Log(Module *mod, const Anope::string &cat, BotInfo *_bi) : bi(_bi), u(NULL), nc(NULL), c(NULL), source(NULL), chan(NULL), ci(NULL), s(NULL), m(mod), type(LOG_MODULE), category(cat)
+Log::Log(Module *mod, const Anope::string &cat, BotInfo *_bi) : bi(_bi), u(NULL), nc(NULL), c(NULL), source(NULL), chan(NULL), ci(NULL), s(NULL), m(mod), type(LOG_MODULE), category(cat), buf(NULL)
 {
+	this->Route();
 }
 
 Log::~Log()
 {
+	if (!this->wanted)
+		return;
+
 	if (Anope::NoFork && Anope::Debug && this->type >= LOG_NORMAL && this->type <= LOG_DEBUG + Anope::Debug - 1)
-		std::cout << GetTimeStamp() << " Debug: " << this->BuildPrefix() << this->buf.str() << std::endl;
+		std::cout << GetTimeStamp() << " Debug: " << this->BuildPrefix() << this->GetMessage() << std::endl;
 	else if (Anope::NoFork && this->type <= LOG_TERMINAL)
-		std::cout << GetTimeStamp() << " " << this->BuildPrefix() << this->buf.str() << std::endl;
+		std::cout << GetTimeStamp() << " " << this->BuildPrefix() << this->GetMessage() << std::endl;
 	else if (this->type == LOG_TERMINAL)
-		std::cout << this->BuildPrefix() << this->buf.str() << std::endl;
+		std::cout << this->BuildPrefix() << this->GetMessage() << std::endl;
 
 	FOREACH_MOD(OnLog, (this));
 
 	if (Config)
 		for (unsigned i = 0; i < Config->LogInfos.size(); ++i)
-			if (Config->LogInfos[i].HasType(this->type, this->category))
+			if (this->routes & (static_cast<LogMask>(1) << i))
 				Config->LogInfos[i].ProcessMessage(this);
+
+	delete this->buf;
+}
+
+bool Log::ToTerminal(LogType type)
+{
+	if (Anope::NoFork && Anope::Debug && type >= LOG_NORMAL && type <= LOG_DEBUG + Anope::Debug - 1)
+		return true;
+	return (Anope::NoFork && type <= LOG_TERMINAL) || type == LOG_TERMINAL;
+}
+
+bool Log::Routed(LogType type)
+{
+	return ToTerminal(type) || (Config && Config->LogRoutes.Route(type, ""));
+}
+
+void Log::Route()
+{
+	this->routes = 0;
+	this->wanted = false;
+	if (!Wants(this->type))
+		return;
+
+	this->routes = Config ? Config->LogRoutes.Route(this->type, this->category) : 0;
+
+	/* Modules only see debug and raw messages which are logged somewhere anyway */
+	this->wanted = this->routes || ToTerminal(this->type) || (this->type <= LOG_TERMINAL && !ModuleManager::EventHandlers[I_OnLog].empty());
+}
+
+Anope::string Log::GetMessage() const
+{
+	return this->buf ? this->buf->str() : "";
 }
 
 Anope::string Log::FormatSource() const
@@ -238,46 +501,45 @@ LogInfo::~LogInfo()
 	this->logfiles.clear();
 }
 
-bool LogInfo::HasType(LogType ltype, const Anope::string &type) const
+const std::vector<Anope::string> *LogInfo::GetCategories(LogType ltype) const
 {
-	const std::vector<Anope::string> *list = NULL;
 	switch (ltype)
 	{
 		case LOG_ADMIN:
-			list = &this->admin;
-			break;
+			return &this->admin;
 		case LOG_OVERRIDE:
-			list = &this->override;
-			break;
+			return &this->override;
 		case LOG_COMMAND:
-			list = &this->commands;
-			break;
+			return &this->commands;
 		case LOG_SERVER:
-			list = &this->servers;
-			break;
+			return &this->servers;
 		case LOG_CHANNEL:
-			list = &this->channels;
-			break;
+			return &this->channels;
 		case LOG_USER:
-			list = &this->users;
-			break;
+			return &this->users;
+		case LOG_MODULE:
+		case LOG_NORMAL:
+			return &this->normal;
+		default:
+			return NULL;
+	}
+}
+
+bool LogInfo::HasType(LogType ltype, const Anope::string &type) const
+{
+	switch (ltype)
+	{
 		case LOG_TERMINAL:
 			return true;
 		case LOG_RAWIO:
 			return (Anope::Debug || this->debug) ? true : this->raw_io;
 		case LOG_DEBUG:
 			return Anope::Debug ? true : this->debug;
-		case LOG_DEBUG_2:
-		case LOG_DEBUG_3:
-		case LOG_DEBUG_4:
-			break;
-		case LOG_MODULE:
-		case LOG_NORMAL:
 		default:
-			list = &this->normal;
 			break;
 	}
 
+	const std::vector<Anope::string> *list = this->GetCategories(ltype);
 	if (list == NULL)
 		return false;
 
@@ -299,6 +561,112 @@ bool LogInfo::HasType(LogType ltype, const Anope::string &type) const
 	return false;
 }
 
+const unsigned LogRouter::MAX_BLOCKS;
+
+void LogRouter::Build(const std::vector<LogInfo> &li)
+{
+	this->built = true;
+
+	for (unsigned t = 0; t < LOG_RAWIO; ++t)
+	{
+		Table &table = this->tables[t];
+		table = Table();
+
+		for (unsigned i = 0; i < li.size(); ++i)
+		{
+			LogMask bit = static_cast<LogMask>(1) << i;
+			const std::vector<Anope::string> *list = li[i].GetCategories(static_cast<LogType>(t));
+			if (list == NULL)
+			{
+				/* Types without categories want all or nothing */
+				if (li[i].HasType(static_cast<LogType>(t), ""))
+					table.fixed |= bit;
+				continue;
+			}
+
+			/* A category named without wildcards can only match itself, so it gets a route
+			 * of its own. Any other category can only match the wildcards, which are kept
+			 * in order up to the first "*", after which nothing else is checked.
+			 */
+			WildBlock wb;
+			wb.block = i;
+			for (unsigned j = 0; j < list->size(); ++j)
+			{
+				Anope::string cat = list->at(j);
+				bool inverse = !cat.empty() && cat[0] == '~';
+				if (inverse)
+					cat.erase(cat.begin());
+
+				if (cat.find_first_of("*?") == Anope::string::npos)
+					table.exact[cat] = 0;
+				else
+				{
+					wb.patterns.push_back(std::make_pair(cat, !inverse));
+					if (cat == "*")
+						break;
+				}
+			}
+
+			if (wb.patterns.size() == 1 && wb.patterns[0].first == "*")
+			{
+				if (wb.patterns[0].second)
+					table.fixed |= bit;
+			}
+			else if (!wb.patterns.empty())
+				table.wild.push_back(wb);
+		}
+
+		for (Anope::hash_map<LogMask>::iterator it = table.exact.begin(), it_end = table.exact.end(); it != it_end; ++it)
+			for (unsigned i = 0; i < li.size(); ++i)
+				if (li[i].HasType(static_cast<LogType>(t), it->first))
+					it->second |= static_cast<LogMask>(1) << i;
+	}
+
+	/* The routes of raw and debug messages depend only on whether debug mode is on, see LogInfo::HasType */
+	for (unsigned t = 0; t <= LOG_DEBUG_4 - LOG_RAWIO; ++t)
+		this->raw_routes[0][t] = this->raw_routes[1][t] = 0;
+	for (unsigned i = 0; i < li.size(); ++i)
+	{
+		LogMask bit = static_cast<LogMask>(1) << i;
+
+		this->raw_routes[1][LOG_RAWIO - LOG_RAWIO] |= bit;
+		this->raw_routes[1][LOG_DEBUG - LOG_RAWIO] |= bit;
+		if (li[i].debug || li[i].raw_io)
+			this->raw_routes[0][LOG_RAWIO - LOG_RAWIO] |= bit;
+		if (li[i].debug)
+			this->raw_routes[0][LOG_DEBUG - LOG_RAWIO] |= bit;
+	}
+}
+
+LogMask LogRouter::Route(LogType type, const Anope::string &category) const
+{
+	if (!this->built)
+		return 0;
+
+	if (type >= LOG_RAWIO)
+		return this->raw_routes[Anope::Debug ? 1 : 0][type - LOG_RAWIO];
+
+	const Table &table = this->tables[type];
+	Anope::hash_map<LogMask>::const_iterator it = table.exact.find(category);
+	if (it != table.exact.end())
+		return it->second;
+
+	LogMask mask = table.fixed;
+	for (unsigned i = 0; i < table.wild.size(); ++i)
+	{
+		const WildBlock &wb = table.wild[i];
+		for (unsigned j = 0; j < wb.patterns.size(); ++j)
+			if (Anope::Match(category, wb.patterns[j].first))
+			{
+				if (wb.patterns[j].second)
+					mask |= static_cast<LogMask>(1) << wb.block;
+				break;
+			}
+	}
+
+	return mask;
+}
+
 void LogInfo::OpenLogFiles()
 {
 	for (unsigned i = 0; i < this->logfiles.size(); ++i)
@@ -349,7 +717,7 @@ void LogInfo::ProcessMessage(const Log *l)
 			return;
 	}
 
-	const Anope::string &buffer = l->BuildPrefix() + l->buf.str();
+	const Anope::string &buffer = l->BuildPrefix() + l->GetMessage();
 
 	FOREACH_MOD(OnLogMessage, (this, l, buffer));
 
@@ -406,9 +774,10 @@ void LogInfo::ProcessMessage(const Log *l)
 			}
 	}
 
+	if (this->logfiles.empty())
+		return;
+
+	const Anope::string line = GetTimeStamp() + " " + buffer + "\n";
 	for (unsigned i = 0; i < this->logfiles.size(); ++i)
-	{
-		LogFile *lf = this->logfiles[i];
-		lf->stream << GetTimeStamp() << " " << buffer << std::endl;
-	}
+		this->logfiles[i]->Write(line, l->type >= LOG_RAWIO);
 }
@@ -12,42 +12,644 @@
 #include "services.h"
 #include "mail.h"
 #include "config.h"
+#include "servers.h"
+#include "threadengine.h"
+#include "timers.h"
 
-Mail::Message::Message(const Anope::string &sf, const Anope::string &mailto, const Anope::string &a, const Anope::string &s, const Anope::string &m) : Thread(), sendmail_path(Config->GetBlock("mail")->Get<const Anope::string>("sendmailpath")), send_from(sf), mail_to(mailto), addr(a), subject(s), message(m), dont_quote_addresses(Config->GetBlock("mail")->Get<bool>("dontquoteaddresses")), success(false)
+#include <errno.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#else
+#include "dir/dir.h"
+#endif
+
+namespace
 {
+	/* Messages delivered per batch, and over one SMTP session */
+	const unsigned BATCH_SIZE = 50;
+	/* Seconds before the first retry, doubled after each failure up to RETRY_MAX */
+	const time_t RETRY_MIN = 60, RETRY_MAX = 3600;
+	/* Seconds an idle connection to the mail server is kept open */
+	const time_t IDLE_TIMEOUT = 60;
+
+	/* A connection to the mail server, only used by one Delivery at a time */
+	class SMTPConnection
+	{
+		int fd;
+		bool pipelining;
+		Anope::string buffer;
+
+		bool ReadLine(Anope::string &line)
+		{
+			for (;;)
+			{
+				size_t nl = buffer.find('\n');
+				if (nl != Anope::string::npos)
+				{
+					line = buffer.substr(0, nl);
+					buffer.erase(0, nl + 1);
+					line.trim();
+					return true;
+				}
+
+				char buf[4096];
+				int len = recv(fd, buf, sizeof(buf), 0);
+				if (len <= 0)
+					return false;
+				buffer.append(buf, len);
+			}
+		}
+
+	 public:
+		/* The last reply read */
+		Anope::string reply;
+		time_t last_used;
+
+		SMTPConnection() : fd(-1), pipelining(false), last_used(0) { }
+
+		~SMTPConnection()
+		{
+			this->Close();
+		}
+
+		bool IsOpen() const
+		{
+			return fd >= 0;
+		}
+
+		bool HasPipelining() const
+		{
+			return pipelining;
+		}
+
+		bool Connect(const Anope::string &host, const Anope::string &port)
+		{
+			this->Close();
+
+			addrinfo hints, *result = NULL;
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_socktype = SOCK_STREAM;
+			int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+			if (err)
+			{
+				reply = "Unable to resolve " + host + ": " + gai_strerror(err);
+				return false;
+			}
+
+			for (addrinfo *ai = result; ai && fd < 0; ai = ai->ai_next)
+			{
+				fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+				if (fd < 0)
+					continue;
+
+				timeval timeout = { 30, 0 };
+				setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<char *>(&timeout), sizeof(timeout));
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<char *>(&timeout), sizeof(timeout));
+
+				if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+				{
+					reply = "Unable to connect to " + host + ": " + Anope::LastError();
+					anope_close(fd);
+					fd = -1;
+				}
+			}
+			freeaddrinfo(result);
+
+			if (fd < 0)
+				return false;
+
+			if (this->Read() != 220 || !this->Send("EHLO " + Me->GetName() + "\r\n"))
+			{
+				reply = "Bad greeting from " + host + ": " + reply;
+				this->Close();
+				return false;
+			}
+
+			/* The capabilities are listed one per line of the reply */
+			Anope::string line;
+			pipelining = false;
+			do
+			{
+				if (!this->ReadLine(line) || line.length() < 4 || !line.substr(0, 3).is_pos_number_only())
+				{
+					reply = "Connection to " + host + " lost";
+					this->Close();
+					return false;
+				}
+				reply = line;
+				if (line.substr(4).equals_ci("PIPELINING"))
+					pipelining = true;
+			}
+			while (line[3] == '-');
+
+			if (convertTo<int>(line.substr(0, 3)) != 250)
+			{
+				reply = "EHLO refused by " + host + ": " + reply;
+				this->Close();
+				return false;
+			}
+
+			return true;
+		}
+
+		void Close()
+		{
+			if (fd < 0)
+				return;
+
+			send(fd, "QUIT\r\n", 6, 0);
+			anope_close(fd);
+			fd = -1;
+			buffer.clear();
+		}
+
+		bool Send(const Anope::string &data)
+		{
+			for (size_t sent = 0; sent < data.length();)
+			{
+				int len = send(fd, data.c_str() + sent, data.length() - sent, 0);
+				if (len <= 0)
+				{
+					reply = "Connection lost: " + Anope::LastError();
+					return false;
+				}
+				sent += len;
+			}
+			return true;
+		}
+
+		/** Read a reply, which may span multiple lines
+		 * @return The reply code, or 0 if the connection is lost
+		 */
+		int Read()
+		{
+			Anope::string line;
+			do
+			{
+				if (!this->ReadLine(line) || line.length() < 3 || !line.substr(0, 3).is_pos_number_only())
+				{
+					reply = "Connection lost";
+					return 0;
+				}
+			}
+			while (line.length() > 3 && line[3] == '-');
+
+			reply = line;
+			return convertTo<int>(line.substr(0, 3));
+		}
+	};
+
+	/* Delivers a batch of messages on the thread pool */
+	class Delivery : public Task
+	{
+		std::vector<Mail::Message *> batch;
+		/* NULL if messages are given to sendmail instead */
+		SMTPConnection *smtp;
+		Anope::string sendmail_path, host, port;
+
+		/* Record the outcome of a message from a reply code */
+		static void SetResult(Mail::Message *m, int code, const Anope::string &reply)
+		{
+			if (code >= 200 && code < 400)
+				return;
+			m->result = code >= 500 ? Mail::Message::FAILED : Mail::Message::DEFERRED;
+			m->error = reply;
+		}
+
+		/* The message as sent over SMTP, with line endings converted and leading dots doubled */
+		static Anope::string Encode(const Anope::string &text)
+		{
+			Anope::string out;
+			for (size_t pos = 0; pos < text.length();)
+			{
+				size_t nl = text.find('\n', pos);
+				if (nl == Anope::string::npos)
+					nl = text.length();
+
+				Anope::string line = text.substr(pos, nl - pos);
+				if (!line.empty() && line[line.length() - 1] == '\r')
+					line.erase(line.length() - 1);
+				if (!line.empty() && line[0] == '.')
+					out += ".";
+				out += line + "\r\n";
+
+				pos = nl + 1;
+			}
+			return out + ".\r\n";
+		}
+
+		/* Send a command and read its reply, 0 if the connection is lost */
+		int Command(const Anope::string &command)
+		{
+			return smtp->Send(command + "\r\n") ? smtp->Read() : 0;
+		}
+
+		/* Read the reply to a message which has been sent */
+		bool Finish(Mail::Message *m)
+		{
+			int code = smtp->Read();
+			if (!code)
+				return false;
+			SetResult(m, code, smtp->reply);
+			if (m->result == Mail::Message::PENDING)
+				m->result = Mail::Message::SENT;
+			return true;
+		}
+
+		bool DeliverSMTP()
+		{
+			/* Make sure a connection kept open from an earlier batch still works */
+			if (smtp->IsOpen() && this->Command("RSET") != 250)
+				smtp->Close();
+
+			if (!smtp->IsOpen())
+			{
+				if (!smtp->Connect(host, port))
+					return false;
+				connected = true;
+			}
+
+			/* With pipelining the commands for a message are sent together, along with
+			 * the message before it, so each message costs one round trip to the server.
+			 */
+			bool pipelining = smtp->HasPipelining();
+			/* A message which has been accepted for DATA, but not sent yet */
+			Mail::Message *last = NULL;
+			for (unsigned i = 0; i < batch.size() && !this->IsCancelled(); ++i)
+			{
+				Mail::Message *m = batch[i];
+				Anope::string mail_from = "MAIL FROM:<" + m->send_from + ">", rcpt_to = "RCPT TO:<" + m->addr + ">";
+				int mail, rcpt, data;
+				/* The reply to the first command refused */
+				Anope::string error;
+
+				if (pipelining)
+				{
+					Anope::string out = last ? Encode(last->text) : "";
+					out += mail_from + "\r\n" + rcpt_to + "\r\nDATA\r\n";
+					if (!smtp->Send(out) || (last && !this->Finish(last)))
+						return false;
+
+					mail = smtp->Read();
+					error = smtp->reply;
+					rcpt = mail ? smtp->Read() : 0;
+					if (mail == 250)
+						error = smtp->reply;
+					data = rcpt ? smtp->Read() : 0;
+					if (mail == 250 && rcpt == 250)
+						error = smtp->reply;
+				}
+				else
+				{
+					if (last && (!smtp->Send(Encode(last->text)) || !this->Finish(last)))
+						return false;
+
+					mail = this->Command(mail_from);
+					rcpt = mail == 250 ? this->Command(rcpt_to) : mail;
+					data = rcpt == 250 ? this->Command("DATA") : rcpt;
+					error = smtp->reply;
+				}
+				last = NULL;
+
+				if (!mail || !rcpt || !data)
+					return false;
+
+				if (mail == 250 && rcpt == 250 && data == 354)
+				{
+					last = m;
+					continue;
+				}
+
+				SetResult(m, mail != 250 ? mail : (rcpt != 250 ? rcpt : data), error);
+
+				/* End the DATA command if it was accepted anyway, and the transaction if one was started */
+				if (data == 354 && !this->Command("."))
+					return false;
+				if (mail == 250 && !this->Command("RSET"))
+					return false;
+			}
+
+			if (last && (!smtp->Send(Encode(last->text)) || !this->Finish(last)))
+				return false;
+
+			return true;
+		}
+
+		void DeliverSendmail()
+		{
+			for (unsigned i = 0; i < batch.size() && !this->IsCancelled(); ++i)
+			{
+				Mail::Message *m = batch[i];
+
+				FILE *pipe = popen(sendmail_path.c_str(), "w");
+				if (!pipe)
+				{
+					SetResult(m, 421, "Unable to run " + sendmail_path + ": " + Anope::LastError());
+					continue;
+				}
+
+				fprintf(pipe, "%s", m->text.c_str());
+				fprintf(pipe, "\n.\n");
+
+				int status = pclose(pipe);
+				if (status)
+					SetResult(m, 421, sendmail_path + " exited with status " + stringify(status));
+				else
+					m->result = Mail::Message::SENT;
+			}
+		}
+
+	 public:
+		/* Whether a new connection was opened */
+		bool connected;
+
+		Delivery(const std::vector<Mail::Message *> &b, SMTPConnection *s, const Anope::string &path, const Anope::string &h, const Anope::string &p)
+			: batch(b), smtp(s), sendmail_path(path), host(h), port(p), connected(false)
+		{
+		}
+
+		/* Number of messages in the batch */
+		size_t Size() const
+		{
+			return batch.size();
+		}
+
+		void Run() anope_override
+		{
+			if (!smtp)
+				return this->DeliverSendmail();
+
+			if (!this->DeliverSMTP())
+			{
+				/* The connection failed, messages which did not get a reply are tried again later */
+				for (unsigned i = 0; i < batch.size(); ++i)
+					if (batch[i]->result == Mail::Message::PENDING)
+						SetResult(batch[i], 421, smtp->reply);
+				smtp->Close();
+			}
+		}
+
+		void OnComplete() anope_override;
+	};
+
+	class DeliveryTimer : public Timer
+	{
+	 public:
+		DeliveryTimer() : Timer(5, Anope::CurTime, true) { }
+
+		void Tick(time_t) anope_override;
+	};
+
+	/* Messages waiting to be delivered, not including the ones being delivered */
+	std::list<Mail::Message *> spool;
+	/* The batch being delivered, if any */
+	Delivery *delivery = NULL;
+	SMTPConnection *smtp = NULL;
+	DeliveryTimer *timer = NULL;
+	Mail::Stats stats;
+	unsigned long serial = 0;
+
+	Anope::string SpoolDir()
+	{
+		return Anope::DataDir + "/mail";
+	}
+
+	/* Start delivering the messages which are due, unless a batch is being delivered already */
+	void Deliver()
+	{
+		if (delivery || Anope::Quitting)
+			return;
+
+		Configuration::Block *b = Config->GetBlock("mail");
+		Anope::string host = b->Get<const Anope::string>("smtphost");
+
+		if (host.empty() && smtp)
+		{
+			delete smtp;
+			smtp = NULL;
+		}
+
+		/* Close a connection which has not been used for a while */
+		if (smtp && smtp->IsOpen() && smtp->last_used + IDLE_TIMEOUT <= Anope::CurTime)
+			smtp->Close();
+
+		std::vector<Mail::Message *> batch;
+		for (std::list<Mail::Message *>::iterator it = spool.begin(); it != spool.end() && batch.size() < BATCH_SIZE;)
+		{
+			Mail::Message *m = *it;
+			if (m->next_attempt > Anope::CurTime)
+			{
+				++it;
+				continue;
+			}
+
+			m->result = Mail::Message::PENDING;
+			m->error.clear();
+			batch.push_back(m);
+			it = spool.erase(it);
+		}
+
+		if (batch.empty())
+			return;
+
+		if (!host.empty() && !smtp)
+			smtp = new SMTPConnection();
+
+		delivery = new Delivery(batch, host.empty() ? NULL : smtp, b->Get<const Anope::string>("sendmailpath"), host, b->Get<const Anope::string>("smtpport", "25"));
+		ThreadPool::Queue(delivery);
+	}
+
+	void Delivery::OnComplete()
+	{
+		delivery = NULL;
+
+		if (connected)
+			++stats.connections;
+		if (smtp)
+		{
+			smtp->last_used = Anope::CurTime;
+			++stats.batches;
+		}
+
+		unsigned max_attempts = Config->GetBlock("mail")->Get<unsigned>("maxattempts", "10");
+
+		for (unsigned i = 0; i < batch.size(); ++i)
+		{
+			Mail::Message *m = batch[i];
+
+			if (m->result == Mail::Message::DEFERRED && ++m->attempts < max_attempts)
+			{
+				time_t delay = RETRY_MIN;
+				for (unsigned j = 1; j < m->attempts && delay < RETRY_MAX; ++j)
+					delay *= 2;
+				delay = std::min(delay, RETRY_MAX);
+
+				m->next_attempt = Anope::CurTime + delay;
+				spool.push_back(m);
+				++stats.deferred;
+				Log(LOG_NORMAL, "mail") << "Unable to deliver mail for " << m->mail_to << " (" << m->addr << "), retrying in " << Anope::Duration(delay) << ": " << m->error;
+				continue;
+			}
+
+			if (m->result == Mail::Message::SENT)
+			{
+				++stats.sent;
+				Log(LOG_NORMAL, "mail") << "Successfully delivered mail for " << m->mail_to << " (" << m->addr << ")";
+			}
+			else
+			{
+				++stats.failed;
+				Log(LOG_NORMAL, "mail") << "Error delivering mail for " << m->mail_to << " (" << m->addr << "): " << m->error;
+			}
+
+			if (!m->file.empty())
+				unlink(m->file.c_str());
+			delete m;
+		}
+
+		/* Carry on with the rest of a burst straight away */
+		Deliver();
+	}
+
+	void DeliveryTimer::Tick(time_t)
+	{
+		Deliver();
+	}
 }
 
-Mail::Message::~Message()
+Mail::Message::Message(const Anope::string &sf, const Anope::string &mailto, const Anope::string &a, const Anope::string &s, const Anope::string &m) : send_from(sf), mail_to(mailto), addr(a), attempts(0), next_attempt(0), result(PENDING)
 {
-	if (success)
-		Log(LOG_NORMAL, "mail") << "Successfully delivered mail for " << mail_to << " (" << addr << ")";
+	text = "From: " + send_from + "\n";
+	if (Config->GetBlock("mail")->Get<bool>("dontquoteaddresses"))
+		text += "To: " + mail_to + " <" + addr + ">\n";
 	else
-		Log(LOG_NORMAL, "mail") << "Error delivering mail for " << mail_to << " (" << addr << ")";
+		text += "To: \"" + mail_to + "\" <" + addr + ">\n";
+	text += "Subject: " + s + "\n";
+	text += m;
 }
 
-void Mail::Message::Run()
+void Mail::Message::Spool()
 {
-	FILE *pipe = popen(sendmail_path.c_str(), "w");
+	++stats.queued;
+
+	/* The envelope goes before the message itself */
+	Anope::string name;
+	do
+		name = SpoolDir() + "/" + stringify(Anope::CurTime) + "-" + stringify(++serial);
+	while (Anope::IsFile(name));
 
-	if (!pipe)
+	Anope::string tmp = name + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	bool written = false;
+	if (f)
 	{
-		SetExitState();
-		return;
+		written = fprintf(f, "%s\n%s\n%s\n%s", send_from.c_str(), addr.c_str(), mail_to.c_str(), text.c_str()) >= 0;
+		/* Always close the file, even if writing it failed */
+		written = !fclose(f) && written && !rename(tmp.c_str(), name.c_str());
 	}
 
-	fprintf(pipe, "From: %s\n", send_from.c_str());
-	if (this->dont_quote_addresses)
-		fprintf(pipe, "To: %s <%s>\n", mail_to.c_str(), addr.c_str());
+	if (written)
+		file = name;
 	else
-		fprintf(pipe, "To: \"%s\" <%s>\n", mail_to.c_str(), addr.c_str());
-	fprintf(pipe, "Subject: %s\n", subject.c_str());
-	fprintf(pipe, "%s", message.c_str());
-	fprintf(pipe, "\n.\n");
+	{
+		Log(LOG_NORMAL, "mail") << "Unable to write mail for " << mail_to << " to the spool directory " << SpoolDir() << ": " << Anope::LastError();
+		if (f)
+			unlink(tmp.c_str());
+	}
+
+	spool.push_back(this);
+	Deliver();
+}
+
+void Mail::Init()
+{
+	if (!timer)
+		timer = new DeliveryTimer();
+
+	Anope::string dir = SpoolDir();
+	DIR *dirp = opendir(dir.c_str());
+	if (!dirp)
+	{
+#ifndef _WIN32
+		if (mkdir(dir.c_str(), S_IRWXU | S_IRGRP | S_IXGRP) && errno != EEXIST)
+#else
+		if (!CreateDirectory(dir.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+#endif
+			Log() << "Unable to create the mail spool directory " << dir << ": " << Anope::LastError();
+		return;
+	}
+
+	unsigned loaded = 0;
+	for (dirent *dp; (dp = readdir(dirp));)
+	{
+		Anope::string name = dp->d_name;
+		if (name[0] == '.')
+			continue;
+
+		Anope::string path = dir + "/" + name;
+		/* Left over from a message which was being spooled */
+		if (name.length() > 4 && name.substr(name.length() - 4) == ".tmp")
+		{
+			unlink(path.c_str());
+			continue;
+		}
 
-	pclose(pipe);
+		std::ifstream stream(path.c_str());
+		Message *m = new Message();
+		m->file = path;
+		for (std::string line; std::getline(stream, line);)
+		{
+			if (m->send_from.empty())
+				m->send_from = line;
+			else if (m->addr.empty())
+				m->addr = line;
+			else if (m->mail_to.empty())
+				m->mail_to = line;
+			else
+				m->text += line + "\n";
+		}
+
+		if (m->addr.empty() || m->text.empty())
+		{
+			Log() << "Ignoring invalid spooled mail " << path;
+			delete m;
+			continue;
+		}
 
-	success = true;
-	SetExitState();
+		spool.push_back(m);
+		++loaded;
+	}
+	closedir(dirp);
+
+	if (loaded)
+		Log() << "Loaded " << loaded << " spooled mail messages";
+}
+
+void Mail::Shutdown()
+{
+	delete timer;
+	timer = NULL;
+
+	delete smtp;
+	smtp = NULL;
+
+	for (std::list<Message *>::iterator it = spool.begin(); it != spool.end(); ++it)
+		delete *it;
+	spool.clear();
+}
+
+Mail::Stats Mail::GetStats()
+{
+	Stats s = stats;
+	s.spooled = spool.size() + (delivery ? delivery->Size() : 0);
+	s.waiting = 0;
+	for (std::list<Message *>::const_iterator it = spool.begin(); it != spool.end(); ++it)
+		if ((*it)->next_attempt > Anope::CurTime)
+			++s.waiting;
+	return s;
 }
 
 bool Mail::Send(User *u, NickCore *nc, BotInfo *service, const Anope::string &subject, const Anope::string &message)
@@ -65,8 +667,7 @@ bool Mail::Send(User *u, NickCore *nc, BotInfo *service, const Anope::string &su
 			return false;
 
 		nc->lastmail = Anope::CurTime;
-		Thread *t = new Mail::Message(b->Get<const Anope::string>("sendfrom"), nc->display, nc->email, subject, message);
-		t->Start();
+		(new Mail::Message(b->Get<const Anope::string>("sendfrom"), nc->display, nc->email, subject, message))->Spool();
 		return true;
 	}
 	else
@@ -80,8 +681,7 @@ bool Mail::Send(User *u, NickCore *nc, BotInfo *service, const Anope::string &su
 		else
 		{
 			u->lastmail = nc->lastmail = Anope::CurTime;
-			Thread *t = new Mail::Message(b->Get<const Anope::string>("sendfrom"), nc->display, nc->email, subject, message);
-			t->Start();
+			(new Mail::Message(b->Get<const Anope::string>("sendfrom"), nc->display, nc->email, subject, message))->Spool();
 			return true;
 		}
 
@@ -96,8 +696,7 @@ bool Mail::Send(NickCore *nc, const Anope::string &subject, const Anope::string
 		return false;
 
 	nc->lastmail = Anope::CurTime;
-	Thread *t = new Mail::Message(b->Get<const Anope::string>("sendfrom"), nc->display, nc->email, subject, message);
-	t->Start();
+	(new Mail::Message(b->Get<const Anope::string>("sendfrom"), nc->display, nc->email, subject, message))->Spool();
 
 	return true;
 }
@@ -15,6 +15,9 @@
 #include "bots.h"
 #include "socketengine.h"
 #include "uplink.h"
+#include "threadengine.h"
+#include "mail.h"
+#include "lagmonitor.h"
 
 #ifndef _WIN32
 #include <limits.h>
@@ -63,6 +66,17 @@ class ExpireTimer : public Timer
 	}
 };
 
+class PingTimer : public Timer
+{
+ public:
+	PingTimer(time_t timeout) : Timer(timeout, Anope::CurTime, true) { }
+
+	void Tick(time_t) anope_override
+	{
+		LagMonitor::Ping();
+	}
+};
+
 void Anope::SaveDatabases()
 {
 	if (Anope::ReadOnly)
@@ -158,11 +172,14 @@ int main(int ac, char **av, char **envp)
 	time_t last_check = Anope::CurTime;
 	UpdateTimer updateTimer(Config->GetBlock("options")->Get<time_t>("updatetimeout", "5m"));
 	ExpireTimer expireTimer(Config->GetBlock("options")->Get<time_t>("expiretimeout", "30m"));
+	time_t uplinkping = Config->GetBlock("options")->Get<time_t>("uplinkping", "1m");
+	PingTimer *pingTimer = uplinkping ? new PingTimer(uplinkping) : NULL;
 
 	/*** Main loop. ***/
 	while (!Anope::Quitting)
 	{
 		Log(LOG_DEBUG_2) << "Top of main loop";
+		LagMonitor::Begin();
 
 		/* Process timers */
 		if (Anope::CurTime - last_check >= Config->TimeoutCheck)
@@ -176,8 +193,12 @@ int main(int ac, char **av, char **envp)
 
 		if (Anope::Signal)
 			Anope::HandleSignal();
+
+		LagMonitor::End();
 	}
 
+	delete pingTimer;
+
 	if (Anope::Restarting)
 	{
 		FOREACH_MOD(OnRestart, ());
@@ -194,6 +215,9 @@ int main(int ac, char **av, char **envp)
 	delete UplinkSock;
 
 	ModuleManager::UnloadAll();
+	/* Before the socket engine, which owns the pool's pipe */
+	ThreadPool::Shutdown();
+	Mail::Shutdown();
 	SocketEngine::Shutdown();
 	for (Module *m; (m = ModuleManager::FindFirstOf(PROTOCOL)) != NULL;)
 		ModuleManager::UnloadModule(m, NULL);
@@ -209,6 +233,7 @@ int main(int ac, char **av, char **envp)
 		chdir(BinaryDir.c_str());
 		Anope::string sbin = "./" + Anope::ServicesBin;
 		av[0] = const_cast<char *>(sbin.c_str());
+		LogFile::Flush();
 		execve(Anope::ServicesBin.c_str(), av, envp);
 		Log() << "Restart failed";
 		Anope::ReturnValue = -1;
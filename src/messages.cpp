@@ -26,7 +26,13 @@ void Away::Run(MessageSource &source, const std::vector<Anope::string> &params)
 {
 	const Anope::string &msg = !params.empty() ? params[0] : "";
 
-	FOREACH_MOD(OnUserAway, (source.GetUser(), msg));
+	/* The modules are told about users who are still bursting once they connect */
+	if (source.GetUser()->IsConnectPending())
+		source.GetUser()->burst_away = msg;
+	else
+	{
+		FOREACH_MOD(OnUserAway, (source.GetUser(), msg));
+	}
 	if (!msg.empty())
 		Log(source.GetUser(), "away") << "is now away: " << msg;
 	else
@@ -84,6 +90,13 @@ void Join::Run(MessageSource &source, const std::vector<Anope::string> &params)
 				Channel *c = cc->chan;
 				++it;
 
+				/* The modules haven't seen this join yet */
+				if (cc->burst_pending)
+				{
+					c->DeleteUser(user);
+					continue;
+				}
+
 				FOREACH_MOD(OnPrePartChannel, (user, c));
 				cc->chan->DeleteUser(user);
 				FOREACH_MOD(OnPartChannel, (user, c, c->name, ""));
@@ -127,6 +140,14 @@ void Join::SJoin(MessageSource &source, const Anope::string &chan, time_t ts, co
 		 */
 		c->SetModesInternal(source, modes, ts, !c->syncing);
 
+	/* During a netburst users are only added to the channel here. Checking them
+	 * and calling OnJoinChannel happens in Channel::ProcessBurstJoins once the
+	 * server is synced. The same goes for joins by users the modules haven't
+	 * seen connect yet, however the join reached us.
+	 */
+	Server *src = source.GetServer() ? source.GetServer() : Me;
+	bool burst = src && src != Me && !src->IsSynced();
+
 	for (std::list<SJoinUser>::const_iterator it = users.begin(), it_end = users.end(); it != it_end; ++it)
 	{
 		const ChannelStatus &status = it->first;
@@ -137,7 +158,14 @@ void Join::SJoin(MessageSource &source, const Anope::string &chan, time_t ts, co
 			continue;
 
 		/* Add the user to the channel */
-		c->JoinUser(u, keep_their_modes ? &status : NULL);
+		ChanUserContainer *cc = c->JoinUser(u, keep_their_modes ? &status : NULL);
+
+		if (burst || u->IsConnectPending())
+		{
+			cc->burst_pending = true;
+			c->burst_joins.push_back(u);
+			continue;
+		}
 
 		/* Check if the user is allowed to join */
 		if (c->CheckKick(u))
@@ -156,7 +184,6 @@ void Join::SJoin(MessageSource &source, const Anope::string &chan, time_t ts, co
 	{
 		/* Sync the channel (mode lock, topic, etc) */
 		/* the channel is synced when the netmerge is complete */
-		Server *src = source.GetServer() ? source.GetServer() : Me;
 		if (src && src->IsSynced())
 		{
 			c->Sync();
@@ -284,10 +311,18 @@ void Part::Run(MessageSource &source, const std::vector<Anope::string> &params)
 	while (sep.GetToken(channel))
 	{
 		Channel *c = Channel::Find(channel);
+		ChanUserContainer *cc = c ? u->FindChannel(c) : NULL;
 
-		if (!c || !u->FindChannel(c))
+		if (!cc)
 			continue;
 
+		/* The modules haven't seen this join yet */
+		if (cc->burst_pending)
+		{
+			c->DeleteUser(u);
+			continue;
+		}
+
 		Log(u, c, "part") << "Reason: " << (!reason.empty() ? reason : "No reason");
 		FOREACH_MOD(OnPrePartChannel, (u, c));
 		c->DeleteUser(u);
@@ -14,11 +14,9 @@
 #include "channels.h"
 #include "uplink.h"
 
-struct StackerInfo;
-
-/* List of pairs of user/channels and their stacker info */
-static std::map<User *, StackerInfo *> UserStackerObjects;
-static std::map<Channel *, StackerInfo *> ChannelStackerObjects;
+/* Users and channels with pending mode changes in the stacker */
+static std::vector<User *> UserStackerObjects;
+static std::vector<Channel *> ChannelStackerObjects;
 
 /* Array of all modes Anope knows about.*/
 static std::vector<ChannelMode *> ChannelModes;
@@ -30,25 +28,71 @@ static std::vector<UserMode *> UserModes;
 static std::vector<ChannelMode *> ChannelModesIdx;
 static std::vector<UserMode *> UserModesIdx;
 
+/* Modes by the id of their name */
+static std::vector<ChannelMode *> ChannelModesByID;
+static std::vector<UserMode *> UserModesByID;
+
 static std::map<Anope::string, ChannelMode *> ChannelModesByName;
 static std::map<Anope::string, UserMode *> UserModesByName;
 
 /* Sorted by status */
 static std::vector<ChannelModeStatus *> ChannelModesByStatus;
 
+/* Mode names by id, and ids by mode name. Id 0 is never used */
+static std::vector<Anope::string> ModeNames(1);
+static TR1NS::unordered_map<Anope::string, unsigned short, Anope::hash_cs> ModeIDs;
+
 /* Number of generic modes we support */
 unsigned ModeManager::GenericChannelModes = 0, ModeManager::GenericUserModes = 0;
 
 struct StackerInfo
 {
-	/* Modes to be added */
-	std::list<std::pair<Mode *, Anope::string> > AddModes;
-	/* Modes to be deleted */
-	std::list<std::pair<Mode *, Anope::string> > DelModes;
+	struct Change
+	{
+		Mode *mode;
+		Anope::string param;
+		bool set;
+		/* Cleared when a later change supersedes or cancels this one */
+		bool active;
+
+		Change(Mode *m, const Anope::string &p, bool s) : mode(m), param(p), set(s), active(true) { }
+	};
+
+	/* What identifies a change for the purpose of merging. Param modes can only be
+	 * set once so they match regardless of their param, status and list modes must
+	 * match the param too (eg +o Adam and +o Bob are different changes).
+	 */
+	struct Key
+	{
+		Mode *mode;
+		Anope::string param;
+
+		Key(Mode *m, const Anope::string &p) : mode(m), param(m->type == MODE_PARAM ? "" : p) { }
+
+		bool operator==(const Key &other) const
+		{
+			return mode == other.mode && param.equals_cs(other.param);
+		}
+	};
+
+	struct KeyHash
+	{
+		size_t operator()(const Key &k) const
+		{
+			return reinterpret_cast<size_t>(k.mode) ^ Anope::hash_cs()(k.param);
+		}
+	};
+
+	/* Changes in the order they were added */
+	std::vector<Change> changes;
+	/* Position in changes of the active change for each key */
+	TR1NS::unordered_map<Key, size_t, KeyHash> index;
+	/* Number of active changes */
+	size_t active;
 	/* Bot this is sent from */
 	BotInfo *bi;
 
-	StackerInfo() : bi(NULL) { }
+	StackerInfo() : active(0), bi(NULL) { }
 
 	/** Add a mode to this object
 	 * @param mode The mode
@@ -56,6 +100,11 @@ struct StackerInfo
 	 * @param param The param for the mode
 	 */
 	void AddMode(Mode *mode, bool set, const Anope::string &param);
+
+	/** Drop all pending changes of a mode
+	 * @param mode The mode
+	 */
+	void DelMode(Mode *mode);
 };
 
 ChannelStatus::ChannelStatus()
@@ -114,7 +163,7 @@ Anope::string ChannelStatus::BuildModePrefixList() const
 	return ret;
 }
 
-Mode::Mode(const Anope::string &mname, ModeClass mcl, char mch, ModeType mt) : name(mname), mclass(mcl), mchar(mch), type(mt)
+Mode::Mode(const Anope::string &mname, ModeClass mcl, char mch, ModeType mt) : name(mname), mclass(mcl), mchar(mch), type(mt), id(0)
 {
 }
 
@@ -261,53 +310,46 @@ bool ChannelModeNoone::CanSet(User *u) const
 
 void StackerInfo::AddMode(Mode *mode, bool set, const Anope::string &param)
 {
-	bool is_param = mode->type == MODE_PARAM;
+	std::pair<TR1NS::unordered_map<Key, size_t, KeyHash>::iterator, bool> res = index.insert(std::make_pair(Key(mode, param), changes.size()));
 
-	std::list<std::pair<Mode *, Anope::string> > *list, *otherlist;
-	if (set)
-	{
-		list = &AddModes;
-		otherlist = &DelModes;
-	}
-	else
+	if (!res.second)
 	{
-		list = &DelModes;
-		otherlist = &AddModes;
-	}
+		Change &old = changes[res.first->second];
+		old.active = false;
+		--active;
 
-	/* Loop through the list and find if this mode is already on here */
-	std::list<std::pair<Mode *, Anope::string > >::iterator it, it_end;
-	for (it = list->begin(), it_end = list->end(); it != it_end; ++it)
-	{
-		/* The param must match too (can have multiple status or list modes), but
-		 * if it is a param mode it can match no matter what the param is
-		 */
-		if (it->first == mode && (is_param || param.equals_cs(it->second)))
+		if (old.set != set)
 		{
-			list->erase(it);
-			/* It can only be on this list once */
-			break;
+			/* This is like setting + and - on the same mode within the same cycle, no change
+			 * is made (eg, we don't want +o-o Adam Adam). This causes no problems with something
+			 * like - + and -, because after the second mode change nothing is pending, and the
+			 * third mode change starts fresh.
+			 */
+			index.erase(res.first);
+			return;
 		}
+
+		/* The same change again, it moves to the end with the new param */
+		res.first->second = changes.size();
 	}
-	/* If the mode is on the other list, remove it from there (eg, we don't want +o-o Adam Adam) */
-	for (it = otherlist->begin(), it_end = otherlist->end(); it != it_end; ++it)
+
+	changes.push_back(Change(mode, param, set));
+	++active;
+}
+
+void StackerInfo::DelMode(Mode *mode)
+{
+	for (TR1NS::unordered_map<Key, size_t, KeyHash>::iterator it = index.begin(); it != index.end();)
 	{
-		/* The param must match too (can have multiple status or list modes), but
-		 * if it is a param mode it can match no matter what the param is
-		 */
-		if (it->first == mode && (is_param || param.equals_cs(it->second)))
+		if (it->first.mode == mode)
 		{
-			otherlist->erase(it);
-			return;
-			/* Note that we return here because this is like setting + and - on the same mode within the same
-			 * cycle, no change is made. This causes no problems with something like - + and -, because after the
-			 * second mode change the list is empty, and the third mode change starts fresh.
-			 */
+			changes[it->second].active = false;
+			--active;
+			it = index.erase(it);
 		}
+		else
+			++it;
 	}
-
-	/* Add this mode and its param to our list */
-	list->push_back(std::make_pair(mode, param));
 }
 
 static class ModePipe : public Pipe
@@ -320,19 +362,20 @@ static class ModePipe : public Pipe
 } *modePipe;
 
 /** Get the stacker info for an item, if one doesn't exist it is created
- * @param Item The user/channel etc
+ * @param l The list of objects with pending changes
+ * @param o The user/channel etc
  * @return The stacker info
  */
-template<typename List, typename Object>
-static StackerInfo *GetInfo(List &l, Object *o)
+template<typename Object>
+static StackerInfo *GetInfo(std::vector<Object *> &l, Object *o)
 {
-	typename List::const_iterator it = l.find(o);
-	if (it != l.end())
-		return it->second;
+	if (o->stacker == NULL)
+	{
+		o->stacker = new StackerInfo();
+		l.push_back(o);
+	}
 
-	StackerInfo *s = new StackerInfo();
-	l[o] = s;
-	return s;
+	return o->stacker;
 }
 
 /** Build a list of mode strings to send to the IRCd from the mode stacker
@@ -342,55 +385,81 @@ static StackerInfo *GetInfo(List &l, Object *o)
 static std::list<Anope::string> BuildModeStrings(StackerInfo *info)
 {
 	std::list<Anope::string> ret;
-	std::list<std::pair<Mode *, Anope::string> >::iterator it, it_end;
-	Anope::string buf = "+", parambuf;
+	if (!info->active)
+		return ret;
+
+	/* Leave room for command, channel, etc */
+	size_t maxlen = IRCD->MaxLine > 100 ? IRCD->MaxLine - 100 : IRCD->MaxLine;
+	Anope::string buf, parambuf;
 	unsigned NModes = 0;
 
-	for (it = info->AddModes.begin(), it_end = info->AddModes.end(); it != it_end; ++it)
+	/* All additions are sent before all removals, in the order they were stacked */
+	for (int pass = 0; pass < 2; ++pass)
 	{
-		if (++NModes > IRCD->MaxModes || (buf.length() + parambuf.length() > IRCD->MaxLine - 100)) // Leave room for command, channel, etc
+		bool set = pass == 0;
+		char sign = set ? '+' : '-';
+		bool have_sign = false;
+
+		for (unsigned i = 0; i < info->changes.size(); ++i)
 		{
-			ret.push_back(buf + parambuf);
-			buf = "+";
-			parambuf.clear();
-			NModes = 1;
-		}
+			const StackerInfo::Change &change = info->changes[i];
+			if (!change.active || change.set != set)
+				continue;
 
-		buf += it->first->mchar;
+			size_t add = 1 + (have_sign ? 0 : 1) + (change.param.empty() ? 0 : change.param.length() + 1);
+			if (NModes && (NModes + 1 > IRCD->MaxModes || buf.length() + parambuf.length() + add > maxlen))
+			{
+				ret.push_back(buf + parambuf);
+				buf.clear();
+				parambuf.clear();
+				NModes = 0;
+				have_sign = false;
+			}
 
-		if (!it->second.empty())
-			parambuf += " " + it->second;
-	}
+			if (!have_sign)
+			{
+				buf += sign;
+				have_sign = true;
+			}
 
-	if (buf[buf.length() - 1] == '+')
-		buf.erase(buf.length() - 1);
+			buf += change.mode->mchar;
+			++NModes;
 
-	buf += "-";
-	for (it = info->DelModes.begin(), it_end = info->DelModes.end(); it != it_end; ++it)
-	{
-		if (++NModes > IRCD->MaxModes || (buf.length() + parambuf.length() > IRCD->MaxLine - 100)) // Leave room for command, channel, etc
-		{
-			ret.push_back(buf + parambuf);
-			buf = "-";
-			parambuf.clear();
-			NModes = 1;
+			if (!change.param.empty())
+			{
+				parambuf += " ";
+				parambuf += change.param;
+			}
 		}
-
-		buf += it->first->mchar;
-
-		if (!it->second.empty())
-			parambuf += " " + it->second;
 	}
 
-	if (buf[buf.length() - 1] == '-')
-		buf.erase(buf.length() - 1);
-
 	if (!buf.empty())
 		ret.push_back(buf + parambuf);
 
 	return ret;
 }
 
+unsigned short ModeManager::GetModeID(const Anope::string &name, bool create)
+{
+	TR1NS::unordered_map<Anope::string, unsigned short, Anope::hash_cs>::const_iterator it = ModeIDs.find(name);
+	if (it != ModeIDs.end())
+		return it->second;
+	else if (!create)
+		return 0;
+
+	unsigned short id = ModeNames.size();
+	ModeNames.push_back(name);
+	ModeIDs[name] = id;
+	return id;
+}
+
+const Anope::string &ModeManager::GetModeName(unsigned short id)
+{
+	if (id < ModeNames.size())
+		return ModeNames[id];
+	return ModeNames[0];
+}
+
 bool ModeManager::AddUserMode(UserMode *um)
 {
 	if (ModeManager::FindUserModeByChar(um->mchar) != NULL)
@@ -411,6 +480,11 @@ bool ModeManager::AddUserMode(UserMode *um)
 
 	UserModesByName[um->name] = um;
 
+	um->id = GetModeID(um->name, true);
+	if (um->id >= UserModesByID.size())
+		UserModesByID.resize(um->id + 1);
+	UserModesByID[um->id] = um;
+
 	UserModes.push_back(um);
 
 	FOREACH_MOD(OnUserModeAdd, (um));
@@ -452,6 +526,11 @@ bool ModeManager::AddChannelMode(ChannelMode *cm)
 
 	ChannelModesByName[cm->name] = cm;
 
+	cm->id = GetModeID(cm->name, true);
+	if (cm->id >= ChannelModesByID.size())
+		ChannelModesByID.resize(cm->id + 1);
+	ChannelModesByID[cm->id] = cm;
+
 	ChannelModes.push_back(cm);
 
 	FOREACH_MOD(OnChannelModeAdd, (cm));
@@ -477,6 +556,7 @@ void ModeManager::RemoveUserMode(UserMode *um)
 	UserModesIdx[want] = NULL;
 
 	UserModesByName.erase(um->name);
+	UserModesByID[um->id] = NULL;
 
 	std::vector<UserMode *>::iterator it = std::find(UserModes.begin(), UserModes.end(), um);
 	if (it != UserModes.end())
@@ -519,6 +599,7 @@ void ModeManager::RemoveChannelMode(ChannelMode *cm)
 	}
 
 	ChannelModesByName.erase(cm->name);
+	ChannelModesByID[cm->id] = NULL;
 
 	std::vector<ChannelMode *>::iterator it = std::find(ChannelModes.begin(), ChannelModes.end(), cm);
 	if (it != ChannelModes.end())
@@ -561,6 +642,22 @@ UserMode *ModeManager::FindUserModeByName(const Anope::string &name)
 	return NULL;
 }
 
+ChannelMode *ModeManager::FindChannelModeByID(unsigned short id)
+{
+	if (id >= ChannelModesByID.size())
+		return NULL;
+
+	return ChannelModesByID[id];
+}
+
+UserMode *ModeManager::FindUserModeByID(unsigned short id)
+{
+	if (id >= UserModesByID.size())
+		return NULL;
+
+	return UserModesByID[id];
+}
+
 char ModeManager::GetStatusChar(char value)
 {
 	unsigned want = value;
@@ -636,53 +733,56 @@ void ModeManager::StackerAdd(BotInfo *bi, User *u, UserMode *um, bool Set, const
 	modePipe->Notify();
 }
 
+/** Send the pending changes for an object and clear its stacker
+ * @param obj The user or channel
+ */
+template<typename T>
+static void FlushStacker(T *obj)
+{
+	StackerInfo *si = obj->stacker;
+	obj->stacker = NULL;
+
+	std::list<Anope::string> ModeStrings = BuildModeStrings(si);
+	for (std::list<Anope::string>::iterator lit = ModeStrings.begin(), lit_end = ModeStrings.end(); lit != lit_end; ++lit)
+		IRCD->SendMode(si->bi, obj, "%s", lit->c_str());
+
+	delete si;
+}
+
 void ModeManager::ProcessModes()
 {
 	if (!UserStackerObjects.empty())
 	{
-		for (std::map<User *, StackerInfo *>::const_iterator it = UserStackerObjects.begin(), it_end = UserStackerObjects.end(); it != it_end; ++it)
-		{
-			User *u = it->first;
-			StackerInfo *s = it->second;
+		std::vector<User *> users;
+		users.swap(UserStackerObjects);
 
-			std::list<Anope::string> ModeStrings = BuildModeStrings(s);
-			for (std::list<Anope::string>::iterator lit = ModeStrings.begin(), lit_end = ModeStrings.end(); lit != lit_end; ++lit)
-				IRCD->SendMode(s->bi, u, "%s", lit->c_str());
-			delete it->second;
-		}
-		UserStackerObjects.clear();
+		for (unsigned i = 0; i < users.size(); ++i)
+			if (users[i] && users[i]->stacker)
+				FlushStacker(users[i]);
 	}
 
 	if (!ChannelStackerObjects.empty())
 	{
-		for (std::map<Channel *, StackerInfo *>::const_iterator it = ChannelStackerObjects.begin(), it_end = ChannelStackerObjects.end(); it != it_end; ++it)
-		{
-			Channel *c = it->first;
-			StackerInfo *s = it->second;
+		std::vector<Channel *> chans;
+		chans.swap(ChannelStackerObjects);
 
-			std::list<Anope::string> ModeStrings = BuildModeStrings(s);
-			for (std::list<Anope::string>::iterator lit = ModeStrings.begin(), lit_end = ModeStrings.end(); lit != lit_end; ++lit)
-				IRCD->SendMode(s->bi, c, "%s", lit->c_str());
-			delete it->second;
-		}
-		ChannelStackerObjects.clear();
+		for (unsigned i = 0; i < chans.size(); ++i)
+			if (chans[i] && chans[i]->stacker)
+				FlushStacker(chans[i]);
 	}
 }
 
 template<typename T>
-static void StackerDel(std::map<T *, StackerInfo *> &map, T *obj)
+static void StackerDel(std::vector<T *> &list, T *obj)
 {
-	typename std::map<T *, StackerInfo *>::iterator it = map.find(obj);
-	if (it != map.end())
-	{
-		StackerInfo *si = it->second;
-		std::list<Anope::string> ModeStrings = BuildModeStrings(si);
-		for (std::list<Anope::string>::iterator lit = ModeStrings.begin(), lit_end = ModeStrings.end(); lit != lit_end; ++lit)
-			IRCD->SendMode(si->bi, obj, "%s", lit->c_str());
+	if (obj->stacker == NULL)
+		return;
 
-		delete si;
-		map.erase(it);
-	}
+	FlushStacker(obj);
+
+	typename std::vector<T *>::iterator it = std::find(list.begin(), list.end(), obj);
+	if (it != list.end())
+		*it = NULL;
 }
 
 void ModeManager::StackerDel(User *u)
@@ -697,49 +797,13 @@ void ModeManager::StackerDel(Channel *c)
 
 void ModeManager::StackerDel(Mode *m)
 {
-	for (std::map<User *, StackerInfo *>::const_iterator it = UserStackerObjects.begin(), it_end = UserStackerObjects.end(); it != it_end;)
-	{
-		StackerInfo *si = it->second;
-		++it;
-
-		for (std::list<std::pair<Mode *, Anope::string> >::iterator it2 = si->AddModes.begin(), it2_end = si->AddModes.end(); it2 != it2_end;)
-		{
-			if (it2->first == m)
-				it2 = si->AddModes.erase(it2);
-			else
-				++it2;
-		}
-
-		for (std::list<std::pair<Mode *, Anope::string> >::iterator it2 = si->DelModes.begin(), it2_end = si->DelModes.end(); it2 != it2_end;)
-		{
-			if (it2->first == m)
-				it2 = si->DelModes.erase(it2);
-			else
-				++it2;
-		}
-	}
-
-	for (std::map<Channel *, StackerInfo *>::const_iterator it = ChannelStackerObjects.begin(), it_end = ChannelStackerObjects.end(); it != it_end;)
-	{
-		StackerInfo *si = it->second;
-		++it;
+	for (unsigned i = 0; i < UserStackerObjects.size(); ++i)
+		if (UserStackerObjects[i] && UserStackerObjects[i]->stacker)
+			UserStackerObjects[i]->stacker->DelMode(m);
 
-		for (std::list<std::pair<Mode *, Anope::string> >::iterator it2 = si->AddModes.begin(), it2_end = si->AddModes.end(); it2 != it2_end;)
-		{
-			if (it2->first == m)
-				it2 = si->AddModes.erase(it2);
-			else
-				++it2;
-		}
-
-		for (std::list<std::pair<Mode *, Anope::string> >::iterator it2 = si->DelModes.begin(), it2_end = si->DelModes.end(); it2 != it2_end;)
-		{
-			if (it2->first == m)
-				it2 = si->DelModes.erase(it2);
-			else
-				++it2;
-		}
-	}
+	for (unsigned i = 0; i < ChannelStackerObjects.size(); ++i)
+		if (ChannelStackerObjects[i] && ChannelStackerObjects[i]->stacker)
+			ChannelStackerObjects[i]->stacker->DelMode(m);
 }
 
 Entry::Entry(const Anope::string &m, const Anope::string &fh) : name(m), mask(fh), cidr_len(0), family(0)
@@ -10,14 +10,12 @@
 #include "modules.h"
 #include "language.h"
 #include "account.h"
-
-#ifdef GETTEXT_FOUND
-# include <libintl.h>
-#endif
+#include "threadengine.h"
 
 Module::Module(const Anope::string &modname, const Anope::string &, ModType modtype) : name(modname), type(modtype)
 {
 	this->handle = NULL;
+	this->event_histograms = NULL;
 	this->permanent = false;
 	this->created = Anope::CurTime;
 	this->SetVersion(Anope::Version());
@@ -39,26 +37,7 @@ Module::Module(const Anope::string &modname, const Anope::string &, ModType modt
 
 	ModuleManager::Modules.push_back(this);
 
-#if GETTEXT_FOUND
-	for (unsigned i = 0; i < Language::Languages.size(); ++i)
-	{
-		/* Remove .UTF-8 or any other suffix */
-		Anope::string lang;
-		sepstream(Language::Languages[i], '.').GetToken(lang);
-
-		if (Anope::IsFile(Anope::LocaleDir + "/" + lang + "/LC_MESSAGES/" + modname + ".mo"))
-		{
-			if (!bindtextdomain(this->name.c_str(), Anope::LocaleDir.c_str()))
-				Log() << "Error calling bindtextdomain, " << Anope::LastError();
-			else
-			{
-				Log() << "Found language file " << lang << " for " << modname;
-				Language::Domains.push_back(modname);
-			}
-			break;
-		}
-	}
-#endif
+	Language::AddDomain(modname);
 }
 
 Module::~Module()
@@ -67,19 +46,18 @@ Module::~Module()
 
 	/* Detach all event hooks for this module */
 	ModuleManager::DetachAll(this);
+	/* Cancel this module's tasks, waiting for any which are running */
+	ThreadPool::ModuleUnload(this);
 	IdentifyRequest::ModuleUnload(this);
 	/* Clear any active timers this module has */
 	TimerManager::DeleteTimersFor(this);
+	EventProfiler::ModuleUnload(this);
 
 	std::list<Module *>::iterator it = std::find(ModuleManager::Modules.begin(), ModuleManager::Modules.end(), this);
 	if (it != ModuleManager::Modules.end())
 		ModuleManager::Modules.erase(it);
 
-#if GETTEXT_FOUND
-	std::vector<Anope::string>::iterator dit = std::find(Language::Domains.begin(), Language::Domains.end(), this->name);
-	if (dit != Language::Domains.end())
-		Language::Domains.erase(dit);
-#endif
+	Language::RemoveDomain(this->name);
 }
 
 void Module::SetPermanent(bool state)
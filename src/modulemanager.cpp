@@ -11,6 +11,7 @@
 #include "users.h"
 #include "regchannel.h"
 #include "config.h"
+#include "lagmonitor.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -18,6 +19,7 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <dlfcn.h>
+#include <sys/time.h>
 #endif
 
 std::list<Module *> ModuleManager::Modules;
@@ -524,3 +526,132 @@ void ModuleManager::UnloadAll()
 			UnloadModule(m, NULL);
 	}
 }
+
+EventHistogram::EventHistogram() : count(0), total(0), max(0)
+{
+	std::fill(counts, counts + BUCKETS, 0);
+}
+
+void EventHistogram::Record(unsigned long long ticks)
+{
+	unsigned bucket;
+	if (ticks < SUB_BUCKETS)
+		bucket = ticks;
+	else
+	{
+		unsigned bits = 0;
+		for (unsigned long long t = ticks; t > 1; t >>= 1)
+			++bits;
+
+		if (bits >= MAX_BITS)
+			bucket = BUCKETS - 1;
+		else
+			bucket = SUB_BUCKETS * (bits - SUB_BITS + 1) + ((ticks >> (bits - SUB_BITS)) & (SUB_BUCKETS - 1));
+	}
+
+	++counts[bucket];
+	++count;
+	total += ticks;
+	if (ticks > max)
+		max = ticks;
+}
+
+unsigned long long EventHistogram::Percentile(unsigned p) const
+{
+	unsigned long want = (count * p + 99) / 100, seen = 0;
+	for (unsigned i = 0; i < BUCKETS; ++i)
+	{
+		seen += counts[i];
+		if (!want || seen < want)
+			continue;
+
+		unsigned long long highest;
+		if (i < SUB_BUCKETS)
+			highest = i;
+		else
+		{
+			unsigned shift = i / SUB_BUCKETS - 1;
+			highest = ((static_cast<unsigned long long>(SUB_BUCKETS + i % SUB_BUCKETS + 1)) << shift) - 1;
+		}
+		return std::min(highest, max);
+	}
+	return max;
+}
+
+Anope::string EventProfiler::names[I_SIZE];
+bool EventProfiler::enabled = false;
+
+/* When the configuration was first read, for converting ticks to time */
+static unsigned long long start_ticks, start_clock;
+
+unsigned long long EventProfiler::Clock()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+void EventProfiler::Stop(Implementation event, const char *name, Module *m, unsigned long long start)
+{
+	unsigned long long ticks = Ticks() - start;
+
+	LagMonitor::Step *step = LagMonitor::Trace(LagMonitor::STEP_EVENT, start);
+	if (step)
+		step->what = Anope::string(name) + " in " + m->name;
+
+	if (m->event_histograms == NULL)
+	{
+		m->event_histograms = new EventHistogram *[I_SIZE];
+		std::fill(m->event_histograms, m->event_histograms + I_SIZE, static_cast<EventHistogram *>(NULL));
+	}
+
+	EventHistogram *&h = m->event_histograms[event];
+	if (h == NULL)
+	{
+		h = new EventHistogram();
+		names[event] = name;
+	}
+	h->Record(ticks);
+}
+
+void EventProfiler::SetEnabled(bool state)
+{
+	/* The lag monitor converts ticks too, so this is done even if profiling is off */
+	if (!start_clock)
+	{
+		start_ticks = Ticks();
+		start_clock = Clock();
+	}
+	enabled = state;
+}
+
+void EventProfiler::Reset()
+{
+	for (std::list<Module *>::iterator it = ModuleManager::Modules.begin(), it_end = ModuleManager::Modules.end(); it != it_end; ++it)
+		ModuleUnload(*it);
+}
+
+void EventProfiler::ModuleUnload(Module *m)
+{
+	if (m->event_histograms == NULL)
+		return;
+
+	for (unsigned i = 0; i < I_SIZE; ++i)
+		delete m->event_histograms[i];
+	delete [] m->event_histograms;
+	m->event_histograms = NULL;
+}
+
+const Anope::string &EventProfiler::GetEventName(unsigned event)
+{
+	static const Anope::string unknown;
+	return event < I_SIZE ? names[event] : unknown;
+}
+
+double EventProfiler::ToMicroseconds(unsigned long long ticks)
+{
+	unsigned long long clock = Clock() - start_clock, elapsed = Ticks() - start_ticks;
+	if (!clock || !elapsed)
+		return 0;
+	return static_cast<double>(ticks) * clock / elapsed;
+}
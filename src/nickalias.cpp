@@ -19,6 +19,7 @@
 #include "config.h"
 
 Serialize::Checker<nickalias_map> NickAliasList("NickAlias");
+Serialize::Checker<nickalias_index> NickAliasIndex("NickAlias");
 
 NickAlias::NickAlias(const Anope::string &nickname, NickCore* nickcore) : Serializable("NickAlias")
 {
@@ -36,6 +37,7 @@ NickAlias::NickAlias(const Anope::string &nickname, NickCore* nickcore) : Serial
 	(*NickAliasList)[this->nick] = this;
 	if (old == NickAliasList->size())
 		Log(LOG_DEBUG) << "Duplicate nick " << nickname << " in nickalias table";
+	NickAliasIndex->insert(this->nick, this);
 
 	if (this->nc->o == NULL)
 	{
@@ -76,6 +78,7 @@ NickAlias::~NickAlias()
 
 	/* Remove us from the aliases list */
 	NickAliasList->erase(this->nick);
+	NickAliasIndex->erase(this->nick);
 }
 
 void NickAlias::SetVhost(const Anope::string &ident, const Anope::string &host, const Anope::string &creator, time_t created)
@@ -15,11 +15,12 @@
 #include "servers.h"
 #include "users.h"
 #include "regchannel.h"
+#include "lagmonitor.h"
 
 void Anope::Process(const Anope::string &buffer)
 {
 	/* If debugging, log the buffer */
-	Log(LOG_RAWIO) << "Received: " << buffer;
+	LOG_IF(LOG_RAWIO) << "Received: " << buffer;
 
 	if (buffer.empty())
 		return;
@@ -51,6 +52,9 @@ void Anope::Process(const Anope::string &buffer)
 
 	MessageSource src(source);
 
+	if (command.equals_ci("PONG"))
+		LagMonitor::Pong(src.GetServer());
+
 	EventReturn MOD_RESULT;
 	FOREACH_RESULT(OnMessage, MOD_RESULT, (src, command, params));
 	if (MOD_RESULT == EVENT_STOP)
@@ -70,7 +74,13 @@ void Anope::Process(const Anope::string &buffer)
 	else if (m->HasFlag(IRCDMESSAGE_REQUIRE_SERVER) && !source.empty() && !src.GetServer())
 		Log(LOG_DEBUG) << "unexpected non-server source " << source << " for " << command;
 	else
+	{
+		unsigned long long start = EventProfiler::Ticks();
 		m->Run(src, params);
+		LagMonitor::Step *step = LagMonitor::Trace(LagMonitor::STEP_MESSAGE, start);
+		if (step)
+			step->what = command + (source.empty() ? "" : " from " + source);
+	}
 }
 
 void IRCDProto::Parse(const Anope::string &buffer, Anope::string &source, Anope::string &command, std::vector<Anope::string> &params)
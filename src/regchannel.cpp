@@ -20,6 +20,7 @@
 #include "servers.h"
 
 Serialize::Checker<registered_channel_map> RegisteredChannelList("ChannelInfo");
+Serialize::Checker<registered_channel_index> RegisteredChannelIndex("ChannelInfo");
 
 AutoKick::AutoKick() : Serializable("AutoKick")
 {
@@ -120,6 +121,7 @@ ChannelInfo::ChannelInfo(const Anope::string &chname) : Serializable("ChannelInf
 	(*RegisteredChannelList)[this->name] = this;
 	if (old == RegisteredChannelList->size())
 		Log(LOG_DEBUG) << "Duplicate channel " << this->name << " in registered channel table?";
+	RegisteredChannelIndex->insert(this->name, this);
 
 	FOREACH_MOD(OnCreateChan, (this));
 }
@@ -163,6 +165,7 @@ ChannelInfo::~ChannelInfo()
 	}
 
 	RegisteredChannelList->erase(this->name);
+	RegisteredChannelIndex->erase(this->name);
 
 	this->SetFounder(NULL);
 	this->SetSuccessor(NULL);
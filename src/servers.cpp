@@ -19,6 +19,10 @@
 #include "config.h"
 #include "channels.h"
 
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
 /* Anope */
 Server *Me = NULL;
 
@@ -118,7 +122,7 @@ Server::Server(Server *up, const Anope::string &sname, unsigned shops, const Ano
 
 				for (Channel::ModeList::const_iterator it2 = c->GetModes().begin(); it2 != c->GetModes().end(); ++it2)
 				{
-					ChannelMode *cm = ModeManager::FindChannelModeByName(it2->first);
+					ChannelMode *cm = ModeManager::FindChannelModeByID(it2->first);
 					if (!cm || cm->type != MODE_LIST)
 						continue;
 					ModeManager::StackerAdd(c->ci->WhoSends(), c, cm, true, it2->second);
@@ -251,6 +255,23 @@ void Server::Sync(bool sync_links)
 	if (this->IsSynced())
 		return;
 
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	/* Users introduced during the burst go through the modules now, while the
+	 * server is still syncing so modules can tell them apart from new connections
+	 */
+	std::vector<Reference<User> > introduced;
+	introduced.swap(this->burst_users);
+
+	unsigned connected = 0;
+	for (unsigned i = 0; i < introduced.size(); ++i)
+	{
+		User *u = introduced[i];
+		if (u && u->FinishBurst())
+			++connected;
+	}
+
 	syncing = false;
 
 	Log(this, "sync") << "is done syncing";
@@ -270,15 +291,24 @@ void Server::Sync(bool sync_links)
 		FOREACH_MOD(OnPreUplinkSync, (this));
 	}
 
+	unsigned joins = 0;
 	for (channel_map::const_iterator it = ChannelList.begin(), it_end = ChannelList.end(); it != it_end;)
 	{
 		Channel *c = it->second;
 		++it;
 
+		if (!c->burst_joins.empty())
+			joins += c->ProcessBurstJoins();
+
 		if (c->syncing)
 			c->Sync();
 	}
 
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	long elapsed = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+	Log(LOG_DEBUG) << "Processed " << connected << " burst users and " << joins << " burst joins for " << this->GetName() << " in " << elapsed << "us";
+
 	if (me)
 	{
 		IRCD->SendEOB();
@@ -14,6 +14,7 @@
 #include "sockets.h"
 #include "socketengine.h"
 #include "config.h"
+#include "lagmonitor.h"
 
 #include <sys/epoll.h>
 #include <ulimit.h>
@@ -75,7 +76,9 @@ void SocketEngine::Process()
 	if (Sockets.size() > events.size())
 		events.resize(events.size() * 2);
 
+	LagMonitor::Sleep();
 	int total = epoll_wait(EngineHandle, &events.front(), events.size(), Config->ReadTimeout * 1000);
+	LagMonitor::Wake();
 	Anope::CurTime = time(NULL);
 
 	/* EINTR can be given if the read timeout expires */
@@ -15,6 +15,7 @@
 #include "socketengine.h"
 #include "logger.h"
 #include "config.h"
+#include "lagmonitor.h"
 
 #include <sys/types.h>
 #include <sys/event.h>
@@ -75,7 +76,9 @@ void SocketEngine::Process()
 		event_events.resize(event_events.size() * 2);
 
 	static timespec kq_timespec = { Config->ReadTimeout, 0 };
+	LagMonitor::Sleep();
 	int total = kevent(kq_fd, &change_events.front(), change_count, &event_events.front(), event_events.size(), &kq_timespec);
+	LagMonitor::Wake();
 	change_count = 0;
 	Anope::CurTime = time(NULL);
 
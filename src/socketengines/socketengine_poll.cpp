@@ -14,6 +14,7 @@
 #include "sockets.h"
 #include "socketengine.h"
 #include "config.h"
+#include "lagmonitor.h"
 
 #include <errno.h>
 
@@ -99,7 +100,9 @@ void SocketEngine::Change(Socket *s, bool set, SocketFlag flag)
 
 void SocketEngine::Process()
 {
+	LagMonitor::Sleep();
 	int total = poll(&events.front(), events.size(), Config->ReadTimeout * 1000);
+	LagMonitor::Wake();
 	Anope::CurTime = time(NULL);
 
 	/* EINTR can be given if the read timeout expires */
@@ -15,6 +15,7 @@
 #include "socketengine.h"
 #include "logger.h"
 #include "config.h"
+#include "lagmonitor.h"
 
 #ifdef _AIX
 # undef FD_ZERO
@@ -88,6 +89,8 @@ void SocketEngine::Process()
 	tval.tv_sec = Config->ReadTimeout;
 	tval.tv_usec = 0;
 
+	LagMonitor::Sleep();
+
 #ifdef _WIN32
 	/* We can use the socket engine to "sleep" services for a period of
 	 * time between connections to the uplink, which allows modules,
@@ -98,11 +101,13 @@ void SocketEngine::Process()
 	if (FDCount == 0)
 	{
 		sleep(tval.tv_sec);
+		LagMonitor::Wake();
 		return;
 	}
 #endif
 
 	int sresult = select(MaxFD + 1, &rfdset, &wfdset, &efdset, &tval);
+	LagMonitor::Wake();
 	Anope::CurTime = time(NULL);
 
 	if (sresult == -1)
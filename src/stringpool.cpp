@@ -0,0 +1,147 @@
+/*
+ *
+ * (C) 2003-2018 Anope Team
+ * Contact us at team@anope.org
+ *
+ * Please read COPYING and README for further details.
+ */
+
+#include "services.h"
+#include "stringpool.h"
+
+#if defined _LIBCPP_VERSION || defined _WIN32
+#include <unordered_set>
+#else
+#include <tr1/unordered_set>
+#endif
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+using Anope::pooled_string;
+
+struct EntryHash
+{
+	size_t operator()(const pooled_string::Entry *e) const
+	{
+		return Anope::hash_cs()(e->value);
+	}
+};
+
+struct EntryEqual
+{
+	bool operator()(const pooled_string::Entry *a, const pooled_string::Entry *b) const
+	{
+		return a->value.equals_cs(b->value);
+	}
+};
+
+typedef TR1NS::unordered_set<pooled_string::Entry *, EntryHash, EntryEqual> pool_set;
+
+/* The pool and the reference counts are not locked, so make sure they are only
+ * used from the main thread, which is the first to use them, from static
+ * initializers or main. A handle used from another thread would corrupt them
+ * silently, so this is checked in all builds.
+ */
+static void CheckThread()
+{
+	static const pthread_t main_thread = pthread_self();
+	if (!pthread_equal(pthread_self(), main_thread))
+	{
+		std::cerr << "Anope::pooled_string used from a thread other than the main thread" << std::endl;
+		abort();
+	}
+}
+
+/* Constructed on first use, as handles can be created by static initializers */
+static pool_set &Pool()
+{
+	static pool_set *pool = new pool_set();
+	return *pool;
+}
+
+const Anope::string &pooled_string::Empty()
+{
+	static const Anope::string empty;
+	return empty;
+}
+
+pooled_string::Entry *pooled_string::Acquire(const Anope::string &value)
+{
+	if (value.empty())
+		return NULL;
+
+	CheckThread();
+
+	Entry probe;
+	probe.value = value;
+
+	pool_set &pool = Pool();
+	pool_set::iterator it = pool.find(&probe);
+	if (it != pool.end())
+	{
+		++(*it)->refs;
+		return *it;
+	}
+
+	Entry *e = new Entry();
+	e->value = value;
+	e->refs = 1;
+	pool.insert(e);
+	return e;
+}
+
+void pooled_string::AddRef(Entry *e)
+{
+	if (e == NULL)
+		return;
+
+	CheckThread();
+
+	++e->refs;
+}
+
+void pooled_string::Release(Entry *e)
+{
+	if (e == NULL)
+		return;
+
+	CheckThread();
+
+	if (--e->refs)
+		return;
+
+	Pool().erase(e);
+	delete e;
+}
+
+/* Heap memory used by a string's contents, beyond the string object itself */
+static inline size_t HeapSize(const Anope::string &s)
+{
+	return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+pooled_string::Stats pooled_string::GetStats()
+{
+	const pool_set &pool = Pool();
+
+	Stats stats;
+	stats.values = pool.size();
+	stats.refs = 0;
+	/* Each value is an Entry and a hash node, plus the buckets */
+	stats.pooled_bytes = pool.bucket_count() * sizeof(void *);
+	stats.unpooled_bytes = 0;
+
+	for (pool_set::const_iterator it = pool.begin(), it_end = pool.end(); it != it_end; ++it)
+	{
+		const Entry *e = *it;
+		size_t heap = HeapSize(e->value);
+
+		stats.refs += e->refs;
+		stats.pooled_bytes += sizeof(Entry) + 2 * sizeof(void *) + heap + e->refs * sizeof(pooled_string);
+		stats.unpooled_bytes += e->refs * (sizeof(Anope::string) + heap);
+	}
+
+	return stats;
+}
@@ -12,9 +12,11 @@
 #include "services.h"
 #include "threadengine.h"
 #include "anope.h"
+#include "config.h"
 
 #ifndef _WIN32
 #include <pthread.h>
+#include <sys/time.h>
 #endif
 
 static inline pthread_attr_t *get_engine_attr()
@@ -130,7 +132,280 @@ void Condition::Wakeup()
 	pthread_cond_signal(&cond);
 }
 
+void Condition::WakeupAll()
+{
+	pthread_cond_broadcast(&cond);
+}
+
 void Condition::Wait()
 {
 	pthread_cond_wait(&cond, &mutex);
 }
+
+namespace
+{
+	/* Delivers finished tasks to the main thread */
+	class CompletionPipe : public Pipe
+	{
+	 public:
+		void OnNotify() anope_override;
+	};
+
+	/* The state of the pool, everything here is protected by cond */
+	struct Pool
+	{
+		Condition cond;
+		std::deque<Task *> pending;
+		std::list<Task *> running;
+		std::vector<Task *> done;
+		std::vector<pthread_t> workers;
+		/* Number of threads waiting for a task */
+		unsigned idle;
+		/* Whether the pipe has been notified since done was last emptied */
+		bool notified;
+		bool stopping;
+		CompletionPipe *pipe;
+		ThreadPool::Stats stats;
+
+		Pool() : idle(0), notified(false), stopping(false), pipe(NULL)
+		{
+			memset(&stats, 0, sizeof(stats));
+		}
+	};
+
+	/* Never destroyed, as threads may outlive static destruction */
+	Pool *pool = NULL;
+
+	unsigned long long Elapsed(const timeval &from, const timeval &to)
+	{
+		return (to.tv_sec - from.tv_sec) * 1000000LL + (to.tv_usec - from.tv_usec);
+	}
+
+	/* Runs the completions of finished tasks */
+	void Complete()
+	{
+		pool->cond.Lock();
+		std::vector<Task *> finished;
+		finished.swap(pool->done);
+		pool->notified = false;
+		pool->cond.Unlock();
+
+		for (unsigned i = 0; i < finished.size(); ++i)
+		{
+			finished[i]->OnComplete();
+			delete finished[i];
+		}
+	}
+
+	void CompletionPipe::OnNotify()
+	{
+		Complete();
+	}
+}
+
+bool Task::IsCancelled() const
+{
+	/* Cancel sets this from the main thread while Run reads it on the pool's */
+	pool->cond.Lock();
+	bool c = this->cancelled;
+	pool->cond.Unlock();
+	return c;
+}
+
+void *ThreadPool::Worker(void *)
+{
+	pool->cond.Lock();
+	for (;;)
+	{
+		while (pool->pending.empty() && !pool->stopping)
+		{
+			++pool->idle;
+			pool->cond.Wait();
+			--pool->idle;
+		}
+
+		/* When stopping the queue is emptied first */
+		if (pool->pending.empty())
+			break;
+
+		Task *t = pool->pending.front();
+		pool->pending.pop_front();
+		pool->running.push_back(t);
+
+		timeval start;
+		gettimeofday(&start, NULL);
+		unsigned long long wait = Elapsed(t->queued, start);
+		pool->stats.wait_total += wait;
+		if (wait > pool->stats.wait_max)
+			pool->stats.wait_max = wait;
+
+		pool->cond.Unlock();
+		t->Run();
+		pool->cond.Lock();
+
+		timeval end;
+		gettimeofday(&end, NULL);
+		pool->stats.run_total += Elapsed(start, end);
+		++pool->stats.completed;
+
+		pool->running.remove(t);
+		pool->done.push_back(t);
+		if (!pool->notified && pool->pipe)
+		{
+			pool->notified = true;
+			pool->pipe->Notify();
+		}
+
+		/* Cancel may be waiting for this task */
+		pool->cond.WakeupAll();
+	}
+	pool->cond.Unlock();
+
+	return NULL;
+}
+
+/* Cancels and removes the tasks matching a module or a task, which must be called with the pool locked */
+void ThreadPool::CancelTasks(Module *m, Task *task, std::vector<Task *> &cancelled)
+{
+	for (;;)
+	{
+		bool waiting = false;
+		for (std::list<Task *>::iterator it = pool->running.begin(); it != pool->running.end(); ++it)
+			if (*it == task || (m && (*it)->owner == m))
+			{
+				(*it)->cancelled = true;
+				waiting = true;
+			}
+
+		if (!waiting)
+			break;
+		pool->cond.Wait();
+	}
+
+	for (std::deque<Task *>::iterator it = pool->pending.begin(); it != pool->pending.end();)
+		if (*it == task || (m && (*it)->owner == m))
+		{
+			cancelled.push_back(*it);
+			it = pool->pending.erase(it);
+		}
+		else
+			++it;
+
+	for (std::vector<Task *>::iterator it = pool->done.begin(); it != pool->done.end();)
+		if (*it == task || (m && (*it)->owner == m))
+		{
+			cancelled.push_back(*it);
+			it = pool->done.erase(it);
+		}
+		else
+			++it;
+}
+
+void ThreadPool::Queue(Task *t)
+{
+	if (!pool)
+		pool = new Pool();
+
+	gettimeofday(&t->queued, NULL);
+
+	pool->cond.Lock();
+
+	if (!pool->pipe)
+		pool->pipe = new CompletionPipe();
+
+	pool->pending.push_back(t);
+
+	/* Start another thread if every thread is busy */
+	unsigned max_workers = Config ? Config->GetBlock("options")->Get<unsigned>("threads", "4") : 4;
+	if (pool->idle < pool->pending.size() && pool->workers.size() < std::max(max_workers, 1U))
+	{
+		pthread_t handle;
+		if (!pthread_create(&handle, get_engine_attr(), Worker, NULL))
+			pool->workers.push_back(handle);
+		else if (pool->workers.empty())
+			Log() << "Unable to create thread: " << Anope::LastError();
+	}
+
+	pool->cond.Wakeup();
+	pool->cond.Unlock();
+
+	if (pool->workers.empty())
+	{
+		/* No threads at all, run it here instead */
+		pool->cond.Lock();
+		pool->pending.erase(std::find(pool->pending.begin(), pool->pending.end(), t));
+		pool->cond.Unlock();
+
+		t->Run();
+		t->OnComplete();
+		delete t;
+	}
+}
+
+void ThreadPool::Cancel(Task *t)
+{
+	if (!pool)
+		return;
+
+	std::vector<Task *> cancelled;
+	pool->cond.Lock();
+	CancelTasks(NULL, t, cancelled);
+	pool->cond.Unlock();
+
+	for (unsigned i = 0; i < cancelled.size(); ++i)
+		delete cancelled[i];
+}
+
+void ThreadPool::ModuleUnload(Module *m)
+{
+	if (!pool)
+		return;
+
+	std::vector<Task *> cancelled;
+	pool->cond.Lock();
+	CancelTasks(m, NULL, cancelled);
+	pool->cond.Unlock();
+
+	for (unsigned i = 0; i < cancelled.size(); ++i)
+		delete cancelled[i];
+}
+
+void ThreadPool::Shutdown()
+{
+	if (!pool)
+		return;
+
+	pool->cond.Lock();
+	pool->stopping = true;
+	pool->cond.WakeupAll();
+	pool->cond.Unlock();
+
+	for (unsigned i = 0; i < pool->workers.size(); ++i)
+		pthread_join(pool->workers[i], NULL);
+	pool->workers.clear();
+
+	Complete();
+
+	delete pool->pipe;
+	pool->pipe = NULL;
+	pool->stopping = false;
+}
+
+ThreadPool::Stats ThreadPool::GetStats()
+{
+	if (!pool)
+	{
+		Stats stats;
+		memset(&stats, 0, sizeof(stats));
+		return stats;
+	}
+
+	pool->cond.Lock();
+	Stats stats = pool->stats;
+	stats.workers = pool->workers.size();
+	stats.active = pool->running.size();
+	stats.pending = pool->pending.size();
+	pool->cond.Unlock();
+
+	return stats;
+}
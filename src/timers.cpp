@@ -8,6 +8,7 @@
 
 #include "services.h"
 #include "timers.h"
+#include "lagmonitor.h"
 
 std::multimap<time_t, Timer *> TimerManager::Timers;
 
@@ -106,7 +107,11 @@ void TimerManager::TickTimers(time_t ctime)
 		if (t->GetTimer() > ctime)
 			break;
 
+		unsigned long long start = EventProfiler::Ticks();
 		t->Tick(ctime);
+		LagMonitor::Step *step = LagMonitor::Trace(LagMonitor::STEP_TIMER, start);
+		if (step)
+			step->what = t->GetOwner() ? t->GetOwner()->name : "core";
 
 		if (t->GetRepeat())
 			t->SetTimer(ctime + t->GetSecs());
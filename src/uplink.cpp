@@ -209,5 +209,5 @@ UplinkSocket::Message::~Message()
 
 	Anope::string sent = IRCD->Format(message_source, this->buffer.str());
 	UplinkSock->Write(sent);
-	Log(LOG_RAWIO) << "Sent: " << sent;
+	LOG_IF(LOG_RAWIO) << "Sent: " << sent;
 }
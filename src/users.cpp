@@ -31,16 +31,47 @@ time_t MaxUserTime = 0;
 
 std::list<User *> User::quitting_users;
 
+/* Ids of the modes checked whenever users change modes or are looked at */
+struct KnownModes
+{
+	unsigned short oper, cloak, vhost, prot, god;
+
+	KnownModes() : oper(ModeManager::GetModeID("OPER", true)), cloak(ModeManager::GetModeID("CLOAK", true)), vhost(ModeManager::GetModeID("VHOST", true)),
+		prot(ModeManager::GetModeID("PROTECTED", true)), god(ModeManager::GetModeID("GOD", true)) { }
+};
+
+static const KnownModes &Known()
+{
+	static const KnownModes known;
+	return known;
+}
+
+static bool ModeIDLess(const User::ModeParamList::value_type &a, const User::ModeParamList::value_type &b)
+{
+	return a.first < b.first;
+}
+
+/* The id of a user mode, which only lacks one if it was never added to the ModeManager */
+static unsigned short GetModeID(UserMode *um)
+{
+	return um->id ? um->id : ModeManager::GetModeID(um->name, true);
+}
+
 User::User(const Anope::string &snick, const Anope::string &sident, const Anope::string &shost, const Anope::string &svhost, const Anope::string &uip, Server *sserver, const Anope::string &srealname, time_t ts, const Anope::string &smodes, const Anope::string &suid, NickCore *account) : ip(uip)
 {
 	if (snick.empty() || sident.empty() || shost.empty())
 		throw CoreException("Bad args passed to User::User");
 
 	/* we used to do this by calloc, no more. */
-	quit = false;
+	quit = burst_identified = false;
+	/* Users introduced in a netburst are hidden from the modules until their server
+	 * syncs, including the modes and account they are introduced with
+	 */
+	connect_pending = sserver && sserver != Me && !sserver->IsSynced();
 	server = NULL;
 	invalid_pw_count = invalid_pw_time = lastmemosend = lastnickreg = lastmail = 0;
 	on_access = false;
+	stacker = NULL;
 
 	this->nick = snick;
 	this->ident = sident;
@@ -80,6 +111,15 @@ User::User(const Anope::string &snick, const Anope::string &sident, const Anope:
 			Log(this, "maxusers") << "connected - new maximum user count: " << UserListByNick.size();
 	}
 
+	/* Users introduced in a netburst are only added to the user maps here,
+	 * the modules get to see them in one pass once their server syncs
+	 */
+	if (connect_pending)
+	{
+		sserver->burst_users.push_back(this);
+		return;
+	}
+
 	bool exempt = false;
 	if (server && server->IsULined())
 		exempt = true;
@@ -181,7 +221,10 @@ void User::ChangeNick(const Anope::string &newnick, time_t ts)
 		}
 	}
 
-	FOREACH_MOD(OnUserNickChange, (this, old));
+	if (!this->connect_pending)
+	{
+		FOREACH_MOD(OnUserNickChange, (this, old));
+	}
 }
 
 void User::SetDisplayedHost(const Anope::string &shost)
@@ -193,7 +236,10 @@ void User::SetDisplayedHost(const Anope::string &shost)
 
 	Log(this, "host") << "changed vhost to " << shost;
 
-	FOREACH_MOD(OnSetDisplayedHost, (this));
+	if (!this->connect_pending)
+	{
+		FOREACH_MOD(OnSetDisplayedHost, (this));
+	}
 
 	this->UpdateHost();
 }
@@ -202,7 +248,7 @@ const Anope::string &User::GetDisplayedHost() const
 {
 	if (!this->vhost.empty())
 		return this->vhost;
-	else if (this->HasMode("CLOAK") && !this->GetCloakedHost().empty())
+	else if (this->HasMode(Known().cloak) && !this->GetCloakedHost().empty())
 		return this->GetCloakedHost();
 	else
 		return this->host;
@@ -304,7 +350,7 @@ User::~User()
 	ModeManager::StackerDel(this);
 	this->Logout();
 
-	if (this->HasMode("OPER"))
+	if (this->HasMode(Known().oper))
 		--OperCount;
 
 	while (!this->chans.empty())
@@ -366,7 +412,12 @@ void User::Identify(NickAlias *na)
 
 	this->Login(na->nc);
 
-	FOREACH_MOD(OnNickIdentify, (this));
+	if (this->connect_pending)
+		this->burst_identified = true;
+	else
+	{
+		FOREACH_MOD(OnNickIdentify, (this));
+	}
 
 	if (this->IsServicesOper())
 	{
@@ -374,8 +425,8 @@ void User::Identify(NickAlias *na)
 		{
 			this->SetModes(NULL, "%s", this->nc->o->ot->modes.c_str());
 			this->SendMessage(NULL, "Changing your usermodes to \002%s\002", this->nc->o->ot->modes.c_str());
-			UserMode *um = ModeManager::FindUserModeByName("OPER");
-			if (um && !this->HasMode("OPER") && this->nc->o->ot->modes.find(um->mchar) != Anope::string::npos)
+			UserMode *um = ModeManager::FindUserModeByID(Known().oper);
+			if (um && !this->HasMode(Known().oper) && this->nc->o->ot->modes.find(um->mchar) != Anope::string::npos)
 				IRCD->SendOper(this);
 		}
 		if (IRCD->CanSetVHost && !this->nc->o->vhost.empty())
@@ -402,7 +453,10 @@ void User::Login(NickCore *core)
 	if (this->server->IsSynced())
 		Log(this, "account") << "is now identified as " << this->nc->display;
 
-	FOREACH_MOD(OnUserLogin, (this));
+	if (!this->connect_pending)
+	{
+		FOREACH_MOD(OnUserLogin, (this));
+	}
 }
 
 void User::Logout()
@@ -453,7 +507,7 @@ bool User::IsServicesOper()
 	if (!this->nc || !this->nc->IsServicesOper())
 		// No opertype.
 		return false;
-	else if (this->nc->o->require_oper && !this->HasMode("OPER"))
+	else if (this->nc->o->require_oper && !this->HasMode(Known().oper))
 		return false;
 	else if (!this->nc->o->certfp.empty() && this->fingerprint != this->nc->o->certfp)
 		// Certfp mismatch
@@ -514,7 +568,14 @@ void User::UpdateHost()
 
 bool User::HasMode(const Anope::string &mname) const
 {
-	return this->modes.count(mname);
+	return this->HasMode(ModeManager::GetModeID(mname));
+}
+
+bool User::HasMode(unsigned short id) const
+{
+	if (id < MODE_BITS)
+		return this->mode_bits.test(id);
+	return std::binary_search(this->mode_params.begin(), this->mode_params.end(), std::make_pair(id, Anope::string()), ModeIDLess);
 }
 
 void User::SetModeInternal(const MessageSource &source, UserMode *um, const Anope::string &param)
@@ -522,9 +583,20 @@ void User::SetModeInternal(const MessageSource &source, UserMode *um, const Anop
 	if (!um)
 		return;
 
-	this->modes[um->name] = param;
+	ModeParamList::value_type entry(GetModeID(um), param);
+	ModeParamList::iterator it = std::lower_bound(this->mode_params.begin(), this->mode_params.end(), entry, ModeIDLess);
+	bool found = it != this->mode_params.end() && it->first == entry.first;
 
-	if (um->name == "OPER")
+	if (entry.first < MODE_BITS)
+		this->mode_bits.set(entry.first);
+	if (found && (!param.empty() || entry.first >= MODE_BITS))
+		it->second = param;
+	else if (found)
+		this->mode_params.erase(it);
+	else if (!param.empty() || entry.first >= MODE_BITS)
+		this->mode_params.insert(it, entry);
+
+	if (entry.first == Known().oper)
 	{
 		++OperCount;
 
@@ -534,8 +606,7 @@ void User::SetModeInternal(const MessageSource &source, UserMode *um, const Anop
 			{
 				this->SetModes(NULL, "%s", this->nc->o->ot->modes.c_str());
 				this->SendMessage(NULL, "Changing your usermodes to \002%s\002", this->nc->o->ot->modes.c_str());
-				UserMode *oper = ModeManager::FindUserModeByName("OPER");
-				if (oper && !this->HasMode("OPER") && this->nc->o->ot->modes.find(oper->mchar) != Anope::string::npos)
+				if (!this->HasMode(Known().oper) && this->nc->o->ot->modes.find(um->mchar) != Anope::string::npos)
 					IRCD->SendOper(this);
 			}
 			if (IRCD->CanSetVHost && !this->nc->o->vhost.empty())
@@ -547,10 +618,13 @@ void User::SetModeInternal(const MessageSource &source, UserMode *um, const Anop
 		}
 	}
 
-	if (um->name == "CLOAK" || um->name == "VHOST")
+	if (entry.first == Known().cloak || entry.first == Known().vhost)
 		this->UpdateHost();
 
-	FOREACH_MOD(OnUserModeSet, (source, this, um->name));
+	if (!this->connect_pending)
+	{
+		FOREACH_MOD(OnUserModeSet, (source, this, um->name));
+	}
 }
 
 void User::RemoveModeInternal(const MessageSource &source, UserMode *um)
@@ -558,23 +632,31 @@ void User::RemoveModeInternal(const MessageSource &source, UserMode *um)
 	if (!um)
 		return;
 
-	this->modes.erase(um->name);
+	unsigned short id = GetModeID(um);
+	if (id < MODE_BITS)
+		this->mode_bits.reset(id);
+	ModeParamList::iterator it = std::lower_bound(this->mode_params.begin(), this->mode_params.end(), std::make_pair(id, Anope::string()), ModeIDLess);
+	if (it != this->mode_params.end() && it->first == id)
+		this->mode_params.erase(it);
 
-	if (um->name == "OPER")
+	if (id == Known().oper)
 		--OperCount;
 
-	if (um->name == "CLOAK" || um->name == "VHOST")
+	if (id == Known().cloak || id == Known().vhost)
 	{
 		this->vhost.clear();
 		this->UpdateHost();
 	}
 
-	FOREACH_MOD(OnUserModeUnset, (source, this, um->name));
+	if (!this->connect_pending)
+	{
+		FOREACH_MOD(OnUserModeUnset, (source, this, um->name));
+	}
 }
 
 void User::SetMode(BotInfo *bi, UserMode *um, const Anope::string &param)
 {
-	if (!um || HasMode(um->name))
+	if (!um || HasMode(GetModeID(um)))
 		return;
 
 	ModeManager::StackerAdd(bi, this, um, true, param);
@@ -586,9 +668,14 @@ void User::SetMode(BotInfo *bi, const Anope::string &uname, const Anope::string
 	SetMode(bi, ModeManager::FindUserModeByName(uname), param);
 }
 
+void User::SetMode(BotInfo *bi, unsigned short id, const Anope::string &param)
+{
+	SetMode(bi, ModeManager::FindUserModeByID(id), param);
+}
+
 void User::RemoveMode(BotInfo *bi, UserMode *um, const Anope::string &param)
 {
-	if (!um || !HasMode(um->name))
+	if (!um || !HasMode(GetModeID(um)))
 		return;
 
 	ModeManager::StackerAdd(bi, this, um, false, param);
@@ -600,6 +687,11 @@ void User::RemoveMode(BotInfo *bi, const Anope::string &name, const Anope::strin
 	RemoveMode(bi, ModeManager::FindUserModeByName(name), param);
 }
 
+void User::RemoveMode(BotInfo *bi, unsigned short id, const Anope::string &param)
+{
+	RemoveMode(bi, ModeManager::FindUserModeByID(id), param);
+}
+
 void User::SetModes(BotInfo *bi, const char *umodes, ...)
 {
 	char buf[BUFSIZE] = "";
@@ -694,10 +786,12 @@ void User::SetModesInternal(const MessageSource &source, const char *umodes, ...
 Anope::string User::GetModes() const
 {
 	Anope::string m, params;
+	ModeParamList list;
+	this->GetModes(list);
 
-	for (ModeList::const_iterator it = this->modes.begin(), it_end = this->modes.end(); it != it_end; ++it)
+	for (ModeParamList::const_iterator it = list.begin(), it_end = list.end(); it != it_end; ++it)
 	{
-		UserMode *um = ModeManager::FindUserModeByName(it->first);
+		UserMode *um = ModeManager::FindUserModeByID(it->first);
 		if (um == NULL)
 			continue;
 
@@ -710,8 +804,31 @@ Anope::string User::GetModes() const
 	return m + params;
 }
 
-const User::ModeList &User::GetModeList() const
+void User::GetModes(ModeParamList &list) const
 {
+	/* Every mode with an id in the bitset and an entry in mode_params has its bit set too */
+	ModeParamList::const_iterator p = this->mode_params.begin(), p_end = this->mode_params.end();
+	for (unsigned short id = 1; id < MODE_BITS; ++id)
+	{
+		if (!this->mode_bits.test(id))
+			continue;
+
+		if (p != p_end && p->first == id)
+			list.push_back(*p++);
+		else
+			list.push_back(std::make_pair(id, Anope::string()));
+	}
+	list.insert(list.end(), p, p_end);
+}
+
+User::ModeList User::GetModeList() const
+{
+	ModeList modes;
+	ModeParamList list;
+	this->GetModes(list);
+
+	for (ModeParamList::const_iterator it = list.begin(), it_end = list.end(); it != it_end; ++it)
+		modes[ModeManager::GetModeName(it->first)] = it->second;
 	return modes;
 }
 
@@ -725,7 +842,7 @@ ChanUserContainer *User::FindChannel(Channel *c) const
 
 bool User::IsProtected()
 {
-	return this->HasMode("PROTECTED") || this->HasMode("GOD") || this->HasPriv("protected") || (this->server && this->server->IsULined());
+	return this->HasMode(Known().prot) || this->HasMode(Known().god) || this->HasPriv("protected") || (this->server && this->server->IsULined());
 }
 
 void User::Kill(const MessageSource &source, const Anope::string &reason)
@@ -756,7 +873,11 @@ void User::Quit(const Anope::string &reason)
 		return;
 	}
 
-	FOREACH_MOD(OnUserQuit, (this, reason));
+	/* The modules haven't seen this user connect, so they don't see them quit either */
+	if (!this->connect_pending)
+	{
+		FOREACH_MOD(OnUserQuit, (this, reason));
+	}
 
 	this->quit = true;
 	quitting_users.push_back(this);
@@ -767,6 +888,58 @@ bool User::Quitting() const
 	return this->quit;
 }
 
+bool User::IsConnectPending() const
+{
+	return this->connect_pending;
+}
+
+bool User::FinishBurst()
+{
+	if (!this->connect_pending || this->quit)
+		return false;
+
+	this->connect_pending = false;
+
+	bool exempt = false;
+	if (server && server->IsULined())
+		exempt = true;
+	FOREACH_MOD(OnUserConnect, (this, exempt));
+
+	/* Tell the modules about what the user has now, as they would have been told
+	 * had the user not been introduced in a burst. Any of them may quit the user.
+	 */
+	ModeParamList modes;
+	this->GetModes(modes);
+	MessageSource source(this->server);
+	for (unsigned i = 0; i < modes.size() && !this->quit; ++i)
+	{
+		UserMode *um = ModeManager::FindUserModeByID(modes[i].first);
+		if (um && this->HasMode(modes[i].first))
+		{
+			FOREACH_MOD(OnUserModeSet, (source, this, um->name));
+		}
+	}
+
+	if (this->nc && !this->quit)
+	{
+		FOREACH_MOD(OnUserLogin, (this));
+	}
+
+	if (this->burst_identified && this->nc && !this->quit)
+	{
+		FOREACH_MOD(OnNickIdentify, (this));
+	}
+	this->burst_identified = false;
+
+	if (!this->burst_away.empty() && !this->quit)
+	{
+		FOREACH_MOD(OnUserAway, (this, this->burst_away));
+	}
+	this->burst_away.clear();
+
+	return true;
+}
+
 Anope::string User::Mask() const
 {
 	Anope::string mask;
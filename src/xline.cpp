@@ -177,10 +177,13 @@ Serializable* XLine::Unserialize(Serializable *obj, Serialize::Data &data)
 	if (obj)
 	{
 		xl = anope_dynamic_static_cast<XLine *>(obj);
+		Anope::string sby, sreason;
 		data["mask"] >> xl->mask;
-		data["by"] >> xl->by;
-		data["reason"] >> xl->reason;
+		data["by"] >> sby;
+		data["reason"] >> sreason;
 		data["uid"] >> xl->id;
+		xl->by = sby;
+		xl->reason = sreason;
 
 		if (xlm != xl->manager)
 		{